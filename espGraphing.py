@@ -1,5 +1,3 @@
-import re
-import sys
 import threading
 import tkinter as tk
 from time import sleep
@@ -9,6 +7,7 @@ import matplotlib
 import serial
 import serial.tools.list_ports
 
+import serialRecord
 from ansiEncoding import ANSI
 from tkAnsiFormatter import tkAnsiFormatter
 from tkPlotGraph import tkPlotGraph
@@ -23,6 +22,7 @@ class SerialApp:
         self.serial_port = None
         self.killed = False
         self.auto_scroll = tk.BooleanVar(value=True)
+        self.demux = serialRecord.SerialDemux()
 
         # Get a list of all available serial ports
         ports = self.get_ports()
@@ -72,9 +72,8 @@ class SerialApp:
         self.delta_figure.grid(row=2, column=2)
         # self.delta_figure.set_ylim(-10, 10)
 
-        # Create threads to draw figures and serial port reading
-        self.draw_graphs_thread = threading.Thread(target=self.draw_graphs)
-        self.draw_graphs_thread.start()
+        # Figures redraw themselves on the UI thread, a thread reads the serial port
+        self.start_graphs()
         self.read_serial_thread = threading.Thread(target=self.read_from_port)
         self.read_serial_thread.start()
 
@@ -86,7 +85,7 @@ class SerialApp:
     def close(self) -> None:
         # Flag the process as dead and close serial port
         self.killed = True
-        self.draw_graphs_thread.join()
+        self.stop_graphs()
         self.read_serial_thread.join()
 
     def connect_toggle(self) -> None:
@@ -97,6 +96,7 @@ class SerialApp:
 
         # Otherwise, try to connect
         self.reset_graphs()
+        self.demux.reset()
         try:
             self.connect_serial()
 
@@ -127,36 +127,30 @@ class SerialApp:
                 f"{ANSI.bBrightMagenta} Port [{self.port_var.get()}] Disconnected{ANSI.default}\n"
             )
 
-    def update_graphs(self, reading: str) -> None:
-        match = re.search(
-            r"I \((\d+)\).*Lspd:( *[-\d.]+).*Rspd:( *[-\d.]+).*Δd:( *[-\d.]+)", reading
-        )
-        if match:
-            time, lspd, rspd, errdis = map(float, match.groups())
-            self.lspd_figure.append(time, lspd)
-            self.rspd_figure.append(time, rspd)
-            self.delta_figure.append(time, errdis)
+    def update_graphs(self, records: list[bytes]) -> None:
+        parsed = serialRecord.parse_records(records)
+        motor = parsed.get(serialRecord.RECORD_TYPE_MOTOR_STAT)
+        if motor is not None:
+            # Milliseconds since boot, as the log timestamps
+            time = motor["time_us"] / 1000.0
+            self.lspd_figure.extend(time, motor["left_motor"]["velocity"])
+            self.rspd_figure.extend(time, motor["right_motor"]["velocity"])
+            self.delta_figure.extend(time, motor["delta_distance"])
 
     def reset_graphs(self) -> None:
         self.lspd_figure.reset()
         self.rspd_figure.reset()
         self.delta_figure.reset()
 
-    def draw_graphs(self) -> None:
-        while True:
-            if self.killed:
-                print("Graphing thread exited")
-                return
-            sleep(0.05)
+    def start_graphs(self) -> None:
+        self.lspd_figure.start()
+        self.rspd_figure.start()
+        self.delta_figure.start()
 
-            # Update graph
-            try:
-                self.lspd_figure.draw()
-                self.rspd_figure.draw()
-                self.delta_figure.draw()
-            except RuntimeError:
-                self.show_message(str(sys.exc_info()))
-                pass
+    def stop_graphs(self) -> None:
+        self.lspd_figure.stop()
+        self.rspd_figure.stop()
+        self.delta_figure.stop()
 
     def read_from_port(self) -> None:
         while True:
@@ -166,18 +160,20 @@ class SerialApp:
                 return
             sleep(0.1)
 
-            # Reads serial port data by line
+            # Reads whatever arrived, records and text are separated by the demultiplexer
             while self.serial_port and self.serial_port.is_open:
                 try:
-                    line = self.serial_port.readline()
+                    data = self.serial_port.read(max(1, self.serial_port.in_waiting))
 
-                    # Check if line is not empty
-                    if not line:
+                    # Check if data is not empty
+                    if not data:
                         break
 
-                    reading = line.decode("utf-8")
-                    self.update_graphs(reading)
-                    self.terminal.write(reading)
+                    text, records = self.demux.feed(data)
+                    if records:
+                        self.update_graphs(records)
+                    if text:
+                        self.terminal.write(text)
 
                 except serial.SerialException as serr:
                     self.disconnect_serial()
@@ -0,0 +1,416 @@
+#include "idf_host.h"
+
+#include <time.h>
+
+#include "logging.h"
+
+static int64_t idf_host_time_us = 1000000;
+static idf_host_esp_now_send_t idf_host_esp_now_send;
+static esp_log_level_t idf_host_log_level = ESP_LOG_WARN;
+
+void idf_host_set_time(int64_t time_us)
+{
+        idf_host_time_us = time_us;
+}
+
+void idf_host_advance_time(int64_t delta_us)
+{
+        idf_host_time_us += delta_us;
+}
+
+void idf_host_set_esp_now_send(idf_host_esp_now_send_t send)
+{
+        idf_host_esp_now_send = send;
+}
+
+void idf_host_set_log_level(esp_log_level_t level)
+{
+        idf_host_log_level = level;
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+        switch (code)
+        {
+        case ESP_OK:
+                return "ESP_OK";
+        case ESP_FAIL:
+                return "ESP_FAIL";
+        case ESP_ERR_NO_MEM:
+                return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG:
+                return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE:
+                return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_INVALID_SIZE:
+                return "ESP_ERR_INVALID_SIZE";
+        case ESP_ERR_NOT_FOUND:
+                return "ESP_ERR_NOT_FOUND";
+        default:
+                return "ESP_ERR_UNKNOWN";
+        }
+}
+
+/* FreeRTOS */
+
+typedef struct
+{
+        uint8_t *items;
+        UBaseType_t length;
+        UBaseType_t item_size;
+        UBaseType_t head;
+        UBaseType_t count;
+} idf_host_queue_t;
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+        idf_host_queue_t *queue = calloc(1, sizeof(idf_host_queue_t));
+        if (queue == NULL)
+                return NULL;
+        queue->items = calloc(length, item_size);
+        queue->length = length;
+        queue->item_size = item_size;
+        return queue;
+}
+
+BaseType_t xQueueSend(QueueHandle_t handle, const void *item, TickType_t wait)
+{
+        idf_host_queue_t *queue = handle;
+        if (queue->count == queue->length)
+                return pdFALSE;
+        memcpy(queue->items + ((queue->head + queue->count) % queue->length) * queue->item_size, item, queue->item_size);
+        queue->count++;
+        return pdTRUE;
+}
+
+BaseType_t xQueueSendFromISR(QueueHandle_t handle, const void *item, BaseType_t *woken)
+{
+        return xQueueSend(handle, item, 0);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t handle, void *item, TickType_t wait)
+{
+        idf_host_queue_t *queue = handle;
+        if (queue->count == 0)
+        {
+                idf_host_time_us += (int64_t)wait * 1000;
+                return pdFALSE;
+        }
+        memcpy(item, queue->items + queue->head * queue->item_size, queue->item_size);
+        queue->head = (queue->head + 1) % queue->length;
+        queue->count--;
+        return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t handle)
+{
+        return ((idf_host_queue_t *)handle)->count;
+}
+
+void vQueueDelete(QueueHandle_t handle)
+{
+        idf_host_queue_t *queue = handle;
+        free(queue->items);
+        free(queue);
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name, uint32_t stack_size, void *arg, UBaseType_t priority, TaskHandle_t *handle)
+{
+        return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char *name, uint32_t stack_size, void *arg, UBaseType_t priority, TaskHandle_t *handle, BaseType_t core)
+{
+        return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t handle)
+{
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+        idf_host_time_us += (int64_t)ticks * 1000;
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+        return idf_host_time_us / 1000;
+}
+
+BaseType_t xPortGetCoreID(void)
+{
+        return 0;
+}
+
+BaseType_t xPortInIsrContext(void)
+{
+        return pdFALSE;
+}
+
+// Locks are never contended, any non-NULL handle will do
+static int idf_host_lock;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+        return &idf_host_lock;
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void)
+{
+        return &idf_host_lock;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t lock, TickType_t wait)
+{
+        return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t lock)
+{
+        return pdTRUE;
+}
+
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t lock, TickType_t wait)
+{
+        return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t lock)
+{
+        return pdTRUE;
+}
+
+/* Logging, deferred lines are written right away */
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+{
+        if (level > idf_host_log_level)
+                return;
+        va_list args;
+        va_start(args, format);
+        vprintf(format, args);
+        va_end(args);
+}
+
+void logging_deferred_write(const logging_site_t *site, const char *tag, const char *format, ...)
+{
+        if (site->level > idf_host_log_level)
+                return;
+        printf("%c (%" PRId64 ") %s: ", "NEWIDV"[site->level], idf_host_time_us / 1000, tag);
+        va_list args;
+        va_start(args, format);
+        vprintf(format, args);
+        va_end(args);
+        printf("\n");
+}
+
+/* esp_timer, esp_cpu, esp_random, esp_crc */
+
+int64_t esp_timer_get_time(void)
+{
+        return idf_host_time_us;
+}
+
+// Nanoseconds of the host clock stand in for CPU cycles
+uint32_t esp_cpu_get_cycle_count(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint32_t)(now.tv_sec * 1000000000ULL + now.tv_nsec);
+}
+
+uint32_t esp_random(void)
+{
+        return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+}
+
+// Same as the ROM function, the CRC is inverted on entry and exit
+uint16_t esp_crc16_le(uint16_t crc, const uint8_t *buf, uint32_t len)
+{
+        crc = ~crc;
+        for (uint32_t i = 0; i < len; i++)
+        {
+                crc ^= buf[i];
+                for (uint8_t bit = 0; bit < 8; bit++)
+                        crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+        }
+        return ~crc;
+}
+
+/* esp_wifi */
+
+static uint8_t idf_host_channel = 1;
+
+esp_err_t esp_wifi_init(const wifi_init_config_t *config)
+{
+        return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_storage(wifi_storage_t storage)
+{
+        return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode)
+{
+        return ESP_OK;
+}
+
+esp_err_t esp_wifi_start(void)
+{
+        return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_channel(uint8_t primary, wifi_second_chan_t second)
+{
+        idf_host_channel = primary;
+        return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_channel(uint8_t *primary, wifi_second_chan_t *second)
+{
+        *primary = idf_host_channel;
+        *second = WIFI_SECOND_CHAN_NONE;
+        return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_country(wifi_country_t *country)
+{
+        memset(country, 0, sizeof(wifi_country_t));
+        country->schan = 1;
+        country->nchan = 13;
+        return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_protocol(wifi_interface_t ifx, uint8_t protocol_bitmap)
+{
+        return ESP_OK;
+}
+
+esp_err_t esp_wifi_config_espnow_rate(wifi_interface_t ifx, wifi_phy_rate_t rate)
+{
+        return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_promiscuous(bool enable)
+{
+        return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_promiscuous_rx_cb(wifi_promiscuous_cb_t cb)
+{
+        return ESP_OK;
+}
+
+esp_err_t esp_netif_init(void)
+{
+        return ESP_OK;
+}
+
+esp_err_t esp_event_loop_create_default(void)
+{
+        return ESP_OK;
+}
+
+/* esp_now */
+
+esp_err_t esp_now_init(void)
+{
+        return ESP_OK;
+}
+
+esp_err_t esp_now_deinit(void)
+{
+        return ESP_OK;
+}
+
+esp_err_t esp_now_register_send_cb(esp_now_send_cb_t cb)
+{
+        return ESP_OK;
+}
+
+esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb)
+{
+        return ESP_OK;
+}
+
+esp_err_t esp_now_send(const uint8_t *mac, const uint8_t *data, size_t len)
+{
+        if (idf_host_esp_now_send == NULL)
+                return ESP_OK;
+        return idf_host_esp_now_send(mac, data, len);
+}
+
+esp_err_t esp_now_add_peer(const esp_now_peer_info_t *peer)
+{
+        return ESP_OK;
+}
+
+esp_err_t esp_now_del_peer(const uint8_t *mac)
+{
+        return ESP_OK;
+}
+
+esp_err_t esp_now_mod_peer(const esp_now_peer_info_t *peer)
+{
+        return ESP_OK;
+}
+
+esp_err_t esp_now_get_peer(const uint8_t *mac, esp_now_peer_info_t *peer)
+{
+        return ESP_ERR_ESPNOW_NOT_FOUND;
+}
+
+bool esp_now_is_peer_exist(const uint8_t *mac)
+{
+        return true;
+}
+
+esp_err_t esp_now_set_pmk(const uint8_t *pmk)
+{
+        return ESP_OK;
+}
+
+/* nvs, nothing is ever stored */
+
+esp_err_t nvs_flash_init(void)
+{
+        return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void)
+{
+        return ESP_OK;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *handle)
+{
+        *handle = 1;
+        return ESP_OK;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *value, size_t *len)
+{
+        return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t len)
+{
+        return ESP_OK;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+        return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+}
+
+/* Firmware sources left out of the host build */
+
+void print_mem(const void *ptr, size_t len)
+{
+}
@@ -0,0 +1,315 @@
+#pragma once
+
+// Just enough of ESP-IDF and FreeRTOS to build the ESP-NOW sources on the host
+// Every IDF header the firmware includes maps to this file, implementations are in `idf_host.c`
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define __packed __attribute__((packed))
+#define __unused __attribute__((unused))
+
+/* esp_err */
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_NO_MEM 0x101
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_STATE 0x103
+#define ESP_ERR_INVALID_SIZE 0x104
+#define ESP_ERR_NOT_FOUND 0x105
+#define ESP_ERR_NOT_SUPPORTED 0x106
+#define ESP_ERR_TIMEOUT 0x107
+#define ESP_ERR_INVALID_VERSION 0x10A
+#define ESP_ERR_ESPNOW_FULL 0x3064
+#define ESP_ERR_ESPNOW_NOT_FOUND 0x3065
+#define ESP_ERR_ESPNOW_EXIST 0x3066
+#define ESP_ERR_NVS_NO_FREE_PAGES 0x1100
+#define ESP_ERR_NVS_NEW_VERSION_FOUND 0x1101
+#define ESP_ERR_NVS_NOT_FOUND 0x1102
+#define ESP_ERROR_CHECK(x)                                                                         \
+        do                                                                                         \
+        {                                                                                          \
+                esp_err_t _err = (x);                                                              \
+                if (_err != ESP_OK)                                                                \
+                {                                                                                  \
+                        fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, esp_err_to_name(_err)); \
+                        abort();                                                                   \
+                }                                                                                  \
+        } while (0)
+#define ESP_ERROR_CHECK_WITHOUT_ABORT(x) ({ esp_err_t _err = (x); _err; })
+const char *esp_err_to_name(esp_err_t code);
+
+/* FreeRTOS, tasks are never started and locks are never contended, tests drive everything from one thread */
+
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint32_t TickType_t;
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define portMAX_DELAY 0xFFFFFFFFu
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define configTICK_RATE_HZ 1000
+#define tskNO_AFFINITY 0x7FFFFFFF
+#define portNUM_PROCESSORS 2
+
+typedef struct
+{
+        int owner;
+} portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {0}
+#define portENTER_CRITICAL(mux) (void)(mux)
+#define portEXIT_CRITICAL(mux) (void)(mux)
+#define portENTER_CRITICAL_ISR(mux) (void)(mux)
+#define portEXIT_CRITICAL_ISR(mux) (void)(mux)
+#define portENTER_CRITICAL_SAFE(mux) (void)(mux)
+#define portEXIT_CRITICAL_SAFE(mux) (void)(mux)
+
+typedef void *QueueHandle_t;
+typedef void *TaskHandle_t;
+typedef void *SemaphoreHandle_t;
+typedef void *TimerHandle_t;
+typedef void (*TaskFunction_t)(void *arg);
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size);
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t wait);
+BaseType_t xQueueSendFromISR(QueueHandle_t queue, const void *item, BaseType_t *woken);
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t wait);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue);
+void vQueueDelete(QueueHandle_t queue);
+BaseType_t xTaskCreate(TaskFunction_t task, const char *name, uint32_t stack_size, void *arg, UBaseType_t priority, TaskHandle_t *handle);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char *name, uint32_t stack_size, void *arg, UBaseType_t priority, TaskHandle_t *handle, BaseType_t core);
+void vTaskDelete(TaskHandle_t handle);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+BaseType_t xPortGetCoreID(void);
+BaseType_t xPortInIsrContext(void);
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t lock, TickType_t wait);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t lock);
+BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t lock, TickType_t wait);
+BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t lock);
+
+/* esp_log */
+
+typedef enum
+{
+        ESP_LOG_NONE,
+        ESP_LOG_ERROR,
+        ESP_LOG_WARN,
+        ESP_LOG_INFO,
+        ESP_LOG_DEBUG,
+        ESP_LOG_VERBOSE,
+} esp_log_level_t;
+#ifndef LOG_LOCAL_LEVEL
+#define LOG_LOCAL_LEVEL ESP_LOG_INFO
+#endif
+#define ESP_LOG_LEVEL(level, tag, format, ...) esp_log_write(level, tag, format "\n", ##__VA_ARGS__)
+#define ESP_LOGE(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_INFO, tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_DEBUG, tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_VERBOSE, tag, format, ##__VA_ARGS__)
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+/* esp_timer, esp_cpu, esp_random, esp_crc */
+
+int64_t esp_timer_get_time(void);
+uint32_t esp_cpu_get_cycle_count(void);
+uint32_t esp_random(void);
+uint16_t esp_crc16_le(uint16_t crc, const uint8_t *buf, uint32_t len);
+
+/* esp_wifi */
+
+typedef enum
+{
+        WIFI_MODE_NULL,
+        WIFI_MODE_STA,
+        WIFI_MODE_AP,
+} wifi_mode_t;
+typedef enum
+{
+        WIFI_IF_STA,
+        WIFI_IF_AP,
+} wifi_interface_t;
+typedef enum
+{
+        ESP_IF_WIFI_STA,
+        ESP_IF_WIFI_AP,
+} esp_interface_t;
+typedef enum
+{
+        WIFI_PHY_RATE_1M_L = 0x00,
+        WIFI_PHY_RATE_2M_L = 0x01,
+        WIFI_PHY_RATE_5M_L = 0x02,
+        WIFI_PHY_RATE_11M_L = 0x03,
+        WIFI_PHY_RATE_2M_S = 0x05,
+        WIFI_PHY_RATE_5M_S = 0x06,
+        WIFI_PHY_RATE_11M_S = 0x07,
+        WIFI_PHY_RATE_48M = 0x08,
+        WIFI_PHY_RATE_24M = 0x09,
+        WIFI_PHY_RATE_12M = 0x0A,
+        WIFI_PHY_RATE_6M = 0x0B,
+        WIFI_PHY_RATE_54M = 0x0C,
+        WIFI_PHY_RATE_36M = 0x0D,
+        WIFI_PHY_RATE_18M = 0x0E,
+        WIFI_PHY_RATE_9M = 0x0F,
+        WIFI_PHY_RATE_MCS0_LGI = 0x10,
+        WIFI_PHY_RATE_LORA_250K = 0x29,
+        WIFI_PHY_RATE_LORA_500K = 0x2A,
+        WIFI_PHY_RATE_MAX,
+} wifi_phy_rate_t;
+#define WIFI_PROTOCOL_11B 1
+#define WIFI_PROTOCOL_11G 2
+#define WIFI_PROTOCOL_11N 4
+#define WIFI_PROTOCOL_LR 8
+typedef enum
+{
+        WIFI_SECOND_CHAN_NONE,
+} wifi_second_chan_t;
+typedef enum
+{
+        WIFI_STORAGE_FLASH,
+        WIFI_STORAGE_RAM,
+} wifi_storage_t;
+typedef enum
+{
+        WIFI_PKT_MGMT,
+        WIFI_PKT_CTRL,
+        WIFI_PKT_DATA,
+        WIFI_PKT_MISC,
+} wifi_promiscuous_pkt_type_t;
+typedef struct
+{
+        signed rssi : 8;
+        unsigned channel : 4;
+        unsigned sig_len : 12;
+} wifi_pkt_rx_ctrl_t;
+typedef struct
+{
+        wifi_pkt_rx_ctrl_t rx_ctrl;
+        uint8_t payload[0];
+} wifi_promiscuous_pkt_t;
+typedef void (*wifi_promiscuous_cb_t)(void *buf, wifi_promiscuous_pkt_type_t type);
+typedef struct
+{
+        int unused;
+} wifi_init_config_t;
+#define WIFI_INIT_CONFIG_DEFAULT() {0}
+typedef struct
+{
+        char cc[3];
+        uint8_t schan;
+        uint8_t nchan;
+        int8_t max_tx_power;
+        int policy;
+} wifi_country_t;
+esp_err_t esp_wifi_init(const wifi_init_config_t *config);
+esp_err_t esp_wifi_set_storage(wifi_storage_t storage);
+esp_err_t esp_wifi_set_mode(wifi_mode_t mode);
+esp_err_t esp_wifi_start(void);
+esp_err_t esp_wifi_set_channel(uint8_t primary, wifi_second_chan_t second);
+esp_err_t esp_wifi_get_channel(uint8_t *primary, wifi_second_chan_t *second);
+esp_err_t esp_wifi_get_country(wifi_country_t *country);
+esp_err_t esp_wifi_set_protocol(wifi_interface_t ifx, uint8_t protocol_bitmap);
+esp_err_t esp_wifi_config_espnow_rate(wifi_interface_t ifx, wifi_phy_rate_t rate);
+esp_err_t esp_wifi_set_promiscuous(bool enable);
+esp_err_t esp_wifi_set_promiscuous_rx_cb(wifi_promiscuous_cb_t cb);
+esp_err_t esp_netif_init(void);
+esp_err_t esp_event_loop_create_default(void);
+
+/* esp_now */
+
+#define ESP_NOW_ETH_ALEN 6
+#define ESP_NOW_KEY_LEN 16
+#define ESP_NOW_MAX_DATA_LEN 250
+#define MACSTR "%02x:%02x:%02x:%02x:%02x:%02x"
+#define MAC2STR(a) (a)[0], (a)[1], (a)[2], (a)[3], (a)[4], (a)[5]
+typedef enum
+{
+        ESP_NOW_SEND_SUCCESS = 0,
+        ESP_NOW_SEND_FAIL,
+} esp_now_send_status_t;
+typedef struct
+{
+        uint8_t peer_addr[ESP_NOW_ETH_ALEN];
+        uint8_t lmk[ESP_NOW_KEY_LEN];
+        uint8_t channel;
+        wifi_interface_t ifidx;
+        bool encrypt;
+        void *priv;
+} esp_now_peer_info_t;
+typedef struct
+{
+        uint8_t *src_addr;
+        uint8_t *des_addr;
+        wifi_pkt_rx_ctrl_t *rx_ctrl;
+} esp_now_recv_info_t;
+typedef void (*esp_now_recv_cb_t)(const esp_now_recv_info_t *info, const uint8_t *data, int len);
+typedef void (*esp_now_send_cb_t)(const uint8_t *mac, esp_now_send_status_t status);
+esp_err_t esp_now_init(void);
+esp_err_t esp_now_deinit(void);
+esp_err_t esp_now_register_send_cb(esp_now_send_cb_t cb);
+esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb);
+esp_err_t esp_now_send(const uint8_t *mac, const uint8_t *data, size_t len);
+esp_err_t esp_now_add_peer(const esp_now_peer_info_t *peer);
+esp_err_t esp_now_del_peer(const uint8_t *mac);
+esp_err_t esp_now_mod_peer(const esp_now_peer_info_t *peer);
+esp_err_t esp_now_get_peer(const uint8_t *mac, esp_now_peer_info_t *peer);
+bool esp_now_is_peer_exist(const uint8_t *mac);
+esp_err_t esp_now_set_pmk(const uint8_t *pmk);
+
+/* nvs */
+
+typedef uint32_t nvs_handle_t;
+typedef enum
+{
+        NVS_READONLY,
+        NVS_READWRITE,
+} nvs_open_mode_t;
+esp_err_t nvs_flash_init(void);
+esp_err_t nvs_flash_erase(void);
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *handle);
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *value, size_t *len);
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t len);
+esp_err_t nvs_commit(nvs_handle_t handle);
+void nvs_close(nvs_handle_t handle);
+
+/* driver, types only */
+
+typedef enum
+{
+        GPIO_NUM_NC = -1,
+        GPIO_NUM_MAX = 49,
+} gpio_num_t;
+typedef void *rmt_channel_handle_t;
+typedef void *rmt_encoder_handle_t;
+typedef struct rmt_encoder_t rmt_encoder_t;
+typedef struct
+{
+        int loop_count;
+} rmt_transmit_config_t;
+
+/* Host test controls */
+
+// Set the time returned by `esp_timer_get_time`, it only moves when told to or through `vTaskDelay`
+void idf_host_set_time(int64_t time_us);
+// Move the time returned by `esp_timer_get_time` forward
+void idf_host_advance_time(int64_t delta_us);
+
+// Replaces `esp_now_send`, the send callback is never called on the host
+typedef esp_err_t (*idf_host_esp_now_send_t)(const uint8_t *mac, const uint8_t *data, size_t len);
+void idf_host_set_esp_now_send(idf_host_esp_now_send_t send);
+
+// Print log lines up to `level`, warnings and errors by default
+void idf_host_set_log_level(esp_log_level_t level);
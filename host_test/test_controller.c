@@ -0,0 +1,263 @@
+// Controller state stream through the encoder and decoder, with lost frames and late send results
+// The firmware source is included to reach the encoder, the frames are handed over without the radio
+
+#include "../main/espnow.c"
+
+#include "test_host.h"
+
+#define TEST_FRAMES (20000)          // Controller snapshots sent in each run
+#define TEST_BENCHMARK_FRAMES (1000) // Snapshots encoded and decoded per timed round
+#define TEST_INTERVAL_MS (10)        // Time between two controller frames, as the controller sends them
+
+// Send result waiting to be reported, as ESP-NOW reports them some time after the send
+typedef struct
+{
+        uint16_t seq_num; // Snapshot the result is for
+        bool success;     // The peer acknowledged the frame
+} test_result_t;
+
+static esp_connection_handle_t test_handle;
+static espnow_packet_t test_request; // Last keyframe request handed to the radio
+static uint32_t test_requests;       // Keyframe requests handed to the radio
+
+// The radio keeps the keyframe requests, to hand them back to the encoder as the peer would receive them
+static esp_err_t test_send(const uint8_t *mac, const uint8_t *data, size_t len)
+{
+        espnow_packet_t packet;
+        TEST_ASSERT(len >= sizeof(packet));
+        memcpy(&packet, data, sizeof(packet));
+        if (ESPNOW_PACKET_TYPE(&packet) == ESPNOW_PACKET_TYPE_KEYFRAME_REQUEST)
+        {
+                TEST_ASSERT(len <= sizeof(espnow_packet_t) + sizeof(uint32_t));
+                memcpy(&test_request, data, len);
+                test_requests++;
+        }
+        return ESP_OK;
+}
+
+// Controller state as a person produces it, the joystick drifts and the buttons change now and then
+static void test_next_state(remote_controller_state_pkt_t *state)
+{
+        state->seq_num++;
+        if (esp_random() % 4 == 0)
+                state->axis_x += (int8_t)(esp_random() % 7) - 3;
+        if (esp_random() % 4 == 0)
+                state->axis_y += (int8_t)(esp_random() % 7) - 3;
+        if (esp_random() % 50 == 0)
+        {
+                uint8_t button = esp_random() % REMOTE_CONTROLLER_MAX_BUTTONS;
+                state->buttons ^= 1 << (2 * button);
+                state->press_count += 1 << (2 * button);
+        }
+}
+
+// Encode a snapshot into a packet, as `espnow_send_controller_state` does
+static espnow_packet_t *test_encode(espnow_controller_encoder_t *encoder, const remote_controller_state_pkt_t *state, uint8_t *buffer, bool *keyframe)
+{
+        espnow_packet_t *packet = (espnow_packet_t *)buffer;
+        memset(packet, 0, sizeof(espnow_packet_t));
+        packet->len = espnow_controller_encode(encoder, state, packet->payload, keyframe);
+        packet->type_flags = (*keyframe ? ESPNOW_PACKET_TYPE_CONTROLLER_STATE : ESPNOW_PACKET_TYPE_CONTROLLER_DELTA) | ESPNOW_PACKET_FLAG_UNICAST;
+        espnow_controller_encoder_sent(encoder, state, *keyframe);
+        return packet;
+}
+
+// Every frame that arrives decodes to the snapshot that was sent, whatever was lost before it
+static void test_round_trip(int loss_percent, size_t result_delay)
+{
+        espnow_controller_encoder_t encoder = {0};
+        esp_peer_handle_t peer = {.mac = {0x02, 0, 0, 0, 0, 1}};
+        remote_controller_state_pkt_t state = {0};
+        test_result_t results[ESPNOW_CONTROLLER_PENDING_SIZE] = {0};
+        size_t results_count = 0;
+        uint32_t keyframes = 0, deltas = 0, lost = 0, payload_bytes = 0;
+        bool lost_before = false;
+
+        for (uint32_t frame = 0; frame < TEST_FRAMES; frame++)
+        {
+                test_next_state(&state);
+                uint8_t buffer[ESP_NOW_MAX_DATA_LEN];
+                bool keyframe;
+                espnow_packet_t *packet = test_encode(&encoder, &state, buffer, &keyframe);
+                TEST_ASSERT(packet->len <= sizeof(remote_controller_state_pkt_t));
+                payload_bytes += packet->len;
+                if (keyframe)
+                        keyframes++;
+                else
+                        deltas++;
+
+                // The result of a lost frame turns the next frame sent after it into a keyframe
+                if (lost_before)
+                        TEST_ASSERT(keyframe);
+
+                bool delivered = (int)(esp_random() % 100) >= loss_percent;
+                if (delivered)
+                {
+                        remote_controller_state_pkt_t decoded;
+                        TEST_ASSERT(espnow_controller_decode(&peer, packet, &decoded) == &decoded);
+                        TEST_ASSERT(memcmp(&decoded, &state, sizeof(state)) == 0);
+                }
+                else
+                {
+                        lost++;
+                }
+
+                results[results_count++] = (test_result_t){.seq_num = state.seq_num, .success = delivered};
+                lost_before = false;
+                while (results_count > result_delay)
+                {
+                        espnow_controller_send_result(&encoder, results[0].seq_num, results[0].success);
+                        lost_before |= !results[0].success;
+                        memmove(results, results + 1, sizeof(test_result_t) * --results_count);
+                }
+        }
+
+        // On a usable link most frames are deltas
+        if (loss_percent <= 10)
+                TEST_ASSERT(deltas > keyframes);
+        TEST_ASSERT(keyframes >= TEST_FRAMES / (ESPNOW_CONTROLLER_KEYFRAME_INTERVAL + 1));
+        printf("loss %2d%%, results %zu frames late: %5lu keyframes, %5lu deltas, %4lu lost, %.2f payload bytes per frame, %lu%% of full snapshots\n",
+               loss_percent, result_delay, keyframes, deltas, lost, (double)payload_bytes / TEST_FRAMES,
+               payload_bytes * 100UL / (TEST_FRAMES * sizeof(remote_controller_state_pkt_t)));
+}
+
+// A delta whose base never reached the decoder is refused, not applied to another snapshot
+static void test_missing_base(void)
+{
+        espnow_controller_encoder_t encoder = {0};
+        esp_peer_handle_t peer = {.mac = {0x02, 0, 0, 0, 0, 1}};
+        remote_controller_state_pkt_t state = {.seq_num = 100, .axis_x = 10};
+        uint8_t buffer[ESP_NOW_MAX_DATA_LEN];
+        bool keyframe;
+
+        // The send result says delivered, the decoder never saw the frame
+        test_encode(&encoder, &state, buffer, &keyframe);
+        TEST_ASSERT(keyframe);
+        espnow_controller_send_result(&encoder, state.seq_num, true);
+
+        state.seq_num++;
+        state.axis_x++;
+        remote_controller_state_pkt_t decoded;
+        espnow_packet_t *packet = test_encode(&encoder, &state, buffer, &keyframe);
+        TEST_ASSERT(!keyframe);
+        TEST_ASSERT(espnow_controller_decode(&peer, packet, &decoded) == NULL);
+
+        // Truncated fields are refused too, the full frame is applied to the base it names
+        espnow_controller_send_result(&encoder, state.seq_num, false);
+        state.seq_num++;
+        packet = test_encode(&encoder, &state, buffer, &keyframe);
+        TEST_ASSERT(keyframe);
+        TEST_ASSERT(espnow_controller_decode(&peer, packet, &decoded) == &decoded);
+        espnow_controller_send_result(&encoder, state.seq_num, true);
+
+        state.seq_num++;
+        state.axis_y++;
+        packet = test_encode(&encoder, &state, buffer, &keyframe);
+        TEST_ASSERT(!keyframe);
+        packet->len--;
+        TEST_ASSERT(espnow_controller_decode(&peer, packet, &decoded) == NULL);
+        packet->len++;
+        TEST_ASSERT(espnow_controller_decode(&peer, packet, &decoded) == &decoded);
+        TEST_ASSERT(memcmp(&decoded, &state, sizeof(state)) == 0);
+}
+
+// A delta base the peer radio acknowledged but the peer dropped is asked for again, the stream recovers on the next frame
+static void test_keyframe_request(void)
+{
+        uint8_t mac[ESP_NOW_ETH_ALEN] = {0x02, 0, 0, 0, 0, 2};
+        esp_peer_handle_t *peer = esp_connection_mac_add_to_entry(&test_handle, mac);
+        TEST_ASSERT(peer != NULL);
+        peer->status = ESP_PEER_STATUS_CONNECTED;
+        peer->registered = true;
+        espnow_controller_encoder_t *encoder = &peer->controller_tx;
+        remote_controller_state_pkt_t state = {.seq_num = 200, .axis_x = 10};
+        uint8_t buffer[ESP_NOW_MAX_DATA_LEN];
+        remote_controller_state_pkt_t decoded;
+        bool keyframe;
+
+        // The keyframe is acknowledged by the radio, the peer dropped it with its receive queue full
+        test_encode(encoder, &state, buffer, &keyframe);
+        TEST_ASSERT(keyframe);
+        espnow_controller_send_result(encoder, state.seq_num, true);
+
+        // Deltas against it are refused, the first one asks for a keyframe and the next ones wait for it
+        // A request still unanswered after `ESPNOW_CONTROLLER_REQUEST_MS` may have been lost, it is sent again
+        test_requests = 0;
+        memset(&espnow_controller_stats, 0, sizeof(espnow_controller_stats));
+        for (int i = 0; i <= ESPNOW_CONTROLLER_REQUEST_MS / TEST_INTERVAL_MS; i++)
+        {
+                state.seq_num++;
+                state.axis_x++;
+                espnow_packet_t *packet = test_encode(encoder, &state, buffer, &keyframe);
+                TEST_ASSERT(!keyframe);
+                TEST_ASSERT(espnow_controller_decode(peer, packet, &decoded) == NULL);
+                espnow_controller_send_result(encoder, state.seq_num, true);
+                idf_host_advance_time(TEST_INTERVAL_MS * 1000);
+                esp_peer_tx_done(peer);
+        }
+        TEST_ASSERT(test_requests == 2);
+
+        // The request reaches the sender, its next frame needs no base
+        TEST_ASSERT(esp_peer_process_received(peer, &test_request));
+        state.seq_num++;
+        espnow_packet_t *packet = test_encode(encoder, &state, buffer, &keyframe);
+        TEST_ASSERT(keyframe);
+        TEST_ASSERT(espnow_controller_decode(peer, packet, &decoded) == &decoded);
+        TEST_ASSERT(memcmp(&decoded, &state, sizeof(state)) == 0);
+        TEST_ASSERT(espnow_controller_stats.requested == 1);
+        TEST_ASSERT(espnow_controller_stats.requests == 2);
+
+        // A base lost later is asked for at once, the keyframe answered the last request
+        espnow_controller_send_result(encoder, state.seq_num, true);
+        state.seq_num++;
+        state.axis_y++;
+        test_encode(encoder, &state, buffer, &keyframe);
+        espnow_controller_send_result(encoder, state.seq_num, true);
+        state.seq_num++;
+        packet = test_encode(encoder, &state, buffer, &keyframe);
+        TEST_ASSERT(!keyframe);
+        TEST_ASSERT(espnow_controller_decode(peer, packet, &decoded) == NULL);
+        TEST_ASSERT(test_requests == 3);
+}
+
+// Time of encoding and decoding one snapshot
+static void test_benchmark(void)
+{
+        static remote_controller_state_pkt_t states[TEST_BENCHMARK_FRAMES];
+        remote_controller_state_pkt_t state = {0};
+        for (size_t i = 0; i < TEST_BENCHMARK_FRAMES; i++)
+        {
+                test_next_state(&state);
+                states[i] = state;
+        }
+
+        espnow_controller_encoder_t encoder = {0};
+        esp_peer_handle_t peer = {0};
+        uint8_t buffer[ESP_NOW_MAX_DATA_LEN];
+        remote_controller_state_pkt_t decoded;
+        bool keyframe;
+        TEST_BENCHMARK("controller encode + decode", TEST_BENCHMARK_FRAMES * 100, {
+                const remote_controller_state_pkt_t *next = &states[_i % TEST_BENCHMARK_FRAMES];
+                espnow_packet_t *packet = test_encode(&encoder, next, buffer, &keyframe);
+                espnow_controller_send_result(&encoder, next->seq_num, true);
+                TEST_ASSERT(espnow_controller_decode(&peer, packet, &decoded) != NULL);
+        });
+}
+
+int main(void)
+{
+        srand(1);
+        espnow_wifi_config_t config;
+        esp_connection_handle_init(&test_handle);
+        TEST_ASSERT(espnow_init(espnow_wifi_default_config(&config), &test_handle) != NULL);
+        idf_host_set_esp_now_send(test_send);
+        test_round_trip(0, 0);
+        test_round_trip(10, 0);
+        test_round_trip(10, ESPNOW_CONTROLLER_PENDING_SIZE - 1);
+        test_round_trip(50, 2);
+        printf("PASS test_round_trip\n");
+        TEST_RUN(test_missing_base);
+        TEST_RUN(test_keyframe_request);
+        TEST_RUN(test_benchmark);
+        return TEST_RESULT();
+}
@@ -0,0 +1,348 @@
+// Reassembly of fragmented messages arriving out of order, twice, interleaved and from restarted senders, and their sending
+// The firmware source is included to feed fragments to its handler, the messages come back through the dispatcher
+
+#include "../main/espnow_fragment.c"
+
+#include "test_host.h"
+
+#define TEST_MESSAGE_TYPE (ESPNOW_PACKET_TYPE_TEXT) // Data packet type of the reassembled messages
+#define TEST_DELIVERED_MAX (8)                      // Messages recorded per test
+#define TEST_SENT_MAX (16)                          // Frames recorded by the radio per test
+
+// Message handed to the dispatcher
+typedef struct
+{
+        uint8_t mac[ESP_NOW_ETH_ALEN];         // Sender
+        uint8_t data[ESPNOW_FRAGMENT_MAX_LEN]; // Reassembled message
+        size_t len;                            // Length of `data`, in bytes
+} test_message_t;
+
+// Frame handed to the radio
+typedef struct
+{
+        espnow_packet_type_t type; // Packet type
+        uint8_t index;             // Fragment index, for `FRAGMENT` packets
+} test_sent_t;
+
+static esp_connection_handle_t test_handle;
+static test_sent_t test_sent[TEST_SENT_MAX];
+static size_t test_sent_count;
+static test_message_t test_delivered[TEST_DELIVERED_MAX];
+static size_t test_delivered_count;
+static esp_peer_handle_t test_peers[3] = {
+    {.mac = {0x02, 0, 0, 0, 0, 1}},
+    {.mac = {0x02, 0, 0, 0, 0, 2}},
+    {.mac = {0x02, 0, 0, 0, 0, 3}},
+};
+
+static void test_deliver(esp_peer_handle_t *peer, espnow_packet_type_t type, const uint8_t *payload, size_t len)
+{
+        TEST_ASSERT(type == TEST_MESSAGE_TYPE);
+        TEST_ASSERT(test_delivered_count < TEST_DELIVERED_MAX);
+        test_message_t *message = &test_delivered[test_delivered_count++];
+        memcpy(message->mac, peer->mac, ESP_NOW_ETH_ALEN);
+        memcpy(message->data, payload, len);
+        message->len = len;
+}
+
+// The radio takes every frame, its send result comes when the test hands it over
+static esp_err_t test_send(const uint8_t *mac, const uint8_t *data, size_t len)
+{
+        TEST_ASSERT(test_sent_count < TEST_SENT_MAX);
+        espnow_packet_t packet;
+        memcpy(&packet, data, sizeof(packet));
+        test_sent_t *sent = &test_sent[test_sent_count++];
+        sent->type = ESPNOW_PACKET_TYPE(&packet);
+        if (sent->type == ESPNOW_PACKET_TYPE_FRAGMENT)
+        {
+                size_t stamp_len = (packet.type_flags & ESPNOW_PACKET_FLAG_TIMESTAMP) ? sizeof(uint32_t) : 0;
+                espnow_fragment_header_pkt_t header;
+                memcpy(&header, data + sizeof(espnow_packet_t) + stamp_len, sizeof(header));
+                sent->index = header.index;
+        }
+        return ESP_OK;
+}
+
+// Byte `offset` of message `msg_id`, every message has its own content
+static uint8_t test_byte(uint8_t msg_id, size_t offset)
+{
+        return (uint8_t)(msg_id * 31 + offset * 7 + (offset >> 8));
+}
+
+static uint8_t test_count(uint16_t total_len)
+{
+        return (total_len + ESPNOW_FRAGMENT_DATA_LEN - 1) / ESPNOW_FRAGMENT_DATA_LEN;
+}
+
+// Hand fragment `index` of message `msg_id` of `total_len` bytes to the receive path
+static void test_fragment(esp_peer_handle_t *peer, uint8_t msg_id, uint16_t total_len, uint8_t index)
+{
+        uint8_t buffer[sizeof(espnow_fragment_header_pkt_t) + ESPNOW_FRAGMENT_DATA_LEN];
+        espnow_fragment_header_pkt_t header = {
+            .msg_id = msg_id,
+            .type = TEST_MESSAGE_TYPE,
+            .index = index,
+            .count = test_count(total_len),
+            .total_len = total_len,
+        };
+        size_t data_len = espnow_fragment_len(header.index, header.count, header.total_len);
+        memcpy(buffer, &header, sizeof(header));
+        for (size_t i = 0; i < data_len; i++)
+                buffer[sizeof(header) + i] = test_byte(msg_id, index * ESPNOW_FRAGMENT_DATA_LEN + i);
+        espnow_fragment_handle(peer, ESPNOW_PACKET_TYPE_FRAGMENT, buffer, sizeof(header) + data_len);
+}
+
+// Message `n` delivered is message `msg_id` of `total_len` bytes from `peer`
+static void test_check_delivered(size_t n, esp_peer_handle_t *peer, uint8_t msg_id, uint16_t total_len)
+{
+        TEST_ASSERT(n < test_delivered_count);
+        test_message_t *message = &test_delivered[n];
+        TEST_ASSERT(memcmp(message->mac, peer->mac, ESP_NOW_ETH_ALEN) == 0);
+        TEST_ASSERT(message->len == total_len);
+        for (size_t i = 0; i < total_len; i++)
+                TEST_ASSERT(message->data[i] == test_byte(msg_id, i));
+}
+
+static void test_setup(void)
+{
+        memset(espnow_fragment_rx, 0, sizeof(espnow_fragment_rx));
+        memset(&espnow_fragment_stats, 0, sizeof(espnow_fragment_stats));
+        test_delivered_count = 0;
+        // Slots just delivered are told apart by time, start each test well after the last one
+        idf_host_advance_time(ESPNOW_FRAGMENT_TIMEOUT_MS * 1000 * 2);
+}
+
+// Fragments in every order give back the message, once
+static void test_out_of_order(void)
+{
+        test_setup();
+        uint16_t total_len = ESPNOW_FRAGMENT_MAX_LEN;
+        uint8_t count = test_count(total_len);
+        for (uint8_t msg_id = 0; msg_id < TEST_DELIVERED_MAX; msg_id++)
+        {
+                uint8_t order[ESPNOW_FRAGMENT_MAX_COUNT];
+                for (uint8_t i = 0; i < count; i++)
+                        order[i] = i;
+                for (uint8_t i = count - 1; i > 0; i--)
+                {
+                        uint8_t j = esp_random() % (i + 1);
+                        uint8_t swap = order[i];
+                        order[i] = order[j];
+                        order[j] = swap;
+                }
+                for (uint8_t i = 0; i < count; i++)
+                {
+                        TEST_ASSERT(test_delivered_count == msg_id);
+                        test_fragment(&test_peers[0], msg_id, total_len, order[i]);
+                }
+                test_check_delivered(msg_id, &test_peers[0], msg_id, total_len);
+        }
+        TEST_ASSERT(espnow_fragment_stats.delivered == TEST_DELIVERED_MAX);
+        TEST_ASSERT(espnow_fragment_stats.reordered > 0);
+        TEST_ASSERT(espnow_fragment_stats.evicted == 0);
+}
+
+// Copies of a fragment are dropped, also when they come after the message was delivered
+static void test_duplicates(void)
+{
+        test_setup();
+        uint16_t total_len = 3 * ESPNOW_FRAGMENT_DATA_LEN + 10;
+        for (uint8_t index = 0; index < 4; index++)
+        {
+                test_fragment(&test_peers[0], 1, total_len, index);
+                test_fragment(&test_peers[0], 1, total_len, index);
+        }
+        TEST_ASSERT(test_delivered_count == 1);
+        test_check_delivered(0, &test_peers[0], 1, total_len);
+        TEST_ASSERT(espnow_fragment_stats.duplicates == 4);
+
+        // A late copy of the delivered message must not take a slot from the messages in progress
+        test_fragment(&test_peers[1], 7, total_len, 0);
+        test_fragment(&test_peers[0], 1, total_len, 2);
+        test_fragment(&test_peers[2], 9, total_len, 0);
+        TEST_ASSERT(test_delivered_count == 1);
+        TEST_ASSERT(espnow_fragment_stats.duplicates == 5);
+        TEST_ASSERT(espnow_fragment_stats.evicted == 0);
+        for (uint8_t index = 1; index < 4; index++)
+        {
+                test_fragment(&test_peers[1], 7, total_len, index);
+                test_fragment(&test_peers[2], 9, total_len, index);
+        }
+        TEST_ASSERT(test_delivered_count == 3);
+        test_check_delivered(1, &test_peers[1], 7, total_len);
+        test_check_delivered(2, &test_peers[2], 9, total_len);
+}
+
+// A third message in progress drops the oldest, the other two complete
+static void test_eviction(void)
+{
+        test_setup();
+        uint16_t total_len = 2 * ESPNOW_FRAGMENT_DATA_LEN;
+        for (size_t peer = 0; peer < 3; peer++)
+        {
+                test_fragment(&test_peers[peer], 4, total_len, 0);
+                idf_host_advance_time(1000);
+        }
+        TEST_ASSERT(espnow_fragment_stats.evicted == 1);
+        for (size_t peer = 1; peer < 3; peer++)
+                test_fragment(&test_peers[peer], 4, total_len, 1);
+        TEST_ASSERT(test_delivered_count == 2);
+        test_check_delivered(0, &test_peers[1], 4, total_len);
+        test_check_delivered(1, &test_peers[2], 4, total_len);
+
+        // The rest of the dropped message waits in a slot of its own until it times out
+        test_fragment(&test_peers[0], 4, total_len, 1);
+        TEST_ASSERT(test_delivered_count == 2);
+        static esp_connection_handle_t handle;
+        idf_host_advance_time(ESPNOW_FRAGMENT_TIMEOUT_MS * 1000);
+        espnow_fragment_update(&handle);
+        TEST_ASSERT(espnow_fragment_stats.timeouts == 1);
+        TEST_ASSERT(!espnow_fragment_rx[0].in_use && !espnow_fragment_rx[1].in_use);
+}
+
+// A sender that restarts its message numbers is not mixed up with its previous messages
+static void test_msg_id_restart(void)
+{
+        test_setup();
+        uint16_t total_len = 3 * ESPNOW_FRAGMENT_DATA_LEN;
+        test_fragment(&test_peers[0], 0, total_len, 0);
+        test_fragment(&test_peers[0], 0, total_len, 1);
+
+        // Same number, another length, the partly received message is dropped for it
+        uint16_t restarted_len = 2 * ESPNOW_FRAGMENT_DATA_LEN + 1;
+        test_fragment(&test_peers[0], 0, restarted_len, 2);
+        test_fragment(&test_peers[0], 0, restarted_len, 0);
+        TEST_ASSERT(test_delivered_count == 0);
+        test_fragment(&test_peers[0], 0, restarted_len, 1);
+        TEST_ASSERT(test_delivered_count == 1);
+        test_check_delivered(0, &test_peers[0], 0, restarted_len);
+
+        // Same number and length once the delivered message is old enough, it is a new message
+        idf_host_advance_time(ESPNOW_FRAGMENT_TIMEOUT_MS * 1000);
+        for (uint8_t index = 0; index < 3; index++)
+                test_fragment(&test_peers[0], 0, restarted_len, index);
+        TEST_ASSERT(test_delivered_count == 2);
+        test_check_delivered(1, &test_peers[0], 0, restarted_len);
+
+        // The same message number from another peer is another message
+        test_fragment(&test_peers[0], 1, total_len, 0);
+        test_fragment(&test_peers[1], 1, total_len, 0);
+        for (uint8_t index = 1; index < 3; index++)
+        {
+                test_fragment(&test_peers[0], 1, total_len, index);
+                test_fragment(&test_peers[1], 1, total_len, index);
+        }
+        TEST_ASSERT(test_delivered_count == 4);
+        test_check_delivered(2, &test_peers[0], 1, total_len);
+        test_check_delivered(3, &test_peers[1], 1, total_len);
+        TEST_ASSERT(espnow_fragment_stats.duplicates == 0);
+}
+
+// Headers that do not add up are refused before touching a slot
+static void test_malformed(void)
+{
+        test_setup();
+        uint8_t buffer[sizeof(espnow_fragment_header_pkt_t) + ESPNOW_FRAGMENT_DATA_LEN] = {0};
+        espnow_fragment_header_pkt_t header = {.msg_id = 3, .type = TEST_MESSAGE_TYPE, .index = 2, .count = 2, .total_len = 300};
+        memcpy(buffer, &header, sizeof(header));
+        espnow_fragment_handle(&test_peers[0], ESPNOW_PACKET_TYPE_FRAGMENT, buffer, sizeof(header) + 300 - ESPNOW_FRAGMENT_DATA_LEN);
+        header.index = 0;
+        header.type = ESPNOW_PACKET_TYPE_FRAGMENT;
+        memcpy(buffer, &header, sizeof(header));
+        espnow_fragment_handle(&test_peers[0], ESPNOW_PACKET_TYPE_FRAGMENT, buffer, sizeof(header) + ESPNOW_FRAGMENT_DATA_LEN);
+        header.type = TEST_MESSAGE_TYPE;
+        memcpy(buffer, &header, sizeof(header));
+        espnow_fragment_handle(&test_peers[0], ESPNOW_PACKET_TYPE_FRAGMENT, buffer, sizeof(header) + ESPNOW_FRAGMENT_DATA_LEN - 1);
+        espnow_fragment_handle(&test_peers[0], ESPNOW_PACKET_TYPE_FRAGMENT, buffer, sizeof(header) - 1);
+        TEST_ASSERT(espnow_fragment_stats.malformed == 4);
+        TEST_ASSERT(espnow_fragment_stats.fragments == 0);
+        TEST_ASSERT(!espnow_fragment_rx[0].in_use && !espnow_fragment_rx[1].in_use);
+}
+
+// A message of a single fragment from another sender goes through a slot like any other
+static void test_single(void)
+{
+        test_setup();
+        test_fragment(&test_peers[0], 5, 10, 0);
+        TEST_ASSERT(test_delivered_count == 1);
+        test_check_delivered(0, &test_peers[0], 5, 10);
+        TEST_ASSERT(espnow_fragment_stats.delivered == 1);
+}
+
+// Other packets queued to the peer while a message is sent push out one another, never a fragment
+static void test_queue_full(void)
+{
+        esp_connection_handle_clear(&test_handle);
+        uint8_t mac[ESP_NOW_ETH_ALEN] = {0x02, 0, 0, 0, 1, 0};
+        esp_peer_handle_t *peer = esp_connection_mac_add_to_entry(&test_handle, mac);
+        TEST_ASSERT(peer != NULL);
+        peer->status = ESP_PEER_STATUS_CONNECTED;
+        peer->registered = true;
+        peer->saved_to_rom = true;
+        test_sent_count = 0;
+        memset(&espnow_fragment_stats, 0, sizeof(espnow_fragment_stats));
+
+        uint8_t message[5 * ESPNOW_FRAGMENT_DATA_LEN];
+        for (size_t i = 0; i < sizeof(message); i++)
+                message[i] = test_byte(0, i);
+        espnow_send_param_t send_param;
+        espnow_get_send_param_unicast(&send_param, mac);
+        TEST_ASSERT(espnow_send_fragmented(&send_param, TEST_MESSAGE_TYPE, message, sizeof(message)) == ESP_OK);
+
+        // One fragment in flight, the queue keeps a spare entry
+        espnow_fragment_update(&test_handle);
+        TEST_ASSERT(test_sent_count == 1);
+        TEST_ASSERT(esp_peer_tx_space(peer) == ESPNOW_FRAGMENT_QUEUE_SPARE);
+        uint8_t text[8] = {0};
+        for (size_t n = 0; n < 3; n++)
+        {
+                espnow_get_send_param_unicast(&send_param, mac);
+                TEST_ASSERT(espnow_send_data(&send_param, ESPNOW_PACKET_TYPE_TEXT, text, sizeof(text)) == ESP_OK);
+        }
+        TEST_ASSERT(peer->tx.dropped == 2);
+
+        // Every send result lets the next frame out, the fragment update refills the queue
+        for (size_t n = 0; n < TEST_SENT_MAX && test_sent_count < TEST_SENT_MAX; n++)
+        {
+                espnow_event_send_cb_t send_cb = {.status = ESP_NOW_SEND_SUCCESS};
+                memcpy(send_cb.mac_addr, mac, ESP_NOW_ETH_ALEN);
+                esp_connection_process_send_result(&test_handle, &send_cb);
+                espnow_fragment_update(&test_handle);
+                if (!peer->tx.busy)
+                        break;
+        }
+        TEST_ASSERT(espnow_fragment_stats.sent == 1);
+        uint16_t indexes = 0;
+        size_t texts = 0;
+        for (size_t i = 0; i < test_sent_count; i++)
+        {
+                if (test_sent[i].type == ESPNOW_PACKET_TYPE_TEXT)
+                        texts++;
+                else if (test_sent[i].type == ESPNOW_PACKET_TYPE_FRAGMENT)
+                {
+                        TEST_ASSERT(!(indexes & (1 << test_sent[i].index)));
+                        indexes |= 1 << test_sent[i].index;
+                }
+        }
+        TEST_ASSERT(indexes == (1 << 5) - 1);
+        TEST_ASSERT(texts == 1);
+}
+
+int main(void)
+{
+        srand(1);
+        espnow_wifi_config_t config;
+        esp_connection_handle_init(&test_handle);
+        TEST_ASSERT(espnow_init(espnow_wifi_default_config(&config), &test_handle) != NULL);
+        idf_host_set_esp_now_send(test_send);
+        espnow_fragment_init();
+        espnow_dispatch_register(TEST_MESSAGE_TYPE, test_deliver);
+        TEST_RUN(test_out_of_order);
+        TEST_RUN(test_duplicates);
+        TEST_RUN(test_eviction);
+        TEST_RUN(test_msg_id_restart);
+        TEST_RUN(test_malformed);
+        TEST_RUN(test_single);
+        TEST_RUN(test_queue_full);
+        return TEST_RESULT();
+}
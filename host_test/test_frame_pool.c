@@ -0,0 +1,130 @@
+// Frame pool borrowing and returning, and its cost next to the heap allocation it replaced in the receive path
+
+#include "espnow.h"
+#include "frame_pool.h"
+
+#include "test_host.h"
+
+#define TEST_DEPTH (ESPNOW_QUEUE_SIZE)  // Frames in the pool, as in the receive pool
+#define TEST_BENCHMARK_ROUNDS (100000) // Bursts timed per benchmark
+#define TEST_BURST (16)                // Frames held at the same time in a burst, the queue fills while the dispatcher is busy
+
+static frame_pool_frame_t test_frames[FRAME_POOL_MAX_DEPTH];
+static uint8_t test_payload[ESP_NOW_MAX_DATA_LEN];
+static volatile uint8_t test_sink;
+
+// Every frame can be borrowed once, the pool then reports itself empty until one is returned
+static void test_exhaustion(void)
+{
+        frame_pool_t pool;
+        TEST_ASSERT(frame_pool_init(&pool, "test", test_frames, TEST_DEPTH) == &pool);
+        uint8_t *borrowed[TEST_DEPTH];
+        for (size_t i = 0; i < TEST_DEPTH; i++)
+        {
+                borrowed[i] = frame_pool_borrow(&pool);
+                TEST_ASSERT(borrowed[i] != NULL);
+                TEST_ASSERT(((uintptr_t)borrowed[i] & 3) == 0);
+                for (size_t j = 0; j < i; j++)
+                        TEST_ASSERT(borrowed[i] != borrowed[j]);
+        }
+        TEST_ASSERT(frame_pool_borrow(&pool) == NULL);
+        TEST_ASSERT(frame_pool_borrow(&pool) == NULL);
+
+        frame_pool_return(&pool, borrowed[5]);
+        TEST_ASSERT(frame_pool_borrow(&pool) == borrowed[5]);
+        for (size_t i = 0; i < TEST_DEPTH; i++)
+                frame_pool_return(&pool, borrowed[i]);
+
+        frame_pool_stats_t stats;
+        TEST_ASSERT(frame_pool_get_stats(&pool, &stats) == &stats);
+        TEST_ASSERT(stats.borrowed == TEST_DEPTH + 1);
+        TEST_ASSERT(stats.returned == TEST_DEPTH + 1);
+        TEST_ASSERT(stats.exhausted == 2);
+        TEST_ASSERT(stats.in_use == 0);
+        TEST_ASSERT(stats.peak_in_use == TEST_DEPTH);
+}
+
+// Frames of another pool, frames returned twice and pointers inside a frame are refused
+static void test_bad_return(void)
+{
+        frame_pool_t pool;
+        frame_pool_init(&pool, "test", test_frames, 4);
+        uint8_t *frame = frame_pool_borrow(&pool);
+        frame_pool_return(&pool, frame + 1);
+        frame_pool_return(&pool, test_frames[4]);
+        frame_pool_return(&pool, frame);
+        frame_pool_return(&pool, frame);
+
+        frame_pool_stats_t stats;
+        frame_pool_get_stats(&pool, &stats);
+        TEST_ASSERT(stats.returned == 1);
+        TEST_ASSERT(stats.in_use == 0);
+        TEST_ASSERT(frame_pool_init(&pool, "test", test_frames, FRAME_POOL_MAX_DEPTH + 1) == NULL);
+}
+
+// Time of taking a received frame and giving it back, as the receive callback and the dispatcher do
+// The heap path copies into `malloc(len + 1)` like the receive callback did before the pool
+static void test_benchmark(void)
+{
+        frame_pool_t pool;
+        frame_pool_init(&pool, "test", test_frames, TEST_DEPTH);
+        for (size_t i = 0; i < sizeof(test_payload); i++)
+                test_payload[i] = i;
+
+        TEST_BENCHMARK("frame pool, one frame", TEST_BENCHMARK_ROUNDS * TEST_BURST, {
+                size_t len = 1 + _i % ESP_NOW_MAX_DATA_LEN;
+                uint8_t *frame = frame_pool_borrow(&pool);
+                memcpy(frame, test_payload, len);
+                test_sink = frame[len - 1];
+                frame_pool_return(&pool, frame);
+        });
+        TEST_BENCHMARK("malloc, one frame", TEST_BENCHMARK_ROUNDS * TEST_BURST, {
+                size_t len = 1 + _i % ESP_NOW_MAX_DATA_LEN;
+                uint8_t *frame = malloc(len + 1);
+                memcpy(frame, test_payload, len);
+                test_sink = frame[len - 1];
+                free(frame);
+        });
+
+        // A burst of frames queued before the dispatcher gets to them, then handled in order
+        uint8_t *frames[TEST_BURST];
+        TEST_BENCHMARK("frame pool, burst of 16", TEST_BENCHMARK_ROUNDS, {
+                for (size_t i = 0; i < TEST_BURST; i++)
+                {
+                        size_t len = 1 + (_i + i * 37) % ESP_NOW_MAX_DATA_LEN;
+                        frames[i] = frame_pool_borrow(&pool);
+                        memcpy(frames[i], test_payload, len);
+                }
+                for (size_t i = 0; i < TEST_BURST; i++)
+                {
+                        test_sink = frames[i][0];
+                        frame_pool_return(&pool, frames[i]);
+                }
+        });
+        TEST_BENCHMARK("malloc, burst of 16", TEST_BENCHMARK_ROUNDS, {
+                for (size_t i = 0; i < TEST_BURST; i++)
+                {
+                        size_t len = 1 + (_i + i * 37) % ESP_NOW_MAX_DATA_LEN;
+                        frames[i] = malloc(len + 1);
+                        memcpy(frames[i], test_payload, len);
+                }
+                for (size_t i = 0; i < TEST_BURST; i++)
+                {
+                        test_sink = frames[i][0];
+                        free(frames[i]);
+                }
+        });
+
+        frame_pool_stats_t stats;
+        frame_pool_get_stats(&pool, &stats);
+        TEST_ASSERT(stats.exhausted == 0);
+        TEST_ASSERT(stats.in_use == 0);
+}
+
+int main(void)
+{
+        TEST_RUN(test_exhaustion);
+        TEST_RUN(test_bad_return);
+        TEST_RUN(test_benchmark);
+        return TEST_RESULT();
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "idf_host.h"
+
+// Stop the test program at the first failed check, the exit code fails the `ctest` run
+#define TEST_ASSERT(condition)                                                                 \
+        do                                                                                     \
+        {                                                                                      \
+                if (!(condition))                                                              \
+                {                                                                              \
+                        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+                        exit(EXIT_FAILURE);                                                    \
+                }                                                                              \
+        } while (0)
+
+// Run one test case and report it
+#define TEST_RUN(test)                        \
+        do                                    \
+        {                                     \
+                test();                       \
+                printf("PASS %s\n", #test);   \
+        } while (0)
+
+// Exit code of a test program that got past all its cases
+#define TEST_RESULT() (EXIT_SUCCESS)
+
+// Time a benchmark body over `iterations` runs and print the average, in nanoseconds
+#define TEST_BENCHMARK(name, iterations, body)                                                                                 \
+        do                                                                                                                     \
+        {                                                                                                                      \
+                uint32_t _start = esp_cpu_get_cycle_count();                                                                   \
+                for (uint32_t _i = 0; _i < (iterations); _i++)                                                                 \
+                {                                                                                                              \
+                        body;                                                                                                  \
+                }                                                                                                              \
+                uint32_t _elapsed = esp_cpu_get_cycle_count() - _start;                                                        \
+                printf("%-40s %10.1f ns/op\n", name, (double)_elapsed / (iterations));                                         \
+        } while (0)
@@ -0,0 +1,145 @@
+// Input-to-radio latency of the old polling main loop and of the event driven one, simulated on a model of the board
+// The old loop drained every queue with zero timeouts, printed on the console itself and slept one tick
+// The new loop sleeps in `xQueueSelectFromSet`, and log lines and car statistics are written by lower priority tasks
+// Only the scheduling differs between the two runs, both pay the same for building and sending a packet
+
+#include "test_host.h"
+
+#define TEST_EVENTS (20000)           // Input events simulated per run
+#define TEST_EVENT_GAP_MAX_US (40000) // Longest time between two input events, a joystick being moved
+#define TEST_TICK_US (1000)           // FreeRTOS tick, `CONFIG_FREERTOS_HZ` is 1000
+#define TEST_BAUD_RATE (115200)       // Console baud rate, `CONFIG_ESP_CONSOLE_UART_BAUDRATE`
+#define TEST_UART_FIFO (128)          // Bytes the console UART takes without blocking the writer
+#define TEST_EVENT_LINE (60)          // Bytes of the "Joystick event" log line written for every input
+#define TEST_STAT_LINE (150)          // Bytes of the motor status line written for every status of the car
+#define TEST_STAT_MS (20)             // Interval of the motor status sent by the car
+#define TEST_SEND_US (50)             // Building a packet and handing it to ESP-NOW, the same in both loops
+#define TEST_WAKE_US (10)             // Context switch into app_main once a queue of its set has an item
+#define TEST_REFRESH_MS (10)          // Interval of the controller state refresh of the new loop
+
+// Console UART, writers block until all but a FIFO of their bytes are on the wire
+typedef struct
+{
+        int64_t idle_us; // Time the UART has sent every byte written so far
+} test_console_t;
+
+// Latencies of one run, in microseconds
+typedef struct
+{
+        int64_t latency_us[TEST_EVENTS];
+        size_t count;
+} test_run_t;
+
+static int64_t test_events_us[TEST_EVENTS];
+static test_run_t test_old;
+static test_run_t test_new;
+
+// Write `len` bytes at `now_us`, returns the time the writer gets its CPU back
+static int64_t test_console_write(test_console_t *console, int64_t now_us, size_t len)
+{
+        int64_t byte_us = 10 * 1000000LL / TEST_BAUD_RATE;
+        int64_t start_us = console->idle_us > now_us ? console->idle_us : now_us;
+        console->idle_us = start_us + len * byte_us;
+        int64_t return_us = console->idle_us - TEST_UART_FIFO * byte_us;
+        return return_us > now_us ? return_us : now_us;
+}
+
+static int64_t test_stat_us(size_t n)
+{
+        return 7000 + n * TEST_STAT_MS * 1000LL;
+}
+
+// Old main loop: inputs, then received packets, each drained with a zero timeout, then `vTaskDelay(1)`
+static void test_polling(test_run_t *run)
+{
+        test_console_t console = {0};
+        int64_t now_us = 0;
+        size_t next_event = 0;
+        size_t next_stat = 0;
+        run->count = 0;
+        while (next_event < TEST_EVENTS)
+        {
+                while (next_event < TEST_EVENTS && test_events_us[next_event] <= now_us)
+                {
+                        now_us = test_console_write(&console, now_us, TEST_EVENT_LINE);
+                        now_us += TEST_SEND_US;
+                        run->latency_us[run->count++] = now_us - test_events_us[next_event++];
+                }
+                while (test_stat_us(next_stat) <= now_us)
+                {
+                        now_us = test_console_write(&console, now_us, TEST_STAT_LINE);
+                        next_stat++;
+                }
+                // The delay ends on the next tick interrupt
+                now_us = (now_us / TEST_TICK_US + 1) * TEST_TICK_US;
+        }
+}
+
+// New main loop: woken by the input queues, sends at once, the refresh is the only other work of the task
+static void test_event_driven(test_run_t *run)
+{
+        int64_t busy_us = 0;
+        int64_t next_refresh_us = TEST_REFRESH_MS * 1000;
+        run->count = 0;
+        for (size_t n = 0; n < TEST_EVENTS; n++)
+        {
+                while (next_refresh_us <= test_events_us[n])
+                {
+                        int64_t start_us = busy_us > next_refresh_us ? busy_us : next_refresh_us;
+                        busy_us = start_us + TEST_SEND_US;
+                        next_refresh_us = busy_us + TEST_REFRESH_MS * 1000;
+                }
+                int64_t wake_us = test_events_us[n] + TEST_WAKE_US;
+                int64_t start_us = busy_us > wake_us ? busy_us : wake_us;
+                busy_us = start_us + TEST_SEND_US;
+                next_refresh_us = busy_us + TEST_REFRESH_MS * 1000;
+                run->latency_us[run->count++] = busy_us - test_events_us[n];
+        }
+}
+
+static int test_compare(const void *a, const void *b)
+{
+        int64_t x = *(const int64_t *)a;
+        int64_t y = *(const int64_t *)b;
+        return (x > y) - (x < y);
+}
+
+// Sort the latencies of `run` and print their distribution, returns the 99th percentile
+static int64_t test_report(const char *name, test_run_t *run)
+{
+        qsort(run->latency_us, run->count, sizeof(int64_t), test_compare);
+        int64_t total_us = 0;
+        for (size_t i = 0; i < run->count; i++)
+                total_us += run->latency_us[i];
+        int64_t p99_us = run->latency_us[run->count * 99 / 100];
+        printf("%-14s mean %6lld us, median %6lld us, p99 %6lld us, max %6lld us\n",
+               name, total_us / (int64_t)run->count, run->latency_us[run->count / 2], p99_us, run->latency_us[run->count - 1]);
+        return p99_us;
+}
+
+static void test_latency(void)
+{
+        int64_t now_us = 0;
+        for (size_t n = 0; n < TEST_EVENTS; n++)
+        {
+                now_us += 1 + esp_random() % TEST_EVENT_GAP_MAX_US;
+                test_events_us[n] = now_us;
+        }
+
+        test_polling(&test_old);
+        test_event_driven(&test_new);
+        TEST_ASSERT(test_old.count == TEST_EVENTS && test_new.count == TEST_EVENTS);
+        int64_t old_p99_us = test_report("polling loop", &test_old);
+        int64_t new_p99_us = test_report("event driven", &test_new);
+
+        // An input never waits for more than a tick of the new loop, the old one waited for the console
+        TEST_ASSERT(new_p99_us < old_p99_us);
+        TEST_ASSERT(test_new.latency_us[test_new.count - 1] <= TEST_WAKE_US + 2 * TEST_SEND_US);
+}
+
+int main(void)
+{
+        srand(1);
+        TEST_RUN(test_latency);
+        return TEST_RESULT();
+}
@@ -0,0 +1,135 @@
+// Byte layout of the ESP-NOW header and the connection request, as the car reads them
+// The firmware source is included to build frames as the send path does, they are compared byte by byte with layouts written out by hand
+
+#include "../main/espnow.c"
+
+#include "test_host.h"
+
+#define TEST_SEQ_NUM (0x1234)       // Sequence number with two different bytes, shows their order
+#define TEST_TIME_US (0x0A0B0C0DLL) // Clock when the frames are built, the low 32 bits are the sender timestamp
+#define TEST_CONTROLLER_PAYLOAD_LEN (sizeof(remote_controller_state_pkt_t))
+
+static esp_connection_handle_t test_handle;
+
+// Build the frame of `type` with `payload` as `espnow_send_data` would, the caller returns it to the pool
+static espnow_send_param_t *test_build(espnow_send_param_t *send_param, espnow_packet_sending_method_t method, uint8_t version,
+                                       espnow_packet_type_t type, void *payload, size_t len)
+{
+        espnow_get_default_send_param(send_param);
+        send_param->broadcast = method;
+        send_param->type = type;
+        send_param->version = version;
+        send_param->seq_num = TEST_SEQ_NUM;
+        TEST_ASSERT(espnow_payload_create(send_param, payload, len) == send_param);
+        return send_param;
+}
+
+// The CRC is over the whole frame with its own two bytes zeroed, stored little endian
+static void test_check_crc(const uint8_t *frame, size_t len)
+{
+        uint8_t zeroed[ESP_NOW_MAX_DATA_LEN];
+        memcpy(zeroed, frame, len);
+        zeroed[4] = 0;
+        zeroed[5] = 0;
+        uint16_t crc = esp_crc16_le(UINT16_MAX, zeroed, len);
+        TEST_ASSERT(frame[4] == (crc & 0xFF));
+        TEST_ASSERT(frame[5] == (crc >> 8));
+}
+
+// A connection request is understood by any peer, oldest version and no timestamp
+static void test_connect(void)
+{
+        espnow_connect_pkt_t connect = {.version_min = ESPNOW_PROTOCOL_VERSION_MIN, .version_max = ESPNOW_PROTOCOL_VERSION};
+        espnow_send_param_t send_param;
+        test_build(&send_param, ESPNOW_DATA_BROADCAST, ESPNOW_PROTOCOL_VERSION_MIN, ESPNOW_PACKET_TYPE_CONNECT, &connect, sizeof(connect));
+
+        const uint8_t expected[] = {
+            ESPNOW_PROTOCOL_VERSION_MIN, // version
+            ESPNOW_PACKET_TYPE_CONNECT,  // type_flags, broadcast
+            0x34, 0x12,                  // seq_num
+            0x00, 0x00,                  // crc, checked apart
+            2,                           // len
+            ESPNOW_PROTOCOL_VERSION_MIN, // version_min
+            ESPNOW_PROTOCOL_VERSION,     // version_max
+        };
+        TEST_ASSERT(sizeof(espnow_connect_pkt_t) == 2);
+        TEST_ASSERT(send_param.len == sizeof(expected));
+        TEST_ASSERT(memcmp(send_param.buffer, expected, 4) == 0);
+        TEST_ASSERT(memcmp(send_param.buffer + 6, expected + 6, sizeof(expected) - 6) == 0);
+        test_check_crc(send_param.buffer, send_param.len);
+        espnow_payload_cleanup(&send_param);
+}
+
+// A unicast control frame of the timestamp version carries the flags and the sender clock ahead of the payload
+static void test_unicast_timestamp(void)
+{
+        uint8_t payload[TEST_CONTROLLER_PAYLOAD_LEN];
+        for (size_t i = 0; i < sizeof(payload); i++)
+                payload[i] = 0xA0 + i;
+        espnow_send_param_t send_param;
+        test_build(&send_param, ESPNOW_DATA_UNICAST, ESPNOW_PROTOCOL_VERSION_TIMESTAMP, ESPNOW_PACKET_TYPE_CONTROLLER_STATE, payload, sizeof(payload));
+
+        const uint8_t expected[] = {
+            ESPNOW_PROTOCOL_VERSION_TIMESTAMP,                  // version
+            ESPNOW_PACKET_TYPE_CONTROLLER_STATE | 0x20 | 0x40, // type_flags, unicast and timestamp
+            0x34, 0x12,                                        // seq_num
+            0x00, 0x00,                                        // crc, checked apart
+            sizeof(uint32_t) + TEST_CONTROLLER_PAYLOAD_LEN,    // len, timestamp included
+            0x0D, 0x0C, 0x0B, 0x0A,                            // sender timestamp
+        };
+        TEST_ASSERT(send_param.len == sizeof(expected) + sizeof(payload));
+        TEST_ASSERT(memcmp(send_param.buffer, expected, 4) == 0);
+        TEST_ASSERT(memcmp(send_param.buffer + 6, expected + 6, sizeof(expected) - 6) == 0);
+        TEST_ASSERT(memcmp(send_param.buffer + sizeof(expected), payload, sizeof(payload)) == 0);
+        test_check_crc(send_param.buffer, send_param.len);
+        espnow_payload_cleanup(&send_param);
+}
+
+// A frame laid out by hand is accepted by the receive path with the fields it was given, one changed byte is refused
+static void test_parse(void)
+{
+        uint8_t frame[] = {
+            ESPNOW_PROTOCOL_VERSION_MIN,                             // version
+            ESPNOW_PACKET_TYPE_CONNECT | ESPNOW_PACKET_FLAG_UNICAST, // type_flags
+            0x34, 0x12,                                              // seq_num
+            0x00, 0x00,                                              // crc
+            2,                                                       // len
+            ESPNOW_PROTOCOL_VERSION_MIN,                             // version_min
+            ESPNOW_PROTOCOL_VERSION,                                 // version_max
+        };
+        uint16_t crc = esp_crc16_le(UINT16_MAX, frame, sizeof(frame));
+        frame[4] = crc & 0xFF;
+        frame[5] = crc >> 8;
+
+        uint8_t received[sizeof(frame)];
+        memcpy(received, frame, sizeof(frame));
+        espnow_event_recv_cb_t recv_cb = {.data_len = sizeof(received), .data = received};
+        espnow_packet_t *packet = espnow_data_parse(NULL, &recv_cb);
+        TEST_ASSERT(packet != NULL);
+        TEST_ASSERT(packet->version == ESPNOW_PROTOCOL_VERSION_MIN);
+        TEST_ASSERT(ESPNOW_PACKET_TYPE(packet) == ESPNOW_PACKET_TYPE_CONNECT);
+        TEST_ASSERT(ESPNOW_PACKET_METHOD(packet) == ESPNOW_DATA_UNICAST);
+        TEST_ASSERT(packet->seq_num == TEST_SEQ_NUM);
+        TEST_ASSERT(packet->crc == crc);
+        TEST_ASSERT(packet->len == sizeof(espnow_connect_pkt_t));
+        espnow_connect_pkt_t connect;
+        memcpy(&connect, packet->payload, sizeof(connect));
+        TEST_ASSERT(connect.version_min == ESPNOW_PROTOCOL_VERSION_MIN);
+        TEST_ASSERT(connect.version_max == ESPNOW_PROTOCOL_VERSION);
+
+        memcpy(received, frame, sizeof(frame));
+        received[2] ^= 0x01;
+        TEST_ASSERT(espnow_data_parse(NULL, &recv_cb) == NULL);
+}
+
+int main(void)
+{
+        espnow_wifi_config_t config;
+        esp_connection_handle_init(&test_handle);
+        TEST_ASSERT(espnow_init(espnow_wifi_default_config(&config), &test_handle) != NULL);
+        idf_host_set_time(TEST_TIME_US);
+        TEST_RUN(test_connect);
+        TEST_RUN(test_unicast_timestamp);
+        TEST_RUN(test_parse);
+        return TEST_RESULT();
+}
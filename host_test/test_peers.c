@@ -0,0 +1,120 @@
+// Peer table MAC index, kept consistent through evictions, and its lookup time next to the linear scan it replaced
+// Built with a table of `ESP_CONNECTION_MAX_PEERS` set by the CMake project, large enough for a busy venue
+
+#include "espnow.h"
+
+#include "test_host.h"
+
+#define TEST_QUERIES (1024)          // MAC addresses looked up in turn, known or unknown
+#define TEST_BENCHMARK_ROUNDS (2000) // Passes over the queries per benchmark
+
+static esp_connection_handle_t test_handle;
+static esp_peer_handle_t *volatile test_sink;
+
+// Address of neighbour `n`, all from the same vendor like a room full of ESP devices
+static void test_mac(uint8_t *mac, uint32_t n)
+{
+        mac[0] = 0x24;
+        mac[1] = 0x0A;
+        mac[2] = 0xC4;
+        mac[3] = n >> 16;
+        mac[4] = n >> 8;
+        mac[5] = n;
+}
+
+// Lookup as it was before the index, every entry compared byte by byte
+static esp_peer_handle_t *test_linear_lookup(esp_connection_handle_t *handle, const uint8_t *mac)
+{
+        for (size_t i = 0; i < handle->size; i++)
+        {
+                uint8_t j = 0;
+                while (j < ESP_NOW_ETH_ALEN && handle->entries[i].mac[j] == mac[j])
+                        j++;
+                if (j == ESP_NOW_ETH_ALEN)
+                        return &handle->entries[i];
+        }
+        return NULL;
+}
+
+// A full table evicts the least recently seen peer, the index still finds every other peer at the same place
+static void test_eviction(void)
+{
+        static esp_peer_handle_t *peers[ESP_CONNECTION_MAX_PEERS];
+        uint8_t mac[ESP_NOW_ETH_ALEN];
+        esp_connection_handle_init(&test_handle);
+        for (uint32_t n = 0; n < ESP_CONNECTION_MAX_PEERS; n++)
+        {
+                test_mac(mac, n);
+                peers[n] = esp_connection_mac_add_to_entry(&test_handle, mac);
+                TEST_ASSERT(peers[n] != NULL);
+                idf_host_advance_time(1000);
+        }
+        TEST_ASSERT(test_handle.size == ESP_CONNECTION_MAX_PEERS);
+
+        // Seeing the first peer again leaves the second one the stalest
+        test_mac(mac, 0);
+        TEST_ASSERT(esp_connection_mac_add_to_entry(&test_handle, mac) == peers[0]);
+        test_mac(mac, ESP_CONNECTION_MAX_PEERS);
+        esp_peer_handle_t *added = esp_connection_mac_add_to_entry(&test_handle, mac);
+        TEST_ASSERT(added == peers[1]);
+        TEST_ASSERT(test_handle.evicted == 1);
+        TEST_ASSERT(esp_connection_mac_lookup(&test_handle, mac) == added);
+
+        for (uint32_t n = 0; n < ESP_CONNECTION_MAX_PEERS; n++)
+        {
+                test_mac(mac, n);
+                TEST_ASSERT(esp_connection_mac_lookup(&test_handle, mac) == (n == 1 ? NULL : peers[n]));
+        }
+        test_mac(mac, ESP_CONNECTION_MAX_PEERS + 1);
+        TEST_ASSERT(esp_connection_mac_lookup(&test_handle, mac) == NULL);
+}
+
+// Time of finding a peer among `count`, for frames of known peers and of strangers
+static void test_benchmark(uint32_t count)
+{
+        static uint8_t known[TEST_QUERIES][ESP_NOW_ETH_ALEN];
+        static uint8_t unknown[TEST_QUERIES][ESP_NOW_ETH_ALEN];
+        esp_connection_handle_init(&test_handle);
+        for (uint32_t n = 0; n < count; n++)
+        {
+                uint8_t mac[ESP_NOW_ETH_ALEN];
+                test_mac(mac, n);
+                TEST_ASSERT(esp_connection_mac_add_to_entry(&test_handle, mac) != NULL);
+        }
+        for (size_t i = 0; i < TEST_QUERIES; i++)
+        {
+                test_mac(known[i], esp_random() % count);
+                test_mac(unknown[i], count + esp_random() % 0x10000);
+        }
+
+        printf("%lu peers\n", count);
+        TEST_BENCHMARK("  index, known", TEST_QUERIES * TEST_BENCHMARK_ROUNDS, {
+                test_sink = esp_connection_mac_lookup(&test_handle, known[_i % TEST_QUERIES]);
+        });
+        TEST_BENCHMARK("  linear scan, known", TEST_QUERIES * TEST_BENCHMARK_ROUNDS / (1 + count / 10), {
+                test_sink = test_linear_lookup(&test_handle, known[_i % TEST_QUERIES]);
+        });
+        TEST_BENCHMARK("  index, unknown", TEST_QUERIES * TEST_BENCHMARK_ROUNDS, {
+                test_sink = esp_connection_mac_lookup(&test_handle, unknown[_i % TEST_QUERIES]);
+        });
+        TEST_BENCHMARK("  linear scan, unknown", TEST_QUERIES * TEST_BENCHMARK_ROUNDS / (1 + count / 10), {
+                test_sink = test_linear_lookup(&test_handle, unknown[_i % TEST_QUERIES]);
+        });
+
+        for (size_t i = 0; i < TEST_QUERIES; i++)
+        {
+                TEST_ASSERT(esp_connection_mac_lookup(&test_handle, known[i]) == test_linear_lookup(&test_handle, known[i]));
+                TEST_ASSERT(esp_connection_mac_lookup(&test_handle, unknown[i]) == NULL);
+        }
+}
+
+int main(void)
+{
+        srand(1);
+        TEST_RUN(test_eviction);
+        test_benchmark(10);
+        test_benchmark(100);
+        test_benchmark(1000);
+        printf("PASS test_benchmark\n");
+        return TEST_RESULT();
+}
@@ -0,0 +1,367 @@
+// Two reliable channel ends talking through a lossy, reordering link, on the host clock
+// The firmware source is included so the state of both ends can be swapped in and out of its statics
+
+#include "../main/espnow_reliable.c"
+
+#include "test_host.h"
+
+#define TEST_LINK_MAX_FRAMES (256) // Frames in flight on the link, both directions
+#define TEST_MESSAGES (320)        // Messages sent each way in the lossy test
+#define TEST_STEP_US (5000)        // Simulated time between two runs of the retransmit timers
+
+// One end of the link, the firmware statics hold the state of the end that is running
+typedef struct
+{
+        uint8_t mac[ESP_NOW_ETH_ALEN];                                // MAC address of this end
+        esp_peer_handle_t peer;                                       // The other end, as this end knows it
+        espnow_reliable_channel_t channels[ESPNOW_RELIABLE_CHANNELS]; // Saved `espnow_reliable_channels`
+        espnow_reliable_stats_t stats;                                // Saved `espnow_reliable_stats`
+        uint16_t delivered[TEST_MESSAGES];                            // Messages delivered, in order of delivery
+        size_t delivered_count;                                       // Number of entries in `delivered`
+        uint16_t failed[ESPNOW_RELIABLE_WINDOW_SIZE * 4];             // Messages given up on, in order of the callback
+        size_t failed_count;                                          // Number of entries in `failed`
+} test_node_t;
+
+// Frame on its way to the other end
+typedef struct
+{
+        int from;                              // Index of the sending node
+        espnow_packet_type_t type;             // Data packet type
+        uint8_t payload[ESP_NOW_MAX_DATA_LEN]; // Payload, as given to `espnow_send_data`
+        size_t len;                            // Length of `payload`, in bytes
+        int64_t arrive_us;                     // Delivered at this time
+} test_frame_t;
+
+// Link between the two nodes
+typedef struct
+{
+        test_frame_t frames[TEST_LINK_MAX_FRAMES]; // Frames in flight, unordered
+        size_t count;                              // Number of entries in `frames`
+        int loss_percent[2];                       // Share of frames lost, by sending node
+        uint32_t drop_next[2];                     // Frames lost whatever the share, by sending node
+        int64_t delay_min_us;                      // Shortest time in flight
+        int64_t delay_max_us;                      // Longest time in flight, a spread reorders the frames
+        uint32_t sent;                             // Frames given to the link
+        uint32_t lost;                             // Frames dropped by the link
+} test_link_t;
+
+static test_node_t test_nodes[2];
+static test_link_t test_link;
+static int test_active = -1; // Node whose state is loaded in the firmware statics
+
+static void test_node_enter(int node)
+{
+        memcpy(espnow_reliable_channels, test_nodes[node].channels, sizeof(espnow_reliable_channels));
+        espnow_reliable_stats = test_nodes[node].stats;
+        test_active = node;
+}
+
+static void test_node_leave(void)
+{
+        memcpy(test_nodes[test_active].channels, espnow_reliable_channels, sizeof(espnow_reliable_channels));
+        test_nodes[test_active].stats = espnow_reliable_stats;
+        test_active = -1;
+}
+
+/* Firmware functions of espnow.c used by the reliable channel, the frames go on the link */
+
+espnow_send_param_t *espnow_get_default_send_param(espnow_send_param_t *send_param)
+{
+        memset(send_param, 0, sizeof(espnow_send_param_t));
+        send_param->broadcast = ESPNOW_DATA_BROADCAST;
+        memset(send_param->dest_mac, 0xFF, ESP_NOW_ETH_ALEN);
+        return send_param;
+}
+
+espnow_send_param_t *espnow_get_send_param_unicast(espnow_send_param_t *send_param, const uint8_t *mac)
+{
+        send_param->broadcast = ESPNOW_DATA_UNICAST;
+        memcpy(send_param->dest_mac, mac, ESP_NOW_ETH_ALEN);
+        return send_param;
+}
+
+espnow_send_param_t *espnow_get_send_param(espnow_send_param_t *send_param, esp_peer_handle_t *peer)
+{
+        espnow_get_default_send_param(send_param);
+        return espnow_get_send_param_unicast(send_param, peer->mac);
+}
+
+esp_err_t espnow_send_data(espnow_send_param_t *send_param, espnow_packet_type_t type, void *data, size_t len)
+{
+        TEST_ASSERT(test_active >= 0);
+        TEST_ASSERT(send_param->broadcast == ESPNOW_DATA_UNICAST);
+        TEST_ASSERT(memcmp(send_param->dest_mac, test_nodes[!test_active].mac, ESP_NOW_ETH_ALEN) == 0);
+        TEST_ASSERT(len <= ESP_NOW_MAX_DATA_LEN - sizeof(espnow_packet_t));
+
+        test_link.sent++;
+        if (test_link.drop_next[test_active] || (int)(esp_random() % 100) < test_link.loss_percent[test_active])
+        {
+                if (test_link.drop_next[test_active])
+                        test_link.drop_next[test_active]--;
+                test_link.lost++;
+                return ESP_OK;
+        }
+        TEST_ASSERT(test_link.count < TEST_LINK_MAX_FRAMES);
+        test_frame_t *frame = &test_link.frames[test_link.count++];
+        frame->from = test_active;
+        frame->type = type;
+        memcpy(frame->payload, data, len);
+        frame->len = len;
+        frame->arrive_us = esp_timer_get_time() + test_link.delay_min_us;
+        if (test_link.delay_max_us > test_link.delay_min_us)
+                frame->arrive_us += esp_random() % (test_link.delay_max_us - test_link.delay_min_us);
+        return ESP_OK;
+}
+
+static void test_deliver_cb(esp_peer_handle_t *peer, espnow_packet_type_t type, const uint8_t *payload, size_t len)
+{
+        test_node_t *node = &test_nodes[test_active];
+        TEST_ASSERT(memcmp(peer->mac, test_nodes[!test_active].mac, ESP_NOW_ETH_ALEN) == 0);
+        TEST_ASSERT(type == ESPNOW_PACKET_TYPE_CONFIG && len == sizeof(uint16_t));
+        TEST_ASSERT(node->delivered_count < TEST_MESSAGES);
+        memcpy(&node->delivered[node->delivered_count++], payload, sizeof(uint16_t));
+}
+
+static void test_failed_cb(const uint8_t *mac, espnow_packet_type_t type, const uint8_t *payload, size_t len)
+{
+        test_node_t *node = &test_nodes[test_active];
+        TEST_ASSERT(memcmp(mac, test_nodes[!test_active].mac, ESP_NOW_ETH_ALEN) == 0);
+        TEST_ASSERT(type == ESPNOW_PACKET_TYPE_CONFIG && len == sizeof(uint16_t));
+        TEST_ASSERT(node->failed_count < sizeof(node->failed) / sizeof(node->failed[0]));
+        memcpy(&node->failed[node->failed_count++], payload, sizeof(uint16_t));
+}
+
+static void test_setup(int loss_percent, int64_t delay_min_us, int64_t delay_max_us)
+{
+        TEST_ASSERT(espnow_reliable_init(test_deliver_cb) == ESP_OK);
+        espnow_reliable_set_failed_cb(test_failed_cb);
+        memset(test_nodes, 0, sizeof(test_nodes));
+        memset(&test_link, 0, sizeof(test_link));
+        for (int i = 0; i < 2; i++)
+        {
+                uint8_t mac[ESP_NOW_ETH_ALEN] = {0x02, 0, 0, 0, 0, i + 1};
+                memcpy(test_nodes[i].mac, mac, ESP_NOW_ETH_ALEN);
+                test_link.loss_percent[i] = loss_percent;
+        }
+        for (int i = 0; i < 2; i++)
+        {
+                memcpy(test_nodes[i].peer.mac, test_nodes[!i].mac, ESP_NOW_ETH_ALEN);
+                test_nodes[i].peer.status = ESP_PEER_STATUS_CONNECTED;
+        }
+        test_link.delay_min_us = delay_min_us;
+        test_link.delay_max_us = delay_max_us;
+}
+
+// Hand every frame due by now to its receiver, earliest first
+static void test_link_deliver(void)
+{
+        int64_t now = esp_timer_get_time();
+        for (;;)
+        {
+                size_t next = test_link.count;
+                for (size_t i = 0; i < test_link.count; i++)
+                        if (test_link.frames[i].arrive_us <= now && (next == test_link.count || test_link.frames[i].arrive_us < test_link.frames[next].arrive_us))
+                                next = i;
+                if (next == test_link.count)
+                        return;
+
+                test_frame_t frame = test_link.frames[next];
+                test_link.frames[next] = test_link.frames[--test_link.count];
+
+                uint8_t buffer[ESP_NOW_MAX_DATA_LEN];
+                espnow_packet_t *packet = (espnow_packet_t *)buffer;
+                memset(packet, 0, sizeof(espnow_packet_t));
+                packet->version = ESPNOW_PROTOCOL_VERSION;
+                packet->type_flags = frame.type | ESPNOW_PACKET_FLAG_UNICAST;
+                packet->len = frame.len;
+                memcpy(packet->payload, frame.payload, frame.len);
+
+                int to = !frame.from;
+                test_node_enter(to);
+                TEST_ASSERT(espnow_reliable_process_received(&test_nodes[to].peer, packet));
+                test_node_leave();
+        }
+}
+
+// Run both ends for `duration_us`, as the dispatcher task does
+static void test_run(int64_t duration_us)
+{
+        for (int64_t elapsed_us = 0; elapsed_us < duration_us; elapsed_us += TEST_STEP_US)
+        {
+                idf_host_advance_time(TEST_STEP_US);
+                test_link_deliver();
+                for (int i = 0; i < 2; i++)
+                {
+                        test_node_enter(i);
+                        espnow_reliable_update();
+                        test_node_leave();
+                }
+        }
+}
+
+static esp_err_t test_send(int from, uint16_t message)
+{
+        espnow_send_param_t send_param;
+        test_node_enter(from);
+        espnow_get_send_param(&send_param, &test_nodes[from].peer);
+        esp_err_t ret = espnow_send_reliable(&send_param, ESPNOW_PACKET_TYPE_CONFIG, &message, sizeof(message));
+        test_node_leave();
+        return ret;
+}
+
+// Send `count` messages numbered from `first`, waiting for room in the window
+static void test_send_all(int from, uint16_t first, uint16_t count)
+{
+        for (uint16_t message = first; message != first + count;)
+        {
+                esp_err_t ret = test_send(from, message);
+                TEST_ASSERT(ret == ESP_OK || ret == ESP_ERR_NO_MEM);
+                if (ret == ESP_OK)
+                        message++;
+                else
+                        test_run(TEST_STEP_US);
+        }
+}
+
+static bool test_is_pending(int node)
+{
+        test_node_enter(node);
+        bool pending = espnow_reliable_is_pending(test_nodes[node].peer.mac);
+        test_node_leave();
+        return pending;
+}
+
+// Both directions at once, every message arrives once and in order despite loss and reordering
+static void test_lossy_reordering(void)
+{
+        test_setup(20, 2000, 40000);
+        for (uint16_t message = 0; message < TEST_MESSAGES; message += ESPNOW_RELIABLE_WINDOW_SIZE)
+        {
+                test_send_all(0, message, ESPNOW_RELIABLE_WINDOW_SIZE);
+                test_send_all(1, message, ESPNOW_RELIABLE_WINDOW_SIZE);
+        }
+        for (int64_t waited_us = 0; test_is_pending(0) || test_is_pending(1); waited_us += TEST_STEP_US)
+        {
+                TEST_ASSERT(waited_us < 60000000);
+                test_run(TEST_STEP_US);
+        }
+
+        for (int i = 0; i < 2; i++)
+        {
+                test_node_t *node = &test_nodes[i];
+                TEST_ASSERT(node->failed_count == 0);
+                TEST_ASSERT(node->delivered_count == TEST_MESSAGES);
+                for (uint16_t message = 0; message < TEST_MESSAGES; message++)
+                        TEST_ASSERT(node->delivered[message] == message);
+                TEST_ASSERT(node->stats.delivered == TEST_MESSAGES);
+                TEST_ASSERT(node->stats.acked == TEST_MESSAGES);
+                TEST_ASSERT(node->stats.retransmits + node->stats.fast_retransmits > 0);
+                TEST_ASSERT(node->stats.resets == 0);
+        }
+        TEST_ASSERT(test_link.lost > 0);
+}
+
+// One expiry of the whole window doubles the retransmit timeout once, not once per message
+static void test_backoff_once_per_pass(void)
+{
+        test_setup(100, 1000, 1000);
+        test_send_all(0, 0, 4);
+        test_run(ESPNOW_RELIABLE_RTO_INIT_US + TEST_STEP_US);
+        TEST_ASSERT(test_nodes[0].stats.retransmits == 4);
+        TEST_ASSERT(test_nodes[0].channels[0].rto_us == 2 * ESPNOW_RELIABLE_RTO_INIT_US);
+}
+
+// The sender gives up during an outage, both ends restart and later messages get through
+static void test_give_up(void)
+{
+        test_setup(0, 1000, 5000);
+        test_send_all(0, 0, 1);
+        test_run(100000);
+        TEST_ASSERT(test_nodes[1].delivered_count == 1);
+        TEST_ASSERT(!test_is_pending(0));
+
+        // The receiver holds message 2 past the lost message 1 when the link goes down, its `NACK` is lost too
+        test_link.drop_next[0] = 1;
+        test_send_all(0, 1, 1);
+        test_link.loss_percent[1] = 100;
+        test_send_all(0, 2, 1);
+        test_run(2 * TEST_STEP_US);
+        TEST_ASSERT(test_nodes[1].delivered_count == 1);
+        TEST_ASSERT(test_nodes[1].channels[0].rx[2].valid);
+        test_link.loss_percent[0] = 100;
+        test_link.loss_percent[1] = 100;
+        test_send_all(0, 3, 2);
+        for (int64_t waited_us = 0; test_is_pending(0); waited_us += TEST_STEP_US)
+        {
+                TEST_ASSERT(waited_us < 60000000);
+                test_run(TEST_STEP_US);
+        }
+        TEST_ASSERT(test_nodes[0].failed_count == 4);
+        for (size_t i = 0; i < test_nodes[0].failed_count; i++)
+                TEST_ASSERT(test_nodes[0].failed[i] == i + 1);
+        TEST_ASSERT(test_nodes[0].stats.failed == 4);
+        TEST_ASSERT(test_nodes[0].stats.resets == 1);
+        TEST_ASSERT(test_nodes[1].delivered_count == 1);
+
+        // Back on a clean link the new epoch restarts the receiver, the message held from before is dropped
+        test_link.loss_percent[0] = 0;
+        test_link.loss_percent[1] = 0;
+        test_send_all(0, 5, 3);
+        test_run(200000);
+        TEST_ASSERT(!test_is_pending(0));
+        TEST_ASSERT(test_nodes[1].stats.resets == 1);
+        TEST_ASSERT(test_nodes[1].delivered_count == 4);
+        TEST_ASSERT(test_nodes[1].delivered[0] == 0);
+        for (size_t i = 1; i < test_nodes[1].delivered_count; i++)
+                TEST_ASSERT(test_nodes[1].delivered[i] == i + 4);
+}
+
+// Only the acknowledgments are lost, the receiver has the message the sender gives up on
+static void test_give_up_ack_lost(void)
+{
+        test_setup(0, 1000, 5000);
+        test_link.loss_percent[1] = 100;
+        test_send_all(0, 0, 2);
+        for (int64_t waited_us = 0; test_is_pending(0); waited_us += TEST_STEP_US)
+        {
+                TEST_ASSERT(waited_us < 60000000);
+                test_run(TEST_STEP_US);
+        }
+        TEST_ASSERT(test_nodes[0].failed_count == 2);
+        TEST_ASSERT(test_nodes[1].delivered_count == 2);
+        TEST_ASSERT(test_nodes[1].stats.duplicates > 0);
+
+        // The receiver window stands at 2 and the sender restarts at 0, the epoch keeps the new messages from being taken as duplicates
+        test_link.loss_percent[1] = 0;
+        test_send_all(0, 2, 3);
+        test_run(200000);
+        TEST_ASSERT(!test_is_pending(0));
+        TEST_ASSERT(test_nodes[1].delivered_count == 5);
+        for (size_t i = 0; i < test_nodes[1].delivered_count; i++)
+                TEST_ASSERT(test_nodes[1].delivered[i] == i);
+}
+
+// Packet types past the end of the type table are refused before any lookup
+static void test_invalid_type(void)
+{
+        test_setup(0, 1000, 1000);
+        espnow_send_param_t send_param;
+        uint16_t message = 0;
+        test_node_enter(0);
+        espnow_get_send_param(&send_param, &test_nodes[0].peer);
+        TEST_ASSERT(espnow_send_reliable(&send_param, ESPNOW_PACKET_TYPE_MAX, &message, sizeof(message)) == ESP_ERR_INVALID_ARG);
+        TEST_ASSERT(espnow_send_reliable(&send_param, (espnow_packet_type_t)0xFF, &message, sizeof(message)) == ESP_ERR_INVALID_ARG);
+        test_node_leave();
+        TEST_ASSERT(test_link.sent == 0);
+}
+
+int main(void)
+{
+        srand(1);
+        TEST_RUN(test_lossy_reordering);
+        TEST_RUN(test_backoff_once_per_pass);
+        TEST_RUN(test_give_up);
+        TEST_RUN(test_give_up_ack_lost);
+        TEST_RUN(test_invalid_type);
+        return TEST_RESULT();
+}
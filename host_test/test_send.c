@@ -0,0 +1,94 @@
+// Cost of building a transmit packet in a pooled frame, next to the heap buffer it replaced in the send path
+// The firmware source is included to reach the packet builder, the frames never reach the radio
+
+#include "../main/espnow.c"
+
+#include "test_host.h"
+
+#define TEST_BENCHMARK_ROUNDS (200000) // Packets built per benchmark
+
+static esp_connection_handle_t test_handle;
+static uint8_t test_payload[ESP_NOW_MAX_DATA_LEN];
+static volatile uint16_t test_sink;
+
+// Packet builder as it was before the pool, a heap buffer per send freed after `esp_now_send`
+static uint8_t *test_malloc_create(const espnow_send_param_t *send_param, const void *data, size_t len, size_t *frame_len)
+{
+        *frame_len = sizeof(espnow_packet_t) + len;
+        uint8_t *buffer = malloc(*frame_len);
+        if (buffer == NULL)
+                return NULL;
+
+        espnow_packet_t *packet = (espnow_packet_t *)buffer;
+        packet->version = send_param->version;
+        packet->type_flags = send_param->type & ESPNOW_PACKET_TYPE_MASK;
+        packet->seq_num = send_param->seq_num;
+        packet->len = len;
+        memcpy(packet->payload, data, len);
+        packet->crc = 0;
+        packet->crc = esp_crc16_le(UINT16_MAX, buffer, *frame_len);
+        return buffer;
+}
+
+// Both builders give the same frame, the benchmark compares equal work
+static void test_same_frame(void)
+{
+        espnow_send_param_t send_param;
+        espnow_get_default_send_param(&send_param);
+        send_param.broadcast = ESPNOW_DATA_BROADCAST;
+        send_param.type = ESPNOW_PACKET_TYPE_TEXT;
+        send_param.version = ESPNOW_PROTOCOL_VERSION_MIN;
+        send_param.seq_num = 42;
+        for (size_t i = 0; i < sizeof(test_payload); i++)
+                test_payload[i] = i;
+
+        size_t frame_len;
+        uint8_t *heap_frame = test_malloc_create(&send_param, test_payload, 100, &frame_len);
+        TEST_ASSERT(espnow_payload_create(&send_param, test_payload, 100) == &send_param);
+        TEST_ASSERT(send_param.len == frame_len);
+        TEST_ASSERT(memcmp(send_param.buffer, heap_frame, frame_len) == 0);
+        espnow_payload_cleanup(&send_param);
+        free(heap_frame);
+}
+
+// Time of building and releasing one packet of `len` payload bytes, CRC included
+static void test_benchmark(size_t len)
+{
+        espnow_send_param_t send_param;
+        espnow_get_default_send_param(&send_param);
+        send_param.broadcast = ESPNOW_DATA_UNICAST;
+        send_param.type = ESPNOW_PACKET_TYPE_TEXT;
+        send_param.version = ESPNOW_PROTOCOL_VERSION;
+
+        printf("%zu payload bytes\n", len);
+        TEST_BENCHMARK("  frame pool + copy + CRC", TEST_BENCHMARK_ROUNDS, {
+                send_param.seq_num = _i;
+                espnow_payload_create(&send_param, test_payload, len);
+                test_sink = ((espnow_packet_t *)send_param.buffer)->crc;
+                espnow_payload_cleanup(&send_param);
+        });
+        TEST_BENCHMARK("  malloc + copy + CRC", TEST_BENCHMARK_ROUNDS, {
+                size_t frame_len;
+                send_param.seq_num = _i;
+                uint8_t *buffer = test_malloc_create(&send_param, test_payload, len, &frame_len);
+                test_sink = ((espnow_packet_t *)buffer)->crc;
+                free(buffer);
+        });
+
+        frame_pool_stats_t stats;
+        frame_pool_get_stats(&espnow_tx_pool, &stats);
+        TEST_ASSERT(stats.exhausted == 0);
+        TEST_ASSERT(stats.in_use == 0);
+}
+
+int main(void)
+{
+        espnow_wifi_config_t config;
+        esp_connection_handle_init(&test_handle);
+        TEST_ASSERT(espnow_init(espnow_wifi_default_config(&config), &test_handle) != NULL);
+        TEST_RUN(test_same_frame);
+        test_benchmark(sizeof(remote_controller_state_pkt_t));
+        test_benchmark(ESP_NOW_MAX_DATA_LEN - sizeof(espnow_packet_t));
+        printf("PASS test_benchmark\n");
+        return TEST_RESULT();
+}
@@ -0,0 +1,96 @@
+// Aggregation windows of the motor status of several cars streaming at once, each car is kept apart
+// The firmware source is included to feed samples to the aggregation without its drain task
+
+#include "../main/telemetry.c"
+
+#include "test_host.h"
+
+#define TEST_CARS (3)        // Cars streaming in the interleaved test
+#define TEST_STAT_MS (20)    // Interval of the motor status sent by every car
+#define TEST_WINDOWS (2)     // Windows completed by every car in the interleaved test
+
+static void test_mac(uint8_t *mac, size_t car)
+{
+        uint8_t base[ESP_NOW_ETH_ALEN] = {0x02, 0, 0, 0, car >> 8, car};
+        memcpy(mac, base, ESP_NOW_ETH_ALEN);
+}
+
+// Sample of `car` whose velocity tells the car apart, and moves within the window
+static void test_sample(size_t car, int64_t time_us, int step)
+{
+        telemetry_sample_t sample = {.time_us = time_us};
+        test_mac(sample.mac, car);
+        sample.stat.left_motor.velocity = car * 100 + step % 10;
+        sample.stat.right_motor.velocity = -(float)car;
+        telemetry_aggregate(&sample);
+}
+
+static void test_setup(void)
+{
+        memset(telemetry_peers, 0, sizeof(telemetry_peers));
+        telemetry_windows = 0;
+        telemetry_evicted = 0;
+}
+
+// Samples of several cars arriving interleaved give one window per car, with only its own values
+static void test_interleaved(void)
+{
+        test_setup();
+        int steps = TEST_WINDOWS * TELEMETRY_WINDOW_MS / TEST_STAT_MS + 1;
+        for (int step = 0; step < steps; step++)
+                for (size_t car = 0; car < TEST_CARS; car++)
+                        test_sample(car, step * TEST_STAT_MS * 1000LL + car * 1000, step);
+
+        TEST_ASSERT(telemetry_windows == TEST_CARS * TEST_WINDOWS);
+        telemetry_window_t windows[TELEMETRY_MAX_PEERS];
+        TEST_ASSERT(telemetry_get_windows(windows, TELEMETRY_MAX_PEERS) == TEST_CARS);
+        for (size_t car = 0; car < TEST_CARS; car++)
+        {
+                uint8_t mac[ESP_NOW_ETH_ALEN];
+                test_mac(mac, car);
+                telemetry_window_t window;
+                TEST_ASSERT(telemetry_get_window(mac, &window) == &window);
+                TEST_ASSERT(memcmp(window.mac, mac, ESP_NOW_ETH_ALEN) == 0);
+                TEST_ASSERT(window.count == TELEMETRY_WINDOW_MS / TEST_STAT_MS);
+                TEST_ASSERT(window.min[TELEMETRY_FIELD_LEFT_VELOCITY] == car * 100);
+                TEST_ASSERT(window.max[TELEMETRY_FIELD_LEFT_VELOCITY] == car * 100 + 9);
+                TEST_ASSERT(window.mean[TELEMETRY_FIELD_LEFT_VELOCITY] == car * 100 + 4.5f);
+                TEST_ASSERT(window.min[TELEMETRY_FIELD_RIGHT_VELOCITY] == -(float)car);
+                TEST_ASSERT(window.max[TELEMETRY_FIELD_RIGHT_VELOCITY] == -(float)car);
+        }
+
+        uint8_t unknown[ESP_NOW_ETH_ALEN];
+        test_mac(unknown, TEST_CARS);
+        telemetry_window_t window;
+        TEST_ASSERT(telemetry_get_window(unknown, &window) == NULL);
+}
+
+// A car beyond `TELEMETRY_MAX_PEERS` takes the place of the one heard from least recently
+static void test_eviction(void)
+{
+        test_setup();
+        for (size_t car = 0; car < TELEMETRY_MAX_PEERS; car++)
+                test_sample(car, car * 1000, 0);
+        test_sample(0, TELEMETRY_MAX_PEERS * 1000, 0);
+        test_sample(TELEMETRY_MAX_PEERS, (TELEMETRY_MAX_PEERS + 1) * 1000, 0);
+        TEST_ASSERT(telemetry_evicted == 1);
+
+        // Car 1 was dropped, car 0 was not as it was heard from again
+        for (size_t car = 0; car <= TELEMETRY_MAX_PEERS; car++)
+        {
+                uint8_t mac[ESP_NOW_ETH_ALEN];
+                test_mac(mac, car);
+                bool found = false;
+                for (size_t i = 0; i < TELEMETRY_MAX_PEERS; i++)
+                        if (telemetry_peers[i].in_use && memcmp(telemetry_peers[i].current.mac, mac, ESP_NOW_ETH_ALEN) == 0)
+                                found = true;
+                TEST_ASSERT(found == (car != 1));
+        }
+}
+
+int main(void)
+{
+        TEST_RUN(test_interleaved);
+        TEST_RUN(test_eviction);
+        return TEST_RESULT();
+}
@@ -0,0 +1,174 @@
+// Connection update driven by the peer timer wheel, next to running every peer state machine on every call, and the keepalives it sends
+// The firmware source is included to reach the peer state machine, send results come back as the dispatcher hands them over
+
+#include "../main/espnow.c"
+
+#include "test_host.h"
+
+#define TEST_SECONDS (10)                         // Simulated time of each run
+#define TEST_LOOP_US (1000)                       // Period of the main loop that used to run the connection update
+#define TEST_TRAFFIC_MS (20)                      // Interval of the frames exchanged with every peer, as the telemetry stream
+#define TEST_SILENT_AFTER_S (5)                   // The first peer stops answering after this long
+#define TEST_SENT_MAX (ESP_CONNECTION_MAX_PEERS) // Send results waiting for the next update
+#define TEST_KEEPALIVE_S (3)                      // Simulated time of the keepalive test
+
+static esp_connection_handle_t test_handle;
+static uint8_t test_sent[TEST_SENT_MAX][ESP_NOW_ETH_ALEN];
+static size_t test_sent_count;
+static uint32_t test_keepalives; // `PING` packets sent without payload
+static uint32_t test_probes;     // `PING` packets sent with a timestamp to echo
+
+// The radio accepts every frame, its result is reported after the update that sent it
+static esp_err_t test_send(const uint8_t *mac, const uint8_t *data, size_t len)
+{
+        TEST_ASSERT(test_sent_count < TEST_SENT_MAX);
+        memcpy(test_sent[test_sent_count++], mac, ESP_NOW_ETH_ALEN);
+
+        espnow_packet_t packet;
+        memcpy(&packet, data, sizeof(packet));
+        if (ESPNOW_PACKET_TYPE(&packet) == ESPNOW_PACKET_TYPE_PING)
+        {
+                size_t stamp_len = (packet.type_flags & ESPNOW_PACKET_FLAG_TIMESTAMP) ? sizeof(uint32_t) : 0;
+                if (packet.len == stamp_len + sizeof(espnow_ping_pkt_t))
+                        test_probes++;
+                else if (packet.len == stamp_len)
+                        test_keepalives++;
+                else
+                        TEST_ASSERT(false);
+        }
+        return ESP_OK;
+}
+
+// A peer that stopped answering does not acknowledge frames either
+static void test_send_results(const uint8_t *silent_mac)
+{
+        for (size_t i = 0; i < test_sent_count; i++)
+        {
+                espnow_event_send_cb_t send_cb = {.status = ESP_NOW_SEND_SUCCESS};
+                memcpy(send_cb.mac_addr, test_sent[i], ESP_NOW_ETH_ALEN);
+                if (silent_mac != NULL && memcmp(send_cb.mac_addr, silent_mac, ESP_NOW_ETH_ALEN) == 0)
+                        send_cb.status = ESP_NOW_SEND_FAIL;
+                esp_connection_process_send_result(&test_handle, &send_cb);
+        }
+        test_sent_count = 0;
+}
+
+// Connection update as it was before the timer wheel, every peer state machine on every call
+// Each run still files the peer in the wheel, which the old update did not pay for
+static void test_linear_update(esp_connection_handle_t *handle)
+{
+        int64_t now_us = esp_timer_get_time();
+        for (size_t i = 0; i < handle->size; i++)
+                esp_peer_update(handle, handle->entries + i, now_us);
+        handle->remote_connected = esp_connection_count_connected(handle);
+        espnow_reliable_update();
+        espnow_rate_update(handle);
+        espnow_channel_update(handle);
+        espnow_fragment_update(handle);
+}
+
+// `count` connected peers exchanging frames, all but the first keep doing so to the end
+static void test_setup(size_t count)
+{
+        esp_connection_handle_clear(&test_handle);
+        int64_t now_us = esp_timer_get_time();
+        for (size_t n = 0; n < count; n++)
+        {
+                uint8_t mac[ESP_NOW_ETH_ALEN] = {0x24, 0x0A, 0xC4, 0, n >> 8, n};
+                esp_peer_handle_t *peer = esp_connection_mac_add_to_entry(&test_handle, mac);
+                TEST_ASSERT(peer != NULL);
+                peer->status = ESP_PEER_STATUS_CONNECTED;
+                peer->registered = true;
+                peer->saved_to_rom = true;
+                peer->timing->last_probe_us = now_us;
+                esp_connection_schedule(&test_handle, peer, now_us);
+        }
+        test_handle.remote_connected = count;
+}
+
+// CPU time spent in the connection update per simulated second, in microseconds
+static double test_run(size_t count, bool wheel)
+{
+        test_setup(count);
+        uint64_t elapsed_ns = 0;
+        for (int64_t t = 0; t < TEST_SECONDS * ONE_SECOND_IN_US; t += TEST_LOOP_US)
+        {
+                idf_host_advance_time(TEST_LOOP_US);
+                int64_t now_us = esp_timer_get_time();
+
+                // Frames of each peer are spread over the traffic interval, as the peers do not run in step
+                bool silent = t >= TEST_SILENT_AFTER_S * ONE_SECOND_IN_US;
+                for (size_t n = 0; n < count; n++)
+                {
+                        if (n == 0 && silent)
+                                continue;
+                        if ((t / TEST_LOOP_US) % TEST_TRAFFIC_MS != n % TEST_TRAFFIC_MS)
+                                continue;
+                        esp_peer_timing_t *timing = test_handle.entries[n].timing;
+                        timing->lastseen_unicast_us = now_us;
+                        timing->lastsent_unicast_us = now_us;
+                }
+
+                // Each at its rate on the board, the dispatcher updates once per wheel tick and the main loop did on every pass
+                uint32_t start = esp_cpu_get_cycle_count();
+                if (!wheel)
+                        test_linear_update(&test_handle);
+                else if (t % (ESP_CONNECTION_UPDATE_INTERVAL_MS * 1000) == 0)
+                        esp_connection_handle_update(&test_handle);
+                elapsed_ns += esp_cpu_get_cycle_count() - start;
+                test_send_results(silent ? test_handle.entries[0].mac : NULL);
+        }
+
+        // The silent peer is dropped a second after its last frame, the others are kept, whichever way they were run
+        TEST_ASSERT(test_handle.entries[0].status == ESP_PEER_STATUS_LOST);
+        for (size_t n = 1; n < count; n++)
+                TEST_ASSERT(test_handle.entries[n].status == ESP_PEER_STATUS_CONNECTED);
+        TEST_ASSERT(test_handle.remote_connected == count - 1);
+        return elapsed_ns / 1000.0 / TEST_SECONDS;
+}
+
+// An idle link gets plain keepalives in between the timestamped round trip probes
+static void test_keepalive(void)
+{
+        test_setup(1);
+        esp_peer_handle_t *peer = &test_handle.entries[0];
+        test_keepalives = 0;
+        test_probes = 0;
+        for (int64_t t = 0; t < TEST_KEEPALIVE_S * ONE_SECOND_IN_US; t += ESP_CONNECTION_UPDATE_INTERVAL_MS * 1000)
+        {
+                // The peer streams to us, we have nothing to send back
+                idf_host_advance_time(ESP_CONNECTION_UPDATE_INTERVAL_MS * 1000);
+                if (t % (TEST_TRAFFIC_MS * 1000) == 0)
+                        peer->timing->lastseen_unicast_us = esp_timer_get_time();
+                esp_connection_handle_update(&test_handle);
+                test_send_results(NULL);
+        }
+
+        TEST_ASSERT(peer->status == ESP_PEER_STATUS_CONNECTED);
+        TEST_ASSERT(test_probes == TEST_KEEPALIVE_S);
+        TEST_ASSERT(test_probes == peer->rtt.probes);
+        TEST_ASSERT(test_keepalives >= TEST_KEEPALIVE_S * (ESP_PEER_RTT_PROBE_MS / ESP_CONNECTION_IDLE_PING_MS - 1));
+}
+
+static void test_benchmark(void)
+{
+        static const size_t counts[] = {1, 10, 100};
+        for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+        {
+                double linear_us = test_run(counts[i], false);
+                double wheel_us = test_run(counts[i], true);
+                printf("%3zu peers: timer wheel %8.1f us/s, %5lu peer runs/s, linear scan %8.1f us/s\n",
+                       counts[i], wheel_us, test_handle.runs_per_s, linear_us);
+        }
+}
+
+int main(void)
+{
+        espnow_wifi_config_t config;
+        esp_connection_handle_init(&test_handle);
+        TEST_ASSERT(espnow_init(espnow_wifi_default_config(&config), &test_handle) != NULL);
+        idf_host_set_esp_now_send(test_send);
+        TEST_RUN(test_keepalive);
+        TEST_RUN(test_benchmark);
+        return TEST_RESULT();
+}
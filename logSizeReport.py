@@ -0,0 +1,182 @@
+import argparse
+import re
+import subprocess
+from pathlib import Path
+
+# Estimates what the log level ceilings of main/info.h remove from the firmware
+# Compare `idf.py size` of two builds for the exact numbers, or pass both ELF files to measure the hot paths
+
+LEVELS = {
+    "ESP_LOG_NONE": 0,
+    "ESP_LOG_ERROR": 1,
+    "ESP_LOG_WARN": 2,
+    "ESP_LOG_INFO": 3,
+    "ESP_LOG_DEBUG": 4,
+    "ESP_LOG_VERBOSE": 5,
+}
+CALLS = {"LOG_ERROR": 1, "LOG_WARNING": 2, "LOG_INFO": 3, "LOG_DEBUG": 4, "LOG_VERBOSE": 5}
+MACROS = {"MACSTR": "%02x:%02x:%02x:%02x:%02x:%02x"}
+
+# Bytes per call site: the old macros appended this suffix, making every format string unique
+OLD_SUFFIX = len(" | \x1b[100m%s:%d\x1b[0m")
+# Bytes per call site kept in flash by the deferred macros
+SITE_SIZE = 8
+# Instructions of a removed call: level check, site address, tag load, arguments and the call itself
+# A guess used when no ELF files are given, the disassembly gives the real count
+CALL_INSTRUCTIONS = 6
+
+HOT_PATHS = ["espnow_send_data", "esp_connection_handle_update"]
+
+
+def read_ceilings(info: str, show_connection_status: bool | None) -> dict[str, int]:
+    defines = dict(re.findall(r"^#define\s+(\w+)\s+(.+?)\s*$", info, re.M))
+    if show_connection_status is not None:
+        defines["SHOW_CONNECTION_STATUS"] = "true" if show_connection_status else "false"
+
+    def evaluate(value: str) -> int:
+        value = value.strip()
+        if value in LEVELS:
+            return LEVELS[value]
+        if value in defines:
+            return evaluate(defines[value])
+        match = re.fullmatch(r"\((\w+) \? (\w+) : (\w+)\)", value)
+        if match:
+            condition = defines.get(match.group(1), "false") == "true"
+            return evaluate(match.group(2) if condition else match.group(3))
+        raise ValueError(f"Cannot evaluate {value}")
+
+    return {
+        name[len("LOG_LEVEL_") :]: evaluate(value)
+        for name, value in defines.items()
+        if name.startswith("LOG_LEVEL_") and name != "LOG_LEVEL_CONNECTION"
+    }
+
+
+# Length of the string literals and known macros at the start of a call
+def format_length(arguments: str) -> int:
+    length = 0
+    for token in re.finditer(r'"((?:[^"\\]|\\.)*)"|(\w+)|(,)', arguments):
+        if token.group(3):
+            break
+        if token.group(1) is not None:
+            length += len(token.group(1).encode().decode("unicode_escape"))
+        elif token.group(2) in MACROS:
+            length += len(MACROS[token.group(2)])
+        else:
+            break
+    return length
+
+
+def function_span(source: str, name: str) -> tuple[int, int] | None:
+    match = re.search(rf"^[\w \*]+\b{name}\([^;]*?\)\s*\{{", source, re.M)
+    if not match:
+        return None
+    depth = 0
+    for pos in range(match.end() - 1, len(source)):
+        if source[pos] == "{":
+            depth += 1
+        elif source[pos] == "}":
+            depth -= 1
+            if depth == 0:
+                return match.start(), pos
+    return None
+
+
+# Instructions of each function of `names` in the disassembly of `elf`, None for the ones not found, inlined or static
+def count_instructions(objdump: str, elf: Path, names: list[str]) -> dict[str, int | None]:
+    counts: dict[str, int | None] = {}
+    for name in names:
+        output = subprocess.run(
+            [objdump, "-d", "--no-show-raw-insn", f"--disassemble={name}", str(elf)],
+            check=True,
+            capture_output=True,
+            text=True,
+        ).stdout
+        body = re.search(rf"^[0-9a-f]+ <{name}>:\n(.*?)(?:\n\n|\Z)", output, re.M | re.S)
+        counts[name] = None if body is None else len(re.findall(r"^\s*[0-9a-f]+:\s+\S", body.group(1), re.M))
+    return counts
+
+
+# LOG_LOCAL_LEVEL of the build, calls above it were already compiled out before the ceilings
+def read_local_level(sdkconfig: Path) -> int:
+    if sdkconfig.exists():
+        match = re.search(r"^CONFIG_LOG_MAXIMUM_LEVEL=(\d+)", sdkconfig.read_text(), re.M)
+        if match:
+            return int(match.group(1))
+    return LEVELS["ESP_LOG_INFO"]
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Estimate the flash and hot path savings of the log ceilings")
+    parser.add_argument("--main", default="main", help="directory of the firmware sources")
+    parser.add_argument("--show-connection-status", choices=["true", "false"], help="override SHOW_CONNECTION_STATUS")
+    parser.add_argument("--build-level", type=int, choices=range(6), help="override CONFIG_LOG_MAXIMUM_LEVEL of sdkconfig")
+    parser.add_argument("--elf", type=Path, help="firmware ELF built with the ceilings, to measure the hot paths")
+    parser.add_argument("--baseline-elf", type=Path, help="firmware ELF built without the ceilings, to measure the hot paths")
+    parser.add_argument("--objdump", default="xtensa-esp32s3-elf-objdump", help="objdump of the firmware toolchain")
+    args = parser.parse_args()
+    if (args.elf is None) != (args.baseline_elf is None):
+        parser.error("--elf and --baseline-elf go together")
+
+    root = Path(args.main)
+    override = None if args.show_connection_status is None else args.show_connection_status == "true"
+    ceilings = read_ceilings((root / "info.h").read_text(), override)
+    local_level = read_local_level(root.parent / "sdkconfig") if args.build_level is None else args.build_level
+
+    total_kept = total_removed = bytes_removed = bytes_suffix = 0
+    print(f"{'module':<18} {'ceiling':<8} {'kept':>5} {'removed':>8} {'bytes':>7}")
+    hot = []
+    for path in sorted(root.glob("*.c")):
+        source = path.read_text()
+        module = re.search(r"^#define LOG_MODULE (\w+)", source, re.M)
+        if not module:
+            continue
+        ceiling = ceilings[module.group(1)]
+
+        spans = {name: function_span(source, name) for name in HOT_PATHS}
+        kept = removed = removed_bytes = 0
+        for call in re.finditer(r"^(?!\s*//).*?\b(LOG_\w+)\((.*)$", source, re.M):
+            level = CALLS.get(call.group(1))
+            if level is None or level > local_level:
+                continue
+            length = format_length(call.group(2)) + 1
+            if level <= ceiling:
+                kept += 1
+                bytes_suffix += OLD_SUFFIX
+                continue
+            removed += 1
+            removed_bytes += length + OLD_SUFFIX + SITE_SIZE
+            for name, span in spans.items():
+                if span and span[0] <= call.start() <= span[1]:
+                    hot.append((name, call.group(1), source.count("\n", 0, call.start()) + 1))
+
+        total_kept += kept
+        total_removed += removed
+        bytes_removed += removed_bytes
+        level_name = next(name for name, value in LEVELS.items() if value == ceiling)[len("ESP_LOG_") :]
+        print(f"{module.group(1):<18} {level_name:<8} {kept:>5} {removed:>8} {removed_bytes:>7}")
+
+    print(f"\n{total_kept} calls kept, {total_removed} compiled out, calls above the build level {local_level} are not counted")
+    print(f"Flash saved by the ceilings: about {bytes_removed} bytes of format strings and call sites")
+    print(f"Flash saved by file IDs and the shared suffix on the kept calls: about {bytes_suffix} bytes")
+    measured = None
+    if args.elf is not None:
+        measured = (
+            count_instructions(args.objdump, args.baseline_elf, HOT_PATHS),
+            count_instructions(args.objdump, args.elf, HOT_PATHS),
+        )
+    for name in HOT_PATHS:
+        calls = [entry for entry in hot if entry[0] == name]
+        if measured is None:
+            print(f"{name}: {len(calls)} calls removed, estimated {len(calls) * CALL_INSTRUCTIONS} instructions at {CALL_INSTRUCTIONS} per call")
+        elif measured[0][name] is None or measured[1][name] is None:
+            print(f"{name}: {len(calls)} calls removed, not found in both ELF files, inlined or renamed")
+        else:
+            before, after = measured[0][name], measured[1][name]
+            print(f"{name}: {len(calls)} calls removed, measured {before - after} instructions, {before} before and {after} after")
+        for _, macro, line in calls:
+            print(f"    {macro} at line {line}")
+
+
+if __name__ == "__main__":
+    main()
@@ -1,6 +1,7 @@
 
 #include "button.h"
 
+#define LOG_MODULE BUTTON
 static const char *TAG = "button";
 
 typedef struct
@@ -55,10 +56,13 @@ static bool button_up(button_data_t *button)
 
 static void button_send_event(button_data_t *button, const button_state_t prev_state)
 {
-        button_event_t new_state = {
-            .pin = button->pin,
-            .prev_state = prev_state,
-            .new_state = button->state,
+        button_queue_event_t new_state = {
+            .event = {
+                .pin = button->pin,
+                .prev_state = prev_state,
+                .new_state = button->state,
+            },
+            .time_us = esp_timer_get_time(),
         };
 
         if (xQueueSend(button_queue, &new_state, 0) != pdTRUE)
@@ -130,7 +134,7 @@ QueueHandle_t button_init(void)
         }
 
         // Initialize queue
-        button_queue = xQueueCreate(BUTTON_QUEUE_DEPTH, sizeof(button_event_t)); // TODO: statically allow memory
+        button_queue = xQueueCreate(BUTTON_QUEUE_DEPTH, sizeof(button_queue_event_t)); // TODO: statically allow memory
         if (button_queue == NULL)
         {
                 LOG_ERROR("Create queue failed");
@@ -53,7 +53,14 @@ typedef struct
         button_state_t new_state : 4;  // new state of button (`to`)
 } __packed button_event_t;
 
-// Creates the task for reading the GPIO and returns a queue for button events
+// Button state event as posted on the event queue, stamped with the time of the state change
+typedef struct
+{
+        button_event_t event; // Button state event
+        int64_t time_us;      // Timestamp of the state change
+} button_queue_event_t;
+
+// Creates the task for reading the GPIO and returns a queue of `button_queue_event_t`
 QueueHandle_t button_init(void);
 
 // Register one button at `pin` and its trigger condition
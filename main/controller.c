@@ -0,0 +1,104 @@
+
+#include "controller.h"
+#include "joystick.h"
+
+#define LOG_MODULE CONTROLLER
+static const char *TAG = "controller";
+
+void controller_init(controller_handle_t *handle)
+{
+        if (handle == NULL)
+        {
+                LOG_ERROR("NULL pointer, handle=0x%X", (uintptr_t)handle);
+                return;
+        }
+
+        memset(handle, 0, sizeof(controller_handle_t));
+        handle->axis_x_pin = GPIO_NUM_NC;
+        handle->axis_y_pin = GPIO_NUM_NC;
+}
+
+static void controller_set_button_state(controller_handle_t *handle, uint8_t id, button_state_t state)
+{
+        uint16_t shift = id * 2;
+        handle->state.buttons = (handle->state.buttons & ~(0x3 << shift)) | ((state & 0x3) << shift);
+}
+
+int controller_register_button(controller_handle_t *handle, const gpio_num_t pin)
+{
+        if (handle == NULL)
+        {
+                LOG_ERROR("NULL pointer, handle=0x%X", (uintptr_t)handle);
+                return -1;
+        }
+        if (handle->num_buttons >= REMOTE_CONTROLLER_MAX_BUTTONS)
+        {
+                LOG_WARNING("No space for button on gpio: %d, max: %d", pin, REMOTE_CONTROLLER_MAX_BUTTONS);
+                return -1;
+        }
+
+        uint8_t id = handle->num_buttons++;
+        handle->button_pins[id] = pin;
+        controller_set_button_state(handle, id, BUTTON_RELEASED);
+        LOG_INFO("Controller button id: %d, gpio: %d", id, pin);
+        return id;
+}
+
+void controller_register_axes(controller_handle_t *handle, const gpio_num_t axis_x_pin, const gpio_num_t axis_y_pin)
+{
+        if (handle == NULL)
+        {
+                LOG_ERROR("NULL pointer, handle=0x%X", (uintptr_t)handle);
+                return;
+        }
+        handle->axis_x_pin = axis_x_pin;
+        handle->axis_y_pin = axis_y_pin;
+}
+
+void controller_update(controller_handle_t *handle, const button_queue_event_t *queue_event)
+{
+        if ((handle == NULL) || (queue_event == NULL))
+        {
+                LOG_ERROR("NULL pointer, handle=0x%X, queue_event=0x%X", (uintptr_t)handle, (uintptr_t)queue_event);
+                return;
+        }
+
+        if (!handle->changed)
+                handle->changed_time_us = queue_event->time_us;
+        handle->changed = true;
+
+        // Joystick direction events have no button id, the axes are sampled with the snapshot
+        for (uint8_t id = 0; id < handle->num_buttons; id++)
+        {
+                if (handle->button_pins[id] != queue_event->event.pin)
+                        continue;
+
+                controller_set_button_state(handle, id, queue_event->event.new_state);
+                if (queue_event->event.new_state == BUTTON_PRESSED)
+                {
+                        uint16_t shift = id * 2;
+                        uint16_t count = ((handle->state.press_count >> shift) + 1) & 0x3;
+                        handle->state.press_count = (handle->state.press_count & ~(0x3 << shift)) | (count << shift);
+                }
+                return;
+        }
+}
+
+remote_controller_state_pkt_t *controller_take_snapshot(controller_handle_t *handle, remote_controller_state_pkt_t *snapshot)
+{
+        if ((handle == NULL) || (snapshot == NULL))
+        {
+                LOG_ERROR("NULL pointer, handle=0x%X, snapshot=0x%X", (uintptr_t)handle, (uintptr_t)snapshot);
+                return NULL;
+        }
+
+        if (handle->axis_x_pin != GPIO_NUM_NC)
+                handle->state.axis_x = joystick_get_position(handle->axis_x_pin);
+        if (handle->axis_y_pin != GPIO_NUM_NC)
+                handle->state.axis_y = joystick_get_position(handle->axis_y_pin);
+
+        handle->state.seq_num++;
+        handle->changed = false;
+        memcpy(snapshot, &handle->state, sizeof(remote_controller_state_pkt_t));
+        return snapshot;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "driver/gpio.h"
+
+#include "esp_timer.h"
+
+#include "logging.h"
+#include "button.h"
+#include "packets.h"
+
+// Interval of controller state refresh while connected, a lost snapshot is repaired by the next one
+#define CONTROLLER_STATE_INTERVAL_MS (10)
+
+// Collects button and joystick events into one controller state snapshot
+typedef struct
+{
+        gpio_num_t button_pins[REMOTE_CONTROLLER_MAX_BUTTONS]; // GPIO pin of each button id
+        uint8_t num_buttons;                                   // Number of registered buttons
+        gpio_num_t axis_x_pin, axis_y_pin;                     // ADC pins of the joystick axes
+        remote_controller_state_pkt_t state;                   // Current controller state
+        bool changed;                                          // State changed since the last snapshot
+        int64_t changed_time_us;                               // Timestamp of the oldest change not yet in a snapshot
+} controller_handle_t;
+
+// Initialize the controller state, all buttons released and joystick centered
+void controller_init(controller_handle_t *handle);
+
+// Register a released button, button ids are given in the order of registration
+// Returns the button id, or -1 if there is no space left
+int controller_register_button(controller_handle_t *handle, const gpio_num_t pin);
+
+// Register the ADC pins of the joystick axes
+void controller_register_axes(controller_handle_t *handle, const gpio_num_t axis_x_pin, const gpio_num_t axis_y_pin);
+
+// Apply a button or joystick event to the controller state
+void controller_update(controller_handle_t *handle, const button_queue_event_t *queue_event);
+
+// Sample the joystick and fill `snapshot` with the next numbered controller state
+remote_controller_state_pkt_t *controller_take_snapshot(controller_handle_t *handle, remote_controller_state_pkt_t *snapshot);
@@ -1,5 +1,6 @@
 #include "device_settings.h"
 
+#define LOG_MODULE DEVICE_SETTINGS
 static const char *TAG = "device_settings";
 __unused static const uint8_t broadcast_mac[ESP_NOW_ETH_ALEN] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 static eeprom_handle_t eeprom_handle;
@@ -15,7 +16,8 @@ void device_settings_default(device_settings_t *device_settings)
         eeprom_default_config(&eeprom_handle);
         memcpy(device_settings->time, __TIME__, 8);
         memcpy(device_settings->date, __DATE__, 11); 
-        memcpy(device_settings->remote_conn_mac, broadcast_mac, ESP_NOW_ETH_ALEN);
+        for (size_t i = 0; i < DEVICE_SETTINGS_MAX_PEERS; i++)
+                memcpy(device_settings->remote_conn_mac[i], broadcast_mac, ESP_NOW_ETH_ALEN);
         device_settings->salt = esp_random();
 }
 
@@ -23,7 +25,8 @@ void device_settings_print(device_settings_t *device_settings)
 {
         LOG_INFO("      Built time : %s %s", __DATE__, __TIME__);
         LOG_INFO("Config save time : %s %s", device_settings->date, device_settings->time);
-        LOG_INFO("  Peer MAC addr. : " MACSTR, MAC2STR(device_settings->remote_conn_mac));
+        for (size_t i = 0; i < device_settings_count_macs(device_settings); i++)
+                LOG_INFO("  Peer MAC addr. : " MACSTR, MAC2STR(device_settings->remote_conn_mac[i]));
         LOG_INFO("            salt : %lu", device_settings->salt);
 }
 
@@ -39,7 +42,7 @@ void device_settings_init(device_settings_t *device_settings)
         if (is_same(device_settings->time, __TIME__, 8) && is_same(device_settings->date, __DATE__, 11))
                 return;
 
-        if (is_same(device_settings->remote_conn_mac, broadcast_mac, ESP_NOW_ETH_ALEN))
+        if (device_settings_count_macs(device_settings) == 0)
                 return;
 
         if (CLEAR_PAIRED_PEER_ON_NEW_UPLOAD != 1)
@@ -53,14 +56,32 @@ void device_settings_init(device_settings_t *device_settings)
         device_settings_print(device_settings);
 }
 
-void device_settings_set_mac(device_settings_t *device_settings, uint8_t *mac)
+size_t device_settings_count_macs(const device_settings_t *device_settings)
+{
+        size_t count = 0;
+        while (count < DEVICE_SETTINGS_MAX_PEERS && !is_same(device_settings->remote_conn_mac[count], broadcast_mac, ESP_NOW_ETH_ALEN))
+                count++;
+        return count;
+}
+
+void device_settings_add_mac(device_settings_t *device_settings, const uint8_t *mac)
 {
         esp_err_t err;
 
-        memcpy(device_settings->remote_conn_mac, mac, ESP_NOW_ETH_ALEN);
+        size_t count = device_settings_count_macs(device_settings);
+        for (size_t i = 0; i < count; i++)
+                if (is_same(device_settings->remote_conn_mac[i], mac, ESP_NOW_ETH_ALEN))
+                        return;
+
+        if (count == DEVICE_SETTINGS_MAX_PEERS)
+        {
+                LOG_WARNING("Forgetting paired peer " MACSTR, MAC2STR(device_settings->remote_conn_mac[0]));
+                memmove(device_settings->remote_conn_mac[0], device_settings->remote_conn_mac[1], ESP_NOW_ETH_ALEN * (DEVICE_SETTINGS_MAX_PEERS - 1));
+                count--;
+        }
+        memcpy(device_settings->remote_conn_mac[count], mac, ESP_NOW_ETH_ALEN);
         err = eeprom_set_entry(&eeprom_handle, device_settings, sizeof(device_settings_t));
         ESP_ERROR_CHECK_WITHOUT_ABORT(err);
         err = eeprom_get_entry(&eeprom_handle, device_settings, sizeof(device_settings_t));
         ESP_ERROR_CHECK_WITHOUT_ABORT(err);
-        device_settings_default(device_settings);
 }
@@ -9,17 +9,23 @@
 #include "eeprom.h"
 #include "logging.h"
 
+#define DEVICE_SETTINGS_MAX_PEERS (4) // Number of paired MAC addresses kept, the oldest is forgotten first
+
 // Persistent settings that will be saved after a power loss
+// New fields go at the end, settings saved by older builds are loaded as a prefix
 typedef struct
 {
-        char time[9];               // Time of code compile
-        char date[12];              // Date of code compile
-        uint32_t salt;              // Random bits
-        uint8_t remote_conn_mac[6]; // Remote MAC address
+        char time[9];                                          // Time of code compile
+        char date[12];                                         // Date of code compile
+        uint32_t salt;                                         // Random bits
+        uint8_t remote_conn_mac[DEVICE_SETTINGS_MAX_PEERS][6]; // Paired MAC addresses, oldest first, unused ones are broadcast
 } device_settings_t;
 
 // Initialize the storage partition and loads settings from flash
 void device_settings_init(device_settings_t *device_settings);
 
-// Writes new MAC address into flash
-void device_settings_set_mac(device_settings_t *device_settings, uint8_t *mac);
\ No newline at end of file
+// Adds a paired MAC address and writes it into flash, forgetting the oldest one when full
+void device_settings_add_mac(device_settings_t *device_settings, const uint8_t *mac);
+
+// Number of paired MAC addresses
+size_t device_settings_count_macs(const device_settings_t *device_settings);
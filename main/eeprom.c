@@ -1,6 +1,7 @@
 
 #include "eeprom.h"
 
+#define LOG_MODULE EEPROM
 static const char *TAG = "eeprom";
 
 eeprom_handle_t *eeprom_default_config(eeprom_handle_t *eeprom_handle)
@@ -1,6 +1,11 @@
 
 #include "espnow.h"
+#include "espnow_reliable.h"
+#include "espnow_rate.h"
+#include "espnow_channel.h"
+#include "espnow_fragment.h"
 
+#define LOG_MODULE ESPNOW
 static const char *TAG = "espnow";
 
 QueueHandle_t espnow_queue;
@@ -8,6 +13,48 @@ static const uint8_t broadcast_mac[ESP_NOW_ETH_ALEN] = {0xFF, 0xFF, 0xFF, 0xFF,
 static uint16_t espnow_seq[2] = {0, 0}; // [0] for Tx, [1] for Rx
 static esp_connection_handle_t *esp_connection_handle;
 static espnow_wifi_config_t *espnow_config;
+static frame_pool_frame_t espnow_rx_frames[ESPNOW_QUEUE_SIZE];
+static frame_pool_t espnow_rx_pool;
+static frame_pool_frame_t espnow_tx_frames[ESPNOW_TX_POOL_SIZE];
+static frame_pool_t espnow_tx_pool;
+static espnow_send_stats_t espnow_send_stats;
+static portMUX_TYPE espnow_send_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static espnow_controller_stats_t espnow_controller_stats;
+
+// Packet handed to ESP-NOW, send results are reported in the same order
+typedef struct
+{
+        uint8_t mac[ESP_NOW_ETH_ALEN]; // Destination MAC address
+        espnow_packet_type_t type;     // Data packet type
+        uint16_t tag;                  // Controller state sequence number, for controller packets
+} espnow_inflight_t;
+
+static SemaphoreHandle_t espnow_send_lock; // Keeps `esp_now_send` calls in the same order as the in-flight list
+static bool espnow_tx_paused; // The radio is away on a channel scan, frames wait, guarded by `espnow_send_lock`
+static _Atomic bool espnow_tx_resumed; // Frames held by the pause are waiting for the dispatcher task to send them
+static espnow_inflight_t espnow_inflight[ESPNOW_TX_INFLIGHT_SIZE];
+static size_t espnow_inflight_head, espnow_inflight_count;
+static portMUX_TYPE espnow_inflight_lock = portMUX_INITIALIZER_UNLOCKED;
+static portMUX_TYPE esp_peer_clock_lock = portMUX_INITIALIZER_UNLOCKED;
+static portMUX_TYPE esp_connection_wheel_lock = portMUX_INITIALIZER_UNLOCKED;
+static portMUX_TYPE espnow_controller_lock = portMUX_INITIALIZER_UNLOCKED; // Controller encoders, encoded by the sender, acknowledged by the dispatcher task
+static portMUX_TYPE esp_connection_index_lock = portMUX_INITIALIZER_UNLOCKED; // Index slots, written by the dispatcher task, probed by senders
+static portMUX_TYPE esp_connection_rssi_lock = portMUX_INITIALIZER_UNLOCKED;  // RSSI snapshots posted to the dispatcher task
+
+// Packet held by a transmit frame, the frame goes back to the pool when no peer queue holds it anymore
+typedef struct
+{
+        uint8_t len;               // Length of the packet, in bytes
+        espnow_packet_type_t type; // Data packet type
+        uint16_t tag;              // Controller state sequence number, for controller packets
+        _Atomic uint8_t refs;      // Peer queues holding the frame
+} espnow_tx_frame_info_t;
+
+static espnow_tx_frame_info_t espnow_tx_frame_info[ESPNOW_TX_POOL_SIZE];
+static portMUX_TYPE espnow_tx_queue_lock = portMUX_INITIALIZER_UNLOCKED;
+
+_Static_assert(ESPNOW_QUEUE_SIZE <= FRAME_POOL_MAX_DEPTH, "Receive frame pool cannot back every queued event");
+_Static_assert(ESP_PEER_SEQ_WINDOW_SIZE <= 64, "Sequence window is tracked in a 64-bit mask");
 
 espnow_wifi_config_t *espnow_wifi_default_config(espnow_wifi_config_t *config)
 {
@@ -24,12 +71,57 @@ espnow_wifi_config_t *espnow_wifi_default_config(espnow_wifi_config_t *config)
         config->esp_interface = ESP_IF_WIFI_AP;
         config->channel = 1;
         config->long_range = false;
+        config->adaptive_rate = true;
         config->lmk = lmk;
         config->pmk = pmk;
         espnow_config = config;
         return config;
 }
 
+esp_err_t espnow_set_channel(esp_connection_handle_t *handle, uint8_t channel)
+{
+        if (handle == NULL)
+        {
+                LOG_ERROR("NULL pointer, handle=0x%X", (uintptr_t)handle);
+                return ESP_ERR_INVALID_ARG;
+        }
+
+        esp_err_t err = esp_wifi_set_channel(channel, WIFI_SECOND_CHAN_NONE);
+        if (err != ESP_OK)
+        {
+                LOG_WARNING("Set WiFi channel %d failed: %s", channel, esp_err_to_name(err));
+                return err;
+        }
+        espnow_config->channel = channel;
+
+        for (size_t i = 0; i < handle->size; i++)
+        {
+                esp_peer_handle_t *peer = handle->entries + i;
+                esp_now_peer_info_t peer_info;
+                if (!peer->registered || esp_now_get_peer(peer->mac, &peer_info) != ESP_OK)
+                        continue;
+                peer_info.channel = channel;
+                err = esp_now_mod_peer(&peer_info);
+                if (err != ESP_OK)
+                        LOG_WARNING("Move peer " MACSTR " to channel %d failed: %s", MAC2STR(peer->mac), channel, esp_err_to_name(err));
+        }
+        return ESP_OK;
+}
+
+uint8_t espnow_get_channel(void)
+{
+        return espnow_config->channel;
+}
+
+void espnow_set_tx_paused(bool paused)
+{
+        xSemaphoreTake(espnow_send_lock, portMAX_DELAY);
+        espnow_tx_paused = paused;
+        xSemaphoreGive(espnow_send_lock);
+        if (!paused)
+                atomic_store(&espnow_tx_resumed, true);
+}
+
 espnow_send_param_t *espnow_get_default_send_param(espnow_send_param_t *send_param)
 {
         if (send_param == NULL)
@@ -59,9 +151,6 @@ void espnow_wifi_init(espnow_wifi_config_t *espnow_config)
         ESP_ERROR_CHECK(esp_wifi_set_mode(espnow_config->mode));
         ESP_ERROR_CHECK(esp_wifi_start());
         ESP_ERROR_CHECK(esp_wifi_set_channel(espnow_config->channel, WIFI_SECOND_CHAN_NONE));
-
-        if (espnow_config->long_range)
-                ESP_ERROR_CHECK(esp_wifi_set_protocol(espnow_config->esp_interface, WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N | WIFI_PROTOCOL_LR));
 }
 
 void espnow_deinit(espnow_send_param_t *send_param)
@@ -70,7 +159,7 @@ void espnow_deinit(espnow_send_param_t *send_param)
         {
                 if (send_param->buffer != NULL)
                 {
-                        free(send_param->buffer);
+                        frame_pool_return(&espnow_tx_pool, send_param->buffer);
                 }
                 else
                 {
@@ -130,12 +219,18 @@ static void espnow_recv_cb(const esp_now_recv_info_t *recv_info, const uint8_t *
                 return;
         }
 
+        if (len >= FRAME_POOL_FRAME_SIZE)
+        {
+                LOG_WARNING("Receive callback frame too long, len:%d>max:%d", len, FRAME_POOL_FRAME_SIZE - 1);
+                return;
+        }
+
         evt.id = ESPNOW_RECV_CB;
         memcpy(recv_cb->mac_addr, mac_addr, ESP_NOW_ETH_ALEN);
-        recv_cb->data = malloc(len + 1);
+        recv_cb->data = frame_pool_borrow(&espnow_rx_pool);
         if (recv_cb->data == NULL)
         {
-                LOG_WARNING("malloc failed");
+                LOG_WARNING("Receive frame pool exhausted");
                 return;
         }
         memcpy(recv_cb->data, data, len);
@@ -144,10 +239,112 @@ static void espnow_recv_cb(const esp_now_recv_info_t *recv_info, const uint8_t *
         if (xQueueSend(espnow_queue, &evt, 0) != pdTRUE)
         {
                 LOG_WARNING("Receive callback failed to send queue");
-                free(recv_cb->data);
+                frame_pool_return(&espnow_rx_pool, recv_cb->data);
+        }
+}
+
+void espnow_data_release(espnow_event_recv_cb_t *recv_cb)
+{
+        if ((recv_cb == NULL) || (recv_cb->data == NULL))
+        {
+                LOG_WARNING("NULL pointer, recv_cb=0x%X", (uintptr_t)recv_cb);
+                return;
+        }
+        frame_pool_return(&espnow_rx_pool, recv_cb->data);
+        recv_cb->data = NULL;
+        recv_cb->data_len = 0;
+}
+
+void espnow_show_stats(void)
+{
+        espnow_send_stats_t stats;
+        espnow_get_send_stats(&stats);
+        frame_pool_print_stats(&espnow_rx_pool);
+        frame_pool_print_stats(&espnow_tx_pool);
+        LOG_INFO("Send path, sent: %lu, failed: %lu, avg cycles: %llu, max cycles: %lu",
+                 stats.sent, stats.failed, stats.sent ? stats.cycles_total / stats.sent : 0, stats.cycles_max);
+        espnow_reliable_show_stats();
+        espnow_rate_show_stats();
+        espnow_channel_show_stats();
+        espnow_fragment_show_stats();
+        LOG_INFO("Controller stream, keyframes: %lu, deltas: %lu, payload: %lu bytes, full snapshots: %lu bytes, keyframe requests in: %lu, out: %lu",
+                 espnow_controller_stats.keyframes, espnow_controller_stats.deltas, espnow_controller_stats.payload_bytes, espnow_controller_stats.full_bytes,
+                 espnow_controller_stats.requested, espnow_controller_stats.requests);
+        rssi_capture_stats_t rssi_stats;
+        rssi_get_capture_stats(&rssi_stats);
+        LOG_INFO("RSSI capture, accepted: %lu, filtered: %lu, table full: %lu",
+                 rssi_stats.accepted, rssi_stats.filtered, rssi_stats.table_full);
+}
+
+static void espnow_inflight_push(const uint8_t *mac, espnow_packet_type_t type, uint16_t tag)
+{
+        portENTER_CRITICAL(&espnow_inflight_lock);
+        if (espnow_inflight_count == ESPNOW_TX_INFLIGHT_SIZE)
+        {
+                // A send result went missing, forget the oldest packet
+                espnow_inflight_head = (espnow_inflight_head + 1) % ESPNOW_TX_INFLIGHT_SIZE;
+                espnow_inflight_count--;
+        }
+        espnow_inflight_t *inflight = &espnow_inflight[(espnow_inflight_head + espnow_inflight_count) % ESPNOW_TX_INFLIGHT_SIZE];
+        memcpy(inflight->mac, mac, ESP_NOW_ETH_ALEN);
+        inflight->type = type;
+        inflight->tag = tag;
+        espnow_inflight_count++;
+        portEXIT_CRITICAL(&espnow_inflight_lock);
+}
+
+// Take the oldest in-flight packet sent to `mac`, older packets to other addresses lost their send result
+static bool espnow_inflight_pop(const uint8_t *mac, espnow_inflight_t *inflight)
+{
+        bool found = false;
+        portENTER_CRITICAL(&espnow_inflight_lock);
+        while (espnow_inflight_count)
+        {
+                *inflight = espnow_inflight[espnow_inflight_head];
+                espnow_inflight_head = (espnow_inflight_head + 1) % ESPNOW_TX_INFLIGHT_SIZE;
+                espnow_inflight_count--;
+                if (memcmp(inflight->mac, mac, ESP_NOW_ETH_ALEN) == 0)
+                {
+                        found = true;
+                        break;
+                }
+        }
+        portEXIT_CRITICAL(&espnow_inflight_lock);
+        return found;
+}
+
+espnow_send_stats_t *espnow_get_send_stats(espnow_send_stats_t *stats)
+{
+        if (stats == NULL)
+        {
+                LOG_ERROR("NULL pointer, stats=0x%X", (uintptr_t)stats);
+                return NULL;
         }
+        portENTER_CRITICAL(&espnow_send_stats_lock);
+        *stats = espnow_send_stats;
+        portEXIT_CRITICAL(&espnow_send_stats_lock);
+        return stats;
+}
+
+static void espnow_send_stats_record(uint32_t start_cycles, esp_err_t ret)
+{
+        uint32_t cycles = esp_cpu_get_cycle_count() - start_cycles;
+        portENTER_CRITICAL(&espnow_send_stats_lock);
+        if (ret == ESP_OK)
+                espnow_send_stats.sent++;
+        else
+                espnow_send_stats.failed++;
+        espnow_send_stats.cycles_total += cycles;
+        if (cycles > espnow_send_stats.cycles_max)
+                espnow_send_stats.cycles_max = cycles;
+        portEXIT_CRITICAL(&espnow_send_stats_lock);
 }
 
+static bool espnow_packet_type_is_control(espnow_packet_type_t type);
+static void espnow_controller_send_result(espnow_controller_encoder_t *encoder, uint16_t seq_num, bool success);
+static void esp_connection_schedule_before(esp_connection_handle_t *handle, esp_peer_handle_t *peer, int64_t deadline_us);
+static void esp_connection_update_rssi(esp_connection_handle_t *handle, const rssi_stat_t *rssi_stat);
+
 /* Parse received ESPNOW data. */
 espnow_packet_t *espnow_data_parse(espnow_packet_t *recv_data, espnow_event_recv_cb_t *recv_cb)
 {
@@ -173,6 +370,18 @@ espnow_packet_t *espnow_data_parse(espnow_packet_t *recv_data, espnow_event_recv
                 return NULL;
         }
 
+        if (recv_data->version < ESPNOW_PROTOCOL_VERSION_MIN || recv_data->version > ESPNOW_PROTOCOL_VERSION)
+        {
+                LOG_WARNING("Received ESP-NOW data version unsupported, version:%d, supported:%d-%d", recv_data->version, ESPNOW_PROTOCOL_VERSION_MIN, ESPNOW_PROTOCOL_VERSION);
+                return NULL;
+        }
+
+        if (ESPNOW_PACKET_TYPE(recv_data) >= ESPNOW_PACKET_TYPE_MAX)
+        {
+                LOG_WARNING("Received ESP-NOW data type unknown, type:%d", ESPNOW_PACKET_TYPE(recv_data));
+                return NULL;
+        }
+
         if (recv_data->len > (recv_cb->data_len - recv_data_min_len))
         {
                 LOG_WARNING("Received ESP-NOW data length mismatch, len:%d!=header:%d", recv_data->len, recv_cb->data_len - recv_data_min_len);
@@ -203,27 +412,40 @@ espnow_send_param_t *espnow_payload_create(espnow_send_param_t *send_param, void
                 return NULL;
         }
 
-        send_param->len = sizeof(espnow_packet_t) + len;
-        send_param->buffer = malloc(send_param->len);
-        if (send_param->buffer == NULL)
+        uint8_t version = send_param->version ? send_param->version : ESPNOW_PROTOCOL_VERSION_MIN;
+        // Control packets tell the peer when they left, for measuring the one-way latency
+        bool timestamp = version >= ESPNOW_PROTOCOL_VERSION_TIMESTAMP && espnow_packet_type_is_control(send_param->type);
+        size_t stamp_len = timestamp ? sizeof(uint32_t) : 0;
+        if (sizeof(espnow_packet_t) + stamp_len + len > ESP_NOW_MAX_DATA_LEN)
         {
-                LOG_WARNING("malloc failed");
+                LOG_WARNING("Payload too long, len:%d>max:%d", len, ESP_NOW_MAX_DATA_LEN - sizeof(espnow_packet_t) - stamp_len);
                 return NULL;
         }
 
-        espnow_packet_t *packet = (espnow_packet_t *)send_param->buffer;
-        if (packet == NULL)
+        /* The packet is built in place inside a transmit frame, `esp_now_send` copies it before returning. */
+        send_param->len = sizeof(espnow_packet_t) + stamp_len + len;
+        send_param->buffer = frame_pool_borrow(&espnow_tx_pool);
+        if (send_param->buffer == NULL)
         {
-                LOG_ERROR("NULL pointer, packet=0x%X", (uintptr_t)packet);
+                LOG_WARNING("Transmit frame pool exhausted");
                 return NULL;
         }
 
-        packet->salt = esp_random();
-        packet->type = send_param->type;
-        packet->broadcast = send_param->broadcast;
+        espnow_packet_t *packet = (espnow_packet_t *)send_param->buffer;
+        packet->version = version;
+        packet->type_flags = send_param->type & ESPNOW_PACKET_TYPE_MASK;
+        if (send_param->broadcast == ESPNOW_DATA_UNICAST)
+                packet->type_flags |= ESPNOW_PACKET_FLAG_UNICAST;
         packet->seq_num = send_param->seq_num;
-        packet->len = len;
-        memcpy(packet->payload, data, len);
+        packet->len = stamp_len + len;
+        if (timestamp)
+        {
+                packet->type_flags |= ESPNOW_PACKET_FLAG_TIMESTAMP;
+                uint32_t stamp = esp_timer_get_time();
+                memcpy(packet->payload, &stamp, sizeof(stamp));
+        }
+        if (len)
+                memcpy(packet->payload + stamp_len, data, len);
         packet->crc = 0;
         packet->crc = esp_crc16_le(UINT16_MAX, (uint8_t const *)send_param->buffer, send_param->len);
         return send_param;
@@ -242,304 +464,1229 @@ espnow_send_param_t *espnow_payload_cleanup(espnow_send_param_t *send_param)
                 return NULL;
         }
 
-        free(send_param->buffer);
+        frame_pool_return(&espnow_tx_pool, send_param->buffer);
         send_param->buffer = NULL;
         send_param->len = 0;
         return send_param;
 }
 
-esp_err_t espnow_send_data(espnow_send_param_t *send_param, espnow_packet_type_t type, void *data, size_t len)
-{
-        esp_err_t err;
-        if (send_param == NULL)
-        {
-                LOG_WARNING("NULL pointer, send_param=0x%X", (uintptr_t)send_param);
-                return ESP_ERR_INVALID_ARG;
-        }
-
-        esp_peer_handle_t *peer = esp_connection_mac_lookup(esp_connection_handle, send_param->dest_mac);
-
-        if (esp_connection_count_unique_peer(esp_connection_handle) > 0 && !peer->is_unique)
-                return ESP_OK;
-
-        if (peer == NULL)
-        {
-                send_param->seq_num = espnow_seq[ESPNOW_PARAM_SEQ_TX]++;
-        }
-        else
-        {
-                send_param->seq_num = peer->seq_tx;
-                peer->seq_tx++;
-                peer->lastsent_unicast_us = esp_timer_get_time();
-        }
-        esp_err_t ret;
-        send_param->type = type;
-        espnow_payload_create(send_param, data, len);
-        espnow_packet_t *packet = (espnow_packet_t *)send_param->buffer;
-        if (packet == NULL)
-        {
-                LOG_WARNING("NULL pointer, packet=0x%X", (uintptr_t)packet);
-                return ESP_ERR_INVALID_STATE;
-        }
-
-        if (peer->registered == false)
-        {
-                esp_now_peer_info_t peer_info = {
-                    .channel = espnow_config->channel,
-                    .encrypt = false,
-                    .ifidx = espnow_config->esp_interface,
-                };
-                memcpy(peer_info.peer_addr, peer->mac, ESP_NOW_ETH_ALEN);
-                err = esp_now_add_peer(&peer_info);
-                if (err != ESP_OK && err != ESP_ERR_ESPNOW_EXIST)
-                        ESP_ERROR_CHECK(err);
-                peer->registered = true;
-        }
-
-        LOG_VERBOSE("Send %s to " MACSTR " , seq:%d, len:%d", ESPNOW_PACKET_TYPE_STRING[send_param->type], MAC2STR(send_param->dest_mac), packet->seq_num, packet->len);
-        ret = esp_now_send(send_param->dest_mac, send_param->buffer, send_param->len);
-        espnow_payload_cleanup(send_param);
-        return ret;
-}
-
-esp_err_t espnow_send_text(espnow_send_param_t *send_param, char *text)
+// Other peers than the unique ones are shut out once as many unique peers as the peer limit are set
+static bool esp_connection_is_full(esp_connection_handle_t *handle)
 {
-        return espnow_send_data(send_param, ESPNOW_PACKET_TYPE_TEXT, text, strlen(text));
+        return handle->unique_count && handle->limit != -1 && handle->unique_count >= handle->limit;
 }
 
-esp_err_t espnow_send_reply(espnow_send_param_t *send_param)
+// Controller state sequence number carried by controller packets, matched against their send result
+static uint16_t espnow_packet_tag(espnow_packet_type_t type, const void *data, size_t len)
 {
-        return ESP_OK;
-        // return espnow_send_data(send_param, ESPNOW_PACKET_TYPE_ACK, 0, 0);
+        uint16_t tag = 0;
+        if ((type == ESPNOW_PACKET_TYPE_CONTROLLER_STATE || type == ESPNOW_PACKET_TYPE_CONTROLLER_DELTA) && len >= sizeof(tag))
+                memcpy(&tag, data, sizeof(tag));
+        return tag;
 }
 
-QueueHandle_t espnow_init(espnow_wifi_config_t *espnow_config, esp_connection_handle_t *conn_handle)
+static void esp_peer_register(esp_peer_handle_t *peer)
 {
-        if ((espnow_config == NULL) || (conn_handle == NULL))
-        {
-                LOG_ERROR("NULL pointer, espnow_config=0x%X, conn_handle=0x%X", (uintptr_t)espnow_config, (uintptr_t)conn_handle);
-                return NULL;
-        }
-
-        esp_connection_handle = conn_handle;
-        espnow_queue = xQueueCreate(ESPNOW_QUEUE_SIZE, sizeof(espnow_event_t));
-        if (espnow_queue == NULL)
-        {
-                LOG_ERROR("Create queue failed");
-                return NULL;
-        }
-
-        /* Initialize ESPNOW and register sending and receiving callback function. */
-        ESP_ERROR_CHECK(esp_now_init());
-        if (espnow_config->long_range)
-                espnow_config->wifi_phy_rate = WIFI_PHY_RATE_LORA_250K;
-        ESP_ERROR_CHECK(esp_wifi_config_espnow_rate(espnow_config->wifi_interface, espnow_config->wifi_phy_rate));
-        ESP_ERROR_CHECK(esp_now_register_send_cb(espnow_send_cb));
-        ESP_ERROR_CHECK(esp_now_register_recv_cb(espnow_recv_cb));
-#if CONFIG_ESP_WIFI_STA_DISCONNECTED_PM_ENABLE
-        ESP_ERROR_CHECK(esp_now_set_wake_window(65535));
-#endif
-        /* Set primary master key. */
-        ESP_ERROR_CHECK(esp_now_set_pmk((uint8_t *)espnow_config->pmk));
+        if (peer->registered)
+                return;
 
-        /* Add broadcast peer information to peer list. */
         esp_now_peer_info_t peer_info = {
             .channel = espnow_config->channel,
             .encrypt = false,
             .ifidx = espnow_config->esp_interface,
         };
-        memcpy(peer_info.peer_addr, broadcast_mac, ESP_NOW_ETH_ALEN);
-        ESP_ERROR_CHECK(esp_now_add_peer(&peer_info));
-        esp_peer_handle_t *peer = esp_connection_mac_add_to_entry(esp_connection_handle, peer_info.peer_addr);
+        memcpy(peer_info.peer_addr, peer->mac, ESP_NOW_ETH_ALEN);
+        esp_err_t err = esp_now_add_peer(&peer_info);
+        if (err != ESP_OK && err != ESP_ERR_ESPNOW_EXIST)
+                ESP_ERROR_CHECK(err);
         peer->registered = true;
-        return espnow_queue;
 }
 
-espnow_send_param_t *espnow_get_send_param_broadcast(espnow_send_param_t *send_param)
+static size_t espnow_tx_frame_index(const uint8_t *frame)
 {
-        if (send_param == NULL)
-        {
-                LOG_ERROR("NULL pointer, send_param=0x%X", (uintptr_t)send_param);
-                return NULL;
-        }
-
-        send_param->broadcast = ESPNOW_DATA_BROADCAST;
-        memcpy(send_param->dest_mac, broadcast_mac, ESP_NOW_ETH_ALEN);
-        return send_param;
+        return (frame - espnow_tx_frames[0]) / FRAME_POOL_FRAME_SIZE;
 }
 
-espnow_send_param_t *espnow_get_send_param_unicast(espnow_send_param_t *send_param, const uint8_t *mac)
+static void espnow_tx_frame_release(size_t frame)
 {
-        if (send_param == NULL)
-        {
-                LOG_ERROR("NULL pointer, send_param=0x%X", (uintptr_t)send_param);
-                return NULL;
-        }
-        send_param->broadcast = ESPNOW_DATA_UNICAST;
-        memcpy(send_param->dest_mac, mac, ESP_NOW_ETH_ALEN);
-        return send_param;
+        if (atomic_fetch_sub(&espnow_tx_frame_info[frame].refs, 1) == 1)
+                frame_pool_return(&espnow_tx_pool, espnow_tx_frames[frame]);
 }
 
-espnow_send_param_t *espnow_get_send_param(espnow_send_param_t *send_param, esp_peer_handle_t *peer)
+// A queued frame will never be sent, the controller encoder must not use it as a delta base
+static void esp_peer_tx_discard(esp_peer_handle_t *peer, size_t frame)
 {
-        if (send_param == NULL)
-        {
-                LOG_ERROR("NULL pointer, send_param=0x%X", (uintptr_t)send_param);
-                return NULL;
-        }
-
-        if (peer == NULL)
-                return espnow_get_default_send_param(send_param);
-
-        if (memcmp(peer->mac, broadcast_mac, ESP_NOW_ETH_ALEN) == 0)
-                return espnow_get_send_param_broadcast(send_param);
-
-        return espnow_get_send_param_unicast(send_param, peer->mac);
+        espnow_tx_frame_info_t *info = &espnow_tx_frame_info[frame];
+        if (info->type == ESPNOW_PACKET_TYPE_CONTROLLER_STATE || info->type == ESPNOW_PACKET_TYPE_CONTROLLER_DELTA)
+                espnow_controller_send_result(&peer->controller_tx, info->tag, false);
+        espnow_tx_frame_release(frame);
 }
 
-void esp_connection_handle_init(esp_connection_handle_t *handle)
+// Next sequence number towards `peer`, or towards any unknown peer, app_main and the dispatcher task both send
+static uint16_t espnow_seq_next(esp_peer_handle_t *peer)
 {
-        if (handle == NULL)
-        {
-                LOG_ERROR("NULL pointer, handle=0x%X", (uintptr_t)handle);
-                return;
-        }
-
-        handle->size = 0;
-        handle->limit = -1;
-        handle->remote_connected = false;
-        handle->entries = malloc(sizeof(esp_peer_handle_t));
-        if (handle->entries == NULL)
-        {
-                LOG_ERROR("malloc failed, cannot create node entries");
-                return;
-        }
+        portENTER_CRITICAL(&espnow_tx_queue_lock);
+        uint16_t seq_num = (peer != NULL) ? peer->seq_tx++ : espnow_seq[ESPNOW_PARAM_SEQ_TX]++;
+        portEXIT_CRITICAL(&espnow_tx_queue_lock);
+        return seq_num;
 }
 
-void esp_connection_handle_connect_to_device_settings(esp_connection_handle_t *handle, device_settings_t *device_settings)
+// Take the oldest queued frame that is not a fragment out of a full queue, returns its frame or -1 if every one is a fragment
+// Fragments are not retransmitted, any other packet is superseded by a newer one or retransmitted by the reliable channel
+// Called under `espnow_tx_queue_lock`
+static int esp_peer_tx_evict(esp_peer_tx_queue_t *tx)
 {
-        if ((handle == NULL) || device_settings == NULL)
+        for (size_t n = 0; n < tx->count; n++)
         {
-                LOG_ERROR("NULL pointer, handle=0x%X, device_settings=0x%X", (uintptr_t)handle, (uintptr_t)device_settings);
-                return;
+                size_t pos = (tx->head + n) % ESP_PEER_TX_QUEUE_SIZE;
+                int frame = tx->entries[pos].frame;
+                if (espnow_tx_frame_info[frame].type == ESPNOW_PACKET_TYPE_FRAGMENT)
+                        continue;
+                for (; n + 1 < tx->count; n++)
+                {
+                        size_t next = (pos + 1) % ESP_PEER_TX_QUEUE_SIZE;
+                        tx->entries[pos] = tx->entries[next];
+                        pos = next;
+                }
+                tx->count--;
+                tx->dropped++;
+                return frame;
         }
-        handle->device_settings = device_settings;
+        return -1;
 }
 
-void esp_connection_handle_clear(esp_connection_handle_t *handle)
+// Queue `frame` for `peer` and set the sequence number it is sent with, returns false if the queue is full of fragments
+// A refused frame is discarded, the number is taken under the queue lock so frames leave in the order of their numbers
+static bool esp_peer_tx_push(esp_peer_handle_t *peer, size_t frame, uint16_t *seq_num)
 {
-        if (handle == NULL)
-        {
-                LOG_ERROR("NULL pointer, handle=0x%X", (uintptr_t)handle);
-                return;
+        esp_peer_tx_queue_t *tx = &peer->tx;
+        int dropped = -1;
+        bool queued = true;
+        portENTER_CRITICAL(&espnow_tx_queue_lock);
+        if (tx->count == ESP_PEER_TX_QUEUE_SIZE)
+        {
+                dropped = esp_peer_tx_evict(tx);
+                if (dropped < 0)
+                {
+                        dropped = frame;
+                        queued = false;
+                        tx->dropped++;
+                }
         }
-        if (handle->entries == NULL)
+        if (queued)
         {
-                LOG_WARNING("NULL pointer, handle->entries=0x%X", (uintptr_t)handle->entries);
-                return;
+                esp_peer_tx_entry_t *entry = &tx->entries[(tx->head + tx->count) % ESP_PEER_TX_QUEUE_SIZE];
+                entry->frame = frame;
+                entry->seq_num = peer->seq_tx++;
+                *seq_num = entry->seq_num;
+                tx->count++;
+                tx->queued++;
         }
-        free(handle->entries);
+        portEXIT_CRITICAL(&espnow_tx_queue_lock);
+        if (dropped >= 0)
+                esp_peer_tx_discard(peer, dropped);
+        return queued;
 }
 
-void esp_connection_handle_update(esp_connection_handle_t *handle)
+// Hand the oldest queued frame to ESP-NOW unless a frame is already in flight
+static void esp_peer_tx_kick(esp_peer_handle_t *peer)
 {
-        if ((handle == NULL) || (handle->entries == NULL))
-        {
-                LOG_ERROR("NULL pointer, handle=0x%X, handle->entries=0x%X", (uintptr_t)handle, (uintptr_t)handle->entries);
-                return;
-        }
-
-        bool have_unique_peer = esp_connection_count_unique_peer(handle);
-        if (have_unique_peer)
-                esp_connection_purge_non_unique_peers(handle);
-
-        for (size_t i = 0; i < handle->size; i++)
+        esp_peer_tx_queue_t *tx = &peer->tx;
+        for (;;)
         {
-                esp_peer_handle_t *peer = handle->entries + i;
-                if (peer == NULL)
+                portENTER_CRITICAL(&espnow_tx_queue_lock);
+                if (tx->busy || tx->count == 0)
                 {
-                        LOG_ERROR("NULL pointer, peer=0x%X, index=%d", (uintptr_t)peer, i);
-                        continue;
+                        portEXIT_CRITICAL(&espnow_tx_queue_lock);
+                        return;
                 }
-
-                espnow_send_param_t send_param;
-                switch (peer->status)
+                esp_peer_tx_entry_t entry = tx->entries[tx->head];
+                tx->head = (tx->head + 1) % ESP_PEER_TX_QUEUE_SIZE;
+                tx->count--;
+                tx->busy = true;
+                tx->sent_us = esp_timer_get_time();
+                portEXIT_CRITICAL(&espnow_tx_queue_lock);
+
+                // Frames shared by several peers only differ in the sequence number, patched under the send lock
+                espnow_tx_frame_info_t *info = &espnow_tx_frame_info[entry.frame];
+                espnow_packet_t *packet = (espnow_packet_t *)espnow_tx_frames[entry.frame];
+                xSemaphoreTake(espnow_send_lock, portMAX_DELAY);
+                if (espnow_tx_paused)
                 {
-                case ESP_PEER_STATUS_UNKNOWN:
-                case ESP_PEER_STATUS_PROTOCOL_ERROR:
-                case ESP_PEER_STATUS_NOREPLY:
-                case ESP_PEER_STATUS_IN_RANGE:
-                        if (esp_timer_get_time() - peer->lastseen_broadcast_us > ONE_SECOND_IN_US)
-                                if (esp_timer_get_time() - peer->lastseen_unicast_us > ONE_SECOND_IN_US)
-                                        esp_peer_set_status(peer, ESP_PEER_STATUS_LOST);
-                        break;
-                case ESP_PEER_STATUS_CONNECTED:
-                        if (!peer->saved_to_rom)
+                        // Back to the head of the queue, in place of a newer frame that is not a fragment if the queue filled meanwhile
+                        // Still under the send lock, so the release of the pause finds the frame queued
+                        int dropped = -1;
+                        portENTER_CRITICAL(&espnow_tx_queue_lock);
+                        if (tx->count == ESP_PEER_TX_QUEUE_SIZE)
+                                dropped = esp_peer_tx_evict(tx);
+                        if (tx->count < ESP_PEER_TX_QUEUE_SIZE)
                         {
-                                device_settings_set_mac(handle->device_settings, peer->mac);
-                                esp_connection_set_unique_peer_mac(handle, peer->mac);
-                                peer->saved_to_rom = true;
+                                tx->head = (tx->head + ESP_PEER_TX_QUEUE_SIZE - 1) % ESP_PEER_TX_QUEUE_SIZE;
+                                tx->entries[tx->head] = entry;
+                                tx->count++;
                         }
-                        if (esp_timer_get_time() - peer->lastseen_unicast_us > ONE_SECOND_IN_US)
-                                esp_peer_set_status(peer, ESP_PEER_STATUS_LOST);
-                        break;
-                case ESP_PEER_STATUS_CONNECTING:
-                        if (esp_timer_get_time() - peer->last_ping_us > 3 * 1e5)
-                        {
-                                peer->last_ping_us = esp_timer_get_time();
-                                espnow_get_default_send_param(&send_param);
-                                espnow_get_send_param_unicast(&send_param, peer->mac);
-                                peer->lastseen_unicast_us = esp_timer_get_time();
-                                espnow_send_data(&send_param, ESPNOW_PACKET_TYPE_CONNECT, NULL, 0);
-                        }
-
-                        if (esp_timer_get_time() - peer->connect_time_us > ONE_SECOND_IN_US)
-                                esp_peer_set_status(peer, ESP_PEER_STATUS_NOREPLY);
-                        break;
-                case ESP_PEER_STATUS_AVAILABLE:
-                        if ((handle->limit != -1) && (handle->remote_connected >= handle->limit))
+                        else
                         {
-                                esp_peer_set_status(peer, ESP_PEER_STATUS_REJECTED);
-                                break;
+                                dropped = entry.frame;
+                                tx->dropped++;
                         }
-                        peer->connect_time_us = esp_timer_get_time();
-                        peer->lastseen_unicast_us = esp_timer_get_time();
-                        espnow_get_default_send_param(&send_param);
-                        espnow_get_send_param_unicast(&send_param, peer->mac);
-                        espnow_send_data(&send_param, ESPNOW_PACKET_TYPE_CONNECT, NULL, 0);
-                        esp_peer_set_status(peer, ESP_PEER_STATUS_CONNECTING);
-                        break;
-                case ESP_PEER_STATUS_LOST:
-                case ESP_PEER_STATUS_REJECTED:
-                case ESP_PEER_STATUS_MAX:
-                        if (peer->is_unique)
-                                esp_peer_set_status(peer, ESP_PEER_STATUS_AVAILABLE);
-                        break;
+                        tx->busy = false;
+                        portEXIT_CRITICAL(&espnow_tx_queue_lock);
+                        xSemaphoreGive(espnow_send_lock);
+                        if (dropped >= 0)
+                                esp_peer_tx_discard(peer, dropped);
+                        return;
+                }
+                packet->seq_num = entry.seq_num;
+                packet->crc = 0;
+                packet->crc = esp_crc16_le(UINT16_MAX, (uint8_t const *)packet, info->len);
+                esp_err_t ret = esp_now_send(peer->mac, (uint8_t *)packet, info->len);
+                if (ret == ESP_OK)
+                        espnow_inflight_push(peer->mac, info->type, info->tag);
+                xSemaphoreGive(espnow_send_lock);
+
+                if (ret == ESP_OK)
+                {
+                        espnow_tx_frame_release(entry.frame);
+                        esp_connection_schedule_before(esp_connection_handle, peer, tx->sent_us + ESP_PEER_TX_TIMEOUT_MS * 1000);
+                        return;
                 }
+
+                LOG_WARNING("Send %s to " MACSTR " failed: %s", ESPNOW_PACKET_TYPE_STRING[info->type], MAC2STR(peer->mac), esp_err_to_name(ret));
+                esp_peer_tx_discard(peer, entry.frame);
+                portENTER_CRITICAL(&espnow_tx_queue_lock);
+                tx->busy = false;
+                portEXIT_CRITICAL(&espnow_tx_queue_lock);
         }
-        handle->remote_connected = esp_connection_count_connected(handle);
 }
 
-void esp_connection_update_rssi(esp_connection_handle_t *handle, const rssi_event_t *rssi_event)
+// The frame in flight is done with, send the next one
+static void esp_peer_tx_done(esp_peer_handle_t *peer)
+{
+        portENTER_CRITICAL(&espnow_tx_queue_lock);
+        peer->tx.busy = false;
+        portEXIT_CRITICAL(&espnow_tx_queue_lock);
+        esp_peer_tx_kick(peer);
+}
+
+// Drop every queued frame, before the peer is forgotten or shut out
+static void esp_peer_tx_flush(esp_peer_handle_t *peer)
 {
-        if ((handle == NULL) || (handle->entries == NULL) || (rssi_event == NULL))
+        esp_peer_tx_queue_t *tx = &peer->tx;
+        for (;;)
         {
-                LOG_ERROR("NULL pointer, handle=0x%X, handle->entries=0x%X, rssi_event=0x%X", (uintptr_t)handle, (uintptr_t)handle->entries, (uintptr_t)rssi_event);
-                return;
+                portENTER_CRITICAL(&espnow_tx_queue_lock);
+                tx->busy = false;
+                if (tx->count == 0)
+                {
+                        portEXIT_CRITICAL(&espnow_tx_queue_lock);
+                        return;
+                }
+                size_t frame = tx->entries[tx->head].frame;
+                tx->head = (tx->head + 1) % ESP_PEER_TX_QUEUE_SIZE;
+                tx->count--;
+                portEXIT_CRITICAL(&espnow_tx_queue_lock);
+                esp_peer_tx_discard(peer, frame);
         }
+}
 
-        esp_peer_handle_t *peer = esp_connection_mac_add_to_entry(handle, rssi_event->recv_mac);
-        peer->rssi = rssi_event->rssi;
-
-        const int rssi_min = MIN_RSSI_TO_INITIATE_CONNECTION;
-        if (rssi_event->rssi > rssi_min)
+esp_err_t espnow_send_data(espnow_send_param_t *send_param, espnow_packet_type_t type, void *data, size_t len)
+{
+        uint32_t start_cycles = esp_cpu_get_cycle_count();
+        if (send_param == NULL)
         {
-                if (peer->status == ESP_PEER_STATUS_CONNECTED)
-                        peer->lastseen_unicast_us = esp_timer_get_time();
+                LOG_WARNING("NULL pointer, send_param=0x%X", (uintptr_t)send_param);
+                return ESP_ERR_INVALID_ARG;
+        }
+
+        esp_peer_handle_t *peer = esp_connection_mac_lookup(esp_connection_handle, send_param->dest_mac);
+
+        if (esp_connection_is_full(esp_connection_handle) && (peer == NULL || !peer->is_unique))
+                return ESP_OK;
+
+        // Unicast to a known peer goes through its transmit queue, one frame in flight per peer
+        // Queued frames get their sequence number when they join the queue
+        bool queued = peer != NULL && send_param->broadcast == ESPNOW_DATA_UNICAST && memcmp(peer->mac, broadcast_mac, ESP_NOW_ETH_ALEN) != 0;
+        send_param->seq_num = queued ? 0 : espnow_seq_next(peer);
+        if (peer != NULL)
+                peer->timing->lastsent_unicast_us = esp_timer_get_time();
+        esp_err_t ret;
+        send_param->type = type;
+        // Broadcasts and connection requests must be understood by any peer
+        bool negotiated = peer != NULL && send_param->broadcast == ESPNOW_DATA_UNICAST && type != ESPNOW_PACKET_TYPE_CONNECT;
+        send_param->version = (negotiated && peer->version) ? peer->version : ESPNOW_PROTOCOL_VERSION_MIN;
+        if (espnow_payload_create(send_param, data, len) == NULL)
+        {
+                espnow_send_stats_record(start_cycles, ESP_ERR_NO_MEM);
+                return ESP_ERR_NO_MEM;
+        }
+        espnow_packet_t *packet = (espnow_packet_t *)send_param->buffer;
+
+        if (peer != NULL)
+                esp_peer_register(peer);
+
+        uint16_t tag = espnow_packet_tag(type, data, len);
+        if (queued)
+        {
+                size_t frame = espnow_tx_frame_index(send_param->buffer);
+                espnow_tx_frame_info[frame].len = send_param->len;
+                espnow_tx_frame_info[frame].type = type;
+                espnow_tx_frame_info[frame].tag = tag;
+                atomic_store(&espnow_tx_frame_info[frame].refs, 1);
+                send_param->buffer = NULL;
+                send_param->len = 0;
+                if (!esp_peer_tx_push(peer, frame, &send_param->seq_num))
+                {
+                        LOG_DEBUG("Send %s to " MACSTR " refused, queue full of fragments", ESPNOW_PACKET_TYPE_STRING[type], MAC2STR(send_param->dest_mac));
+                        espnow_send_stats_record(start_cycles, ESP_ERR_NO_MEM);
+                        return ESP_ERR_NO_MEM;
+                }
+                LOG_VERBOSE("Send %s to " MACSTR " , seq:%d, len:%d", ESPNOW_PACKET_TYPE_STRING[type], MAC2STR(send_param->dest_mac), send_param->seq_num, (int)len);
+                esp_peer_tx_kick(peer);
+                espnow_send_stats_record(start_cycles, ESP_OK);
+                return ESP_OK;
+        }
+
+        LOG_VERBOSE("Send %s to " MACSTR " , seq:%d, len:%d", ESPNOW_PACKET_TYPE_STRING[type], MAC2STR(send_param->dest_mac), packet->seq_num, packet->len);
+        // Broadcasts are not held through a channel scan, the next one goes out when the radio is back
+        xSemaphoreTake(espnow_send_lock, portMAX_DELAY);
+        ret = espnow_tx_paused ? ESP_ERR_INVALID_STATE : esp_now_send(send_param->dest_mac, send_param->buffer, send_param->len);
+        if (ret == ESP_OK)
+                espnow_inflight_push(send_param->dest_mac, type, tag);
+        xSemaphoreGive(espnow_send_lock);
+        espnow_payload_cleanup(send_param);
+        espnow_send_stats_record(start_cycles, ret);
+        return ret;
+}
+
+// Wire format version a fan-out copy is built with for `peer`, 0 if the peer is skipped
+static uint8_t esp_peer_fanout_version(esp_peer_handle_t *peer, bool full)
+{
+        if (peer == NULL || (full && !peer->is_unique) || memcmp(peer->mac, broadcast_mac, ESP_NOW_ETH_ALEN) == 0)
+                return 0;
+        return peer->version ? peer->version : ESPNOW_PROTOCOL_VERSION_MIN;
+}
+
+esp_err_t espnow_send_fanout(esp_peer_handle_t *const *peers, size_t count, espnow_packet_type_t type, const void *data, size_t len)
+{
+        uint32_t start_cycles = esp_cpu_get_cycle_count();
+        if (peers == NULL)
+        {
+                LOG_WARNING("NULL pointer, peers=0x%X", (uintptr_t)peers);
+                return ESP_ERR_INVALID_ARG;
+        }
+
+        esp_err_t ret = ESP_OK;
+        bool full = esp_connection_is_full(esp_connection_handle);
+        uint16_t tag = espnow_packet_tag(type, data, len);
+        for (uint8_t version = ESPNOW_PROTOCOL_VERSION_MIN; version <= ESPNOW_PROTOCOL_VERSION; version++)
+        {
+                uint8_t users = 0;
+                for (size_t i = 0; i < count; i++)
+                        if (esp_peer_fanout_version(peers[i], full) == version)
+                                users++;
+                if (users == 0)
+                        continue;
+
+                // Sequence numbers are patched per peer when the frame leaves its queue
+                espnow_send_param_t send_param = {
+                    .broadcast = ESPNOW_DATA_UNICAST,
+                    .type = type,
+                    .version = version,
+                };
+                if (espnow_payload_create(&send_param, (void *)data, len) == NULL)
+                {
+                        ret = ESP_ERR_NO_MEM;
+                        continue;
+                }
+                size_t frame = espnow_tx_frame_index(send_param.buffer);
+                espnow_tx_frame_info[frame].len = send_param.len;
+                espnow_tx_frame_info[frame].type = type;
+                espnow_tx_frame_info[frame].tag = tag;
+                atomic_store(&espnow_tx_frame_info[frame].refs, users);
+
+                int64_t now_us = esp_timer_get_time();
+                for (size_t i = 0; i < count; i++)
+                {
+                        esp_peer_handle_t *peer = peers[i];
+                        if (esp_peer_fanout_version(peer, full) != version)
+                                continue;
+                        esp_peer_register(peer);
+                        peer->timing->lastsent_unicast_us = now_us;
+                        uint16_t seq_num;
+                        if (esp_peer_tx_push(peer, frame, &seq_num))
+                                esp_peer_tx_kick(peer);
+                }
+        }
+        espnow_send_stats_record(start_cycles, ret);
+        return ret;
+}
+
+// Append the fields of `state` that differ from `base`, returns the number of bytes written
+static size_t espnow_controller_delta_fields(const remote_controller_state_pkt_t *base, const remote_controller_state_pkt_t *state, uint8_t *changed, uint8_t *fields)
+{
+        size_t len = 0;
+        *changed = 0;
+        if (state->buttons != base->buttons)
+        {
+                *changed |= REMOTE_CONTROLLER_FIELD_BUTTONS;
+                memcpy(fields + len, &state->buttons, sizeof(state->buttons));
+                len += sizeof(state->buttons);
+        }
+        if (state->press_count != base->press_count)
+        {
+                *changed |= REMOTE_CONTROLLER_FIELD_PRESS_COUNT;
+                memcpy(fields + len, &state->press_count, sizeof(state->press_count));
+                len += sizeof(state->press_count);
+        }
+        if (state->axis_x != base->axis_x)
+        {
+                *changed |= REMOTE_CONTROLLER_FIELD_AXIS_X;
+                fields[len++] = state->axis_x;
+        }
+        if (state->axis_y != base->axis_y)
+        {
+                *changed |= REMOTE_CONTROLLER_FIELD_AXIS_Y;
+                fields[len++] = state->axis_y;
+        }
+        return len;
+}
+
+static bool espnow_controller_needs_keyframe(const espnow_controller_encoder_t *encoder, const remote_controller_state_pkt_t *state)
+{
+        uint16_t base_offset = state->seq_num - encoder->acked.seq_num;
+        return !encoder->acked_valid ||
+               encoder->force_keyframe ||
+               encoder->since_keyframe >= ESPNOW_CONTROLLER_KEYFRAME_INTERVAL ||
+               base_offset > UINT8_MAX;
+}
+
+// Build the snapshot or delta frame `encoder` sends next for `state`, returns the payload length
+static size_t espnow_controller_encode(const espnow_controller_encoder_t *encoder, const remote_controller_state_pkt_t *state, uint8_t *buffer, bool *keyframe)
+{
+        *keyframe = espnow_controller_needs_keyframe(encoder, state);
+        if (*keyframe)
+        {
+                memcpy(buffer, state, sizeof(remote_controller_state_pkt_t));
+                return sizeof(remote_controller_state_pkt_t);
+        }
+
+        remote_controller_delta_pkt_t *delta = (remote_controller_delta_pkt_t *)buffer;
+        delta->seq_num = state->seq_num;
+        delta->base_offset = state->seq_num - encoder->acked.seq_num;
+        size_t len = sizeof(remote_controller_delta_pkt_t) + espnow_controller_delta_fields(&encoder->acked, state, &delta->changed, delta->fields);
+        if (len < sizeof(remote_controller_state_pkt_t))
+                return len;
+
+        // Most fields changed, the snapshot itself is no longer and needs no base
+        *keyframe = true;
+        memcpy(buffer, state, sizeof(remote_controller_state_pkt_t));
+        return sizeof(remote_controller_state_pkt_t);
+}
+
+// Record a snapshot about to be handed to the transmit path, it becomes the delta base once its send result arrives
+// Called with the controller lock held and before the frame is sent, its send result may arrive before the send returns
+static void espnow_controller_encoder_sent(espnow_controller_encoder_t *encoder, const remote_controller_state_pkt_t *state, bool keyframe)
+{
+        if (keyframe)
+        {
+                encoder->since_keyframe = 0;
+                encoder->force_keyframe = false;
+        }
+        else
+        {
+                encoder->since_keyframe++;
+        }
+
+        if (encoder->pending_count == ESPNOW_CONTROLLER_PENDING_SIZE)
+        {
+                memmove(encoder->pending, encoder->pending + 1, sizeof(remote_controller_state_pkt_t) * (ESPNOW_CONTROLLER_PENDING_SIZE - 1));
+                encoder->pending_count--;
+        }
+        encoder->pending[encoder->pending_count++] = *state;
+}
+
+static void espnow_controller_stats_record(bool keyframe, size_t payload_len, size_t peers)
+{
+        if (keyframe)
+                espnow_controller_stats.keyframes += peers;
+        else
+                espnow_controller_stats.deltas += peers;
+        espnow_controller_stats.payload_bytes += payload_len * peers;
+        espnow_controller_stats.full_bytes += sizeof(remote_controller_state_pkt_t) * peers;
+}
+
+esp_err_t espnow_send_controller_state(espnow_send_param_t *send_param, const remote_controller_state_pkt_t *state)
+{
+        if ((send_param == NULL) || (state == NULL))
+        {
+                LOG_WARNING("NULL pointer, send_param=0x%X, state=0x%X", (uintptr_t)send_param, (uintptr_t)state);
+                return ESP_ERR_INVALID_ARG;
+        }
+
+        esp_peer_handle_t *peer = esp_connection_mac_lookup(esp_connection_handle, send_param->dest_mac);
+        if (peer == NULL || send_param->broadcast == ESPNOW_DATA_BROADCAST)
+                return espnow_send_data(send_param, ESPNOW_PACKET_TYPE_CONTROLLER_STATE, (void *)state, sizeof(remote_controller_state_pkt_t));
+
+        uint8_t buffer[sizeof(remote_controller_delta_pkt_t) + sizeof(remote_controller_state_pkt_t)];
+        bool keyframe;
+        portENTER_CRITICAL(&espnow_controller_lock);
+        size_t payload_len = espnow_controller_encode(&peer->controller_tx, state, buffer, &keyframe);
+        espnow_controller_encoder_sent(&peer->controller_tx, state, keyframe);
+        portEXIT_CRITICAL(&espnow_controller_lock);
+
+        esp_err_t ret = espnow_send_data(send_param, keyframe ? ESPNOW_PACKET_TYPE_CONTROLLER_STATE : ESPNOW_PACKET_TYPE_CONTROLLER_DELTA, buffer, payload_len);
+        if (ret != ESP_OK)
+        {
+                espnow_controller_send_result(&peer->controller_tx, state->seq_num, false);
+                return ret;
+        }
+        espnow_controller_stats_record(keyframe, payload_len, 1);
+        return ESP_OK;
+}
+
+esp_err_t espnow_send_controller_state_fanout(esp_peer_handle_t *const *peers, size_t count, const remote_controller_state_pkt_t *state)
+{
+        if ((peers == NULL) || (state == NULL))
+        {
+                LOG_WARNING("NULL pointer, peers=0x%X, state=0x%X", (uintptr_t)peers, (uintptr_t)state);
+                return ESP_ERR_INVALID_ARG;
+        }
+        if (count > ESP_CONNECTION_MAX_PEERS)
+        {
+                LOG_WARNING("Too many peers, count:%d>max:%d", count, ESP_CONNECTION_MAX_PEERS);
+                return ESP_ERR_INVALID_ARG;
+        }
+
+        // Peers that take a keyframe, or a delta against the same acknowledged snapshot, receive the same frame
+        esp_err_t ret = ESP_OK;
+        bool done[ESP_CONNECTION_MAX_PEERS] = {0};
+        esp_peer_handle_t *group[ESP_CONNECTION_MAX_PEERS];
+        for (size_t i = 0; i < count; i++)
+        {
+                if (done[i] || peers[i] == NULL)
+                        continue;
+
+                uint8_t buffer[sizeof(remote_controller_delta_pkt_t) + sizeof(remote_controller_state_pkt_t)];
+                bool keyframe;
+                const espnow_controller_encoder_t *encoder = &peers[i]->controller_tx;
+                portENTER_CRITICAL(&espnow_controller_lock);
+                size_t payload_len = espnow_controller_encode(encoder, state, buffer, &keyframe);
+                size_t members = 0;
+                for (size_t j = i; j < count; j++)
+                {
+                        if (done[j] || peers[j] == NULL)
+                                continue;
+                        if (j != i)
+                        {
+                                if (espnow_controller_needs_keyframe(&peers[j]->controller_tx, state) != keyframe)
+                                        continue;
+                                if (!keyframe && memcmp(&peers[j]->controller_tx.acked, &encoder->acked, sizeof(remote_controller_state_pkt_t)) != 0)
+                                        continue;
+                        }
+                        group[members++] = peers[j];
+                        done[j] = true;
+                }
+                for (size_t k = 0; k < members; k++)
+                        espnow_controller_encoder_sent(&group[k]->controller_tx, state, keyframe);
+                portEXIT_CRITICAL(&espnow_controller_lock);
+
+                esp_err_t err = espnow_send_fanout(group, members, keyframe ? ESPNOW_PACKET_TYPE_CONTROLLER_STATE : ESPNOW_PACKET_TYPE_CONTROLLER_DELTA, buffer, payload_len);
+                if (err != ESP_OK)
+                {
+                        for (size_t k = 0; k < members; k++)
+                                espnow_controller_send_result(&group[k]->controller_tx, state->seq_num, false);
+                        ret = err;
+                        continue;
+                }
+                espnow_controller_stats_record(keyframe, payload_len, members);
+        }
+        return ret;
+}
+
+// Apply the send result of the controller snapshot `seq_num` to the encoder
+static void espnow_controller_send_result(espnow_controller_encoder_t *encoder, uint16_t seq_num, bool success)
+{
+        portENTER_CRITICAL_SAFE(&espnow_controller_lock);
+        for (uint8_t i = 0; i < encoder->pending_count; i++)
+        {
+                if (encoder->pending[i].seq_num != seq_num)
+                        continue;
+
+                if (success)
+                {
+                        encoder->acked = encoder->pending[i];
+                        encoder->acked_valid = true;
+                }
+                else
+                {
+                        encoder->force_keyframe = true;
+                }
+                encoder->pending_count -= i + 1;
+                memmove(encoder->pending, encoder->pending + i + 1, sizeof(remote_controller_state_pkt_t) * encoder->pending_count);
+                break;
+        }
+        portEXIT_CRITICAL_SAFE(&espnow_controller_lock);
+}
+
+// The send result only tells the frame reached the peer radio, the peer may still have dropped it
+// Ask for a keyframe instead of refusing every delta until the next one, spaced out while the reply is on its way
+static void espnow_controller_request_keyframe(esp_peer_handle_t *peer)
+{
+        espnow_controller_decoder_t *decoder = &peer->controller_rx;
+        int64_t now_us = esp_timer_get_time();
+        if (decoder->requested_us != 0 && now_us - decoder->requested_us < ESPNOW_CONTROLLER_REQUEST_MS * 1000)
+                return;
+
+        espnow_send_param_t send_param;
+        espnow_get_default_send_param(&send_param);
+        espnow_get_send_param_unicast(&send_param, peer->mac);
+        if (espnow_send_data(&send_param, ESPNOW_PACKET_TYPE_KEYFRAME_REQUEST, NULL, 0) != ESP_OK)
+                return;
+        decoder->requested_us = now_us;
+        espnow_controller_stats.requests++;
+}
+
+// The peer lost the base of a delta, the next controller state is sent in full
+static void espnow_controller_keyframe_requested(esp_peer_handle_t *peer)
+{
+        portENTER_CRITICAL(&espnow_controller_lock);
+        peer->controller_tx.force_keyframe = true;
+        portEXIT_CRITICAL(&espnow_controller_lock);
+        espnow_controller_stats.requested++;
+}
+
+remote_controller_state_pkt_t *espnow_controller_decode(esp_peer_handle_t *peer, espnow_packet_t *recv_data, remote_controller_state_pkt_t *state)
+{
+        if ((peer == NULL) || (recv_data == NULL) || (state == NULL))
+        {
+                LOG_ERROR("NULL pointer, peer=0x%X, recv_data=0x%X, state=0x%X", (uintptr_t)peer, (uintptr_t)recv_data, (uintptr_t)state);
+                return NULL;
+        }
+
+        espnow_controller_decoder_t *decoder = &peer->controller_rx;
+        if (ESPNOW_PACKET_TYPE(recv_data) == ESPNOW_PACKET_TYPE_CONTROLLER_STATE)
+        {
+                if (recv_data->len != sizeof(remote_controller_state_pkt_t))
+                        return NULL;
+                memcpy(state, recv_data->payload, sizeof(remote_controller_state_pkt_t));
+                // The keyframe answers any request, the next lost base is asked for at once
+                decoder->requested_us = 0;
+        }
+        else if (ESPNOW_PACKET_TYPE(recv_data) == ESPNOW_PACKET_TYPE_CONTROLLER_DELTA)
+        {
+                if (recv_data->len < sizeof(remote_controller_delta_pkt_t))
+                        return NULL;
+
+                remote_controller_delta_pkt_t delta;
+                memcpy(&delta, recv_data->payload, sizeof(remote_controller_delta_pkt_t));
+                uint16_t base_seq_num = delta.seq_num - delta.base_offset;
+                size_t slot = base_seq_num % ESPNOW_CONTROLLER_HISTORY_SIZE;
+                if (!decoder->history_valid[slot] || decoder->history[slot].seq_num != base_seq_num)
+                {
+                        LOG_VERBOSE("Controller delta %d from " MACSTR " lost its base %d", delta.seq_num, MAC2STR(peer->mac), base_seq_num);
+                        espnow_controller_request_keyframe(peer);
+                        return NULL;
+                }
+
+                *state = decoder->history[slot];
+                state->seq_num = delta.seq_num;
+                const uint8_t *fields = recv_data->payload + sizeof(remote_controller_delta_pkt_t);
+                size_t fields_len = recv_data->len - sizeof(remote_controller_delta_pkt_t);
+                size_t pos = 0;
+                if (delta.changed & REMOTE_CONTROLLER_FIELD_BUTTONS)
+                {
+                        if (pos + sizeof(state->buttons) > fields_len)
+                                return NULL;
+                        memcpy(&state->buttons, fields + pos, sizeof(state->buttons));
+                        pos += sizeof(state->buttons);
+                }
+                if (delta.changed & REMOTE_CONTROLLER_FIELD_PRESS_COUNT)
+                {
+                        if (pos + sizeof(state->press_count) > fields_len)
+                                return NULL;
+                        memcpy(&state->press_count, fields + pos, sizeof(state->press_count));
+                        pos += sizeof(state->press_count);
+                }
+                if (delta.changed & REMOTE_CONTROLLER_FIELD_AXIS_X)
+                {
+                        if (pos + 1 > fields_len)
+                                return NULL;
+                        state->axis_x = fields[pos++];
+                }
+                if (delta.changed & REMOTE_CONTROLLER_FIELD_AXIS_Y)
+                {
+                        if (pos + 1 > fields_len)
+                                return NULL;
+                        state->axis_y = fields[pos++];
+                }
+        }
+        else
+        {
+                return NULL;
+        }
+
+        size_t slot = state->seq_num % ESPNOW_CONTROLLER_HISTORY_SIZE;
+        decoder->history[slot] = *state;
+        decoder->history_valid[slot] = true;
+        return state;
+}
+
+esp_err_t espnow_send_connect(espnow_send_param_t *send_param)
+{
+        espnow_connect_pkt_t connect = {
+            .version_min = ESPNOW_PROTOCOL_VERSION_MIN,
+            .version_max = ESPNOW_PROTOCOL_VERSION,
+        };
+        return espnow_send_data(send_param, ESPNOW_PACKET_TYPE_CONNECT, &connect, sizeof(connect));
+}
+
+esp_err_t espnow_send_text(espnow_send_param_t *send_param, char *text)
+{
+        return espnow_send_data(send_param, ESPNOW_PACKET_TYPE_TEXT, text, strlen(text));
+}
+
+QueueHandle_t espnow_init(espnow_wifi_config_t *espnow_config, esp_connection_handle_t *conn_handle)
+{
+        if ((espnow_config == NULL) || (conn_handle == NULL))
+        {
+                LOG_ERROR("NULL pointer, espnow_config=0x%X, conn_handle=0x%X", (uintptr_t)espnow_config, (uintptr_t)conn_handle);
+                return NULL;
+        }
+
+        esp_connection_handle = conn_handle;
+        frame_pool_init(&espnow_rx_pool, "espnow_rx", espnow_rx_frames, ESPNOW_QUEUE_SIZE);
+        frame_pool_init(&espnow_tx_pool, "espnow_tx", espnow_tx_frames, ESPNOW_TX_POOL_SIZE);
+        espnow_send_lock = xSemaphoreCreateMutex();
+        if (espnow_send_lock == NULL)
+        {
+                LOG_ERROR("Create send lock failed");
+                return NULL;
+        }
+        espnow_queue = xQueueCreate(ESPNOW_QUEUE_SIZE, sizeof(espnow_event_t));
+        if (espnow_queue == NULL)
+        {
+                LOG_ERROR("Create queue failed");
+                return NULL;
+        }
+
+        /* Initialize ESPNOW and register sending and receiving callback function. */
+        ESP_ERROR_CHECK(esp_now_init());
+        espnow_rate_init(espnow_config);
+        ESP_ERROR_CHECK(esp_now_register_send_cb(espnow_send_cb));
+        ESP_ERROR_CHECK(esp_now_register_recv_cb(espnow_recv_cb));
+#if CONFIG_ESP_WIFI_STA_DISCONNECTED_PM_ENABLE
+        ESP_ERROR_CHECK(esp_now_set_wake_window(65535));
+#endif
+        /* Set primary master key. */
+        ESP_ERROR_CHECK(esp_now_set_pmk((uint8_t *)espnow_config->pmk));
+
+        /* Add broadcast peer information to peer list. */
+        esp_now_peer_info_t peer_info = {
+            .channel = espnow_config->channel,
+            .encrypt = false,
+            .ifidx = espnow_config->esp_interface,
+        };
+        memcpy(peer_info.peer_addr, broadcast_mac, ESP_NOW_ETH_ALEN);
+        ESP_ERROR_CHECK(esp_now_add_peer(&peer_info));
+        esp_peer_handle_t *peer = esp_connection_mac_add_to_entry(esp_connection_handle, peer_info.peer_addr);
+        if (peer != NULL)
+                peer->registered = true;
+        return espnow_queue;
+}
+
+espnow_send_param_t *espnow_get_send_param_broadcast(espnow_send_param_t *send_param)
+{
+        if (send_param == NULL)
+        {
+                LOG_ERROR("NULL pointer, send_param=0x%X", (uintptr_t)send_param);
+                return NULL;
+        }
+
+        send_param->broadcast = ESPNOW_DATA_BROADCAST;
+        memcpy(send_param->dest_mac, broadcast_mac, ESP_NOW_ETH_ALEN);
+        return send_param;
+}
+
+espnow_send_param_t *espnow_get_send_param_unicast(espnow_send_param_t *send_param, const uint8_t *mac)
+{
+        if (send_param == NULL)
+        {
+                LOG_ERROR("NULL pointer, send_param=0x%X", (uintptr_t)send_param);
+                return NULL;
+        }
+        send_param->broadcast = ESPNOW_DATA_UNICAST;
+        memcpy(send_param->dest_mac, mac, ESP_NOW_ETH_ALEN);
+        return send_param;
+}
+
+espnow_send_param_t *espnow_get_send_param(espnow_send_param_t *send_param, esp_peer_handle_t *peer)
+{
+        if (send_param == NULL)
+        {
+                LOG_ERROR("NULL pointer, send_param=0x%X", (uintptr_t)send_param);
+                return NULL;
+        }
+
+        if (peer == NULL)
+                return espnow_get_default_send_param(send_param);
+
+        if (memcmp(peer->mac, broadcast_mac, ESP_NOW_ETH_ALEN) == 0)
+                return espnow_get_send_param_broadcast(send_param);
+
+        return espnow_get_send_param_unicast(send_param, peer->mac);
+}
+
+void esp_connection_handle_init(esp_connection_handle_t *handle)
+{
+        if (handle == NULL)
+        {
+                LOG_ERROR("NULL pointer, handle=0x%X", (uintptr_t)handle);
+                return;
+        }
+
+        handle->size = 0;
+        handle->limit = -1;
+        handle->remote_connected = false;
+        handle->evicted = 0;
+        handle->rssi_sub_count = 0;
+        handle->rssi_pending_count = 0;
+        handle->rssi_dropped = 0;
+        handle->unique_count = 0;
+        handle->wheel_tick = esp_timer_get_time() / (ESP_CONNECTION_UPDATE_INTERVAL_MS * 1000);
+        memset(handle->entries, 0, sizeof(handle->entries));
+        memset(handle->timing, 0, sizeof(handle->timing));
+        for (size_t i = 0; i < ESP_CONNECTION_WHEEL_SLOTS; i++)
+                handle->wheel[i] = ESP_CONNECTION_INDEX_EMPTY;
+        for (size_t i = 0; i < ESP_CONNECTION_INDEX_SIZE; i++)
+                handle->index[i].slot = ESP_CONNECTION_INDEX_EMPTY;
+}
+
+void esp_connection_handle_connect_to_device_settings(esp_connection_handle_t *handle, device_settings_t *device_settings)
+{
+        if ((handle == NULL) || device_settings == NULL)
+        {
+                LOG_ERROR("NULL pointer, handle=0x%X, device_settings=0x%X", (uintptr_t)handle, (uintptr_t)device_settings);
+                return;
+        }
+        handle->device_settings = device_settings;
+}
+
+void esp_connection_handle_clear(esp_connection_handle_t *handle)
+{
+        if (handle == NULL)
+        {
+                LOG_ERROR("NULL pointer, handle=0x%X", (uintptr_t)handle);
+                return;
+        }
+        for (size_t i = 0; i < handle->size; i++)
+                esp_peer_tx_flush(handle->entries + i);
+        device_settings_t *device_settings = handle->device_settings;
+        int8_t limit = handle->limit;
+        esp_rssi_subscription_t rssi_subs[ESP_CONNECTION_RSSI_SUBS];
+        size_t rssi_sub_count = handle->rssi_sub_count;
+        memcpy(rssi_subs, handle->rssi_subs, sizeof(rssi_subs));
+        esp_connection_handle_init(handle);
+        handle->device_settings = device_settings;
+        handle->limit = limit;
+        memcpy(handle->rssi_subs, rssi_subs, sizeof(rssi_subs));
+        handle->rssi_sub_count = rssi_sub_count;
+}
+
+// Take the peer out of its timer wheel slot, called with the wheel lock held
+static void esp_connection_wheel_unlink(esp_connection_handle_t *handle, esp_peer_handle_t *peer)
+{
+        if (peer->deadline_us == 0)
+                return;
+        size_t slot = (peer->deadline_us / (ESP_CONNECTION_UPDATE_INTERVAL_MS * 1000)) % ESP_CONNECTION_WHEEL_SLOTS;
+        if (peer->wheel_prev != ESP_CONNECTION_INDEX_EMPTY)
+                handle->entries[peer->wheel_prev].wheel_next = peer->wheel_next;
+        else
+                handle->wheel[slot] = peer->wheel_next;
+        if (peer->wheel_next != ESP_CONNECTION_INDEX_EMPTY)
+                handle->entries[peer->wheel_next].wheel_prev = peer->wheel_prev;
+        peer->wheel_prev = ESP_CONNECTION_INDEX_EMPTY;
+        peer->wheel_next = ESP_CONNECTION_INDEX_EMPTY;
+        peer->deadline_us = 0;
+}
+
+// Put the peer in the timer wheel slot of `deadline_us`, called with the wheel lock held
+// A deadline in a tick already processed lands in the next one, its slot would only be scanned a turn later
+static void esp_connection_wheel_link(esp_connection_handle_t *handle, esp_peer_handle_t *peer, int64_t deadline_us)
+{
+        esp_peer_slot_t index = peer - handle->entries;
+        int64_t first_us = (handle->wheel_tick + 1) * (ESP_CONNECTION_UPDATE_INTERVAL_MS * 1000);
+        if (deadline_us < first_us)
+                deadline_us = first_us;
+        size_t slot = (deadline_us / (ESP_CONNECTION_UPDATE_INTERVAL_MS * 1000)) % ESP_CONNECTION_WHEEL_SLOTS;
+        peer->deadline_us = deadline_us;
+        peer->wheel_prev = ESP_CONNECTION_INDEX_EMPTY;
+        peer->wheel_next = handle->wheel[slot];
+        if (peer->wheel_next != ESP_CONNECTION_INDEX_EMPTY)
+                handle->entries[peer->wheel_next].wheel_prev = index;
+        handle->wheel[slot] = index;
+}
+
+// Run the state machine of `peer` on the first tick at or after `deadline_us`, replacing its previous deadline
+static void esp_connection_schedule(esp_connection_handle_t *handle, esp_peer_handle_t *peer, int64_t deadline_us)
+{
+        portENTER_CRITICAL(&esp_connection_wheel_lock);
+        esp_connection_wheel_unlink(handle, peer);
+        if (deadline_us > 0)
+                esp_connection_wheel_link(handle, peer, deadline_us);
+        portEXIT_CRITICAL(&esp_connection_wheel_lock);
+}
+
+// Same as `esp_connection_schedule`, unless the peer already runs earlier
+static void esp_connection_schedule_before(esp_connection_handle_t *handle, esp_peer_handle_t *peer, int64_t deadline_us)
+{
+        if (handle == NULL || peer < handle->entries || peer >= handle->entries + ESP_CONNECTION_MAX_PEERS)
+                return;
+        portENTER_CRITICAL(&esp_connection_wheel_lock);
+        if (peer->deadline_us == 0 || deadline_us < peer->deadline_us)
+        {
+                esp_connection_wheel_unlink(handle, peer);
+                esp_connection_wheel_link(handle, peer, deadline_us);
+        }
+        portEXIT_CRITICAL(&esp_connection_wheel_lock);
+}
+
+// Earliest of the deadlines the peer waits for in its status, 0 if it waits for a packet only
+// Deadlines are computed from the timestamps of the last packets, a packet arriving before it
+// does not move the deadline, the state machine runs and finds the peer still alive instead
+static int64_t esp_peer_next_deadline(esp_peer_handle_t *peer, int64_t now_us)
+{
+        esp_peer_timing_t *timing = peer->timing;
+        int64_t deadline_us = 0;
+        switch (peer->status)
+        {
+        case ESP_PEER_STATUS_UNKNOWN:
+        case ESP_PEER_STATUS_PROTOCOL_ERROR:
+        case ESP_PEER_STATUS_NOREPLY:
+        case ESP_PEER_STATUS_IN_RANGE:
+                deadline_us = (timing->lastseen_broadcast_us > timing->lastseen_unicast_us) ? timing->lastseen_broadcast_us : timing->lastseen_unicast_us;
+                deadline_us += (int64_t)ONE_SECOND_IN_US;
+                break;
+        case ESP_PEER_STATUS_CONNECTED:
+                deadline_us = timing->lastseen_unicast_us + (int64_t)ONE_SECOND_IN_US;
+                break;
+        case ESP_PEER_STATUS_CONNECTING:
+                deadline_us = timing->last_ping_us + ESP_CONNECTION_CONNECT_RETRY_MS * 1000;
+                if (timing->connect_time_us + (int64_t)ONE_SECOND_IN_US < deadline_us)
+                        deadline_us = timing->connect_time_us + (int64_t)ONE_SECOND_IN_US;
+                break;
+        case ESP_PEER_STATUS_AVAILABLE:
+                deadline_us = now_us;
+                break;
+        case ESP_PEER_STATUS_LOST:
+        case ESP_PEER_STATUS_REJECTED:
+        case ESP_PEER_STATUS_MAX:
+                deadline_us = peer->is_unique ? now_us : 0;
+                break;
+        }
+
+        if (peer->status >= ESP_PEER_STATUS_CONNECTING || peer->is_unique)
+        {
+                int64_t ping_us = timing->lastsent_unicast_us + ESP_CONNECTION_IDLE_PING_MS * 1000;
+                if (peer->status == ESP_PEER_STATUS_CONNECTED && timing->last_probe_us + ESP_PEER_RTT_PROBE_MS * 1000 < ping_us)
+                        ping_us = timing->last_probe_us + ESP_PEER_RTT_PROBE_MS * 1000;
+                if (deadline_us == 0 || ping_us < deadline_us)
+                        deadline_us = ping_us;
+        }
+
+        if (peer->tx.busy)
+        {
+                int64_t timeout_us = peer->tx.sent_us + ESP_PEER_TX_TIMEOUT_MS * 1000;
+                if (deadline_us == 0 || timeout_us < deadline_us)
+                        deadline_us = timeout_us;
+        }
+        return (deadline_us && deadline_us < now_us) ? now_us : deadline_us;
+}
+
+// Keepalive for idle peers and round trip probe for connected ones
+static void esp_peer_send_heartbeat(esp_connection_handle_t *handle, esp_peer_handle_t *peer, int64_t now_us)
+{
+        if (peer->status < ESP_PEER_STATUS_CONNECTING && !peer->is_unique)
+                return;
+
+        // Any unicast frame keeps the link alive, a keepalive is only needed when nothing else was sent
+        bool idle = now_us - peer->timing->lastsent_unicast_us >= ESP_CONNECTION_IDLE_PING_MS * 1000;
+        bool probe = peer->status == ESP_PEER_STATUS_CONNECTED && now_us - peer->timing->last_probe_us >= ESP_PEER_RTT_PROBE_MS * 1000;
+        if (!idle && !probe)
+                return;
+
+        LOG_VERBOSE("Sending %s to peer " MACSTR, probe ? "round trip probe" : "keepalive", MAC2STR(peer->mac));
+        espnow_send_param_t send_param;
+        espnow_ping_pkt_t ping = {.sent_us = (uint32_t)now_us};
+        espnow_get_send_param(&send_param, peer);
+        send_param.broadcast = ESPNOW_DATA_UNICAST;
+
+        // Only a timestamped ping is answered, a plain keepalive costs the peer no `PONG`
+        esp_err_t err = espnow_send_data(&send_param, ESPNOW_PACKET_TYPE_PING, probe ? &ping : NULL, probe ? sizeof(ping) : 0);
+        if (probe)
+        {
+                if (err == ESP_OK)
+                        peer->rtt.probes++;
+                peer->timing->last_probe_us = now_us;
+        }
+        if (idle)
+                handle->heartbeats++;
+}
+
+// Run the state machine of one peer and schedule its next run
+static void esp_peer_update(esp_connection_handle_t *handle, esp_peer_handle_t *peer, int64_t now_us)
+{
+        // Once the fleet is complete its unique peers shut out every other peer
+        if (esp_connection_is_full(handle) && !peer->is_unique && peer->registered)
+        {
+                esp_peer_tx_flush(peer);
+                esp_err_t err = esp_now_del_peer(peer->mac);
+                if (err != ESP_OK && err != ESP_ERR_ESPNOW_NOT_FOUND)
+                        ESP_ERROR_CHECK(err);
+                peer->registered = false;
+                peer->status = ESP_PEER_STATUS_REJECTED;
+        }
+
+        // The send result of the frame in flight went missing, do not hold the queue forever
+        portENTER_CRITICAL(&espnow_tx_queue_lock);
+        bool tx_expired = peer->tx.busy && now_us - peer->tx.sent_us >= ESP_PEER_TX_TIMEOUT_MS * 1000;
+        if (tx_expired)
+                peer->tx.timeouts++;
+        portEXIT_CRITICAL(&espnow_tx_queue_lock);
+        if (tx_expired)
+                esp_peer_tx_done(peer);
+
+        espnow_send_param_t send_param;
+        switch (peer->status)
+        {
+        case ESP_PEER_STATUS_UNKNOWN:
+        case ESP_PEER_STATUS_PROTOCOL_ERROR:
+        case ESP_PEER_STATUS_NOREPLY:
+        case ESP_PEER_STATUS_IN_RANGE:
+                if (now_us - peer->timing->lastseen_broadcast_us > ONE_SECOND_IN_US)
+                        if (now_us - peer->timing->lastseen_unicast_us > ONE_SECOND_IN_US)
+                                esp_peer_set_status(peer, ESP_PEER_STATUS_LOST);
+                break;
+        case ESP_PEER_STATUS_CONNECTED:
+                if (!peer->saved_to_rom)
+                {
+                        device_settings_add_mac(handle->device_settings, peer->mac);
+                        esp_connection_set_unique_peer_mac(handle, peer->mac);
+                        peer->saved_to_rom = true;
+                }
+                if (now_us - peer->timing->lastseen_unicast_us > ONE_SECOND_IN_US)
+                        esp_peer_set_status(peer, ESP_PEER_STATUS_LOST);
+                break;
+        case ESP_PEER_STATUS_CONNECTING:
+                if (now_us - peer->timing->last_ping_us >= ESP_CONNECTION_CONNECT_RETRY_MS * 1000)
+                {
+                        peer->timing->last_ping_us = now_us;
+                        espnow_get_default_send_param(&send_param);
+                        espnow_get_send_param_unicast(&send_param, peer->mac);
+                        peer->timing->lastseen_unicast_us = now_us;
+                        espnow_send_connect(&send_param);
+                }
+
+                if (now_us - peer->timing->connect_time_us > ONE_SECOND_IN_US)
+                        esp_peer_set_status(peer, ESP_PEER_STATUS_NOREPLY);
+                break;
+        case ESP_PEER_STATUS_AVAILABLE:
+                if ((handle->limit != -1) && (handle->remote_connected >= handle->limit))
+                {
+                        esp_peer_set_status(peer, ESP_PEER_STATUS_REJECTED);
+                        break;
+                }
+                peer->timing->connect_time_us = now_us;
+                peer->timing->last_ping_us = now_us;
+                peer->timing->lastseen_unicast_us = now_us;
+                espnow_get_default_send_param(&send_param);
+                espnow_get_send_param_unicast(&send_param, peer->mac);
+                espnow_send_connect(&send_param);
+                esp_peer_set_status(peer, ESP_PEER_STATUS_CONNECTING);
+                break;
+        case ESP_PEER_STATUS_LOST:
+        case ESP_PEER_STATUS_REJECTED:
+        case ESP_PEER_STATUS_MAX:
+                if (peer->is_unique)
+                        esp_peer_set_status(peer, ESP_PEER_STATUS_AVAILABLE);
+                break;
+        }
+
+        esp_peer_send_heartbeat(handle, peer, now_us);
+        esp_connection_schedule(handle, peer, esp_peer_next_deadline(peer, now_us));
+}
+
+void esp_connection_handle_update(esp_connection_handle_t *handle)
+{
+        if (handle == NULL)
+        {
+                LOG_ERROR("NULL pointer, handle=0x%X", (uintptr_t)handle);
+                return;
+        }
+
+        uint32_t start_cycles = esp_cpu_get_cycle_count();
+        int64_t now_us = esp_timer_get_time();
+        int64_t tick = now_us / (ESP_CONNECTION_UPDATE_INTERVAL_MS * 1000);
+        int64_t first_tick = handle->wheel_tick + 1;
+        if (tick - first_tick >= ESP_CONNECTION_WHEEL_SLOTS)
+                first_tick = tick - ESP_CONNECTION_WHEEL_SLOTS + 1;
+
+        // Collect the expired peers first, running them reschedules them
+        esp_peer_slot_t due[ESP_CONNECTION_MAX_PEERS];
+        size_t num_due = 0;
+        portENTER_CRITICAL(&esp_connection_wheel_lock);
+        for (int64_t t = first_tick; t <= tick; t++)
+        {
+                esp_peer_slot_t index = handle->wheel[t % ESP_CONNECTION_WHEEL_SLOTS];
+                while (index != ESP_CONNECTION_INDEX_EMPTY)
+                {
+                        esp_peer_handle_t *peer = handle->entries + index;
+                        index = peer->wheel_next;
+                        if (peer->deadline_us / (ESP_CONNECTION_UPDATE_INTERVAL_MS * 1000) > tick)
+                                continue; // Due in a later turn of the wheel
+                        esp_connection_wheel_unlink(handle, peer);
+                        due[num_due++] = peer - handle->entries;
+                }
+        }
+        handle->wheel_tick = tick;
+        portEXIT_CRITICAL(&esp_connection_wheel_lock);
+
+        // Snapshots posted by other tasks, the peer table is only changed here
+        rssi_stat_t rssi_stats[RSSI_TABLE_SIZE];
+        portENTER_CRITICAL(&esp_connection_rssi_lock);
+        size_t num_rssi_stats = handle->rssi_pending_count;
+        memcpy(rssi_stats, handle->rssi_pending, num_rssi_stats * sizeof(rssi_stat_t));
+        handle->rssi_pending_count = 0;
+        portEXIT_CRITICAL(&esp_connection_rssi_lock);
+        for (size_t i = 0; i < num_rssi_stats; i++)
+                esp_connection_update_rssi(handle, &rssi_stats[i]);
+
+        // The radio is back from a channel scan, send what queued up meanwhile
+        if (atomic_exchange(&espnow_tx_resumed, false))
+                for (size_t i = 0; i < handle->size; i++)
+                        esp_peer_tx_kick(handle->entries + i);
+
+        for (size_t i = 0; i < num_due; i++)
+                esp_peer_update(handle, handle->entries + due[i], now_us);
+        if (num_due)
+                handle->remote_connected = esp_connection_count_connected(handle);
+
+        espnow_reliable_update();
+        espnow_rate_update(handle);
+        espnow_channel_update(handle);
+        espnow_fragment_update(handle);
+
+        handle->load_runs += num_due;
+        handle->load_cycles += esp_cpu_get_cycle_count() - start_cycles;
+        if (now_us - handle->load_since_us >= ONE_SECOND_IN_US)
+        {
+                handle->runs_per_s = handle->load_runs;
+                handle->cycles_per_s = handle->load_cycles;
+                handle->load_runs = 0;
+                handle->load_cycles = 0;
+                handle->load_since_us = now_us;
+        }
+}
+
+void esp_connection_process_send_result(esp_connection_handle_t *handle, const espnow_event_send_cb_t *send_cb)
+{
+        if ((handle == NULL) || (send_cb == NULL))
+        {
+                LOG_ERROR("NULL pointer, handle=0x%X, send_cb=0x%X", (uintptr_t)handle, (uintptr_t)send_cb);
+                return;
+        }
+
+        bool success = (send_cb->status == ESP_NOW_SEND_SUCCESS);
+        bool unicast = memcmp(send_cb->mac_addr, broadcast_mac, ESP_NOW_ETH_ALEN) != 0;
+        esp_peer_handle_t *peer = esp_connection_mac_lookup(handle, send_cb->mac_addr);
+
+        // Broadcast frames are never acknowledged, only unicast results tell about the link
+        if (unicast)
+        {
+                espnow_rate_record_send(success);
+                // The MAC-layer acknowledgment proves the peer alive as well as a received frame
+                if (peer != NULL && success)
+                {
+                        peer->timing->lastseen_unicast_us = esp_timer_get_time();
+                        peer->timing->last_active_us = peer->timing->lastseen_unicast_us;
+                }
+        }
+
+        espnow_inflight_t inflight;
+        bool controller = espnow_inflight_pop(send_cb->mac_addr, &inflight) &&
+                          (inflight.type == ESPNOW_PACKET_TYPE_CONTROLLER_STATE || inflight.type == ESPNOW_PACKET_TYPE_CONTROLLER_DELTA);
+        if (peer == NULL)
+                return;
+
+        if (controller)
+                espnow_controller_send_result(&peer->controller_tx, inflight.tag, success);
+        if (unicast)
+                esp_peer_tx_done(peer);
+}
+
+esp_err_t esp_connection_post_rssi(esp_connection_handle_t *handle, const rssi_stat_t *rssi_stat)
+{
+        if ((handle == NULL) || (rssi_stat == NULL))
+        {
+                LOG_ERROR("NULL pointer, handle=0x%X, rssi_stat=0x%X", (uintptr_t)handle, (uintptr_t)rssi_stat);
+                return ESP_ERR_INVALID_ARG;
+        }
+
+        // A newer snapshot of the same transmitter replaces the one not taken yet
+        esp_err_t ret = ESP_OK;
+        portENTER_CRITICAL(&esp_connection_rssi_lock);
+        size_t i = 0;
+        while (i < handle->rssi_pending_count && memcmp(handle->rssi_pending[i].recv_mac, rssi_stat->recv_mac, ESP_NOW_ETH_ALEN) != 0)
+                i++;
+        if (i < RSSI_TABLE_SIZE)
+        {
+                handle->rssi_pending[i] = *rssi_stat;
+                if (i == handle->rssi_pending_count)
+                        handle->rssi_pending_count++;
+        }
+        else
+        {
+                handle->rssi_dropped++;
+                ret = ESP_ERR_NO_MEM;
+        }
+        portEXIT_CRITICAL(&esp_connection_rssi_lock);
+        return ret;
+}
+
+// Feeds the RSSI filter of the transmitter with the frames of one snapshot, dispatcher task only
+static void esp_connection_update_rssi(esp_connection_handle_t *handle, const rssi_stat_t *rssi_stat)
+{
+        esp_peer_handle_t *peer = esp_connection_mac_add_to_entry(handle, rssi_stat->recv_mac);
+        if (peer == NULL)
+                return;
+        peer->rssi = rssi_filter_update(&peer->rssi_filter, rssi_stat->mean);
+        // A new transmitter is not acted on before its median window is full, one strong frame is not a pairing gesture
+        if (!rssi_filter_is_ready(&peer->rssi_filter))
+                return;
+
+        for (size_t i = 0; i < handle->rssi_sub_count; i++)
+        {
+                const esp_rssi_subscription_t *sub = &handle->rssi_subs[i];
+                bool above = peer->rssi_above & (1 << i);
+                if (!above && peer->rssi > sub->threshold)
+                        peer->rssi_above |= (1 << i);
+                else if (above && peer->rssi <= sub->threshold - sub->hysteresis)
+                        peer->rssi_above &= ~(1 << i);
+                else
+                        continue;
+                sub->cb(peer, peer->rssi, !above, sub->arg);
+        }
+
+        // Holding the devices together is the pairing gesture, the filter keeps a stray strong frame from starting it
+        const int rssi_min = MIN_RSSI_TO_INITIATE_CONNECTION;
+        if (peer->rssi > rssi_min)
+        {
+                if (peer->status == ESP_PEER_STATUS_CONNECTED)
+                        peer->timing->lastseen_unicast_us = esp_timer_get_time();
 
                 if (peer != NULL && peer->status == ESP_PEER_STATUS_IN_RANGE)
                 {
-                        peer->lastseen_broadcast_us = esp_timer_get_time();
+                        peer->timing->lastseen_broadcast_us = esp_timer_get_time();
                         esp_peer_set_status(peer, ESP_PEER_STATUS_AVAILABLE);
 
                         /* Add unicast peer information to peer list. */
@@ -561,6 +1708,27 @@ void esp_connection_update_rssi(esp_connection_handle_t *handle, const rssi_even
                 esp_peer_set_status(peer, ESP_PEER_STATUS_AVAILABLE);
 }
 
+esp_err_t esp_connection_subscribe_rssi(esp_connection_handle_t *handle, int threshold, int hysteresis, esp_connection_rssi_cb_t cb, void *arg)
+{
+        if ((handle == NULL) || (cb == NULL))
+        {
+                LOG_ERROR("NULL pointer, handle=0x%X, cb=0x%X", (uintptr_t)handle, (uintptr_t)cb);
+                return ESP_ERR_INVALID_ARG;
+        }
+        if (handle->rssi_sub_count >= ESP_CONNECTION_RSSI_SUBS)
+        {
+                LOG_WARNING("No room for RSSI subscription at %d dBm", threshold);
+                return ESP_ERR_NO_MEM;
+        }
+
+        esp_rssi_subscription_t *sub = &handle->rssi_subs[handle->rssi_sub_count++];
+        sub->threshold = threshold;
+        sub->hysteresis = hysteresis;
+        sub->cb = cb;
+        sub->arg = arg;
+        return ESP_OK;
+}
+
 bool esp_mac_check_equals(const uint8_t *mac1, const uint8_t *mac2)
 {
         if ((mac1 == NULL) || (mac2 == NULL))
@@ -577,9 +1745,9 @@ bool esp_mac_check_equals(const uint8_t *mac1, const uint8_t *mac2)
 
 size_t esp_connection_count_connected(esp_connection_handle_t *handle)
 {
-        if ((handle == NULL) || (handle->entries == NULL))
+        if (handle == NULL)
         {
-                LOG_ERROR("NULL pointer, handle=0x%X, handle->entries=0x%X", (uintptr_t)handle, (uintptr_t)handle->entries);
+                LOG_ERROR("NULL pointer, handle=0x%X", (uintptr_t)handle);
                 return 0;
         }
 
@@ -601,121 +1769,231 @@ size_t esp_connection_count_connected(esp_connection_handle_t *handle)
 
 size_t esp_connection_count_unique_peer(esp_connection_handle_t *handle)
 {
-        if ((handle == NULL) || (handle->entries == NULL))
+        if (handle == NULL)
+        {
+                LOG_ERROR("NULL pointer, handle=0x%X", (uintptr_t)handle);
+                return 0;
+        }
+        return handle->unique_count;
+}
+
+size_t esp_peer_tx_space(esp_peer_handle_t *peer)
+{
+        if (peer == NULL)
+        {
+                LOG_ERROR("NULL pointer, peer=0x%X", (uintptr_t)peer);
+                return 0;
+        }
+
+        portENTER_CRITICAL(&espnow_tx_queue_lock);
+        size_t space = ESP_PEER_TX_QUEUE_SIZE - peer->tx.count;
+        portEXIT_CRITICAL(&espnow_tx_queue_lock);
+        return space;
+}
+
+size_t esp_connection_get_fleet(esp_connection_handle_t *handle, esp_peer_handle_t **peers, size_t max_peers)
+{
+        if ((handle == NULL) || (peers == NULL))
         {
-                LOG_ERROR("NULL pointer, handle=0x%X, handle->entries=0x%X", (uintptr_t)handle, (uintptr_t)handle->entries);
+                LOG_ERROR("NULL pointer, handle=0x%X, peers=0x%X", (uintptr_t)handle, (uintptr_t)peers);
                 return 0;
         }
 
         size_t count = 0;
-        for (size_t i = 0; i < handle->size; i++)
+        for (size_t i = 0; i < handle->size && count < max_peers; i++)
         {
                 esp_peer_handle_t *peer = handle->entries + i;
-                if (peer == NULL)
-                {
-                        LOG_ERROR("NULL pointer, peer=0x%X, index=%d", (uintptr_t)peer, i);
-                        return 0;
-                }
-
-                if (peer->is_unique)
-                        count++;
+                if (peer->is_unique && peer->status == ESP_PEER_STATUS_CONNECTED)
+                        peers[count++] = peer;
         }
         return count;
 }
 
-esp_peer_handle_t *esp_connection_mac_lookup(esp_connection_handle_t *handle, const uint8_t *mac)
+static uint32_t esp_mac_hash(const uint8_t *mac)
+{
+        uint32_t hash = 2166136261UL; // FNV-1a
+        for (uint8_t i = 0; i < ESP_NOW_ETH_ALEN; i++)
+                hash = (hash ^ mac[i]) * 16777619UL;
+        return hash;
+}
+
+// Find the index slot holding `mac`, or the empty slot where it would be inserted
+static esp_peer_index_entry_t *esp_connection_index_probe(esp_connection_handle_t *handle, const uint8_t *mac)
 {
-        if ((handle == NULL) || (handle->entries == NULL))
+        size_t pos = esp_mac_hash(mac) & (ESP_CONNECTION_INDEX_SIZE - 1);
+        for (;;)
         {
-                LOG_ERROR("NULL pointer");
-                return NULL;
+                esp_peer_index_entry_t *entry = &handle->index[pos];
+                if (entry->slot == ESP_CONNECTION_INDEX_EMPTY || memcmp(entry->mac, mac, ESP_NOW_ETH_ALEN) == 0)
+                        return entry;
+                pos = (pos + 1) & (ESP_CONNECTION_INDEX_SIZE - 1);
         }
-        for (size_t i = 0; i < handle->size; i++)
+}
+
+// Remove `mac` from the index, shifting back the following entries of the probe run so no tombstone is needed
+static void esp_connection_index_remove(esp_connection_handle_t *handle, const uint8_t *mac)
+{
+        esp_peer_index_entry_t *entry = esp_connection_index_probe(handle, mac);
+        if (entry->slot == ESP_CONNECTION_INDEX_EMPTY)
+                return;
+
+        size_t hole = entry - handle->index;
+        size_t pos = hole;
+        for (;;)
         {
-                esp_peer_handle_t *peer = handle->entries + i;
-                if (peer == NULL)
+                pos = (pos + 1) & (ESP_CONNECTION_INDEX_SIZE - 1);
+                esp_peer_index_entry_t *next = &handle->index[pos];
+                if (next->slot == ESP_CONNECTION_INDEX_EMPTY)
+                        break;
+
+                // Move the entry back only if its home slot does not lie between the hole and its position
+                size_t home = esp_mac_hash(next->mac) & (ESP_CONNECTION_INDEX_SIZE - 1);
+                size_t dist_home = (pos - home) & (ESP_CONNECTION_INDEX_SIZE - 1);
+                size_t dist_hole = (pos - hole) & (ESP_CONNECTION_INDEX_SIZE - 1);
+                if (dist_home >= dist_hole)
                 {
-                        LOG_ERROR("NULL pointer, peer=0x%X, index=%d", (uintptr_t)peer, i);
-                        return NULL;
+                        handle->index[hole] = *next;
+                        hole = pos;
                 }
+        }
+        handle->index[hole].slot = ESP_CONNECTION_INDEX_EMPTY;
+}
 
-                if (esp_mac_check_equals(peer->mac, mac))
-                        return peer;
+esp_peer_handle_t *esp_connection_mac_lookup(esp_connection_handle_t *handle, const uint8_t *mac)
+{
+        if ((handle == NULL) || (mac == NULL))
+        {
+                LOG_ERROR("NULL pointer, handle=0x%X, mac=0x%X", (uintptr_t)handle, (uintptr_t)mac);
+                return NULL;
         }
-        return NULL;
+
+        portENTER_CRITICAL_SAFE(&esp_connection_index_lock);
+        esp_peer_slot_t slot = esp_connection_index_probe(handle, mac)->slot;
+        portEXIT_CRITICAL_SAFE(&esp_connection_index_lock);
+        if (slot == ESP_CONNECTION_INDEX_EMPTY)
+                return NULL;
+        return &handle->entries[slot];
 }
 
-void esp_connection_peer_init(esp_peer_handle_t *peer, const uint8_t *mac)
+void esp_connection_peer_init(esp_peer_handle_t *peer, esp_peer_timing_t *timing, const uint8_t *mac)
 {
-        if (peer == NULL)
+        if ((peer == NULL) || (timing == NULL))
         {
-                LOG_ERROR("NULL pointer, peer=0x%X", (uintptr_t)peer);
+                LOG_ERROR("NULL pointer, peer=0x%X, timing=0x%X", (uintptr_t)peer, (uintptr_t)timing);
                 return;
         }
         memset(peer, 0, sizeof(esp_peer_handle_t));
+        memset(timing, 0, sizeof(esp_peer_timing_t));
         memcpy(peer->mac, mac, ESP_NOW_ETH_ALEN);
-        peer->conn_retry = 0;
-        peer->lastseen_broadcast_us = esp_timer_get_time();
-        peer->lastseen_unicast_us = esp_timer_get_time();
+        peer->timing = timing;
+        peer->timing->conn_retry = 0;
+        peer->timing->lastseen_broadcast_us = esp_timer_get_time();
+        peer->timing->lastseen_unicast_us = esp_timer_get_time();
+        peer->timing->last_active_us = esp_timer_get_time();
         peer->seq_rx = 0;
         peer->seq_tx = 0;
         peer->rssi = -200;
+        rssi_filter_reset(&peer->rssi_filter);
         peer->status = ESP_PEER_STATUS_UNKNOWN;
         peer->registered = false;
         peer->is_unique = false;
         peer->saved_to_rom = false;
+        peer->deadline_us = 0;
+        peer->wheel_prev = ESP_CONNECTION_INDEX_EMPTY;
+        peer->wheel_next = ESP_CONNECTION_INDEX_EMPTY;
+}
+
+// Pick the least recently seen peer that is neither paired, connecting nor the broadcast peer
+static esp_peer_handle_t *esp_connection_find_stale_peer(esp_connection_handle_t *handle)
+{
+        esp_peer_handle_t *stale = NULL;
+        for (size_t i = 0; i < handle->size; i++)
+        {
+                esp_peer_handle_t *peer = handle->entries + i;
+                if (peer->is_unique || memcmp(peer->mac, broadcast_mac, ESP_NOW_ETH_ALEN) == 0)
+                        continue;
+                if (peer->status >= ESP_PEER_STATUS_AVAILABLE && peer->status <= ESP_PEER_STATUS_CONNECTED)
+                        continue;
+                if (stale == NULL || peer->timing->last_active_us < stale->timing->last_active_us)
+                        stale = peer;
+        }
+        return stale;
 }
 
 esp_peer_handle_t *esp_connection_mac_add_to_entry(esp_connection_handle_t *handle, const uint8_t *mac)
 {
-        if ((handle == NULL) || (handle->entries == NULL))
+        if ((handle == NULL) || (mac == NULL))
         {
-                LOG_ERROR("NULL pointer, handle=0x%X, handle->entries=0x%X", (uintptr_t)handle, (uintptr_t)handle->entries);
+                LOG_ERROR("NULL pointer, handle=0x%X, mac=0x%X", (uintptr_t)handle, (uintptr_t)mac);
                 return NULL;
         }
 
-        esp_peer_handle_t *peer = esp_connection_mac_lookup(handle, mac);
-        if (peer != NULL)
+        esp_peer_index_entry_t *entry = esp_connection_index_probe(handle, mac);
+        if (entry->slot != ESP_CONNECTION_INDEX_EMPTY)
         {
+                esp_peer_handle_t *peer = &handle->entries[entry->slot];
+                peer->timing->last_active_us = esp_timer_get_time();
                 LOG_VERBOSE("Peer " MACSTR " already logged", MAC2STR(mac));
-                // print_mem(peer, sizeof(esp_peer_handle_t));
                 return peer;
         }
 
-        size_t new_capacity = handle->size + 1;
-        esp_peer_handle_t *new_addr = realloc(handle->entries, sizeof(esp_peer_handle_t) * new_capacity);
-        if (new_addr == NULL)
+        esp_peer_handle_t *new_peer;
+        if (handle->size < ESP_CONNECTION_MAX_PEERS)
         {
-                LOG_ERROR("realloc failed, cannot add peer " MACSTR "to node list", MAC2STR(mac));
-                return NULL;
+                new_peer = handle->entries + handle->size;
+                handle->size++;
         }
-
-        handle->entries = new_addr;
-        esp_peer_handle_t *new_peer = handle->entries + handle->size;
-        if (peer != NULL)
+        else
         {
-                LOG_ERROR("NULL pointer, new_peer=0x%X", (uintptr_t)new_peer);
-                // print_mem(peer, sizeof(esp_peer_handle_t));
-                return peer;
-        }
+                new_peer = esp_connection_find_stale_peer(handle);
+                if (new_peer == NULL)
+                {
+                        LOG_ERROR("Peer list full, cannot add peer " MACSTR " to node list", MAC2STR(mac));
+                        return NULL;
+                }
 
-        esp_connection_peer_init(new_peer, mac);
-        handle->size = new_capacity;
+                LOG_INFO("Evicting stale peer " MACSTR " for " MACSTR, MAC2STR(new_peer->mac), MAC2STR(mac));
+                if (new_peer->registered)
+                {
+                        esp_err_t err = esp_now_del_peer(new_peer->mac);
+                        if (err != ESP_OK && err != ESP_ERR_ESPNOW_NOT_FOUND)
+                                ESP_ERROR_CHECK(err);
+                }
+                // Subscribers holding the peer let go of it before the entry is reused
+                for (size_t i = 0; i < handle->rssi_sub_count; i++)
+                        if (new_peer->rssi_above & (1 << i))
+                                handle->rssi_subs[i].cb(new_peer, new_peer->rssi, false, handle->rssi_subs[i].arg);
+                portENTER_CRITICAL(&esp_connection_index_lock);
+                esp_connection_index_remove(handle, new_peer->mac);
+                portEXIT_CRITICAL(&esp_connection_index_lock);
+                esp_connection_schedule(handle, new_peer, 0);
+                esp_peer_tx_flush(new_peer);
+                handle->evicted++;
+                entry = esp_connection_index_probe(handle, mac);
+        }
+
+        size_t slot = new_peer - handle->entries;
+        esp_connection_peer_init(new_peer, &handle->timing[slot], mac);
+        portENTER_CRITICAL(&esp_connection_index_lock);
+        memcpy(entry->mac, mac, ESP_NOW_ETH_ALEN);
+        entry->slot = slot;
+        portEXIT_CRITICAL(&esp_connection_index_lock);
+        esp_connection_schedule(handle, new_peer, esp_timer_get_time());
         LOG_INFO("Added " MACSTR " to known node, total: %d", MAC2STR(mac), handle->size);
         esp_connection_show_entries(handle);
-        // print_mem(new_peer, sizeof(esp_peer_handle_t));
         return new_peer;
 }
 
 void esp_connection_show_entries(esp_connection_handle_t *handle)
 {
-        if ((handle == NULL) || (handle->entries == NULL))
+        if (handle == NULL)
         {
-                LOG_ERROR("NULL pointer, handle=0x%X, handle->entries=0x%X", (uintptr_t)handle, (uintptr_t)handle->entries);
+                LOG_ERROR("NULL pointer, handle=0x%X", (uintptr_t)handle);
                 return;
         }
 
-        LOG_INFO("Listing available ESP-NOW nodes, %d total", handle->size);
+        LOG_INFO("Listing available ESP-NOW nodes, %d total, %lu evicted, %lu keepalives, %lu RSSI snapshots dropped", handle->size, handle->evicted, handle->heartbeats, handle->rssi_dropped);
+        LOG_INFO("Peer state machine, runs: %lu/s, cpu: %lu cycles/s", handle->runs_per_s, handle->cycles_per_s);
         for (size_t i = 0; i < handle->size; i++)
         {
                 esp_peer_handle_t *peer = handle->entries + i;
@@ -724,7 +2002,30 @@ void esp_connection_show_entries(esp_connection_handle_t *handle)
                         LOG_ERROR("NULL pointer, peer=0x%X", (uintptr_t)peer);
                         return;
                 }
-                LOG_INFO("    id: %d, addr: " MACSTR ", rssi: %4d, status: %s, unique: %d", i, MAC2STR(peer->mac), peer->rssi, ESP_PEER_STATUS_STRING[peer->status], peer->is_unique);
+                LOG_INFO("    id: %d, addr: " MACSTR ", rssi: %4d, variance: %3d, status: %s, unique: %d", i, MAC2STR(peer->mac), peer->rssi, rssi_filter_get_variance(&peer->rssi_filter), ESP_PEER_STATUS_STRING[peer->status], peer->is_unique);
+                for (size_t j = 0; j < 2; j++)
+                {
+                        esp_peer_seq_window_t *window = j ? &peer->rx_unicast : &peer->rx_broadcast;
+                        if (!window->valid)
+                                continue;
+                        LOG_INFO("        %s rx: %lu, lost: %lu, reordered: %lu, duplicates: %lu, stale: %lu, resyncs: %lu",
+                                 j ? "unicast" : "broadcast", window->accepted, window->lost, window->reordered, window->duplicates, window->stale, window->resyncs);
+                }
+                esp_peer_clock_t *clock = &peer->clock;
+                if (clock->synced)
+                        LOG_INFO("        clock offset: %lld us, error: <%lu us, drift: %ld ppb",
+                                 clock->ref.offset_us, clock->ref.rtt_us / 2, clock->drift_ppb);
+                if (clock->one_way_count)
+                        LOG_INFO("        one-way packets: %lu, last: %ld us, avg: %lld us, min: %ld us, max: %ld us",
+                                 clock->one_way_count, clock->one_way_last_us, clock->one_way_total_us / clock->one_way_count, clock->one_way_min_us, clock->one_way_max_us);
+                esp_peer_tx_queue_t *tx = &peer->tx;
+                if (tx->queued)
+                        LOG_INFO("        tx queued: %lu, waiting: %d, dropped: %lu, timeouts: %lu",
+                                 tx->queued, tx->count, tx->dropped, tx->timeouts);
+                esp_peer_rtt_t *rtt = &peer->rtt;
+                if (rtt->probes)
+                        LOG_INFO("        rtt probes: %lu, replies: %lu, last: %lu us, p50: %lu us, p95: %lu us, p99: %lu us, max: %lu us",
+                                 rtt->probes, rtt->count, rtt->last_us, esp_peer_rtt_percentile(rtt, 50), esp_peer_rtt_percentile(rtt, 95), esp_peer_rtt_percentile(rtt, 99), rtt->max_us);
         }
         if (handle->size == 0)
         {
@@ -734,9 +2035,9 @@ void esp_connection_show_entries(esp_connection_handle_t *handle)
 
 void esp_connection_set_peer_limit(esp_connection_handle_t *handle, int8_t new_limit)
 {
-        if ((handle == NULL) || (handle->entries == NULL))
+        if (handle == NULL)
         {
-                LOG_ERROR("NULL pointer, handle=0x%X, handle->entries=0x%X", (uintptr_t)handle, (uintptr_t)handle->entries);
+                LOG_ERROR("NULL pointer, handle=0x%X", (uintptr_t)handle);
                 return;
         }
         handle->limit = new_limit;
@@ -744,9 +2045,9 @@ void esp_connection_set_peer_limit(esp_connection_handle_t *handle, int8_t new_l
 
 void esp_connection_set_unique_peer_mac(esp_connection_handle_t *handle, const uint8_t *mac)
 {
-        if ((handle == NULL) || (handle->entries == NULL))
+        if (handle == NULL)
         {
-                LOG_ERROR("NULL pointer, handle=0x%X, handle->entries=0x%X", (uintptr_t)handle, (uintptr_t)handle->entries);
+                LOG_ERROR("NULL pointer, handle=0x%X", (uintptr_t)handle);
                 return;
         }
         if (memcmp(mac, broadcast_mac, ESP_NOW_ETH_ALEN) == 0)
@@ -754,7 +2055,17 @@ void esp_connection_set_unique_peer_mac(esp_connection_handle_t *handle, const u
 
         LOG_WARNING("Setting peer MAC " MACSTR " as unique peer", MAC2STR(mac));
         esp_peer_handle_t *peer = esp_connection_mac_add_to_entry(handle, mac);
+        if (peer == NULL)
+                return;
+        if (!peer->is_unique)
+                handle->unique_count++;
         peer->is_unique = true;
+        rssi_watch(mac);
+
+        // Other peers are shut out on their next run, bring it forward
+        int64_t now_us = esp_timer_get_time();
+        for (size_t i = 0; i < handle->size; i++)
+                esp_connection_schedule(handle, handle->entries + i, now_us);
 }
 
 void esp_peer_set_status(esp_peer_handle_t *peer, esp_peer_status_t new_status)
@@ -765,52 +2076,362 @@ void esp_peer_set_status(esp_peer_handle_t *peer, esp_peer_status_t new_status)
                 return;
         }
         if (new_status == ESP_PEER_STATUS_CONNECTED)
+        {
                 LOG_INFO("peer " MACSTR " connected!", MAC2STR(peer->mac));
+                rssi_watch(peer->mac);
+                // The peer may have restarted, the next controller state is sent in full
+                peer->controller_tx.force_keyframe = true;
+                espnow_reliable_reset(peer->mac);
+        }
         if (peer->status == ESP_PEER_STATUS_CONNECTED && new_status == ESP_PEER_STATUS_LOST)
                 LOG_WARNING("peer " MACSTR " disconnected!", MAC2STR(peer->mac));
         LOG_INFO("peer " MACSTR " status [%s --> %s]", MAC2STR(peer->mac), ESP_PEER_STATUS_STRING[peer->status], ESP_PEER_STATUS_STRING[new_status]);
         peer->status = new_status;
+        // The new status waits for other deadlines, work them out on the next tick
+        if (esp_connection_handle != NULL && peer >= esp_connection_handle->entries && peer < esp_connection_handle->entries + ESP_CONNECTION_MAX_PEERS)
+                esp_connection_schedule(esp_connection_handle, peer, esp_timer_get_time());
+}
+
+// Control frames are replaced by every newer one, a late control frame carries outdated state
+static bool espnow_packet_type_is_control(espnow_packet_type_t type)
+{
+        switch (type)
+        {
+        case ESPNOW_PACKET_TYPE_CAR_MOVEMENT:
+        case ESPNOW_PACKET_TYPE_CATAPULT_MOVEMENT:
+        case ESPNOW_PACKET_TYPE_KEEPER_MOVEMENT:
+        case ESPNOW_PACKET_TYPE_CONTROLLER_STATE:
+        case ESPNOW_PACKET_TYPE_CONTROLLER_DELTA:
+                return true;
+        default:
+                return false;
+        }
+}
+
+static void esp_peer_seq_window_restart(esp_peer_seq_window_t *window, uint16_t seq_num)
+{
+        window->valid = true;
+        window->highest = seq_num;
+        window->received = 1;
+        window->stale_run = 0;
+}
+
+// Record `seq_num` in the window, returns false if the frame is a duplicate or stale
+static bool esp_peer_seq_window_check(esp_peer_seq_window_t *window, uint16_t seq_num, bool is_control)
+{
+        if (!window->valid)
+        {
+                esp_peer_seq_window_restart(window, seq_num);
+                window->accepted++;
+                return true;
+        }
+
+        uint16_t ahead = seq_num - window->highest;
+        if (ahead != 0 && ahead < 0x8000)
+        {
+                // Sequence numbers skipped over count as lost until they arrive
+                window->lost += ahead - 1;
+                window->received = (ahead < ESP_PEER_SEQ_WINDOW_SIZE) ? (window->received << ahead) | 1 : 1;
+                window->highest = seq_num;
+                window->stale_run = 0;
+                window->accepted++;
+                return true;
+        }
+
+        uint16_t behind = window->highest - seq_num;
+        if (behind >= ESP_PEER_SEQ_WINDOW_SIZE)
+        {
+                window->stale++;
+                if (++window->stale_run < ESP_PEER_SEQ_RESYNC_COUNT)
+                        return false;
+                window->resyncs++;
+                esp_peer_seq_window_restart(window, seq_num);
+                window->accepted++;
+                return true;
+        }
+
+        window->stale_run = 0;
+        if (window->received & (1ULL << behind))
+        {
+                window->duplicates++;
+                return false;
+        }
+        window->received |= 1ULL << behind;
+        window->reordered++;
+        if (window->lost)
+                window->lost--;
+        if (is_control)
+        {
+                window->stale++;
+                return false;
+        }
+        window->accepted++;
+        return true;
+}
+
+// Agree on the newest wire format version both sides understand, returns false if there is none
+static bool esp_peer_negotiate_version(esp_peer_handle_t *peer, espnow_packet_t *recv_data)
+{
+        espnow_connect_pkt_t connect = {.version_min = 0, .version_max = 0};
+        if (recv_data->len >= sizeof(espnow_connect_pkt_t))
+                memcpy(&connect, recv_data->payload, sizeof(espnow_connect_pkt_t));
+
+        uint8_t version_min = (connect.version_min > ESPNOW_PROTOCOL_VERSION_MIN) ? connect.version_min : ESPNOW_PROTOCOL_VERSION_MIN;
+        uint8_t version_max = (connect.version_max < ESPNOW_PROTOCOL_VERSION) ? connect.version_max : ESPNOW_PROTOCOL_VERSION;
+        if (version_min > version_max)
+        {
+                if (peer->status != ESP_PEER_STATUS_PROTOCOL_ERROR)
+                {
+                        LOG_WARNING("peer " MACSTR " speaks versions %d-%d, supported: %d-%d", MAC2STR(peer->mac),
+                                    connect.version_min, connect.version_max, ESPNOW_PROTOCOL_VERSION_MIN, ESPNOW_PROTOCOL_VERSION);
+                        esp_peer_set_status(peer, ESP_PEER_STATUS_PROTOCOL_ERROR);
+                }
+                peer->version = 0;
+                return false;
+        }
+
+        peer->version = version_max;
+        if (peer->status == ESP_PEER_STATUS_PROTOCOL_ERROR)
+                esp_peer_set_status(peer, ESP_PEER_STATUS_IN_RANGE);
+        return true;
+}
+
+// Echo a timestamped ping, the sender measures the round trip with its own clock
+static void esp_peer_send_pong(esp_peer_handle_t *peer, espnow_packet_t *recv_data)
+{
+        espnow_pong_pkt_t pong;
+        memcpy(&pong.sent_us, recv_data->payload, sizeof(pong.sent_us));
+        pong.remote_us = esp_timer_get_time();
+
+        espnow_send_param_t send_param;
+        espnow_get_default_send_param(&send_param);
+        espnow_get_send_param_unicast(&send_param, peer->mac);
+        espnow_send_data(&send_param, ESPNOW_PACKET_TYPE_PONG, &pong, sizeof(pong));
+}
+
+// Index of the histogram bucket of a round trip, four buckets per power of two
+static size_t esp_peer_rtt_bucket(uint32_t rtt_us)
+{
+        if (rtt_us < (1UL << ESP_PEER_RTT_MIN_SHIFT))
+                return 0;
+        size_t octave = 31 - __builtin_clz(rtt_us);
+        size_t bucket = 1 + (octave - ESP_PEER_RTT_MIN_SHIFT) * 4 + ((rtt_us >> (octave - 2)) & 3);
+        return (bucket < ESP_PEER_RTT_BUCKETS) ? bucket : ESP_PEER_RTT_BUCKETS - 1;
+}
+
+// Largest round trip that falls in `bucket`, in us
+static uint32_t esp_peer_rtt_bucket_limit(size_t bucket)
+{
+        if (bucket == 0)
+                return (1UL << ESP_PEER_RTT_MIN_SHIFT) - 1;
+        if (bucket >= ESP_PEER_RTT_BUCKETS - 1)
+                return UINT32_MAX;
+        size_t octave = ESP_PEER_RTT_MIN_SHIFT + (bucket - 1) / 4;
+        return ((5 + (bucket - 1) % 4) << (octave - 2)) - 1;
+}
+
+// Keep the exchange, the one with the shortest round trip among the kept ones had the least queuing
+// and gives the offset, successive offsets far enough apart give the drift
+static void esp_peer_clock_update(esp_peer_clock_t *clock, int64_t local_us, int64_t offset_us, uint32_t rtt_us)
+{
+        esp_peer_clock_sample_t *sample = &clock->samples[clock->next];
+        clock->next = (clock->next + 1) % ESP_PEER_CLOCK_SAMPLES;
+        sample->local_us = local_us;
+        sample->offset_us = offset_us;
+        sample->rtt_us = rtt_us;
+
+        esp_peer_clock_sample_t *best = NULL;
+        for (size_t i = 0; i < ESP_PEER_CLOCK_SAMPLES; i++)
+        {
+                esp_peer_clock_sample_t *candidate = &clock->samples[i];
+                if (candidate->local_us == 0)
+                        continue;
+                if (best == NULL || candidate->rtt_us < best->rtt_us || (candidate->rtt_us == best->rtt_us && candidate->local_us > best->local_us))
+                        best = candidate;
+        }
+        if (clock->synced && best->local_us == clock->ref.local_us)
+                return;
+
+        portENTER_CRITICAL(&esp_peer_clock_lock);
+        clock->ref = *best;
+        if (!clock->synced)
+        {
+                clock->drift_ref = *best;
+                clock->synced = true;
+        }
+        int64_t elapsed_us = best->local_us - clock->drift_ref.local_us;
+        if (elapsed_us >= ESP_PEER_CLOCK_DRIFT_MIN_MS * 1000LL)
+        {
+                int32_t drift_ppb = (best->offset_us - clock->drift_ref.offset_us) * 1000000000LL / elapsed_us;
+                clock->drift_ppb = clock->drift_ppb ? clock->drift_ppb + (drift_ppb - clock->drift_ppb) / 4 : drift_ppb;
+                clock->drift_ref = *best;
+        }
+        portEXIT_CRITICAL(&esp_peer_clock_lock);
+}
+
+int64_t esp_peer_remote_time_us(const esp_peer_handle_t *peer, int64_t local_us)
+{
+        if (peer == NULL)
+        {
+                LOG_ERROR("NULL pointer, peer=0x%X", (uintptr_t)peer);
+                return local_us;
+        }
+
+        portENTER_CRITICAL(&esp_peer_clock_lock);
+        const esp_peer_clock_t *clock = &peer->clock;
+        int64_t remote_us = local_us;
+        if (clock->synced)
+                remote_us += clock->ref.offset_us + (local_us - clock->ref.local_us) * clock->drift_ppb / 1000000000LL;
+        portEXIT_CRITICAL(&esp_peer_clock_lock);
+        return remote_us;
+}
+
+int64_t remote_time_us(void)
+{
+        int64_t local_us = esp_timer_get_time();
+        for (size_t i = 0; esp_connection_handle != NULL && i < esp_connection_handle->size; i++)
+        {
+                esp_peer_handle_t *peer = esp_connection_handle->entries + i;
+                if (peer->status == ESP_PEER_STATUS_CONNECTED && peer->clock.synced)
+                        return esp_peer_remote_time_us(peer, local_us);
+        }
+        return local_us;
+}
+
+// One-way latency of a packet stamped by the peer, from its clock mapped onto ours
+static void esp_peer_record_one_way(esp_peer_handle_t *peer, uint32_t stamp_us)
+{
+        esp_peer_clock_t *clock = &peer->clock;
+        if (!clock->synced)
+                return;
+
+        int32_t one_way_us = (uint32_t)esp_peer_remote_time_us(peer, esp_timer_get_time()) - stamp_us;
+        if (clock->one_way_count == 0 || one_way_us < clock->one_way_min_us)
+                clock->one_way_min_us = one_way_us;
+        if (clock->one_way_count == 0 || one_way_us > clock->one_way_max_us)
+                clock->one_way_max_us = one_way_us;
+        clock->one_way_last_us = one_way_us;
+        clock->one_way_total_us += one_way_us;
+        clock->one_way_count++;
+}
+
+static void esp_peer_record_rtt(esp_peer_handle_t *peer, espnow_packet_t *recv_data)
+{
+        int64_t now_us = esp_timer_get_time();
+        espnow_pong_pkt_t pong;
+        memcpy(&pong.sent_us, recv_data->payload, sizeof(pong.sent_us));
+        uint32_t rtt_us = (uint32_t)now_us - pong.sent_us;
+
+        // The peer stamped its clock halfway through the round trip, assuming equal delays both ways
+        if (recv_data->len == sizeof(espnow_pong_pkt_t))
+        {
+                memcpy(&pong, recv_data->payload, sizeof(pong));
+                int64_t local_us = now_us - rtt_us / 2;
+                esp_peer_clock_update(&peer->clock, local_us, pong.remote_us - local_us, rtt_us);
+        }
+
+        esp_peer_rtt_t *rtt = &peer->rtt;
+        rtt->buckets[esp_peer_rtt_bucket(rtt_us)]++;
+        rtt->count++;
+        rtt->last_us = rtt_us;
+        if (rtt_us > rtt->max_us)
+                rtt->max_us = rtt_us;
+}
+
+uint32_t esp_peer_rtt_percentile(const esp_peer_rtt_t *rtt, uint8_t percent)
+{
+        if (rtt == NULL)
+        {
+                LOG_ERROR("NULL pointer, rtt=0x%X", (uintptr_t)rtt);
+                return 0;
+        }
+        if (rtt->count == 0)
+                return 0;
+
+        // Rank of the round trip, rounded up so p99 of few samples is the slowest one
+        uint32_t rank = ((uint64_t)rtt->count * percent + 99) / 100;
+        uint32_t seen = 0;
+        for (size_t i = 0; i < ESP_PEER_RTT_BUCKETS; i++)
+        {
+                seen += rtt->buckets[i];
+                if (seen >= rank)
+                {
+                        uint32_t limit = esp_peer_rtt_bucket_limit(i);
+                        return (limit < rtt->max_us) ? limit : rtt->max_us;
+                }
+        }
+        return rtt->max_us;
 }
 
-void esp_peer_process_received(esp_peer_handle_t *peer, espnow_packet_t *recv_data)
+bool esp_peer_process_received(esp_peer_handle_t *peer, espnow_packet_t *recv_data)
 {
         if ((peer == NULL) || (recv_data == NULL))
         {
                 LOG_ERROR("NULL pointer, peer=0x%X, recv_data=0x%X", (uintptr_t)peer, (uintptr_t)recv_data);
-                return;
+                return false;
         }
 
-        espnow_send_param_t send_param;
-        espnow_get_send_param(&send_param, peer);
+        esp_peer_seq_window_t *window = (ESPNOW_PACKET_METHOD(recv_data) == ESPNOW_DATA_BROADCAST) ? &peer->rx_broadcast : &peer->rx_unicast;
+        // A connection request starts a new count, the peer may have restarted
+        if (ESPNOW_PACKET_TYPE(recv_data) == ESPNOW_PACKET_TYPE_CONNECT)
+        {
+                window->valid = false;
+                if (!esp_peer_negotiate_version(peer, recv_data))
+                        return false;
+        }
+        if (!esp_peer_seq_window_check(window, recv_data->seq_num, espnow_packet_type_is_control(ESPNOW_PACKET_TYPE(recv_data))))
+        {
+                LOG_VERBOSE("Drop %s id:[%04d] from peer " MACSTR ", newest:[%04d]", ESPNOW_PACKET_TYPE_STRING[ESPNOW_PACKET_TYPE(recv_data)], recv_data->seq_num, MAC2STR(peer->mac), window->highest);
+                return false;
+        }
+        peer->seq_rx++;
+
+        if (recv_data->version >= ESPNOW_PROTOCOL_VERSION_TIMESTAMP && (recv_data->type_flags & ESPNOW_PACKET_FLAG_TIMESTAMP))
+        {
+                uint32_t stamp_us;
+                if (recv_data->len < sizeof(stamp_us))
+                        return false;
+                // Handlers only see the payload, the timestamp is taken off here
+                memcpy(&stamp_us, recv_data->payload, sizeof(stamp_us));
+                recv_data->len -= sizeof(stamp_us);
+                memmove(recv_data->payload, recv_data->payload + sizeof(stamp_us), recv_data->len);
+                esp_peer_record_one_way(peer, stamp_us);
+        }
 
-        if (recv_data->type == ESPNOW_PACKET_TYPE_ACK)
+        if (ESPNOW_PACKET_TYPE(recv_data) == ESPNOW_PACKET_TYPE_ACK)
         {
                 LOG_VERBOSE("packet id:[%04d] acknowledged from peer " MACSTR, recv_data->seq_num, MAC2STR(peer->mac));
-                return;
+                return true;
         }
 
+        if (peer->status == ESP_PEER_STATUS_PROTOCOL_ERROR)
+                return false; // Only a compatible connection request clears the error
+
         if (peer->status < ESP_PEER_STATUS_IN_RANGE)
                 esp_peer_set_status(peer, ESP_PEER_STATUS_IN_RANGE);
 
-        if (recv_data->broadcast == ESPNOW_DATA_BROADCAST)
+        if (ESPNOW_PACKET_METHOD(recv_data) == ESPNOW_DATA_BROADCAST)
         {
-                peer->lastseen_broadcast_us = esp_timer_get_time();
-                espnow_send_reply(&send_param);
+                peer->timing->lastseen_broadcast_us = esp_timer_get_time();
                 LOG_VERBOSE("Receive %dth broadcast data from: " MACSTR ", len: %d",
                             recv_data->seq_num,
                             MAC2STR(peer->mac),
                             recv_data->len);
                 // print_mem(recv_data->payload, recv_data->len);
         }
-        else if (recv_data->broadcast == ESPNOW_DATA_UNICAST)
+        else if (ESPNOW_PACKET_METHOD(recv_data) == ESPNOW_DATA_UNICAST)
         {
-                peer->lastseen_unicast_us = esp_timer_get_time();
-                espnow_send_reply(&send_param);
-                peer->lastsent_unicast_us = esp_timer_get_time();
+                peer->timing->lastseen_unicast_us = esp_timer_get_time();
                 if (peer->status == ESP_PEER_STATUS_CONNECTING)
                 {
                         esp_peer_set_status(peer, ESP_PEER_STATUS_CONNECTED);
                 }
+                if (ESPNOW_PACKET_TYPE(recv_data) == ESPNOW_PACKET_TYPE_PING && recv_data->len == sizeof(espnow_ping_pkt_t))
+                        esp_peer_send_pong(peer, recv_data);
+                else if (ESPNOW_PACKET_TYPE(recv_data) == ESPNOW_PACKET_TYPE_PONG && recv_data->len >= sizeof(espnow_ping_pkt_t))
+                        esp_peer_record_rtt(peer, recv_data);
+                else if (ESPNOW_PACKET_TYPE(recv_data) == ESPNOW_PACKET_TYPE_KEYFRAME_REQUEST)
+                        espnow_controller_keyframe_requested(peer);
                 LOG_VERBOSE("Receive %dth unicast data from: " MACSTR ", len: %d",
                             recv_data->seq_num,
                             MAC2STR(peer->mac),
@@ -821,36 +2442,20 @@ void esp_peer_process_received(esp_peer_handle_t *peer, espnow_packet_t *recv_da
         {
                 LOG_WARNING("Receive error data from: " MACSTR "", MAC2STR(peer->mac));
         }
+        return true;
 }
 
 void esp_connection_send_heartbeat(esp_connection_handle_t *handle)
 {
-        static espnow_send_param_t send_param;
-
-        if ((handle == NULL) || (handle->entries == NULL))
+        if (handle == NULL)
         {
-                LOG_ERROR("NULL pointer, handle=0x%X, handle->entries=0x%X", (uintptr_t)handle, (uintptr_t)handle->entries);
+                LOG_ERROR("NULL pointer, handle=0x%X", (uintptr_t)handle);
                 return;
         }
 
+        int64_t now_us = esp_timer_get_time();
         for (size_t i = 0; i < handle->size; i++)
-        {
-                esp_peer_handle_t *peer = handle->entries + i;
-                if (peer == NULL)
-                {
-                        LOG_ERROR("NULL pointer, peer=0x%X", (uintptr_t)peer);
-                        return;
-                }
-
-                // if (peer->registered == true)
-                if (peer->status >= ESP_PEER_STATUS_CONNECTING || peer->is_unique)
-                {
-                        LOG_VERBOSE("Sending heartbeat to peer " MACSTR, MAC2STR(peer->mac));
-                        espnow_get_send_param(&send_param, peer);
-                        send_param.broadcast = ESPNOW_DATA_UNICAST;
-                        espnow_send_text(&send_param, "ping");
-                }
-        }
+                esp_peer_send_heartbeat(handle, handle->entries + i, now_us);
 }
 
 void esp_connection_enable_broadcast(esp_connection_handle_t *handle)
@@ -868,6 +2473,7 @@ void esp_connection_enable_broadcast(esp_connection_handle_t *handle)
                 ESP_ERROR_CHECK(err);
         peer->registered = true;
         peer->status = ESP_PEER_STATUS_UNKNOWN;
+        esp_connection_schedule(handle, peer, esp_timer_get_time());
 }
 
 void esp_connection_disable_broadcast(esp_connection_handle_t *handle)
@@ -885,9 +2491,9 @@ void esp_connection_disable_broadcast(esp_connection_handle_t *handle)
 void esp_connection_purge_non_unique_peers(esp_connection_handle_t *handle)
 {
         esp_err_t err;
-        if ((handle == NULL) || (handle->entries == NULL))
+        if (handle == NULL)
         {
-                LOG_ERROR("NULL pointer, handle=0x%X, handle->entries=0x%X", (uintptr_t)handle, (uintptr_t)handle->entries);
+                LOG_ERROR("NULL pointer, handle=0x%X", (uintptr_t)handle);
                 return;
         }
 
@@ -8,6 +8,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
@@ -28,16 +29,64 @@
 #include "esp_crc.h"
 #include "nvs_flash.h"
 #include "esp_timer.h"
+#include "esp_cpu.h"
 
 #include "mem_probe.h"
 #include "logging.h"
 #include "rssi.h"
 #include "device_settings.h"
 #include "info.h"
+#include "frame_pool.h"
+#include "packets.h"
 
 #define ONE_SECOND_IN_US (1 * 1e6)
 
 #define ESPNOW_QUEUE_SIZE (64)
+#define ESPNOW_TX_POOL_SIZE (16) // Number of transmit frames, shared by the peer transmit queues and the broadcasts being sent
+
+// Peer table sizes, the host benchmarks build larger tables
+#ifndef ESP_CONNECTION_MAX_PEERS
+#define ESP_CONNECTION_MAX_PEERS (32) // Capacity of the peer table, least recently seen unpaired peers are evicted when full
+#endif
+#ifndef ESP_CONNECTION_INDEX_SIZE
+#define ESP_CONNECTION_INDEX_SIZE (64) // Slots of the MAC hash index, power of two and larger than the peer table
+#endif
+
+// Position in the peer table, one byte unless the table is too large for it
+#if ESP_CONNECTION_MAX_PEERS < 0xFF
+typedef uint8_t esp_peer_slot_t;
+#define ESP_CONNECTION_INDEX_EMPTY (0xFF) // Marks an unused slot of the MAC hash index
+#else
+typedef uint16_t esp_peer_slot_t;
+#define ESP_CONNECTION_INDEX_EMPTY (0xFFFF) // Marks an unused slot of the MAC hash index
+#endif
+
+_Static_assert((ESP_CONNECTION_INDEX_SIZE & (ESP_CONNECTION_INDEX_SIZE - 1)) == 0, "MAC hash index size must be a power of two");
+_Static_assert(ESP_CONNECTION_INDEX_SIZE > ESP_CONNECTION_MAX_PEERS, "MAC hash index needs an empty slot to end every probe");
+_Static_assert(ESP_CONNECTION_MAX_PEERS < ESP_CONNECTION_INDEX_EMPTY, "Peer slots cannot be told from the empty marker");
+
+#define ESP_CONNECTION_UPDATE_INTERVAL_MS (10) // Interval of the peer status housekeeping, one timer wheel tick
+#define ESP_CONNECTION_WHEEL_SLOTS (64)        // Slots of the peer timer wheel, later deadlines wrap around
+#define ESP_CONNECTION_CONNECT_RETRY_MS (300)  // Interval between two connection requests while connecting
+#define ESP_CONNECTION_IDLE_PING_MS (300)      // Send a keepalive after this long without unicast traffic to the peer
+#define ESP_PEER_TX_QUEUE_SIZE (4)             // Frames waiting to be sent to one peer, the oldest that is not a fragment is dropped when full
+#define ESP_PEER_TX_TIMEOUT_MS (50)            // Give up waiting for the send result of the frame in flight after this long
+#define ESP_PEER_SEQ_WINDOW_SIZE (64)          // Sequence numbers tracked behind the newest received one
+#define ESP_PEER_SEQ_RESYNC_COUNT (4)          // Consecutive frames older than the window that mean the peer restarted its count
+#define ESP_CONNECTION_RSSI_SUBS (4)           // Maximum number of RSSI threshold subscriptions
+#define ESP_PEER_RTT_PROBE_MS (1000)           // Interval of round trip probes to connected peers, busy or idle
+#define ESP_PEER_RTT_MIN_SHIFT (7)             // First histogram octave starts at 2^shift us, faster round trips share bucket 0
+#define ESP_PEER_RTT_OCTAVES (13)              // Powers of two covered by the histogram, up to about one second
+#define ESP_PEER_CLOCK_SAMPLES (8)             // Ping exchanges kept, the one with the shortest round trip gives the clock offset
+#define ESP_PEER_CLOCK_DRIFT_MIN_MS (20000)    // Minimum time between the two offsets the clock drift is measured from
+// Four buckets per power of two, plus the underflow and overflow buckets
+#define ESP_PEER_RTT_BUCKETS (ESP_PEER_RTT_OCTAVES * 4 + 2)
+
+#define ESPNOW_TX_INFLIGHT_SIZE (16)            // Sent packets waiting for their send result
+#define ESPNOW_CONTROLLER_KEYFRAME_INTERVAL (32) // Maximum number of delta frames between two controller keyframes
+#define ESPNOW_CONTROLLER_PENDING_SIZE (4)       // Controller snapshots waiting for their send result
+#define ESPNOW_CONTROLLER_HISTORY_SIZE (8)       // Received controller snapshots kept as delta bases
+#define ESPNOW_CONTROLLER_REQUEST_MS (20)        // Minimum time between two keyframe requests to the same peer
 
 // Configuration for the ESP-NOW
 typedef struct
@@ -46,8 +95,9 @@ typedef struct
         wifi_interface_t wifi_interface; // WiFi IF interface
         wifi_mode_t mode;                // WiFi mode
         esp_interface_t esp_interface;   // ESP IF interface
-        bool long_range;                 // Enable long-range mode
-        uint8_t channel;                 // WiFi channel, currently only supported channel is: `1`
+        bool long_range;                 // Start in long-range mode
+        bool adaptive_rate;              // Move the PHY rate with link quality, long-range rates included
+        uint8_t channel;                 // WiFi channel, peers meet on it before moving to a quieter one
         char *pmk;                       // Public master key
         char *lmk;                       // Local master key
 } espnow_wifi_config_t;
@@ -71,7 +121,7 @@ typedef struct
 {
         uint8_t mac_addr[ESP_NOW_ETH_ALEN]; // Peer MAC address
         size_t data_len;                    // Received data length, in bytes
-        uint8_t *data;                      // Received data, in heap memory
+        uint8_t *data;                      // Received data, borrowed from the receive frame pool
 } __packed espnow_event_recv_cb_t;
 
 // ESP-NOW queue date event info
@@ -98,10 +148,17 @@ typedef enum
         ESPNOW_PACKET_TYPE_CAR_MOVEMENT,      // `NOT IMPLEMENTED`
         ESPNOW_PACKET_TYPE_CATAPULT_MOVEMENT, // `NOT IMPLEMENTED`
         ESPNOW_PACKET_TYPE_KEEPER_MOVEMENT,   // `NOT IMPLEMENTED`
-        ESPNOW_PACKET_TYPE_PING,              // `NOT IMPLEMENTED`
-        ESPNOW_PACKET_TYPE_ACK,               // Acknowledgment
-        ESPNOW_PACKET_TYPE_NACK,              // `NOT IMPLEMENTED`
+        ESPNOW_PACKET_TYPE_PING,              // Keepalive and round trip probe, answered with `PONG` when timestamped
+        ESPNOW_PACKET_TYPE_ACK,               // Acknowledgment of reliable packets
+        ESPNOW_PACKET_TYPE_NACK,              // Acknowledgment of reliable packets, asking for the missing ones now
         ESPNOW_PACKET_TYPE_CONNECT,           // Request for connection
+        ESPNOW_PACKET_TYPE_CONTROLLER_STATE,  // Snapshot of all buttons and joystick axes
+        ESPNOW_PACKET_TYPE_CONTROLLER_DELTA,  // Changes of the controller state against an acknowledged snapshot
+        ESPNOW_PACKET_TYPE_CONFIG,            // Mode change or configuration command, delivered through the reliable channel
+        ESPNOW_PACKET_TYPE_CHANNEL_CHANGE,    // Move to another WiFi channel, delivered through the reliable channel
+        ESPNOW_PACKET_TYPE_PONG,              // Reply to a timestamped ping, echoing its payload
+        ESPNOW_PACKET_TYPE_FRAGMENT,          // Part of a message larger than one frame
+        ESPNOW_PACKET_TYPE_KEYFRAME_REQUEST,  // Request for a controller keyframe, a delta arrived without its base
         ESPNOW_PACKET_TYPE_MAX,
 } espnow_packet_type_t;
 
@@ -117,6 +174,13 @@ static const char __attribute__((unused)) * ESPNOW_PACKET_TYPE_STRING[] = {
     "ESPNOW_PACKET_TYPE_ACK",
     "ESPNOW_PACKET_TYPE_NACK",
     "ESPNOW_PACKET_TYPE_CONNECT",
+    "ESPNOW_PACKET_TYPE_CONTROLLER_STATE",
+    "ESPNOW_PACKET_TYPE_CONTROLLER_DELTA",
+    "ESPNOW_PACKET_TYPE_CONFIG",
+    "ESPNOW_PACKET_TYPE_CHANNEL_CHANGE",
+    "ESPNOW_PACKET_TYPE_PONG",
+    "ESPNOW_PACKET_TYPE_FRAGMENT",
+    "ESPNOW_PACKET_TYPE_KEYFRAME_REQUEST",
     "ESPNOW_PACKET_TYPE_MAX"};
 
 // ESP-NOW data packet sequence number
@@ -133,35 +197,116 @@ typedef enum
         ESPNOW_DATA_UNICAST,   // Use unicast, use peer MAC address
 } espnow_packet_sending_method_t;
 
-// ESP-NOW data packet content definition
+#define ESPNOW_PROTOCOL_VERSION (3)           // Newest wire format version, used with peers that agreed on it
+#define ESPNOW_PROTOCOL_VERSION_MIN (2)       // Oldest wire format version understood, used for broadcasts and connection requests
+#define ESPNOW_PROTOCOL_VERSION_TIMESTAMP (3) // First wire format version with sender timestamps
+#define ESPNOW_PACKET_TYPE_MASK (0x1F)        // Bits of `type_flags` holding the `espnow_packet_type_t`
+#define ESPNOW_PACKET_FLAG_UNICAST (1 << 5)   // Bit of `type_flags` set when the packet is sent to one peer
+#define ESPNOW_PACKET_FLAG_TIMESTAMP (1 << 6) // Bit of `type_flags` set when the payload starts with a `uint32_t` sender timestamp
+
+// Data packet type of a received packet
+#define ESPNOW_PACKET_TYPE(packet) ((espnow_packet_type_t)((packet)->type_flags & ESPNOW_PACKET_TYPE_MASK))
+// Sending method of a received packet
+#define ESPNOW_PACKET_METHOD(packet) (((packet)->type_flags & ESPNOW_PACKET_FLAG_UNICAST) ? ESPNOW_DATA_UNICAST : ESPNOW_DATA_BROADCAST)
+
+// ESP-NOW data packet content definition, the byte layout is shared with the car and must not depend on the compiler
+// `version` stays the first byte in every version so mismatched peers can be recognized
 typedef struct
 {
-        uint16_t seq_num;                         // Sequence number of ESP-NOW data.
-        uint16_t crc;                             // CRC16 value of ESPNOW data.
-        espnow_packet_sending_method_t broadcast; // 0: broadcast, 1: unicast
-        espnow_packet_type_t type;                // Data packet types
-        uint8_t salt;                             // Random bits
-        uint8_t len;                              // Length of payload, unit: byte.
-        uint8_t payload[0];                       // Payload of ESP-NOW data.
-} espnow_packet_t;
+        uint8_t version;    // Wire format version, agreed with the peer or `ESPNOW_PROTOCOL_VERSION_MIN`
+        uint8_t type_flags; // Data packet type in the low 5 bits, `ESPNOW_PACKET_FLAG_*` in the high 3 bits
+        uint16_t seq_num;   // Sequence number of ESP-NOW data, little endian
+        uint16_t crc;       // CRC16 value of ESPNOW data, computed with this field set to 0, little endian
+        uint8_t len;        // Length of payload, unit: byte.
+        uint8_t payload[0]; // Payload of ESP-NOW data.
+} __packed espnow_packet_t;
+
+_Static_assert(sizeof(espnow_packet_t) == 7, "ESP-NOW header layout changed");
+_Static_assert(offsetof(espnow_packet_t, version) == 0, "ESP-NOW header layout changed");
+_Static_assert(offsetof(espnow_packet_t, type_flags) == 1, "ESP-NOW header layout changed");
+_Static_assert(offsetof(espnow_packet_t, seq_num) == 2, "ESP-NOW header layout changed");
+_Static_assert(offsetof(espnow_packet_t, crc) == 4, "ESP-NOW header layout changed");
+_Static_assert(offsetof(espnow_packet_t, len) == 6, "ESP-NOW header layout changed");
+_Static_assert(offsetof(espnow_packet_t, payload) == 7, "ESP-NOW header layout changed");
+_Static_assert(ESPNOW_PACKET_TYPE_MAX <= ESPNOW_PACKET_TYPE_MASK + 1, "Packet types do not fit in the header");
+
+// Payload of `CONNECT` packets, the range of wire format versions the sender understands
+typedef struct
+{
+        uint8_t version_min; // Oldest version understood
+        uint8_t version_max; // Newest version understood
+} __packed espnow_connect_pkt_t;
+
+// Payload of `PING` and `PONG` packets, a `PING` without payload is a plain keepalive
+typedef struct
+{
+        uint32_t sent_us; // Low 32 bits of the sender clock when the ping was sent, little endian
+} __packed espnow_ping_pkt_t;
+
+// Payload of `PONG` packets answering a timestamped `PING`
+typedef struct
+{
+        uint32_t sent_us;  // `sent_us` of the ping, echoed
+        int64_t remote_us; // Clock of the replying peer when the reply was sent, little endian
+} __packed espnow_pong_pkt_t;
 
 // Parameters of sending ESPNOW data
 typedef struct
 {
         espnow_packet_sending_method_t broadcast; // Broadcast or unicast of ESP-NOW data.
         espnow_packet_type_t type;                // Data packet types
+        uint8_t version;                          // Wire format version of the header
         uint16_t seq_num;                         // Sequence number of ESP-NOW data.
         int len;                                  // Length of ESPNOW data to be sent, unit: byte.
-        uint8_t *buffer;                          // Buffer pointing to ESPNOW data.
+        uint8_t *buffer;                          // Buffer pointing to ESPNOW data, borrowed from the transmit frame pool while sending.
         uint8_t dest_mac[ESP_NOW_ETH_ALEN];       // MAC address of destination device.
 } espnow_send_param_t;
 
+// Transmit path statistics
+typedef struct
+{
+        uint32_t sent;         // Number of packets handed to `esp_now_send`
+        uint32_t failed;       // Number of packets that could not be built or sent
+        uint64_t cycles_total; // CPU cycles spent in `espnow_send_data`
+        uint32_t cycles_max;   // Longest `espnow_send_data` call, in CPU cycles
+} espnow_send_stats_t;
+
+// Controller state stream statistics
+typedef struct
+{
+        uint32_t keyframes;     // Number of full snapshots sent
+        uint32_t deltas;        // Number of delta frames sent
+        uint32_t payload_bytes; // Payload bytes sent
+        uint32_t full_bytes;    // Payload bytes if every frame was a full snapshot
+        uint32_t requested;     // Keyframe requests received, a delta base was lost after its send result
+        uint32_t requests;      // Keyframe requests sent, a received delta named a base not seen
+} espnow_controller_stats_t;
+
+// Sender side of a controller state stream
+typedef struct
+{
+        remote_controller_state_pkt_t acked;                                   // Last snapshot acknowledged by the peer, base of delta frames
+        remote_controller_state_pkt_t pending[ESPNOW_CONTROLLER_PENDING_SIZE]; // Snapshots sent and waiting for their send result, oldest first
+        uint8_t pending_count;                                                 // Number of snapshots waiting for their send result
+        uint16_t since_keyframe;                                               // Number of delta frames since the last keyframe
+        bool acked_valid;                                                      // A snapshot is acknowledged, delta frames can be sent
+        bool force_keyframe;                                                   // Send a keyframe next, set after a lost frame
+} espnow_controller_encoder_t;
+
+// Receiver side of a controller state stream
+typedef struct
+{
+        remote_controller_state_pkt_t history[ESPNOW_CONTROLLER_HISTORY_SIZE]; // Received snapshots, slot is sequence number modulo size
+        bool history_valid[ESPNOW_CONTROLLER_HISTORY_SIZE];                    // Slot holds a received snapshot
+        int64_t requested_us;                                                  // Last keyframe request sent, 0 if none
+} espnow_controller_decoder_t;
+
 // ESP-NOW peer connection status
 typedef enum
 {
         ESP_PEER_STATUS_UNKNOWN,        // Unknown status
         ESP_PEER_STATUS_LOST,           // Not in range of Wi-Fi for an extended period of time
-        ESP_PEER_STATUS_PROTOCOL_ERROR, // `NOT IMPLEMENTED`, all mismatched packet is discarded on the upstream
+        ESP_PEER_STATUS_PROTOCOL_ERROR, // Peer shares no wire format version, learnt from its connection request
         ESP_PEER_STATUS_NOREPLY,        // Peer does not reply for ping packet
         ESP_PEER_STATUS_IN_RANGE,       // In range of Wi-Fi
         ESP_PEER_STATUS_AVAILABLE,      // Can establish connection
@@ -183,33 +328,159 @@ static const char __attribute__((unused)) * ESP_PEER_STATUS_STRING[] = {
     "ESP_PEER_STATUS_REJECTED",
     "ESP_PEER_STATUS_MAX"};
 
-// ESP-NOW peer handle
+// Timing data of a peer, kept apart from the frequently accessed peer fields
 typedef struct
 {
-        uint8_t mac[ESP_NOW_ETH_ALEN]; // Peer MAC address
         int64_t lastseen_broadcast_us; // Timestamp of last received broadcast packet
-        int64_t lastseen_unicast_us;   // Timestamp of last received unicast packet
+        int64_t lastseen_unicast_us;   // Timestamp of last received or acknowledged unicast packet
         int64_t lastsent_unicast_us;   // Timestamp of last transmitted unicast packet
         int64_t connect_time_us;       // Timestamp of last send connection request packet
         int64_t last_ping_us;          // Timestamp of last ping packet
+        int64_t last_probe_us;         // Timestamp of last round trip probe
+        int64_t last_active_us;        // Timestamp of last frame seen from the peer, used for LRU eviction
         size_t conn_retry;             // Number of time of retrying the connection request packet
-        size_t seq_rx;                 // Total number of packet received
-        size_t seq_tx;                 // Total number of packet transmitted
-        esp_peer_status_t status;      // Peer connection status
-        int rssi;                      // Last seen RSSI
-        bool registered;               // Is registered on the connection table
-        bool is_unique;                // Is set to unique peer, will disconnect all other peer
-        bool saved_to_rom;             // Peer MAC address is saved to EEPROM
+} esp_peer_timing_t;
+
+// Sequence number window of the frames received from a peer
+typedef struct
+{
+        uint16_t highest;    // Newest sequence number received
+        uint64_t received;   // Bit `n` is set when `highest - n` is received
+        bool valid;          // A frame is received, `highest` is meaningful
+        uint8_t stale_run;   // Consecutive frames older than the window
+        uint32_t accepted;   // Frames passed on for processing
+        uint32_t duplicates; // Frames received more than once, dropped
+        uint32_t reordered;  // Frames received after a newer one
+        uint32_t stale;      // Frames dropped for being older than the window, or older than newer state
+        uint32_t lost;       // Sequence numbers skipped and not received since
+        uint32_t resyncs;    // Times the window restarted because the peer restarted its count
+} esp_peer_seq_window_t;
+
+// Round trip times to a peer, in logarithmic buckets
+typedef struct
+{
+        uint32_t buckets[ESP_PEER_RTT_BUCKETS]; // Round trips per bucket
+        uint32_t probes;                        // Timestamped pings sent
+        uint32_t count;                         // Replies received
+        uint32_t last_us;                       // Latest round trip
+        uint32_t max_us;                        // Longest round trip
+} esp_peer_rtt_t;
+
+// Clock offset measured by one ping exchange
+typedef struct
+{
+        int64_t local_us;  // Local time halfway through the round trip, 0 if the slot is empty
+        int64_t offset_us; // Peer clock minus local clock
+        uint32_t rtt_us;   // Round trip, half of it bounds the error of `offset_us`
+} esp_peer_clock_sample_t;
+
+// Estimate of the clock of a peer against the local clock
+typedef struct
+{
+        esp_peer_clock_sample_t samples[ESP_PEER_CLOCK_SAMPLES]; // Latest exchanges, oldest overwritten first
+        uint8_t next;                                            // Slot of the next exchange
+        bool synced;                                             // `ref` holds an offset
+        esp_peer_clock_sample_t ref;                             // Exchange with the shortest round trip among the kept ones
+        esp_peer_clock_sample_t drift_ref;                       // Older reference the drift is measured from
+        int32_t drift_ppb;                                       // Peer clock rate minus local clock rate, in parts per billion
+        uint32_t one_way_count;                                  // Timestamped packets received
+        int64_t one_way_total_us;                                // Sum of their one-way latencies
+        int32_t one_way_last_us;                                 // Latest one-way latency
+        int32_t one_way_min_us;                                  // Shortest one-way latency
+        int32_t one_way_max_us;                                  // Longest one-way latency
+} esp_peer_clock_t;
+
+// Frame waiting in the transmit queue of a peer
+typedef struct
+{
+        uint8_t frame;    // Transmit frame holding the packet, may be shared with other peers
+        uint16_t seq_num; // Sequence number of the packet for this peer
+} esp_peer_tx_entry_t;
+
+// Transmit queue of a peer, frames are sent one at a time so a slow peer only holds back its own frames
+typedef struct
+{
+        esp_peer_tx_entry_t entries[ESP_PEER_TX_QUEUE_SIZE]; // Waiting frames, oldest first from `head`
+        uint8_t head;                                        // Position of the oldest waiting frame
+        uint8_t count;                                       // Number of waiting frames
+        bool busy;                                           // A frame is handed to ESP-NOW, waiting for its send result
+        int64_t sent_us;                                     // Timestamp of handing the frame in flight to ESP-NOW
+        uint32_t queued;                                     // Frames queued
+        uint32_t dropped;                                    // Frames dropped from a full queue or refused by it
+        uint32_t timeouts;                                   // Send results that never came
+} esp_peer_tx_queue_t;
+
+// ESP-NOW peer handle
+typedef struct
+{
+        uint8_t mac[ESP_NOW_ETH_ALEN];             // Peer MAC address
+        esp_peer_status_t status;                  // Peer connection status
+        int rssi;                                  // Filtered RSSI
+        rssi_filter_t rssi_filter;                 // RSSI estimator, fed with the captured frames of the peer
+        uint8_t rssi_above;                        // Bit `n` is set while the RSSI is above subscription `n`
+        bool registered;                           // Is registered on the connection table
+        bool is_unique;                            // Is set to unique peer, other peers are disconnected once the peer limit is reached
+        bool saved_to_rom;                         // Peer MAC address is saved to EEPROM
+        size_t seq_rx;                             // Total number of packet received
+        size_t seq_tx;                             // Total number of packet transmitted
+        uint8_t version;                           // Wire format version agreed in the connection request, 0 before
+        esp_peer_seq_window_t rx_broadcast;        // Sequence window of broadcast frames, numbered apart from unicast
+        esp_peer_seq_window_t rx_unicast;          // Sequence window of unicast frames
+        esp_peer_rtt_t rtt;                        // Round trip time histogram
+        esp_peer_clock_t clock;                    // Clock offset and drift of the peer
+        int64_t deadline_us;                       // Next run of the peer state machine, 0 if not scheduled
+        esp_peer_slot_t wheel_prev;                // Previous peer in the timer wheel slot, `ESP_CONNECTION_INDEX_EMPTY` if first
+        esp_peer_slot_t wheel_next;                // Next peer in the timer wheel slot, `ESP_CONNECTION_INDEX_EMPTY` if last
+        esp_peer_tx_queue_t tx;                    // Frames waiting to be sent to the peer
+        esp_peer_timing_t *timing;                 // Timing data of the peer, stored in the connection handle
+        espnow_controller_encoder_t controller_tx; // Controller state sent to the peer
+        espnow_controller_decoder_t controller_rx; // Controller state received from the peer
 } esp_peer_handle_t;
 
+// Called when the filtered RSSI of a peer crosses a subscribed threshold
+typedef void (*esp_connection_rssi_cb_t)(esp_peer_handle_t *peer, int rssi, bool above, void *arg);
+
+// RSSI threshold subscription
+typedef struct
+{
+        int threshold;               // Crossed upward when the RSSI goes above it
+        int hysteresis;              // Crossed downward when the RSSI falls to `threshold - hysteresis`
+        esp_connection_rssi_cb_t cb; // Callback, runs on the dispatcher task
+        void *arg;                   // User argument of the callback
+} esp_rssi_subscription_t;
+
+// Slot of the peer MAC hash index
+typedef struct
+{
+        uint8_t mac[ESP_NOW_ETH_ALEN]; // Peer MAC address, probed without touching the peer table
+        esp_peer_slot_t slot;          // Position in the peer table, `ESP_CONNECTION_INDEX_EMPTY` when unused
+} esp_peer_index_entry_t;
+
 // ESP-NOW peer connection handle, create/remove connection as requested
 typedef struct
 {
-        device_settings_t *device_settings; // EEPROM handle
-        esp_peer_handle_t *entries;         // List of all peers
-        int8_t size;                        // Number of peers in the list
-        int8_t limit;                       // Max active number of peers
-        int8_t remote_connected;            // Number of connected peers
+        device_settings_t *device_settings;                          // EEPROM handle
+        esp_peer_handle_t entries[ESP_CONNECTION_MAX_PEERS];         // List of all peers, entries never move once added
+        esp_peer_timing_t timing[ESP_CONNECTION_MAX_PEERS];          // Timing data of each entry in the list
+        esp_peer_index_entry_t index[ESP_CONNECTION_INDEX_SIZE];     // Open-addressed MAC hash index over the list
+        esp_peer_slot_t size;                                        // Number of peers in the list
+        int8_t limit;                                                // Max active number of peers
+        int8_t remote_connected;                                     // Number of connected peers
+        uint32_t evicted;                                            // Number of stale peers evicted to make room
+        uint32_t heartbeats;                                         // Number of keepalives sent to idle peers
+        esp_rssi_subscription_t rssi_subs[ESP_CONNECTION_RSSI_SUBS]; // RSSI threshold subscriptions
+        size_t rssi_sub_count;                                       // Number of RSSI threshold subscriptions
+        rssi_stat_t rssi_pending[RSSI_TABLE_SIZE];                   // RSSI snapshots posted to the dispatcher task, one per transmitter
+        size_t rssi_pending_count;                                   // Number of posted RSSI snapshots
+        uint32_t rssi_dropped;                                       // Number of RSSI snapshots lost because the list was full
+        size_t unique_count;                                         // Number of unique peers
+        esp_peer_slot_t wheel[ESP_CONNECTION_WHEEL_SLOTS];           // First peer of each timer wheel slot, `ESP_CONNECTION_INDEX_EMPTY` if none
+        int64_t wheel_tick;                                          // Last timer wheel tick processed
+        int64_t load_since_us;                                       // Start of the current load measurement second
+        uint32_t load_runs;                                          // Peer state machine runs in the current second
+        uint32_t load_cycles;                                        // CPU cycles spent in the current second
+        uint32_t runs_per_s;                                         // Peer state machine runs in the last full second
+        uint32_t cycles_per_s;                                       // CPU cycles spent in the last full second
 } esp_connection_handle_t;
 
 /* ESP-NOW */
@@ -222,6 +493,14 @@ QueueHandle_t espnow_init(espnow_wifi_config_t *espnow_config, esp_connection_ha
 // Loads default settings of the ESP-NOW Wi-Fi
 espnow_wifi_config_t *espnow_wifi_default_config(espnow_wifi_config_t *config);
 
+// Move ESP-NOW to another WiFi channel, registered peers are moved along
+esp_err_t espnow_set_channel(esp_connection_handle_t *handle, uint8_t channel);
+// WiFi channel ESP-NOW is on
+uint8_t espnow_get_channel(void);
+// Hold every transmission while the radio listens on another channel, frames to peers wait in their queues and broadcasts fail
+// Once released the dispatcher task sends the frames that waited
+void espnow_set_tx_paused(bool paused);
+
 // Configure parameter for sending packet to default peer
 espnow_send_param_t *espnow_get_default_send_param(espnow_send_param_t *send_param);
 // Configure parameter for sending packet to broadcast address
@@ -235,13 +514,32 @@ void espnow_deinit(espnow_send_param_t *send_param);
 
 // Validates the packet structure from the header and extract the payload
 espnow_packet_t *espnow_data_parse(espnow_packet_t *recv_data, espnow_event_recv_cb_t *recv_cb);
+// Returns the received data of the event back to the receive frame pool
+void espnow_data_release(espnow_event_recv_cb_t *recv_cb);
+
+// Print ESP-NOW buffer statistics
+void espnow_show_stats(void);
 
 // Send ESP-NOW data packet to peer
+// Returns `ESP_ERR_NO_MEM` when out of transmit frames, or when the transmit queue of the peer is full of fragments
 esp_err_t espnow_send_data(espnow_send_param_t *send_param, espnow_packet_type_t type, void *data, size_t len);
+// Send ESP-NOW data packet type of `CONNECT` to peer, offering the supported wire format versions
+esp_err_t espnow_send_connect(espnow_send_param_t *send_param);
 // Send ESP-NOW data packet type of `TEXT` to peer
 esp_err_t espnow_send_text(espnow_send_param_t *send_param, char *text);
-// Send ESP-NOW data packet type of `REPLY` to peer
-esp_err_t espnow_send_reply(espnow_send_param_t *send_param);
+// Copy the transmit path statistics
+espnow_send_stats_t *espnow_get_send_stats(espnow_send_stats_t *stats);
+
+// Send the same packet to every peer of `peers` with unicast, the packet is built once per wire format version
+// Each peer numbers its copy and sends it from its own transmit queue
+esp_err_t espnow_send_fanout(esp_peer_handle_t *const *peers, size_t count, espnow_packet_type_t type, const void *data, size_t len);
+// Send the controller state to peer, as a delta against the last acknowledged snapshot when possible
+esp_err_t espnow_send_controller_state(espnow_send_param_t *send_param, const remote_controller_state_pkt_t *state);
+// Send the controller state to every peer of `peers`, peers sharing an acknowledged snapshot share one encoding
+esp_err_t espnow_send_controller_state_fanout(esp_peer_handle_t *const *peers, size_t count, const remote_controller_state_pkt_t *state);
+// Rebuild the full controller state from a received `CONTROLLER_STATE` or `CONTROLLER_DELTA` packet
+// Returns NULL if the packet is malformed or its base snapshot was not received
+remote_controller_state_pkt_t *espnow_controller_decode(esp_peer_handle_t *peer, espnow_packet_t *recv_data, remote_controller_state_pkt_t *state);
 
 /* ESP-NOW peer connection */
 
@@ -249,12 +547,17 @@ esp_err_t espnow_send_reply(espnow_send_param_t *send_param);
 void esp_connection_handle_init(esp_connection_handle_t *handle);
 // Load paired peer as the unique peer, disconnecting all other peer
 void esp_connection_handle_connect_to_device_settings(esp_connection_handle_t *handle, device_settings_t *device_settings);
-// `DO NOT USE`
+// Forget all peers
 void esp_connection_handle_clear(esp_connection_handle_t *handle);
-// Updates all peer status
+// Runs the state machine of the peers whose deadline expired
 void esp_connection_handle_update(esp_connection_handle_t *handle);
-// Updates rssi
-void esp_connection_update_rssi(esp_connection_handle_t *handle, const rssi_event_t *rssi_event);
+// Process the result of sending an ESP-NOW packet
+void esp_connection_process_send_result(esp_connection_handle_t *handle, const espnow_event_send_cb_t *send_cb);
+// Hand an RSSI snapshot to the dispatcher task, which feeds the RSSI filter of the transmitter on its next update
+// The peer table is only changed by the dispatcher task, any task may post
+esp_err_t esp_connection_post_rssi(esp_connection_handle_t *handle, const rssi_stat_t *rssi_stat);
+// Call `cb` whenever the filtered RSSI of a peer goes above `threshold` or falls back to `threshold - hysteresis`
+esp_err_t esp_connection_subscribe_rssi(esp_connection_handle_t *handle, int threshold, int hysteresis, esp_connection_rssi_cb_t cb, void *arg);
 
 // Enable broadcast
 void esp_connection_enable_broadcast(esp_connection_handle_t *handle);
@@ -265,23 +568,30 @@ void esp_connection_disable_broadcast(esp_connection_handle_t *handle);
 size_t esp_connection_count_connected(esp_connection_handle_t *handle);
 // Count the total number of unique peer
 size_t esp_connection_count_unique_peer(esp_connection_handle_t *handle);
+// Number of frames that can be queued to `peer` before a waiting one is dropped
+size_t esp_peer_tx_space(esp_peer_handle_t *peer);
+// Fill `peers` with the connected unique peers, returns the number found
+size_t esp_connection_get_fleet(esp_connection_handle_t *handle, esp_peer_handle_t **peers, size_t max_peers);
 
 // Get peer handle from peer MAC address, return NULL if not found in list
 esp_peer_handle_t *esp_connection_mac_lookup(esp_connection_handle_t *handle, const uint8_t *mac);
 
 // Create new peer handle with provided MAC if not in list, returns peer handle
+// Evicts the least recently seen unpaired peer when the list is full, returns NULL if no peer can be evicted
 esp_peer_handle_t *esp_connection_mac_add_to_entry(esp_connection_handle_t *handle, const uint8_t *mac);
 
 // Print peer list and status
 void esp_connection_show_entries(esp_connection_handle_t *handle);
 
-// Pinging peer to keep connection valid
+// Pinging peers that had no unicast traffic for `ESP_CONNECTION_IDLE_PING_MS` to keep connection valid
+// Connected peers are also pinged every `ESP_PEER_RTT_PROBE_MS` to measure the round trip time
+// `esp_connection_handle_update` already does this when the deadlines expire
 void esp_connection_send_heartbeat(esp_connection_handle_t *handle);
 
-// Sets the maximum peer that can be active
+// Sets the maximum peer that can be active, other peers are shut out once as many unique peers are set
 void esp_connection_set_peer_limit(esp_connection_handle_t *handle, int8_t new_limit);
 
-// Sets the unique peer
+// Adds a unique peer, every unique peer is kept connected
 void esp_connection_set_unique_peer_mac(esp_connection_handle_t *handle, const uint8_t *mac);
 
 /* ESP-NOW peer */
@@ -289,8 +599,17 @@ void esp_connection_set_unique_peer_mac(esp_connection_handle_t *handle, const u
 // Updates peer status
 void esp_peer_set_status(esp_peer_handle_t *peer, esp_peer_status_t new_status);
 
-// Process received packet
-void esp_peer_process_received(esp_peer_handle_t *peer, espnow_packet_t *recv_data);
+// Time on the clock of `peer` at local time `local_us`, `local_us` itself until the clocks are synchronized
+int64_t esp_peer_remote_time_us(const esp_peer_handle_t *peer, int64_t local_us);
+
+// Current time on the clock of the first synchronized connected peer, the local time if none
+int64_t remote_time_us(void);
+
+// Round trip time below which `percent` of the measured round trips fall, in us
+uint32_t esp_peer_rtt_percentile(const esp_peer_rtt_t *rtt, uint8_t percent);
+
+// Process received packet, returns false if the packet is a duplicate or stale and must be dropped
+bool esp_peer_process_received(esp_peer_handle_t *peer, espnow_packet_t *recv_data);
 
 // Kill all ono-unique peer
 void esp_connection_purge_non_unique_peers(esp_connection_handle_t *handle);
@@ -0,0 +1,306 @@
+
+#include "espnow_channel.h"
+
+#define LOG_MODULE ESPNOW_CHANNEL
+static const char *TAG = "espnow_channel";
+
+static esp_connection_handle_t *espnow_channel_handle;
+static espnow_channel_survey_t espnow_channel_survey[ESPNOW_CHANNEL_MAX + 1];
+static espnow_channel_stats_t espnow_channel_stats;
+static volatile bool espnow_channel_scan_requested;
+static volatile bool espnow_channel_scanning;    // The scan task runs, the channel is left alone until it is done
+static uint8_t espnow_channel_preferred;         // Channel to move connected peers to, 0 if none
+static volatile uint8_t espnow_channel_pending;  // Channel announced and not switched to yet, 0 if none, stops a running scan
+static bool espnow_channel_announced;            // The pending change was announced by us, peers must acknowledge it
+static int64_t espnow_channel_ack_us;            // Timestamp by which every peer must have acknowledged the announced change, 0 once checked
+static int64_t espnow_channel_switch_us;         // Timestamp of the pending switch
+static int64_t espnow_channel_last_connected_us; // Timestamp of the last update with a connected peer
+
+static void espnow_channel_handle_change(esp_peer_handle_t *peer, espnow_packet_type_t type, const uint8_t *payload, size_t len)
+{
+        if (len != sizeof(espnow_channel_change_pkt_t))
+        {
+                LOG_WARNING("Channel change with invalid size, len:%d", len);
+                return;
+        }
+
+        // Only a peer we are connected to may move us, and only a paired one once there is one
+        if (peer->status != ESP_PEER_STATUS_CONNECTED)
+        {
+                LOG_WARNING("Channel change from " MACSTR " ignored, peer is %s", MAC2STR(peer->mac), ESP_PEER_STATUS_STRING[peer->status]);
+                return;
+        }
+        if (esp_connection_count_unique_peer(espnow_channel_handle) && !peer->is_unique)
+        {
+                LOG_WARNING("Channel change from " MACSTR " ignored, peer is not paired", MAC2STR(peer->mac));
+                return;
+        }
+
+        espnow_channel_change_pkt_t change;
+        memcpy(&change, payload, sizeof(change));
+        if (change.channel == 0)
+        {
+                if (espnow_channel_pending && !espnow_channel_announced)
+                {
+                        LOG_INFO("Peer " MACSTR " cancelled the move to channel %d", MAC2STR(peer->mac), espnow_channel_pending);
+                        espnow_channel_pending = 0;
+                        espnow_channel_stats.cancelled++;
+                }
+                return;
+        }
+        if (change.channel > ESPNOW_CHANNEL_MAX)
+        {
+                LOG_WARNING("Channel change to invalid channel %d", change.channel);
+                return;
+        }
+
+        LOG_INFO("Peer " MACSTR " moves to channel %d in %d ms", MAC2STR(peer->mac), change.channel, change.delay_ms);
+        espnow_channel_pending = change.channel;
+        espnow_channel_announced = false;
+        espnow_channel_switch_us = esp_timer_get_time() + change.delay_ms * 1000;
+}
+
+void espnow_channel_init(esp_connection_handle_t *handle)
+{
+        if (handle == NULL)
+        {
+                LOG_ERROR("NULL pointer, handle=0x%X", (uintptr_t)handle);
+                return;
+        }
+
+        espnow_channel_handle = handle;
+        espnow_channel_last_connected_us = esp_timer_get_time();
+        espnow_dispatch_register(ESPNOW_PACKET_TYPE_CHANNEL_CHANGE, espnow_channel_handle_change);
+}
+
+void espnow_channel_request_scan(void)
+{
+        espnow_channel_scan_requested = true;
+}
+
+uint8_t espnow_channel_scan(void)
+{
+        uint8_t first = 1, last = 11;
+        wifi_country_t country;
+        if (esp_wifi_get_country(&country) == ESP_OK && country.nchan > 0)
+        {
+                first = country.schan;
+                last = country.schan + country.nchan - 1;
+        }
+        if (last > ESPNOW_CHANNEL_MAX)
+                last = ESPNOW_CHANNEL_MAX;
+
+        uint8_t current = espnow_get_channel();
+        uint32_t airtime[ESPNOW_CHANNEL_MAX + 1] = {0};
+        for (uint8_t channel = first; channel <= last; channel++)
+        {
+                if (espnow_channel_pending)
+                {
+                        LOG_INFO("Channel scan stopped, moving to channel %d", espnow_channel_pending);
+                        return current;
+                }
+
+                // Away from the current channel the frames wait, one channel at a time so the peers stay connected
+                bool away = channel != current;
+                if (away)
+                {
+                        espnow_set_tx_paused(true);
+                        if (esp_wifi_set_channel(channel, WIFI_SECOND_CHAN_NONE) != ESP_OK)
+                        {
+                                espnow_set_tx_paused(false);
+                                continue;
+                        }
+                }
+                rssi_channel_load_t load;
+                rssi_take_channel_load(&load);
+                vTaskDelay(pdMS_TO_TICKS(ESPNOW_CHANNEL_SCAN_DWELL_MS));
+                rssi_take_channel_load(&load);
+                if (away)
+                {
+                        esp_wifi_set_channel(current, WIFI_SECOND_CHAN_NONE);
+                        espnow_set_tx_paused(false);
+                        vTaskDelay(pdMS_TO_TICKS(ESPNOW_CHANNEL_SCAN_GAP_MS));
+                }
+
+                espnow_channel_survey_t *survey = &espnow_channel_survey[channel];
+                survey->frames = load.frames;
+                survey->bytes = load.bytes;
+                survey->rssi = load.frames ? load.rssi_sum / (int32_t)load.frames : 0;
+                airtime[channel] = load.bytes + load.frames * ESPNOW_CHANNEL_FRAME_OVERHEAD;
+        }
+
+        // 20 MHz channels 5 MHz apart overlap, traffic two channels away still costs a quarter
+        uint8_t best = current;
+        for (uint8_t channel = first; channel <= last; channel++)
+        {
+                uint32_t score = airtime[channel] * 4;
+                for (uint8_t distance = 1; distance <= 2; distance++)
+                {
+                        uint32_t weight = distance == 1 ? 2 : 1;
+                        if (channel - distance >= first)
+                                score += airtime[channel - distance] * weight;
+                        if (channel + distance <= last)
+                                score += airtime[channel + distance] * weight;
+                }
+                espnow_channel_survey[channel].score = score / 4;
+                if (espnow_channel_survey[channel].score < espnow_channel_survey[best].score)
+                        best = channel;
+        }
+
+        uint64_t best_score = espnow_channel_survey[best].score;
+        uint64_t current_score = espnow_channel_survey[current].score;
+        if (best != current && best_score * 100 <= current_score * (100 - ESPNOW_CHANNEL_MIN_GAIN_PERCENT))
+                espnow_channel_preferred = best;
+        else
+                espnow_channel_preferred = 0;
+        espnow_channel_stats.scans++;
+        LOG_INFO("Channel scan done, current: %d (score %lu), quietest: %d (score %lu), moving: %d",
+                 current, espnow_channel_survey[current].score, best, espnow_channel_survey[best].score, espnow_channel_preferred != 0);
+        return best;
+}
+
+static void espnow_channel_scan_task(void *arg)
+{
+        espnow_channel_scan();
+        espnow_channel_scanning = false;
+        vTaskDelete(NULL);
+}
+
+// Send a change to `channel` to every connected peer, 0 cancels the one sent before
+static void espnow_channel_send_change(esp_connection_handle_t *handle, uint8_t channel)
+{
+        espnow_channel_change_pkt_t change = {.channel = channel, .delay_ms = ESPNOW_CHANNEL_SWITCH_DELAY_MS};
+        for (size_t i = 0; i < handle->size; i++)
+        {
+                esp_peer_handle_t *peer = handle->entries + i;
+                if (peer->status != ESP_PEER_STATUS_CONNECTED)
+                        continue;
+                espnow_send_param_t send_param;
+                espnow_get_send_param(&send_param, peer);
+                esp_err_t err = espnow_send_reliable(&send_param, ESPNOW_PACKET_TYPE_CHANNEL_CHANGE, &change, sizeof(change));
+                if (err != ESP_OK)
+                        LOG_WARNING("Send channel change %d to " MACSTR " failed: %s", channel, MAC2STR(peer->mac), esp_err_to_name(err));
+        }
+}
+
+// Ask every connected peer to follow us to `channel`
+static void espnow_channel_announce(esp_connection_handle_t *handle, uint8_t channel)
+{
+        espnow_channel_send_change(handle, channel);
+        LOG_INFO("Moving to channel %d in %d ms", channel, ESPNOW_CHANNEL_SWITCH_DELAY_MS);
+        int64_t now_us = esp_timer_get_time();
+        espnow_channel_pending = channel;
+        espnow_channel_announced = true;
+        espnow_channel_ack_us = now_us + ESPNOW_CHANNEL_ACK_TIMEOUT_MS * 1000;
+        espnow_channel_switch_us = now_us + ESPNOW_CHANNEL_SWITCH_DELAY_MS * 1000;
+}
+
+// Returns true when every connected peer acknowledged the announced change
+static bool espnow_channel_announce_acked(esp_connection_handle_t *handle)
+{
+        for (size_t i = 0; i < handle->size; i++)
+        {
+                esp_peer_handle_t *peer = handle->entries + i;
+                if (peer->status == ESP_PEER_STATUS_CONNECTED && espnow_reliable_is_pending(peer->mac))
+                        return false;
+        }
+        return true;
+}
+
+void espnow_channel_update(esp_connection_handle_t *handle)
+{
+        if (handle == NULL)
+        {
+                LOG_ERROR("NULL pointer, handle=0x%X", (uintptr_t)handle);
+                return;
+        }
+
+        int64_t now_us = esp_timer_get_time();
+        bool connected = handle->remote_connected > 0;
+        if (connected)
+                espnow_channel_last_connected_us = now_us;
+
+        // The scan task hops channels, any switch waits until it returned to the current one
+        if (espnow_channel_scanning)
+                return;
+        if (espnow_channel_scan_requested && !espnow_channel_pending)
+        {
+                espnow_channel_scan_requested = false;
+                espnow_channel_scanning = true;
+                if (xTaskCreate(espnow_channel_scan_task, "channel_scan", ESPNOW_CHANNEL_SCAN_STACK_SIZE, NULL, ESPNOW_CHANNEL_SCAN_PRIORITY, NULL) != pdPASS)
+                {
+                        LOG_ERROR("Create channel scan task failed");
+                        espnow_channel_scanning = false;
+                }
+                return;
+        }
+
+        if (espnow_channel_pending)
+        {
+                // Peers that heard the announcement switch on their own timer, even when their acknowledgment was lost
+                // Tell them to stay while they still listen, the fallback brings back any that the cancel misses
+                if (espnow_channel_announced && espnow_channel_ack_us && now_us >= espnow_channel_ack_us)
+                {
+                        espnow_channel_ack_us = 0;
+                        if (!espnow_channel_announce_acked(handle))
+                        {
+                                LOG_WARNING("Channel %d not acknowledged by every peer, staying on channel %d", espnow_channel_pending, espnow_get_channel());
+                                espnow_channel_send_change(handle, 0);
+                                espnow_channel_stats.cancelled++;
+                                espnow_channel_pending = 0;
+                                return;
+                        }
+                }
+                if (now_us < espnow_channel_switch_us)
+                        return;
+                if (espnow_set_channel(handle, espnow_channel_pending) == ESP_OK)
+                {
+                        espnow_channel_stats.switches++;
+                        espnow_channel_last_connected_us = now_us;
+                }
+                espnow_channel_pending = 0;
+                return;
+        }
+
+        // Both ends return to the home channel when they lose each other, and meet there again
+        if (espnow_get_channel() != ESPNOW_CHANNEL_HOME && now_us - espnow_channel_last_connected_us >= ESPNOW_CHANNEL_FALLBACK_MS * 1000)
+        {
+                LOG_WARNING("No peer connected on channel %d, back to channel %d", espnow_get_channel(), ESPNOW_CHANNEL_HOME);
+                if (espnow_set_channel(handle, ESPNOW_CHANNEL_HOME) == ESP_OK)
+                        espnow_channel_stats.fallbacks++;
+                espnow_channel_preferred = 0;
+                espnow_channel_last_connected_us = now_us;
+                return;
+        }
+
+        if (connected && espnow_channel_preferred && espnow_channel_preferred != espnow_get_channel())
+        {
+                espnow_channel_announce(handle, espnow_channel_preferred);
+                espnow_channel_preferred = 0;
+        }
+}
+
+espnow_channel_stats_t *espnow_channel_get_stats(espnow_channel_stats_t *stats)
+{
+        if (stats == NULL)
+        {
+                LOG_ERROR("NULL pointer, stats=0x%X", (uintptr_t)stats);
+                return NULL;
+        }
+        *stats = espnow_channel_stats;
+        return stats;
+}
+
+void espnow_channel_show_stats(void)
+{
+        LOG_INFO("WiFi channel %d, scans: %lu, switches: %lu, cancelled: %lu, fallbacks: %lu",
+                 espnow_get_channel(), espnow_channel_stats.scans, espnow_channel_stats.switches, espnow_channel_stats.cancelled, espnow_channel_stats.fallbacks);
+        for (uint8_t channel = 1; channel <= ESPNOW_CHANNEL_MAX; channel++)
+        {
+                espnow_channel_survey_t *survey = &espnow_channel_survey[channel];
+                if (survey->frames == 0 && survey->score == 0)
+                        continue;
+                LOG_INFO("    channel %2d, frames: %5lu, bytes: %7lu, rssi: %4d, score: %7lu",
+                         channel, survey->frames, survey->bytes, survey->rssi, survey->score);
+        }
+}
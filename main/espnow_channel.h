@@ -0,0 +1,76 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_wifi.h"
+#include "esp_timer.h"
+
+#include "logging.h"
+#include "espnow.h"
+#include "espnow_dispatch.h"
+#include "espnow_reliable.h"
+#include "rssi.h"
+
+#define ESPNOW_CHANNEL_HOME (1)               // Rendezvous channel, used at boot and whenever the peers lose each other
+#define ESPNOW_CHANNEL_MAX (14)               // Highest WiFi channel in the 2.4 GHz band
+#define ESPNOW_CHANNEL_SCAN_DWELL_MS (120)    // Time listening to each channel during a scan
+#define ESPNOW_CHANNEL_SCAN_GAP_MS (100)      // Time back on the current channel between two scanned ones, keeps the peers connected
+#define ESPNOW_CHANNEL_SCAN_PRIORITY (3)      // Priority of the scan task, below the dispatcher task
+#define ESPNOW_CHANNEL_SCAN_STACK_SIZE (3072) // Stack size of the scan task, in bytes
+#define ESPNOW_CHANNEL_FRAME_OVERHEAD (48)    // Airtime of the preamble and inter-frame space of one frame, in bytes
+#define ESPNOW_CHANNEL_MIN_GAIN_PERCENT (30)  // Only move when the new channel is at least this much quieter
+#define ESPNOW_CHANNEL_SWITCH_DELAY_MS (500)  // Delay between announcing a channel change and switching, leaves time for retransmissions
+#define ESPNOW_CHANNEL_ACK_TIMEOUT_MS (300)   // Time for every peer to acknowledge an announced change, the rest of the delay is left to cancel it
+#define ESPNOW_CHANNEL_FALLBACK_MS (3000)     // Return to the home channel after this long without a connected peer
+
+// Payload of `CHANNEL_CHANGE` packets
+typedef struct
+{
+        uint8_t channel;    // WiFi channel to move to, 0 cancels the change announced before
+        uint16_t delay_ms;  // Time from receiving the message to switching, little endian
+} __packed espnow_channel_change_pkt_t;
+
+_Static_assert(ESPNOW_CHANNEL_ACK_TIMEOUT_MS < ESPNOW_CHANNEL_SWITCH_DELAY_MS, "No time left to cancel a channel change");
+
+// Traffic heard on one channel during the last scan
+typedef struct
+{
+        uint32_t frames; // Number of frames
+        uint32_t bytes;  // Sum of the frame lengths
+        int8_t rssi;     // Mean RSSI of the frames, 0 if none
+        uint32_t score;  // Estimated airtime in use, overlapping neighbour channels included
+} espnow_channel_survey_t;
+
+// Channel selection statistics
+typedef struct
+{
+        uint32_t scans;     // Number of scans
+        uint32_t switches;  // Number of channel changes completed
+        uint32_t cancelled; // Announced changes not acknowledged in time by every peer, or cancelled by the announcer
+        uint32_t fallbacks; // Returns to the home channel after losing all peers
+} espnow_channel_stats_t;
+
+// Handle channel change requests of the connected peers of `handle`, only paired peers are followed once one is set
+void espnow_channel_init(esp_connection_handle_t *handle);
+
+// Start a scan task on the next update, sends are held while the radio is away from the current channel
+void espnow_channel_request_scan(void);
+
+// Listen to every channel for `ESPNOW_CHANNEL_SCAN_DWELL_MS`, returning to the current channel in between, blocks the caller throughout
+// Returns the least congested channel, it becomes the preferred channel if it is quiet enough to move to
+// A change announced by a peer stops the scan early, the current channel is returned then
+uint8_t espnow_channel_scan(void);
+
+// Move connected peers to the preferred channel, run the announced switches and fall back to the home channel
+void espnow_channel_update(esp_connection_handle_t *handle);
+
+// Copy the channel selection statistics
+espnow_channel_stats_t *espnow_channel_get_stats(espnow_channel_stats_t *stats);
+
+// Print the current channel and the result of the last scan
+void espnow_channel_show_stats(void);
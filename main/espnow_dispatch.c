@@ -0,0 +1,187 @@
+
+#include "espnow_dispatch.h"
+
+#define LOG_MODULE ESPNOW_DISPATCH
+static const char *TAG = "espnow_dispatch";
+
+static espnow_dispatch_entry_t espnow_dispatch_table[ESPNOW_PACKET_TYPE_MAX];
+static portMUX_TYPE espnow_dispatch_lock = portMUX_INITIALIZER_UNLOCKED;
+static QueueHandle_t espnow_dispatch_queue;
+static esp_connection_handle_t *esp_connection_handle;
+static uint8_t espnow_dispatch_reply_mac[ESP_NOW_ETH_ALEN];
+static bool espnow_dispatch_reply_valid;
+
+espnow_dispatch_config_t *espnow_dispatch_default_config(espnow_dispatch_config_t *config)
+{
+        if (config == NULL)
+        {
+                LOG_ERROR("NULL pointer, config=0x%X", (uintptr_t)config);
+                return NULL;
+        }
+        config->stack_size = 4096;
+        config->priority = 5;
+        config->core = 1;
+        return config;
+}
+
+esp_err_t espnow_dispatch_register(espnow_packet_type_t type, espnow_dispatch_handler_t handler)
+{
+        if (type >= ESPNOW_PACKET_TYPE_MAX)
+        {
+                LOG_ERROR("Invalid packet type: %d", type);
+                return ESP_ERR_INVALID_ARG;
+        }
+        portENTER_CRITICAL(&espnow_dispatch_lock);
+        espnow_dispatch_table[type].handler = handler;
+        portEXIT_CRITICAL(&espnow_dispatch_lock);
+        return ESP_OK;
+}
+
+void espnow_dispatch_packet(esp_peer_handle_t *peer, espnow_packet_type_t type, const uint8_t *payload, size_t len)
+{
+        if (type >= ESPNOW_PACKET_TYPE_MAX)
+                return;
+
+        espnow_dispatch_entry_t *entry = &espnow_dispatch_table[type];
+        portENTER_CRITICAL(&espnow_dispatch_lock);
+        espnow_dispatch_handler_t handler = entry->handler;
+        portEXIT_CRITICAL(&espnow_dispatch_lock);
+        if (handler == NULL)
+        {
+                entry->dropped++;
+                return;
+        }
+
+        uint32_t start_cycles = esp_cpu_get_cycle_count();
+        handler(peer, type, payload, len);
+        uint32_t cycles = esp_cpu_get_cycle_count() - start_cycles;
+        entry->calls++;
+        entry->cycles_total += cycles;
+        if (cycles > entry->cycles_max)
+                entry->cycles_max = cycles;
+}
+
+static void espnow_dispatch_send_cb(espnow_event_send_cb_t *send_cb)
+{
+        esp_connection_process_send_result(esp_connection_handle, send_cb);
+        if (send_cb->status != ESP_NOW_SEND_SUCCESS)
+        {
+                LOG_WARNING("Send data to peer " MACSTR " failed", MAC2STR(send_cb->mac_addr));
+        }
+        else
+        {
+                LOG_VERBOSE("Send data to peer " MACSTR " success", MAC2STR(send_cb->mac_addr));
+        }
+}
+
+static void espnow_dispatch_recv_cb(espnow_event_recv_cb_t *recv_cb)
+{
+        espnow_packet_t *recv_data = NULL;
+        if (!(recv_data = espnow_data_parse(recv_data, recv_cb)))
+        {
+                LOG_WARNING("bad data packet from peer " MACSTR, MAC2STR(recv_cb->mac_addr));
+                return;
+        }
+
+        esp_peer_handle_t *peer = esp_connection_mac_add_to_entry(esp_connection_handle, recv_cb->mac_addr);
+        if (peer == NULL)
+                return;
+        if (!esp_peer_process_received(peer, recv_data))
+                return;
+
+        portENTER_CRITICAL(&espnow_dispatch_lock);
+        memcpy(espnow_dispatch_reply_mac, peer->mac, ESP_NOW_ETH_ALEN);
+        espnow_dispatch_reply_valid = true;
+        portEXIT_CRITICAL(&espnow_dispatch_lock);
+
+        if (!espnow_reliable_process_received(peer, recv_data))
+                espnow_dispatch_packet(peer, ESPNOW_PACKET_TYPE(recv_data), recv_data->payload, recv_data->len);
+}
+
+static void espnow_dispatch_task(void *arg)
+{
+        int64_t next_update_us = esp_timer_get_time();
+        for (;;)
+        {
+                int64_t now_us = esp_timer_get_time();
+                if (now_us >= next_update_us)
+                {
+                        esp_connection_handle_update(esp_connection_handle);
+                        next_update_us = now_us + ESP_CONNECTION_UPDATE_INTERVAL_MS * 1000;
+                }
+
+                // Sleep until an event arrives or the housekeeping is due
+                espnow_event_t espnow_evt;
+                TickType_t wait_ticks = pdMS_TO_TICKS((next_update_us - now_us + 999) / 1000);
+                if (!xQueueReceive(espnow_dispatch_queue, &espnow_evt, wait_ticks))
+                        continue;
+
+                switch (espnow_evt.id)
+                {
+                case ESPNOW_SEND_CB:
+                        espnow_dispatch_send_cb(&espnow_evt.info.send_cb);
+                        break;
+                case ESPNOW_RECV_CB:
+                        espnow_dispatch_recv_cb(&espnow_evt.info.recv_cb);
+                        espnow_data_release(&espnow_evt.info.recv_cb);
+                        break;
+                default:
+                        LOG_ERROR("Callback type error: %d", espnow_evt.id);
+                        break;
+                }
+        }
+}
+
+esp_err_t espnow_dispatch_start(const espnow_dispatch_config_t *config, QueueHandle_t espnow_event_queue, esp_connection_handle_t *conn_handle)
+{
+        if ((config == NULL) || (espnow_event_queue == NULL) || (conn_handle == NULL))
+        {
+                LOG_ERROR("NULL pointer, config=0x%X, espnow_event_queue=0x%X, conn_handle=0x%X", (uintptr_t)config, (uintptr_t)espnow_event_queue, (uintptr_t)conn_handle);
+                return ESP_ERR_INVALID_ARG;
+        }
+
+        esp_connection_handle = conn_handle;
+        espnow_dispatch_queue = espnow_event_queue;
+        esp_err_t ret = espnow_reliable_init(espnow_dispatch_packet);
+        if (ret != ESP_OK)
+                return ret;
+
+        if (xTaskCreatePinnedToCore(espnow_dispatch_task, "espnow_dispatch", config->stack_size, NULL, config->priority, NULL, config->core) != pdPASS)
+        {
+                LOG_ERROR("Create dispatcher task failed");
+                return ESP_ERR_NO_MEM;
+        }
+        return ESP_OK;
+}
+
+espnow_send_param_t *espnow_dispatch_get_reply_param(espnow_send_param_t *send_param)
+{
+        if (send_param == NULL)
+        {
+                LOG_ERROR("NULL pointer, send_param=0x%X", (uintptr_t)send_param);
+                return NULL;
+        }
+
+        uint8_t mac[ESP_NOW_ETH_ALEN];
+        portENTER_CRITICAL(&espnow_dispatch_lock);
+        bool valid = espnow_dispatch_reply_valid;
+        memcpy(mac, espnow_dispatch_reply_mac, ESP_NOW_ETH_ALEN);
+        portEXIT_CRITICAL(&espnow_dispatch_lock);
+
+        if (!valid)
+                return espnow_get_default_send_param(send_param);
+        return espnow_get_send_param(send_param, esp_connection_mac_lookup(esp_connection_handle, mac));
+}
+
+void espnow_dispatch_show_stats(void)
+{
+        for (size_t i = 0; i < ESPNOW_PACKET_TYPE_MAX; i++)
+        {
+                espnow_dispatch_entry_t *entry = &espnow_dispatch_table[i];
+                if (entry->calls == 0 && entry->dropped == 0)
+                        continue;
+                LOG_INFO("Handler %s, calls: %lu, unhandled: %lu, avg cycles: %llu, max cycles: %lu",
+                         ESPNOW_PACKET_TYPE_STRING[i], entry->calls, entry->dropped,
+                         entry->calls ? entry->cycles_total / entry->calls : 0, entry->cycles_max);
+        }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+#include "esp_timer.h"
+#include "esp_cpu.h"
+
+#include "logging.h"
+#include "espnow.h"
+#include "espnow_reliable.h"
+
+// Handles the payload of a received packet, runs on the dispatcher task
+typedef void (*espnow_dispatch_handler_t)(esp_peer_handle_t *peer, espnow_packet_type_t type, const uint8_t *payload, size_t len);
+
+// Configuration of the dispatcher task
+typedef struct
+{
+        uint32_t stack_size;  // Stack size of the task, in bytes
+        UBaseType_t priority; // Priority of the task
+        BaseType_t core;      // Core the task is pinned to, away from the input loop
+} espnow_dispatch_config_t;
+
+// Handler of one packet type and its execution time
+typedef struct
+{
+        espnow_dispatch_handler_t handler; // Registered handler, NULL if none
+        uint32_t calls;                    // Number of packets handled
+        uint32_t dropped;                  // Number of packets received with no handler
+        uint64_t cycles_total;             // CPU cycles spent in the handler
+        uint32_t cycles_max;               // Longest handler call, in CPU cycles
+} espnow_dispatch_entry_t;
+
+// Loads default settings of the dispatcher task
+espnow_dispatch_config_t *espnow_dispatch_default_config(espnow_dispatch_config_t *config);
+
+// Register the handler of a packet type, replacing the previous one
+esp_err_t espnow_dispatch_register(espnow_packet_type_t type, espnow_dispatch_handler_t handler);
+
+// Run the registered handler of `type`, reliable messages are delivered through here as well
+void espnow_dispatch_packet(esp_peer_handle_t *peer, espnow_packet_type_t type, const uint8_t *payload, size_t len);
+
+// Creates the task that drains the ESP-NOW event queue and runs the peer connection housekeeping
+esp_err_t espnow_dispatch_start(const espnow_dispatch_config_t *config, QueueHandle_t espnow_event_queue, esp_connection_handle_t *conn_handle);
+
+// Configure parameter for sending packet to the peer that sent the last accepted packet, or to broadcast address if none
+espnow_send_param_t *espnow_dispatch_get_reply_param(espnow_send_param_t *send_param);
+
+// Print the execution time of every registered handler
+void espnow_dispatch_show_stats(void);
@@ -0,0 +1,278 @@
+
+#include "espnow_fragment.h"
+
+#define LOG_MODULE ESPNOW_FRAGMENT
+static const char *TAG = "espnow_fragment";
+
+static espnow_fragment_tx_slot_t espnow_fragment_tx[ESPNOW_FRAGMENT_TX_SLOTS];
+static espnow_fragment_rx_slot_t espnow_fragment_rx[ESPNOW_FRAGMENT_RX_SLOTS];
+static espnow_fragment_stats_t espnow_fragment_stats;
+static uint8_t espnow_fragment_next_id;
+static portMUX_TYPE espnow_fragment_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Length of fragment `index` of a message of `total_len` bytes
+static size_t espnow_fragment_len(uint8_t index, uint8_t count, uint16_t total_len)
+{
+        if (index + 1 < count)
+                return ESPNOW_FRAGMENT_DATA_LEN;
+        return total_len - (count - 1) * ESPNOW_FRAGMENT_DATA_LEN;
+}
+
+// Slot holds a message delivered less than `ESPNOW_FRAGMENT_TIMEOUT_MS` ago, late copies of its fragments are duplicates
+static bool espnow_fragment_rx_is_recent(const espnow_fragment_rx_slot_t *slot, int64_t now_us)
+{
+        return !slot->in_use && slot->count && slot->received == (1 << slot->count) - 1 && now_us - slot->last_us < ESPNOW_FRAGMENT_TIMEOUT_MS * 1000;
+}
+
+// Slot reassembling message `msg_id` of `mac`, a new one if none, the oldest is dropped when all are busy
+static espnow_fragment_rx_slot_t *espnow_fragment_rx_get(const uint8_t *mac, const espnow_fragment_header_pkt_t *header)
+{
+        int64_t now_us = esp_timer_get_time();
+        espnow_fragment_rx_slot_t *slot = NULL;
+        for (size_t i = 0; i < ESPNOW_FRAGMENT_RX_SLOTS; i++)
+        {
+                espnow_fragment_rx_slot_t *candidate = &espnow_fragment_rx[i];
+                if ((candidate->in_use || espnow_fragment_rx_is_recent(candidate, now_us)) &&
+                    candidate->msg_id == header->msg_id && memcmp(candidate->mac, mac, ESP_NOW_ETH_ALEN) == 0)
+                {
+                        // Same number with another shape, the sender restarted its message numbers
+                        if (candidate->type == header->type && candidate->count == header->count && candidate->len == header->total_len)
+                                return candidate;
+                        slot = candidate;
+                        break;
+                }
+        }
+        // A slot whose message was just delivered is only taken when no other is free
+        for (size_t i = 0; slot == NULL && i < ESPNOW_FRAGMENT_RX_SLOTS; i++)
+                if (!espnow_fragment_rx[i].in_use && !espnow_fragment_rx_is_recent(&espnow_fragment_rx[i], now_us))
+                        slot = &espnow_fragment_rx[i];
+        for (size_t i = 0; slot == NULL && i < ESPNOW_FRAGMENT_RX_SLOTS; i++)
+                if (!espnow_fragment_rx[i].in_use)
+                        slot = &espnow_fragment_rx[i];
+        if (slot == NULL)
+        {
+                slot = &espnow_fragment_rx[0];
+                for (size_t i = 1; i < ESPNOW_FRAGMENT_RX_SLOTS; i++)
+                        if (espnow_fragment_rx[i].started_us < slot->started_us)
+                                slot = &espnow_fragment_rx[i];
+        }
+
+        if (slot->in_use && (slot->msg_id != header->msg_id || memcmp(slot->mac, mac, ESP_NOW_ETH_ALEN) != 0))
+        {
+                LOG_WARNING("Dropping message %d from " MACSTR ", %d of %d fragments received",
+                            slot->msg_id, MAC2STR(slot->mac), __builtin_popcount(slot->received), slot->count);
+                espnow_fragment_stats.evicted++;
+        }
+
+        memcpy(slot->mac, mac, ESP_NOW_ETH_ALEN);
+        slot->msg_id = header->msg_id;
+        slot->type = header->type;
+        slot->count = header->count;
+        slot->len = header->total_len;
+        slot->received = 0;
+        slot->in_use = true;
+        slot->started_us = now_us;
+        return slot;
+}
+
+static void espnow_fragment_handle(esp_peer_handle_t *peer, espnow_packet_type_t type, const uint8_t *payload, size_t len)
+{
+        espnow_fragment_header_pkt_t header;
+        if (len < sizeof(header))
+        {
+                LOG_WARNING("Fragment too short, len:%d", len);
+                espnow_fragment_stats.malformed++;
+                return;
+        }
+        memcpy(&header, payload, sizeof(header));
+        const uint8_t *data = payload + sizeof(header);
+        size_t data_len = len - sizeof(header);
+
+        if (header.count == 0 || header.count > ESPNOW_FRAGMENT_MAX_COUNT || header.index >= header.count ||
+            header.total_len > ESPNOW_FRAGMENT_MAX_LEN || header.total_len > header.count * ESPNOW_FRAGMENT_DATA_LEN ||
+            header.total_len < (header.count - 1) * ESPNOW_FRAGMENT_DATA_LEN ||
+            header.type >= ESPNOW_PACKET_TYPE_MAX || header.type == ESPNOW_PACKET_TYPE_FRAGMENT ||
+            data_len != espnow_fragment_len(header.index, header.count, header.total_len))
+        {
+                LOG_WARNING("Fragment %d/%d of message %d from " MACSTR " is inconsistent, len:%d, total:%d",
+                            header.index, header.count, header.msg_id, MAC2STR(peer->mac), data_len, header.total_len);
+                espnow_fragment_stats.malformed++;
+                return;
+        }
+        espnow_fragment_stats.fragments++;
+
+        espnow_fragment_rx_slot_t *slot = espnow_fragment_rx_get(peer->mac, &header);
+        uint16_t bit = 1 << header.index;
+        if (slot->received & bit)
+        {
+                espnow_fragment_stats.duplicates++;
+                return;
+        }
+        if (slot->received >> header.index)
+                espnow_fragment_stats.reordered++;
+
+        // Fragments land at their final place whatever order they arrive in, the message is never copied again
+        memcpy(slot->data + header.index * ESPNOW_FRAGMENT_DATA_LEN, data, data_len);
+        slot->received |= bit;
+        slot->last_us = esp_timer_get_time();
+        if (slot->received != (1 << slot->count) - 1)
+                return;
+
+        LOG_VERBOSE("Message %d from " MACSTR " reassembled, %d fragments, %d bytes in %lld us",
+                    slot->msg_id, MAC2STR(peer->mac), slot->count, slot->len, slot->last_us - slot->started_us);
+        espnow_fragment_stats.delivered++;
+        espnow_dispatch_packet(peer, slot->type, slot->data, slot->len);
+        slot->in_use = false; // Kept as received for a while, see `espnow_fragment_rx_is_recent`
+}
+
+void espnow_fragment_init(void)
+{
+        espnow_dispatch_register(ESPNOW_PACKET_TYPE_FRAGMENT, espnow_fragment_handle);
+}
+
+esp_err_t espnow_send_fragmented(espnow_send_param_t *send_param, espnow_packet_type_t type, const void *data, size_t len)
+{
+        if ((send_param == NULL) || (data == NULL && len))
+        {
+                LOG_WARNING("NULL pointer, send_param=0x%X, data=0x%X", (uintptr_t)send_param, (uintptr_t)data);
+                return ESP_ERR_INVALID_ARG;
+        }
+        if (len > ESPNOW_FRAGMENT_MAX_LEN)
+        {
+                LOG_WARNING("Message too long, len:%d>max:%d", len, ESPNOW_FRAGMENT_MAX_LEN);
+                return ESP_ERR_INVALID_SIZE;
+        }
+
+        // Leave room for the sender timestamp of control packets
+        if (sizeof(espnow_packet_t) + sizeof(uint32_t) + len <= ESP_NOW_MAX_DATA_LEN)
+                return espnow_send_data(send_param, type, (void *)data, len);
+
+        if (send_param->broadcast != ESPNOW_DATA_UNICAST)
+        {
+                LOG_WARNING("Fragmented messages are unicast only");
+                return ESP_ERR_INVALID_ARG;
+        }
+
+        espnow_fragment_tx_slot_t *slot = NULL;
+        portENTER_CRITICAL(&espnow_fragment_lock);
+        for (size_t i = 0; i < ESPNOW_FRAGMENT_TX_SLOTS; i++)
+        {
+                if (espnow_fragment_tx[i].state != ESPNOW_FRAGMENT_TX_FREE)
+                        continue;
+                slot = &espnow_fragment_tx[i];
+                slot->state = ESPNOW_FRAGMENT_TX_FILLING;
+                slot->msg_id = espnow_fragment_next_id++;
+                break;
+        }
+        portEXIT_CRITICAL(&espnow_fragment_lock);
+        if (slot == NULL)
+                return ESP_ERR_NO_MEM;
+
+        memcpy(slot->data, data, len);
+        slot->len = len;
+        memcpy(slot->mac, send_param->dest_mac, ESP_NOW_ETH_ALEN);
+        slot->type = type;
+        slot->count = (len + ESPNOW_FRAGMENT_DATA_LEN - 1) / ESPNOW_FRAGMENT_DATA_LEN;
+        slot->next = 0;
+        portENTER_CRITICAL(&espnow_fragment_lock);
+        slot->state = ESPNOW_FRAGMENT_TX_READY;
+        portEXIT_CRITICAL(&espnow_fragment_lock);
+        return ESP_OK;
+}
+
+// Queue fragments of `slot` while the peer transmit queue has room to spare, returns true when every fragment is queued
+static bool espnow_fragment_send_next(esp_peer_handle_t *peer, espnow_fragment_tx_slot_t *slot)
+{
+        uint8_t buffer[sizeof(espnow_fragment_header_pkt_t) + ESPNOW_FRAGMENT_DATA_LEN];
+        espnow_fragment_header_pkt_t header = {
+            .msg_id = slot->msg_id,
+            .type = slot->type,
+            .count = slot->count,
+            .total_len = slot->len,
+        };
+        while (slot->next < slot->count && esp_peer_tx_space(peer) > ESPNOW_FRAGMENT_QUEUE_SPARE)
+        {
+                header.index = slot->next;
+                size_t data_len = espnow_fragment_len(header.index, header.count, header.total_len);
+                memcpy(buffer, &header, sizeof(header));
+                memcpy(buffer + sizeof(header), slot->data + header.index * ESPNOW_FRAGMENT_DATA_LEN, data_len);
+
+                espnow_send_param_t send_param;
+                espnow_get_send_param_unicast(&send_param, peer->mac);
+                if (espnow_send_data(&send_param, ESPNOW_PACKET_TYPE_FRAGMENT, buffer, sizeof(header) + data_len) != ESP_OK)
+                        return false; // Out of transmit frames or refused by the queue, carry on with this fragment at the next update
+                slot->next++;
+        }
+        return slot->next == slot->count;
+}
+
+void espnow_fragment_update(esp_connection_handle_t *handle)
+{
+        if (handle == NULL)
+        {
+                LOG_ERROR("NULL pointer, handle=0x%X", (uintptr_t)handle);
+                return;
+        }
+
+        for (size_t i = 0; i < ESPNOW_FRAGMENT_TX_SLOTS; i++)
+        {
+                espnow_fragment_tx_slot_t *slot = &espnow_fragment_tx[i];
+                if (slot->state != ESPNOW_FRAGMENT_TX_READY)
+                        continue;
+
+                esp_peer_handle_t *peer = esp_connection_mac_lookup(handle, slot->mac);
+                bool done;
+                if (peer == NULL || peer->status != ESP_PEER_STATUS_CONNECTED)
+                {
+                        LOG_WARNING("Abandoning message %d to " MACSTR ", %d of %d fragments sent", slot->msg_id, MAC2STR(slot->mac), slot->next, slot->count);
+                        espnow_fragment_stats.abandoned++;
+                        done = true;
+                }
+                else
+                {
+                        done = espnow_fragment_send_next(peer, slot);
+                        if (done)
+                                espnow_fragment_stats.sent++;
+                }
+                if (!done)
+                        continue;
+
+                portENTER_CRITICAL(&espnow_fragment_lock);
+                slot->state = ESPNOW_FRAGMENT_TX_FREE;
+                portEXIT_CRITICAL(&espnow_fragment_lock);
+        }
+
+        int64_t now_us = esp_timer_get_time();
+        for (size_t i = 0; i < ESPNOW_FRAGMENT_RX_SLOTS; i++)
+        {
+                espnow_fragment_rx_slot_t *slot = &espnow_fragment_rx[i];
+                if (!slot->in_use || now_us - slot->last_us < ESPNOW_FRAGMENT_TIMEOUT_MS * 1000)
+                        continue;
+                LOG_WARNING("Message %d from " MACSTR " timed out, %d of %d fragments received",
+                            slot->msg_id, MAC2STR(slot->mac), __builtin_popcount(slot->received), slot->count);
+                espnow_fragment_stats.timeouts++;
+                slot->in_use = false;
+        }
+}
+
+espnow_fragment_stats_t *espnow_fragment_get_stats(espnow_fragment_stats_t *stats)
+{
+        if (stats == NULL)
+        {
+                LOG_ERROR("NULL pointer, stats=0x%X", (uintptr_t)stats);
+                return NULL;
+        }
+        *stats = espnow_fragment_stats;
+        return stats;
+}
+
+void espnow_fragment_show_stats(void)
+{
+        espnow_fragment_stats_t *stats = &espnow_fragment_stats;
+        if (stats->sent == 0 && stats->abandoned == 0 && stats->fragments == 0 && stats->malformed == 0)
+                return;
+        LOG_INFO("Fragmentation, sent: %lu, abandoned: %lu, fragments rx: %lu, delivered: %lu",
+                 stats->sent, stats->abandoned, stats->fragments, stats->delivered);
+        LOG_INFO("    duplicates: %lu, reordered: %lu, timeouts: %lu, evicted: %lu, malformed: %lu",
+                 stats->duplicates, stats->reordered, stats->timeouts, stats->evicted, stats->malformed);
+}
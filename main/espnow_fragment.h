@@ -0,0 +1,104 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "esp_timer.h"
+
+#include "logging.h"
+#include "espnow.h"
+#include "espnow_dispatch.h"
+
+#define ESPNOW_FRAGMENT_MAX_LEN (2048)   // Largest message, in bytes
+#define ESPNOW_FRAGMENT_RX_SLOTS (2)     // Messages reassembled at the same time, the oldest is dropped for a new one
+#define ESPNOW_FRAGMENT_TX_SLOTS (2)     // Messages being sent at the same time
+#define ESPNOW_FRAGMENT_TIMEOUT_MS (500) // Drop a partly received message after this long without a new fragment
+#define ESPNOW_FRAGMENT_QUEUE_SPARE (1)  // Entries of the peer transmit queue left to other packets while fragments are queued
+
+// Header in front of the data of every `FRAGMENT` packet
+typedef struct
+{
+        uint8_t msg_id;     // Message number, chosen by the sender
+        uint8_t type;       // Data packet type of the whole message
+        uint8_t index;      // Position of the fragment in the message
+        uint8_t count;      // Number of fragments in the message
+        uint16_t total_len; // Length of the whole message, little endian
+} __packed espnow_fragment_header_pkt_t;
+
+// Data carried by every fragment but the last, which carries the rest
+#define ESPNOW_FRAGMENT_DATA_LEN (ESP_NOW_MAX_DATA_LEN - sizeof(espnow_packet_t) - sizeof(espnow_fragment_header_pkt_t))
+// Fragments of the largest message
+#define ESPNOW_FRAGMENT_MAX_COUNT ((ESPNOW_FRAGMENT_MAX_LEN + ESPNOW_FRAGMENT_DATA_LEN - 1) / ESPNOW_FRAGMENT_DATA_LEN)
+
+_Static_assert(ESPNOW_FRAGMENT_MAX_COUNT <= 16, "Received fragments are tracked in a 16-bit mask");
+
+// State of a transmit slot
+typedef enum
+{
+        ESPNOW_FRAGMENT_TX_FREE,    // Slot is unused
+        ESPNOW_FRAGMENT_TX_FILLING, // Slot is claimed, the message is being copied in
+        ESPNOW_FRAGMENT_TX_READY,   // Fragments are being sent
+} espnow_fragment_tx_state_t;
+
+// Message being sent
+typedef struct
+{
+        uint8_t data[ESPNOW_FRAGMENT_MAX_LEN]; // Whole message
+        uint16_t len;                          // Length of `data`, in bytes
+        uint8_t mac[ESP_NOW_ETH_ALEN];         // Peer MAC address
+        espnow_packet_type_t type;             // Data packet type of the message
+        uint8_t msg_id;                        // Message number
+        uint8_t count;                         // Number of fragments
+        uint8_t next;                          // Next fragment to send
+        espnow_fragment_tx_state_t state;      // `ESPNOW_FRAGMENT_TX_*`
+} espnow_fragment_tx_slot_t;
+
+// Message being reassembled
+typedef struct
+{
+        uint8_t data[ESPNOW_FRAGMENT_MAX_LEN]; // Fragments are copied straight to their place
+        uint16_t len;                          // Length of the whole message, in bytes
+        uint8_t mac[ESP_NOW_ETH_ALEN];         // Peer MAC address
+        espnow_packet_type_t type;             // Data packet type of the message
+        uint8_t msg_id;                        // Message number
+        uint8_t count;                         // Number of fragments
+        uint16_t received;                     // Bit `n` is set when fragment `n` is received
+        bool in_use;                           // Slot holds a partly received message
+        int64_t started_us;                    // Timestamp of the first fragment received
+        int64_t last_us;                       // Timestamp of the last fragment received
+} espnow_fragment_rx_slot_t;
+
+// Fragmentation statistics
+typedef struct
+{
+        uint32_t sent;       // Messages whose every fragment was queued
+        uint32_t abandoned;  // Messages given up before every fragment was queued, the peer was lost
+        uint32_t fragments;  // Fragments received
+        uint32_t delivered;  // Messages reassembled and delivered
+        uint32_t duplicates; // Fragments received more than once
+        uint32_t reordered;  // Fragments received after a later one of the same message
+        uint32_t timeouts;   // Messages dropped after `ESPNOW_FRAGMENT_TIMEOUT_MS` with fragments missing
+        uint32_t evicted;    // Messages dropped to make room for a new one
+        uint32_t malformed;  // Fragments with an inconsistent header
+} espnow_fragment_stats_t;
+
+// Reassemble `FRAGMENT` packets and deliver the messages through the dispatcher
+void espnow_fragment_init(void);
+
+// Send a message of any length up to `ESPNOW_FRAGMENT_MAX_LEN` to the unicast peer of `send_param`
+// Messages fitting one frame are sent as a single packet, others are copied and sent over the next updates
+// Fragments are never dropped from the peer transmit queue, but are not retransmitted, a message lost on air is dropped by the receiver
+// Returns `ESP_ERR_NO_MEM` while every transmit slot is busy, the caller may retry later
+esp_err_t espnow_send_fragmented(espnow_send_param_t *send_param, espnow_packet_type_t type, const void *data, size_t len);
+
+// Queue the next fragments as the peer transmit queues make room, drop partly received messages that timed out
+void espnow_fragment_update(esp_connection_handle_t *handle);
+
+// Copy the fragmentation statistics
+espnow_fragment_stats_t *espnow_fragment_get_stats(espnow_fragment_stats_t *stats);
+
+// Print the fragmentation statistics
+void espnow_fragment_show_stats(void);
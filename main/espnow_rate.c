@@ -0,0 +1,191 @@
+
+#include "espnow_rate.h"
+
+#define LOG_MODULE ESPNOW_RATE
+static const char *TAG = "espnow_rate";
+
+// Thresholds sit a few dB above the sensitivity of each rate, long-range rates need the LR protocol on both ends
+static const espnow_rate_step_t espnow_rate_ladder[] = {
+    {WIFI_PHY_RATE_LORA_250K, "LR 250K", INT8_MIN},
+    {WIFI_PHY_RATE_LORA_500K, "LR 500K", -90},
+    {WIFI_PHY_RATE_1M_L, "1M", -84},
+    {WIFI_PHY_RATE_2M_S, "2M", -80},
+    {WIFI_PHY_RATE_5M_S, "5.5M", -76},
+    {WIFI_PHY_RATE_11M_S, "11M", -72},
+    {WIFI_PHY_RATE_24M, "24M", -66},
+};
+
+#define ESPNOW_RATE_STEPS (sizeof(espnow_rate_ladder) / sizeof(espnow_rate_ladder[0]))
+
+static wifi_interface_t espnow_rate_interface;
+static bool espnow_rate_adaptive;
+static size_t espnow_rate_step;         // Current position on the ladder
+static size_t espnow_rate_home_step;    // Configured rate, used while no peer is connected
+static int64_t espnow_rate_since_us;    // Timestamp of the last rate change
+static int64_t espnow_rate_next_eval_us; // Timestamp of the next rate decision
+static uint32_t espnow_rate_sent_ok, espnow_rate_sent_failed;
+static uint64_t espnow_rate_time_us[ESPNOW_RATE_STEPS]; // Time spent at each rate, before the current stay
+static espnow_rate_stats_t espnow_rate_stats;
+static portMUX_TYPE espnow_rate_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static size_t espnow_rate_find_step(wifi_phy_rate_t rate)
+{
+        for (size_t i = 0; i < ESPNOW_RATE_STEPS; i++)
+                if (espnow_rate_ladder[i].rate == rate)
+                        return i;
+        LOG_WARNING("PHY rate %d is not on the rate ladder, using %s", rate, espnow_rate_ladder[2].name);
+        return 2;
+}
+
+static void espnow_rate_apply(size_t step)
+{
+        esp_err_t err = esp_wifi_config_espnow_rate(espnow_rate_interface, espnow_rate_ladder[step].rate);
+        if (err != ESP_OK)
+        {
+                LOG_WARNING("Set PHY rate %s failed: %s", espnow_rate_ladder[step].name, esp_err_to_name(err));
+                espnow_rate_stats.failed++;
+                return;
+        }
+
+        int64_t now_us = esp_timer_get_time();
+        portENTER_CRITICAL(&espnow_rate_lock);
+        espnow_rate_time_us[espnow_rate_step] += now_us - espnow_rate_since_us;
+        if (step > espnow_rate_step)
+                espnow_rate_stats.up++;
+        else if (step < espnow_rate_step)
+                espnow_rate_stats.down++;
+        espnow_rate_step = step;
+        espnow_rate_since_us = now_us;
+        espnow_rate_stats.rate = espnow_rate_ladder[step].rate;
+        portEXIT_CRITICAL(&espnow_rate_lock);
+}
+
+void espnow_rate_init(espnow_wifi_config_t *espnow_config)
+{
+        if (espnow_config == NULL)
+        {
+                LOG_ERROR("NULL pointer, espnow_config=0x%X", (uintptr_t)espnow_config);
+                return;
+        }
+
+        espnow_rate_interface = espnow_config->wifi_interface;
+        espnow_rate_adaptive = espnow_config->adaptive_rate;
+        if (espnow_config->long_range || espnow_config->adaptive_rate)
+                ESP_ERROR_CHECK(esp_wifi_set_protocol(espnow_config->wifi_interface, WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N | WIFI_PROTOCOL_LR));
+        if (espnow_config->long_range)
+                espnow_config->wifi_phy_rate = WIFI_PHY_RATE_LORA_250K;
+
+        espnow_rate_home_step = espnow_rate_find_step(espnow_config->wifi_phy_rate);
+        espnow_rate_step = espnow_rate_home_step;
+        espnow_rate_since_us = esp_timer_get_time();
+        espnow_rate_next_eval_us = espnow_rate_since_us + ESPNOW_RATE_EVAL_INTERVAL_MS * 1000;
+        ESP_ERROR_CHECK(esp_wifi_config_espnow_rate(espnow_rate_interface, espnow_rate_ladder[espnow_rate_step].rate));
+        espnow_rate_stats.rate = espnow_rate_ladder[espnow_rate_step].rate;
+}
+
+void espnow_rate_record_send(bool success)
+{
+        if (success)
+                espnow_rate_sent_ok++;
+        else
+                espnow_rate_sent_failed++;
+}
+
+void espnow_rate_update(esp_connection_handle_t *handle)
+{
+        if (handle == NULL)
+        {
+                LOG_ERROR("NULL pointer, handle=0x%X", (uintptr_t)handle);
+                return;
+        }
+
+        int64_t now_us = esp_timer_get_time();
+        if (!espnow_rate_adaptive || now_us < espnow_rate_next_eval_us)
+                return;
+        espnow_rate_next_eval_us = now_us + ESPNOW_RATE_EVAL_INTERVAL_MS * 1000;
+
+        uint32_t sent = espnow_rate_sent_ok + espnow_rate_sent_failed;
+        uint32_t success = sent ? espnow_rate_sent_ok * 100 / sent : 100;
+        espnow_rate_sent_ok = 0;
+        espnow_rate_sent_failed = 0;
+
+        bool connected = false;
+        int weakest_rssi = 0;
+        for (size_t i = 0; i < handle->size; i++)
+        {
+                esp_peer_handle_t *peer = handle->entries + i;
+                if (peer->status != ESP_PEER_STATUS_CONNECTED)
+                        continue;
+                if (!connected || peer->rssi < weakest_rssi)
+                        weakest_rssi = peer->rssi;
+                connected = true;
+        }
+
+        // Look for peers at the configured rate, both ends meet there after losing each other
+        if (!connected)
+        {
+                if (espnow_rate_step != espnow_rate_home_step)
+                {
+                        LOG_INFO("No peer connected, PHY rate back to %s", espnow_rate_ladder[espnow_rate_home_step].name);
+                        espnow_rate_apply(espnow_rate_home_step);
+                }
+                return;
+        }
+
+        size_t step = espnow_rate_step;
+        bool enough_samples = sent >= ESPNOW_RATE_MIN_SAMPLES;
+        if (step > 0 && (weakest_rssi < espnow_rate_ladder[step].min_rssi - ESPNOW_RATE_RSSI_HYSTERESIS ||
+                         (enough_samples && success < ESPNOW_RATE_SUCCESS_DOWN)))
+        {
+                step--;
+        }
+        else if (step + 1 < ESPNOW_RATE_STEPS &&
+                 now_us - espnow_rate_since_us >= ESPNOW_RATE_HOLD_MS * 1000 &&
+                 weakest_rssi >= espnow_rate_ladder[step + 1].min_rssi + ESPNOW_RATE_RSSI_HYSTERESIS &&
+                 success >= ESPNOW_RATE_SUCCESS_UP)
+        {
+                step++;
+        }
+
+        if (step != espnow_rate_step)
+        {
+                LOG_INFO("PHY rate %s --> %s, rssi: %d, send success: %lu%% of %lu",
+                         espnow_rate_ladder[espnow_rate_step].name, espnow_rate_ladder[step].name, weakest_rssi, success, sent);
+                espnow_rate_apply(step);
+        }
+}
+
+espnow_rate_stats_t *espnow_rate_get_stats(espnow_rate_stats_t *stats)
+{
+        if (stats == NULL)
+        {
+                LOG_ERROR("NULL pointer, stats=0x%X", (uintptr_t)stats);
+                return NULL;
+        }
+
+        portENTER_CRITICAL(&espnow_rate_lock);
+        *stats = espnow_rate_stats;
+        portEXIT_CRITICAL(&espnow_rate_lock);
+        return stats;
+}
+
+void espnow_rate_show_stats(void)
+{
+        uint64_t time_us[ESPNOW_RATE_STEPS];
+        int64_t now_us = esp_timer_get_time();
+        portENTER_CRITICAL(&espnow_rate_lock);
+        memcpy(time_us, espnow_rate_time_us, sizeof(time_us));
+        time_us[espnow_rate_step] += now_us - espnow_rate_since_us;
+        size_t step = espnow_rate_step;
+        espnow_rate_stats_t stats = espnow_rate_stats;
+        portEXIT_CRITICAL(&espnow_rate_lock);
+
+        LOG_INFO("PHY rate %s, adaptive: %d, up: %lu, down: %lu, refused: %lu",
+                 espnow_rate_ladder[step].name, espnow_rate_adaptive, stats.up, stats.down, stats.failed);
+        for (size_t i = 0; i < ESPNOW_RATE_STEPS; i++)
+        {
+                if (time_us[i] == 0)
+                        continue;
+                LOG_INFO("    %-8s %10llu ms", espnow_rate_ladder[i].name, time_us[i] / 1000);
+        }
+}
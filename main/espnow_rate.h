@@ -0,0 +1,53 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "esp_wifi.h"
+#include "esp_timer.h"
+
+#include "logging.h"
+#include "espnow.h"
+
+#define ESPNOW_RATE_EVAL_INTERVAL_MS (500) // Interval between two rate decisions
+#define ESPNOW_RATE_HOLD_MS (2000)         // Minimum time at a rate before moving to a faster one
+#define ESPNOW_RATE_RSSI_HYSTERESIS (4)    // Margin around the RSSI threshold of a rate, in dB
+#define ESPNOW_RATE_SUCCESS_UP (95)        // Unicast send success needed to move to a faster rate, in percent
+#define ESPNOW_RATE_SUCCESS_DOWN (70)      // Unicast send success below which a slower rate is taken, in percent
+#define ESPNOW_RATE_MIN_SAMPLES (8)        // Unicast sends needed in an interval to judge the success ratio
+
+// One step of the rate ladder, from the most robust to the fastest
+typedef struct
+{
+        wifi_phy_rate_t rate; // PHY rate used for ESP-NOW
+        const char *name;     // Name of the rate, for logging
+        int8_t min_rssi;      // Weakest peer RSSI the rate is used at, in dBm
+} espnow_rate_step_t;
+
+// Rate controller statistics
+typedef struct
+{
+        wifi_phy_rate_t rate; // Current PHY rate
+        uint32_t up;          // Number of moves to a faster rate
+        uint32_t down;        // Number of moves to a slower rate
+        uint32_t failed;      // Number of rate changes refused by the Wi-Fi driver
+} espnow_rate_stats_t;
+
+// Enable the long-range protocol next to 802.11b/g/n and apply the configured rate
+// The rate only moves at runtime when `adaptive_rate` is set in the configuration
+void espnow_rate_init(espnow_wifi_config_t *espnow_config);
+
+// Record the result of a unicast send
+void espnow_rate_record_send(bool success);
+
+// Move along the rate ladder using the weakest RSSI of the connected peers and the send success ratio
+void espnow_rate_update(esp_connection_handle_t *handle);
+
+// Copy the rate controller statistics
+espnow_rate_stats_t *espnow_rate_get_stats(espnow_rate_stats_t *stats);
+
+// Print the current rate and the time spent at each rate
+void espnow_rate_show_stats(void);
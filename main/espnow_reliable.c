@@ -0,0 +1,498 @@
+
+#include "espnow_reliable.h"
+
+#define LOG_MODULE ESPNOW_RELIABLE
+static const char *TAG = "espnow_reliable";
+
+static espnow_reliable_channel_t espnow_reliable_channels[ESPNOW_RELIABLE_CHANNELS];
+static bool espnow_reliable_types[ESPNOW_PACKET_TYPE_MAX] = {
+    [ESPNOW_PACKET_TYPE_CONFIG] = true,
+    [ESPNOW_PACKET_TYPE_CHANNEL_CHANGE] = true,
+};
+static espnow_reliable_deliver_cb_t espnow_reliable_deliver_cb;
+static espnow_reliable_failed_cb_t espnow_reliable_failed_cb;
+static espnow_reliable_stats_t espnow_reliable_stats;
+static SemaphoreHandle_t espnow_reliable_lock; // Guards the channels, recursive so the deliver callback may send reliable messages
+
+esp_err_t espnow_reliable_init(espnow_reliable_deliver_cb_t deliver_cb)
+{
+        if (deliver_cb == NULL)
+        {
+                LOG_ERROR("NULL pointer, deliver_cb=0x%X", (uintptr_t)deliver_cb);
+                return ESP_ERR_INVALID_ARG;
+        }
+
+        espnow_reliable_lock = xSemaphoreCreateRecursiveMutex();
+        if (espnow_reliable_lock == NULL)
+        {
+                LOG_ERROR("Create reliable channel lock failed");
+                return ESP_ERR_NO_MEM;
+        }
+        memset(espnow_reliable_channels, 0, sizeof(espnow_reliable_channels));
+        memset(&espnow_reliable_stats, 0, sizeof(espnow_reliable_stats));
+        espnow_reliable_deliver_cb = deliver_cb;
+        return ESP_OK;
+}
+
+void espnow_reliable_set_failed_cb(espnow_reliable_failed_cb_t failed_cb)
+{
+        espnow_reliable_failed_cb = failed_cb;
+}
+
+void espnow_reliable_set_type(espnow_packet_type_t type, bool reliable)
+{
+        if (type >= ESPNOW_PACKET_TYPE_MAX || type == ESPNOW_PACKET_TYPE_ACK || type == ESPNOW_PACKET_TYPE_NACK)
+        {
+                LOG_WARNING("Packet type %d cannot be reliable", type);
+                return;
+        }
+        espnow_reliable_types[type] = reliable;
+}
+
+bool espnow_reliable_is_type(espnow_packet_type_t type)
+{
+        return type < ESPNOW_PACKET_TYPE_MAX && espnow_reliable_types[type];
+}
+
+static void espnow_reliable_channel_init(espnow_reliable_channel_t *channel, const uint8_t *mac)
+{
+        memset(channel, 0, sizeof(espnow_reliable_channel_t));
+        memcpy(channel->mac, mac, ESP_NOW_ETH_ALEN);
+        channel->in_use = true;
+        channel->rto_us = ESPNOW_RELIABLE_RTO_INIT_US;
+        channel->last_used_us = esp_timer_get_time();
+}
+
+// Find the channel of `mac`, when `create` is set a free or idle channel is taken over
+static espnow_reliable_channel_t *espnow_reliable_channel_get(const uint8_t *mac, bool create)
+{
+        espnow_reliable_channel_t *reuse = NULL;
+        for (size_t i = 0; i < ESPNOW_RELIABLE_CHANNELS; i++)
+        {
+                espnow_reliable_channel_t *channel = &espnow_reliable_channels[i];
+                if (!channel->in_use)
+                {
+                        if (reuse == NULL || reuse->in_use)
+                                reuse = channel;
+                        continue;
+                }
+                if (memcmp(channel->mac, mac, ESP_NOW_ETH_ALEN) == 0)
+                        return channel;
+                if (channel->tx_base != channel->tx_next)
+                        continue; // Messages in flight, keep the channel
+                if (reuse == NULL || (reuse->in_use && channel->last_used_us < reuse->last_used_us))
+                        reuse = channel;
+        }
+
+        if (!create || reuse == NULL)
+                return NULL;
+        if (reuse->in_use)
+                LOG_INFO("Reliable channel of " MACSTR " reused for " MACSTR, MAC2STR(reuse->mac), MAC2STR(mac));
+        espnow_reliable_channel_init(reuse, mac);
+        return reuse;
+}
+
+// Send one message of the window, called with the lock held
+static void espnow_reliable_transmit(espnow_reliable_channel_t *channel, espnow_reliable_tx_slot_t *slot)
+{
+        int64_t now = esp_timer_get_time();
+        slot->sent_us = now;
+        slot->deadline_us = now + channel->rto_us;
+        slot->transmissions++;
+        espnow_reliable_stats.transmissions++;
+
+#if ESPNOW_RELIABLE_TEST_LOSS_PERCENT > 0
+        if (esp_random() % 100 < ESPNOW_RELIABLE_TEST_LOSS_PERCENT)
+        {
+                espnow_reliable_stats.test_dropped++;
+                return;
+        }
+#endif
+
+        espnow_send_param_t send_param;
+        espnow_get_default_send_param(&send_param);
+        espnow_get_send_param_unicast(&send_param, channel->mac);
+        espnow_send_data(&send_param, slot->type, slot->frame, slot->len);
+}
+
+esp_err_t espnow_send_reliable(espnow_send_param_t *send_param, espnow_packet_type_t type, const void *data, size_t len)
+{
+        if (send_param == NULL)
+        {
+                LOG_WARNING("NULL pointer, send_param=0x%X", (uintptr_t)send_param);
+                return ESP_ERR_INVALID_ARG;
+        }
+        if (type >= ESPNOW_PACKET_TYPE_MAX)
+        {
+                LOG_WARNING("Invalid packet type: %d", type);
+                return ESP_ERR_INVALID_ARG;
+        }
+        if (send_param->broadcast != ESPNOW_DATA_UNICAST || !espnow_reliable_is_type(type))
+        {
+                LOG_WARNING("Reliable delivery needs a unicast peer and a reliable packet type, type: %s", ESPNOW_PACKET_TYPE_STRING[type]);
+                return ESP_ERR_INVALID_ARG;
+        }
+        if (len > ESPNOW_RELIABLE_MAX_PAYLOAD || (len && data == NULL))
+        {
+                LOG_WARNING("Reliable payload too long, len:%d>max:%d", len, ESPNOW_RELIABLE_MAX_PAYLOAD);
+                return ESP_ERR_INVALID_SIZE;
+        }
+
+        xSemaphoreTakeRecursive(espnow_reliable_lock, portMAX_DELAY);
+        espnow_reliable_channel_t *channel = espnow_reliable_channel_get(send_param->dest_mac, true);
+        if (channel == NULL || (uint16_t)(channel->tx_next - channel->tx_base) >= ESPNOW_RELIABLE_WINDOW_SIZE)
+        {
+                xSemaphoreGiveRecursive(espnow_reliable_lock);
+                return ESP_ERR_NO_MEM;
+        }
+
+        espnow_reliable_tx_slot_t *slot = &channel->tx[channel->tx_next % ESPNOW_RELIABLE_WINDOW_SIZE];
+        espnow_reliable_header_pkt_t header = {.rseq = channel->tx_next, .epoch = channel->tx_epoch};
+        memcpy(slot->frame, &header, sizeof(header));
+        if (len)
+                memcpy(slot->frame + sizeof(header), data, len);
+        slot->len = sizeof(header) + len;
+        slot->type = type;
+        slot->in_use = true;
+        slot->fast_retransmitted = false;
+        slot->transmissions = 0;
+        channel->tx_next++;
+        channel->last_used_us = esp_timer_get_time();
+        espnow_reliable_stats.sent++;
+        espnow_reliable_transmit(channel, slot);
+        xSemaphoreGiveRecursive(espnow_reliable_lock);
+        return ESP_OK;
+}
+
+esp_err_t espnow_send_reply(espnow_send_param_t *send_param, espnow_packet_type_t type, const espnow_reliable_ack_pkt_t *ack)
+{
+        if ((send_param == NULL) || (ack == NULL))
+        {
+                LOG_WARNING("NULL pointer, send_param=0x%X, ack=0x%X", (uintptr_t)send_param, (uintptr_t)ack);
+                return ESP_ERR_INVALID_ARG;
+        }
+        if (type != ESPNOW_PACKET_TYPE_ACK && type != ESPNOW_PACKET_TYPE_NACK)
+                return ESP_ERR_INVALID_ARG;
+        return espnow_send_data(send_param, type, (void *)ack, sizeof(espnow_reliable_ack_pkt_t));
+}
+
+// RTT estimation as in RFC 6298, only called for messages sent once (Karn's algorithm)
+static void espnow_reliable_rtt_sample(espnow_reliable_channel_t *channel, int64_t rtt_us)
+{
+        if (channel->srtt_us == 0)
+        {
+                channel->srtt_us = rtt_us;
+                channel->rttvar_us = rtt_us / 2;
+        }
+        else
+        {
+                int64_t error_us = channel->srtt_us - rtt_us;
+                channel->rttvar_us += ((error_us < 0 ? -error_us : error_us) - channel->rttvar_us) / 4;
+                channel->srtt_us += (rtt_us - channel->srtt_us) / 8;
+        }
+        int64_t rto_us = channel->srtt_us + 4 * channel->rttvar_us;
+        if (rto_us < ESPNOW_RELIABLE_RTO_MIN_US)
+                rto_us = ESPNOW_RELIABLE_RTO_MIN_US;
+        if (rto_us > ESPNOW_RELIABLE_RTO_MAX_US)
+                rto_us = ESPNOW_RELIABLE_RTO_MAX_US;
+        channel->rto_us = rto_us;
+}
+
+static void espnow_reliable_ack_slot(espnow_reliable_channel_t *channel, uint16_t rseq, int64_t now)
+{
+        espnow_reliable_tx_slot_t *slot = &channel->tx[rseq % ESPNOW_RELIABLE_WINDOW_SIZE];
+        if (!slot->in_use)
+                return;
+        if (slot->transmissions == 1)
+                espnow_reliable_rtt_sample(channel, now - slot->sent_us);
+        slot->in_use = false;
+        espnow_reliable_stats.acked++;
+}
+
+// Apply an `ACK` or `NACK` to the send window, called with the lock held
+static void espnow_reliable_process_ack(espnow_reliable_channel_t *channel, const espnow_reliable_ack_pkt_t *ack, bool nack)
+{
+        if (ack->epoch != channel->tx_epoch)
+                return; // Receive state of the window before a restart
+
+        int64_t now = esp_timer_get_time();
+        uint16_t in_flight = channel->tx_next - channel->tx_base;
+        uint16_t cumulative = ack->next - channel->tx_base;
+        if (cumulative > in_flight)
+                return; // Stale acknowledgment, or one from an earlier connection
+
+        for (uint16_t rseq = channel->tx_base; rseq != ack->next; rseq++)
+                espnow_reliable_ack_slot(channel, rseq, now);
+
+        uint16_t highest_sacked = ack->next;
+        for (uint8_t i = 0; i < 32; i++)
+        {
+                uint16_t rseq = ack->next + 1 + i;
+                if ((uint16_t)(rseq - channel->tx_base) >= in_flight)
+                        break;
+                if (ack->sack & (1UL << i))
+                {
+                        espnow_reliable_ack_slot(channel, rseq, now);
+                        highest_sacked = rseq;
+                }
+        }
+
+        // Everything below the highest selectively acknowledged message that is still missing was lost
+        if (nack)
+        {
+                for (uint16_t rseq = ack->next; rseq != highest_sacked; rseq++)
+                {
+                        espnow_reliable_tx_slot_t *slot = &channel->tx[rseq % ESPNOW_RELIABLE_WINDOW_SIZE];
+                        if (!slot->in_use || slot->fast_retransmitted)
+                                continue;
+                        slot->fast_retransmitted = true;
+                        espnow_reliable_stats.fast_retransmits++;
+                        espnow_reliable_transmit(channel, slot);
+                }
+        }
+
+        while (channel->tx_base != channel->tx_next && !channel->tx[channel->tx_base % ESPNOW_RELIABLE_WINDOW_SIZE].in_use)
+                channel->tx_base++;
+}
+
+static espnow_reliable_ack_pkt_t *espnow_reliable_rx_state(espnow_reliable_channel_t *channel, espnow_reliable_ack_pkt_t *ack)
+{
+        ack->next = channel->rx_next;
+        ack->sack = 0;
+        ack->epoch = channel->rx_epoch;
+        for (uint8_t i = 0; i + 1 < ESPNOW_RELIABLE_WINDOW_SIZE; i++)
+                if (channel->rx[(uint16_t)(channel->rx_next + 1 + i) % ESPNOW_RELIABLE_WINDOW_SIZE].valid)
+                        ack->sack |= 1UL << i;
+        return ack;
+}
+
+// Store a reliable message and deliver what became in order, called with the lock held
+static void espnow_reliable_process_data(espnow_reliable_channel_t *channel, esp_peer_handle_t *peer, espnow_packet_t *recv_data)
+{
+        espnow_reliable_header_pkt_t header;
+        memcpy(&header, recv_data->payload, sizeof(header));
+        if (header.epoch != channel->rx_epoch)
+        {
+                // A later epoch means the sender gave up on a message, a late frame of an earlier one is stale
+                if ((int8_t)(header.epoch - channel->rx_epoch) < 0)
+                {
+                        espnow_reliable_stats.out_of_window++;
+                        return;
+                }
+                LOG_WARNING("Reliable channel of " MACSTR " restarted by the sender, epoch: %d", MAC2STR(channel->mac), header.epoch);
+                channel->rx_epoch = header.epoch;
+                channel->rx_next = 0;
+                for (size_t i = 0; i < ESPNOW_RELIABLE_WINDOW_SIZE; i++)
+                        channel->rx[i].valid = false;
+                espnow_reliable_stats.resets++;
+        }
+        uint16_t offset = header.rseq - channel->rx_next;
+        if (offset >= 0x8000)
+        {
+                espnow_reliable_stats.duplicates++; // Delivered already, the `ACK` was lost
+                return;
+        }
+        size_t len = recv_data->len - sizeof(header);
+        if (offset >= ESPNOW_RELIABLE_WINDOW_SIZE || len > ESPNOW_RELIABLE_MAX_PAYLOAD)
+        {
+                espnow_reliable_stats.out_of_window++;
+                return;
+        }
+
+        espnow_reliable_rx_slot_t *slot = &channel->rx[header.rseq % ESPNOW_RELIABLE_WINDOW_SIZE];
+        if (slot->valid)
+        {
+                espnow_reliable_stats.duplicates++;
+        }
+        else
+        {
+                memcpy(slot->payload, recv_data->payload + sizeof(header), len);
+                slot->len = len;
+                slot->type = ESPNOW_PACKET_TYPE(recv_data);
+                slot->valid = true;
+        }
+
+        for (slot = &channel->rx[channel->rx_next % ESPNOW_RELIABLE_WINDOW_SIZE]; slot->valid; slot = &channel->rx[channel->rx_next % ESPNOW_RELIABLE_WINDOW_SIZE])
+        {
+                slot->valid = false;
+                channel->rx_next++;
+                espnow_reliable_stats.delivered++;
+                espnow_reliable_deliver_cb(peer, slot->type, slot->payload, slot->len);
+        }
+}
+
+bool espnow_reliable_process_received(esp_peer_handle_t *peer, espnow_packet_t *recv_data)
+{
+        if ((peer == NULL) || (recv_data == NULL))
+        {
+                LOG_ERROR("NULL pointer, peer=0x%X, recv_data=0x%X", (uintptr_t)peer, (uintptr_t)recv_data);
+                return false;
+        }
+
+        bool is_ack = ESPNOW_PACKET_TYPE(recv_data) == ESPNOW_PACKET_TYPE_ACK || ESPNOW_PACKET_TYPE(recv_data) == ESPNOW_PACKET_TYPE_NACK;
+        if (!is_ack && !espnow_reliable_is_type(ESPNOW_PACKET_TYPE(recv_data)))
+                return false;
+        if (ESPNOW_PACKET_METHOD(recv_data) != ESPNOW_DATA_UNICAST)
+                return true;
+
+        if (is_ack)
+        {
+                if (recv_data->len != sizeof(espnow_reliable_ack_pkt_t))
+                        return true;
+                espnow_reliable_ack_pkt_t ack;
+                memcpy(&ack, recv_data->payload, sizeof(ack));
+                xSemaphoreTakeRecursive(espnow_reliable_lock, portMAX_DELAY);
+                espnow_reliable_channel_t *channel = espnow_reliable_channel_get(peer->mac, false);
+                if (channel != NULL)
+                        espnow_reliable_process_ack(channel, &ack, ESPNOW_PACKET_TYPE(recv_data) == ESPNOW_PACKET_TYPE_NACK);
+                xSemaphoreGiveRecursive(espnow_reliable_lock);
+                return true;
+        }
+
+        if (recv_data->len < sizeof(espnow_reliable_header_pkt_t))
+                return true;
+
+        xSemaphoreTakeRecursive(espnow_reliable_lock, portMAX_DELAY);
+        espnow_reliable_channel_t *channel = espnow_reliable_channel_get(peer->mac, true);
+        if (channel != NULL)
+        {
+                channel->last_used_us = esp_timer_get_time();
+                espnow_reliable_process_data(channel, peer, recv_data);
+
+                // Messages held past a hole mean the hole was lost, ask for it right away
+                espnow_reliable_ack_pkt_t ack;
+                espnow_reliable_rx_state(channel, &ack);
+                espnow_send_param_t send_param;
+                espnow_get_send_param(&send_param, peer);
+                espnow_send_reply(&send_param, ack.sack ? ESPNOW_PACKET_TYPE_NACK : ESPNOW_PACKET_TYPE_ACK, &ack);
+        }
+        xSemaphoreGiveRecursive(espnow_reliable_lock);
+        return true;
+}
+
+// Drop every message of the send window and start a new epoch, called with the lock held
+// Later messages cannot be delivered in order without the one given up on, the receiver restarts on the new epoch
+static void espnow_reliable_channel_restart(espnow_reliable_channel_t *channel)
+{
+        for (uint16_t rseq = channel->tx_base; rseq != channel->tx_next; rseq++)
+        {
+                espnow_reliable_tx_slot_t *slot = &channel->tx[rseq % ESPNOW_RELIABLE_WINDOW_SIZE];
+                if (!slot->in_use)
+                        continue;
+                slot->in_use = false;
+                espnow_reliable_stats.failed++;
+                if (espnow_reliable_failed_cb != NULL)
+                        espnow_reliable_failed_cb(channel->mac, slot->type, slot->frame + sizeof(espnow_reliable_header_pkt_t),
+                                                  slot->len - sizeof(espnow_reliable_header_pkt_t));
+        }
+        channel->tx_epoch++;
+        channel->tx_base = 0;
+        channel->tx_next = 0;
+        espnow_reliable_stats.resets++;
+}
+
+void espnow_reliable_update(void)
+{
+        if (espnow_reliable_lock == NULL)
+                return;
+
+        int64_t now = esp_timer_get_time();
+        xSemaphoreTakeRecursive(espnow_reliable_lock, portMAX_DELAY);
+        for (size_t i = 0; i < ESPNOW_RELIABLE_CHANNELS; i++)
+        {
+                espnow_reliable_channel_t *channel = &espnow_reliable_channels[i];
+                if (!channel->in_use)
+                        continue;
+
+                bool backed_off = false;
+                for (uint16_t rseq = channel->tx_base; rseq != channel->tx_next; rseq++)
+                {
+                        espnow_reliable_tx_slot_t *slot = &channel->tx[rseq % ESPNOW_RELIABLE_WINDOW_SIZE];
+                        if (!slot->in_use || now < slot->deadline_us)
+                                continue;
+
+                        if (slot->transmissions >= ESPNOW_RELIABLE_MAX_RETRIES)
+                        {
+                                LOG_WARNING("Reliable %s to " MACSTR " dropped after %d transmissions",
+                                            ESPNOW_PACKET_TYPE_STRING[slot->type], MAC2STR(channel->mac), slot->transmissions);
+                                espnow_reliable_channel_restart(channel);
+                                break;
+                        }
+
+                        // Exponential backoff once per expiry, as RFC 6298, the next RTT sample brings the timeout back down
+                        if (!backed_off)
+                        {
+                                channel->rto_us *= 2;
+                                if (channel->rto_us > ESPNOW_RELIABLE_RTO_MAX_US)
+                                        channel->rto_us = ESPNOW_RELIABLE_RTO_MAX_US;
+                                backed_off = true;
+                        }
+                        slot->fast_retransmitted = false;
+                        espnow_reliable_stats.retransmits++;
+                        espnow_reliable_transmit(channel, slot);
+                }
+
+                while (channel->tx_base != channel->tx_next && !channel->tx[channel->tx_base % ESPNOW_RELIABLE_WINDOW_SIZE].in_use)
+                        channel->tx_base++;
+        }
+        xSemaphoreGiveRecursive(espnow_reliable_lock);
+}
+
+bool espnow_reliable_is_pending(const uint8_t *mac)
+{
+        if ((mac == NULL) || (espnow_reliable_lock == NULL))
+                return false;
+
+        xSemaphoreTakeRecursive(espnow_reliable_lock, portMAX_DELAY);
+        espnow_reliable_channel_t *channel = espnow_reliable_channel_get(mac, false);
+        bool pending = channel != NULL && channel->tx_base != channel->tx_next;
+        xSemaphoreGiveRecursive(espnow_reliable_lock);
+        return pending;
+}
+
+void espnow_reliable_reset(const uint8_t *mac)
+{
+        if ((mac == NULL) || (espnow_reliable_lock == NULL))
+                return;
+
+        xSemaphoreTakeRecursive(espnow_reliable_lock, portMAX_DELAY);
+        espnow_reliable_channel_t *channel = espnow_reliable_channel_get(mac, false);
+        if (channel != NULL)
+                channel->in_use = false;
+        xSemaphoreGiveRecursive(espnow_reliable_lock);
+}
+
+espnow_reliable_stats_t *espnow_reliable_get_stats(espnow_reliable_stats_t *stats)
+{
+        if (stats == NULL)
+        {
+                LOG_ERROR("NULL pointer, stats=0x%X", (uintptr_t)stats);
+                return NULL;
+        }
+
+        xSemaphoreTakeRecursive(espnow_reliable_lock, portMAX_DELAY);
+        *stats = espnow_reliable_stats;
+        xSemaphoreGiveRecursive(espnow_reliable_lock);
+        return stats;
+}
+
+void espnow_reliable_show_stats(void)
+{
+        if (espnow_reliable_lock == NULL)
+                return;
+
+        espnow_reliable_stats_t stats;
+        espnow_reliable_get_stats(&stats);
+        LOG_INFO("Reliable channel, sent: %lu, acked: %lu, failed: %lu, resets: %lu, frames: %lu, retransmits: %lu, fast retransmits: %lu",
+                 stats.sent, stats.acked, stats.failed, stats.resets, stats.transmissions, stats.retransmits, stats.fast_retransmits);
+        LOG_INFO("Reliable channel, delivered: %lu, duplicates: %lu, out of window: %lu, test dropped: %lu",
+                 stats.delivered, stats.duplicates, stats.out_of_window, stats.test_dropped);
+        for (size_t i = 0; i < ESPNOW_RELIABLE_CHANNELS; i++)
+        {
+                espnow_reliable_channel_t *channel = &espnow_reliable_channels[i];
+                if (!channel->in_use)
+                        continue;
+                LOG_INFO("Reliable channel " MACSTR ", in flight: %d, srtt: %lld us, rttvar: %lld us, rto: %lld us",
+                         MAC2STR(channel->mac), (uint16_t)(channel->tx_next - channel->tx_base), channel->srtt_us, channel->rttvar_us, channel->rto_us);
+        }
+}
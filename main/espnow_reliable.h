@@ -0,0 +1,139 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "esp_timer.h"
+
+#include "logging.h"
+#include "espnow.h"
+
+#define ESPNOW_RELIABLE_CHANNELS (4)            // Peers with a reliable channel at the same time, least recently used idle channel is reused
+#define ESPNOW_RELIABLE_WINDOW_SIZE (8)         // Messages in flight per channel, also the receive reorder window
+#define ESPNOW_RELIABLE_MAX_PAYLOAD (64)        // Largest reliable message, in bytes, commands are small
+#define ESPNOW_RELIABLE_MAX_RETRIES (10)        // Transmissions of one message before giving up
+#define ESPNOW_RELIABLE_RTO_INIT_US (200000)    // Retransmit timeout before the first RTT sample
+#define ESPNOW_RELIABLE_RTO_MIN_US (20000)      // Lower bound of the retransmit timeout
+#define ESPNOW_RELIABLE_RTO_MAX_US (2000000)    // Upper bound of the retransmit timeout, after backoff
+#define ESPNOW_RELIABLE_TEST_LOSS_PERCENT (0)   // Drop this share of outgoing reliable frames, for exercising recovery on a clean link
+
+_Static_assert(ESPNOW_RELIABLE_WINDOW_SIZE <= 33, "Selective ACK bitmap cannot cover the receive window");
+
+// Header in front of the payload of every reliable message
+typedef struct
+{
+        uint16_t rseq; // Sequence number of the message in its channel
+        uint8_t epoch; // Incremented when the sender gives up on a message, the receiver restarts its window at 0
+} __packed espnow_reliable_header_pkt_t;
+
+// Payload of `ACK` and `NACK` packets, the receive state of a channel
+// `NACK` additionally asks for the holes below the highest selectively acknowledged message to be sent again now
+typedef struct
+{
+        uint16_t next; // Cumulative acknowledgment, every message before `next` is received
+        uint32_t sack; // Bit `n` is set when message `next + 1 + n` is received
+        uint8_t epoch; // Epoch of the receive window, acknowledgments of another epoch are ignored
+} __packed espnow_reliable_ack_pkt_t;
+
+// Message waiting for its acknowledgment
+typedef struct
+{
+        uint8_t frame[sizeof(espnow_reliable_header_pkt_t) + ESPNOW_RELIABLE_MAX_PAYLOAD]; // Header and payload, as sent
+        uint8_t len;                                                                       // Length of `frame`, in bytes
+        espnow_packet_type_t type;                                                         // Data packet type
+        bool in_use;                                                                       // Slot holds a message not yet acknowledged
+        bool fast_retransmitted;                                                           // Sent again on a `NACK` since the last timer transmission
+        uint8_t transmissions;                                                             // Number of times the message was sent
+        int64_t sent_us;                                                                   // Timestamp of the last transmission
+        int64_t deadline_us;                                                               // Retransmit the message at this time
+} espnow_reliable_tx_slot_t;
+
+// Message received ahead of a missing one
+typedef struct
+{
+        uint8_t payload[ESPNOW_RELIABLE_MAX_PAYLOAD]; // Payload without the header
+        uint8_t len;                                  // Length of `payload`, in bytes
+        espnow_packet_type_t type;                    // Data packet type
+        bool valid;                                   // Slot holds a received message
+} espnow_reliable_rx_slot_t;
+
+// Reliable channel to one peer
+typedef struct
+{
+        uint8_t mac[ESP_NOW_ETH_ALEN];                             // Peer MAC address
+        bool in_use;                                               // Channel is assigned to `mac`
+        int64_t last_used_us;                                      // Timestamp of the last message sent or received
+        uint8_t tx_epoch;                                          // Epoch of the send window
+        uint16_t tx_base;                                          // Oldest message not yet acknowledged
+        uint16_t tx_next;                                          // Sequence number of the next message
+        espnow_reliable_tx_slot_t tx[ESPNOW_RELIABLE_WINDOW_SIZE]; // Send window, slot is sequence number modulo size
+        uint8_t rx_epoch;                                          // Epoch of the receive window
+        uint16_t rx_next;                                          // Next message to deliver
+        espnow_reliable_rx_slot_t rx[ESPNOW_RELIABLE_WINDOW_SIZE]; // Receive window, slot is sequence number modulo size
+        int64_t srtt_us;                                           // Smoothed round trip time, 0 before the first sample
+        int64_t rttvar_us;                                         // Round trip time variation
+        int64_t rto_us;                                            // Retransmit timeout
+} espnow_reliable_channel_t;
+
+// Reliable channel statistics
+typedef struct
+{
+        uint32_t sent;             // Messages accepted for sending
+        uint32_t transmissions;    // Frames sent, including retransmissions
+        uint32_t retransmits;      // Frames sent again on timeout
+        uint32_t fast_retransmits; // Frames sent again on `NACK`
+        uint32_t acked;            // Messages acknowledged
+        uint32_t failed;           // Messages dropped after `ESPNOW_RELIABLE_MAX_RETRIES`, with the rest of their window
+        uint32_t resets;           // Windows restarted, by this sender giving up or on a new epoch from the peer
+        uint32_t delivered;        // Messages delivered in order
+        uint32_t duplicates;       // Messages received more than once
+        uint32_t out_of_window;    // Messages received too far ahead of the window
+        uint32_t test_dropped;     // Frames dropped by `ESPNOW_RELIABLE_TEST_LOSS_PERCENT`
+} espnow_reliable_stats_t;
+
+// Called for every reliable message, once and in the order it was sent
+typedef void (*espnow_reliable_deliver_cb_t)(esp_peer_handle_t *peer, espnow_packet_type_t type, const uint8_t *payload, size_t len);
+
+// Called for every message dropped when the sender gives up, in the order they were sent
+typedef void (*espnow_reliable_failed_cb_t)(const uint8_t *mac, espnow_packet_type_t type, const uint8_t *payload, size_t len);
+
+// Initialize the reliable channels, `deliver_cb` receives the messages
+esp_err_t espnow_reliable_init(espnow_reliable_deliver_cb_t deliver_cb);
+
+// Set the callback told about dropped messages, NULL for none
+// A message that runs out of retries takes the rest of its window with it, and both ends restart the channel
+void espnow_reliable_set_failed_cb(espnow_reliable_failed_cb_t failed_cb);
+
+// Select whether packets of `type` are sent and received through the reliable channel
+void espnow_reliable_set_type(espnow_packet_type_t type, bool reliable);
+// Returns true if packets of `type` use the reliable channel
+bool espnow_reliable_is_type(espnow_packet_type_t type);
+
+// Queue a message for guaranteed, in-order delivery to the unicast peer of `send_param`
+// Returns `ESP_ERR_NO_MEM` if the send window is full, the caller may retry later
+esp_err_t espnow_send_reliable(espnow_send_param_t *send_param, espnow_packet_type_t type, const void *data, size_t len);
+
+// Send ESP-NOW data packet type of `ACK` or `NACK` to peer
+esp_err_t espnow_send_reply(espnow_send_param_t *send_param, espnow_packet_type_t type, const espnow_reliable_ack_pkt_t *ack);
+
+// Handle `ACK`, `NACK` and reliable packets, returns true if the packet was consumed
+bool espnow_reliable_process_received(esp_peer_handle_t *peer, espnow_packet_t *recv_data);
+
+// Retransmit messages whose timer expired
+void espnow_reliable_update(void);
+
+// Returns true while messages sent to `mac` wait for their acknowledgment
+bool espnow_reliable_is_pending(const uint8_t *mac);
+
+// Forget the channel state of a peer, both ends restart their sequence numbers on a new connection
+void espnow_reliable_reset(const uint8_t *mac);
+
+// Copy the reliable channel statistics
+espnow_reliable_stats_t *espnow_reliable_get_stats(espnow_reliable_stats_t *stats);
+
+// Print the reliable channel statistics and timers
+void espnow_reliable_show_stats(void);
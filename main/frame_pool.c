@@ -0,0 +1,123 @@
+
+#include "frame_pool.h"
+
+#define LOG_MODULE FRAME_POOL
+static const char *TAG = "frame_pool";
+
+frame_pool_t *frame_pool_init(frame_pool_t *pool, const char *name, frame_pool_frame_t *frames, size_t depth)
+{
+        if ((pool == NULL) || (frames == NULL))
+        {
+                LOG_ERROR("NULL pointer, pool=0x%X, frames=0x%X", (uintptr_t)pool, (uintptr_t)frames);
+                return NULL;
+        }
+        if ((depth == 0) || (depth > FRAME_POOL_MAX_DEPTH))
+        {
+                LOG_ERROR("Invalid pool depth: %d, max: %d", depth, FRAME_POOL_MAX_DEPTH);
+                return NULL;
+        }
+
+        pool->name = name;
+        pool->frames = frames;
+        pool->depth = depth;
+        for (size_t i = 0; i < FRAME_POOL_MASK_WORDS; i++)
+        {
+                size_t first = i * 32;
+                uint32_t mask = 0;
+                if (depth >= first + 32)
+                        mask = UINT32_MAX;
+                else if (depth > first)
+                        mask = (1UL << (depth - first)) - 1;
+                atomic_init(&pool->free_mask[i], mask);
+        }
+        atomic_init(&pool->borrowed, 0);
+        atomic_init(&pool->returned, 0);
+        atomic_init(&pool->exhausted, 0);
+        atomic_init(&pool->peak_in_use, 0);
+        return pool;
+}
+
+uint8_t *frame_pool_borrow(frame_pool_t *pool)
+{
+        if (pool == NULL)
+        {
+                LOG_ERROR("NULL pointer, pool=0x%X", (uintptr_t)pool);
+                return NULL;
+        }
+
+        for (size_t i = 0; i < FRAME_POOL_MASK_WORDS; i++)
+        {
+                uint32_t mask = atomic_load_explicit(&pool->free_mask[i], memory_order_relaxed);
+                while (mask)
+                {
+                        uint32_t bit = __builtin_ctz(mask);
+                        if (!atomic_compare_exchange_weak_explicit(&pool->free_mask[i], &mask, mask & ~(1UL << bit),
+                                                                   memory_order_acquire, memory_order_relaxed))
+                                continue; // `mask` is reloaded by the failed exchange
+
+                        // Frames in use follow from the two counters, one atomic operation less on each side
+                        // A return seen before its borrow on the other core wraps `in_use`, the peak is then left alone
+                        uint32_t borrowed = atomic_fetch_add_explicit(&pool->borrowed, 1, memory_order_relaxed) + 1;
+                        uint32_t in_use = borrowed - atomic_load_explicit(&pool->returned, memory_order_relaxed);
+                        uint32_t peak = atomic_load_explicit(&pool->peak_in_use, memory_order_relaxed);
+                        while (in_use > peak && in_use <= pool->depth &&
+                               !atomic_compare_exchange_weak_explicit(&pool->peak_in_use, &peak, in_use, memory_order_relaxed, memory_order_relaxed))
+                                ;
+                        return pool->frames[i * 32 + bit];
+                }
+        }
+        atomic_fetch_add_explicit(&pool->exhausted, 1, memory_order_relaxed);
+        return NULL;
+}
+
+void frame_pool_return(frame_pool_t *pool, uint8_t *frame)
+{
+        if ((pool == NULL) || (frame == NULL))
+        {
+                LOG_ERROR("NULL pointer, pool=0x%X, frame=0x%X", (uintptr_t)pool, (uintptr_t)frame);
+                return;
+        }
+
+        uintptr_t offset = (uintptr_t)frame - (uintptr_t)pool->frames;
+        size_t index = offset / FRAME_POOL_FRAME_SIZE;
+        if (((uintptr_t)frame < (uintptr_t)pool->frames) || (offset % FRAME_POOL_FRAME_SIZE) || (index >= pool->depth))
+        {
+                LOG_ERROR("Frame 0x%X does not belong to pool %s", (uintptr_t)frame, pool->name);
+                return;
+        }
+
+        uint32_t bit = 1UL << (index % 32);
+        uint32_t old_mask = atomic_fetch_or_explicit(&pool->free_mask[index / 32], bit, memory_order_release);
+        if (old_mask & bit)
+        {
+                LOG_ERROR("Frame %d returned twice to pool %s", index, pool->name);
+                return;
+        }
+        atomic_fetch_add_explicit(&pool->returned, 1, memory_order_relaxed);
+}
+
+frame_pool_stats_t *frame_pool_get_stats(frame_pool_t *pool, frame_pool_stats_t *stats)
+{
+        if ((pool == NULL) || (stats == NULL))
+        {
+                LOG_ERROR("NULL pointer, pool=0x%X, stats=0x%X", (uintptr_t)pool, (uintptr_t)stats);
+                return NULL;
+        }
+
+        stats->borrowed = atomic_load(&pool->borrowed);
+        stats->returned = atomic_load(&pool->returned);
+        stats->exhausted = atomic_load(&pool->exhausted);
+        stats->in_use = stats->borrowed - stats->returned;
+        stats->peak_in_use = atomic_load(&pool->peak_in_use);
+        return stats;
+}
+
+void frame_pool_print_stats(frame_pool_t *pool)
+{
+        frame_pool_stats_t stats;
+        if (frame_pool_get_stats(pool, &stats) == NULL)
+                return;
+
+        LOG_INFO("Frame pool %s, depth: %d, in use: %lu, peak: %lu, borrowed: %lu, returned: %lu, exhausted: %lu",
+                 pool->name, pool->depth, stats.in_use, stats.peak_in_use, stats.borrowed, stats.returned, stats.exhausted);
+}
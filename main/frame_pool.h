@@ -0,0 +1,60 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include "esp_now.h"
+
+#include "logging.h"
+
+// Size of one frame, one ESP-NOW MTU plus a null terminator, rounded up to keep every frame word aligned
+#define FRAME_POOL_FRAME_SIZE ((ESP_NOW_MAX_DATA_LEN + 1 + 3) & ~3)
+// Maximum number of frames in one pool
+#define FRAME_POOL_MAX_DEPTH (64)
+// Number of 32-bit words in the free frame bitmap
+#define FRAME_POOL_MASK_WORDS ((FRAME_POOL_MAX_DEPTH + 31) / 32)
+
+// Storage of one frame
+typedef uint8_t frame_pool_frame_t[FRAME_POOL_FRAME_SIZE] __attribute__((aligned(4)));
+
+// Statistics of a frame pool
+typedef struct
+{
+        uint32_t borrowed;    // Number of frames handed out
+        uint32_t returned;    // Number of frames given back
+        uint32_t exhausted;   // Number of borrow attempts that found the pool empty
+        uint32_t in_use;      // Number of frames currently borrowed
+        uint32_t peak_in_use; // Highest number of frames borrowed at the same time
+} frame_pool_stats_t;
+
+// Fixed-size frame pool, frames are borrowed and returned without locking or heap allocation
+typedef struct
+{
+        const char *name;                                  // Name of the pool, for logging
+        frame_pool_frame_t *frames;                        // Backing storage of `depth` frames
+        size_t depth;                                      // Number of frames in the pool
+        _Atomic uint32_t free_mask[FRAME_POOL_MASK_WORDS]; // Bit is set when the frame is free
+        _Atomic uint32_t borrowed;                         // Number of frames handed out
+        _Atomic uint32_t returned;                         // Number of frames given back
+        _Atomic uint32_t exhausted;                        // Number of borrow attempts that found the pool empty
+        _Atomic uint32_t peak_in_use;                      // Highest number of frames borrowed at the same time
+} frame_pool_t;
+
+// Initialize the pool over `depth` frames of caller provided storage
+// `depth` must not exceed `FRAME_POOL_MAX_DEPTH`
+frame_pool_t *frame_pool_init(frame_pool_t *pool, const char *name, frame_pool_frame_t *frames, size_t depth);
+
+// Borrow one frame, returns NULL if the pool is exhausted
+// Safe to call from any task, including the Wi-Fi task
+uint8_t *frame_pool_borrow(frame_pool_t *pool);
+
+// Give a borrowed frame back to the pool
+void frame_pool_return(frame_pool_t *pool, uint8_t *frame);
+
+// Copy the pool statistics
+frame_pool_stats_t *frame_pool_get_stats(frame_pool_t *pool, frame_pool_stats_t *stats);
+
+// Print the pool statistics
+void frame_pool_print_stats(frame_pool_t *pool);
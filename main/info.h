@@ -12,12 +12,50 @@
 // Default: true
 #define CLEAR_PAIRED_PEER_ON_NEW_UPLOAD true
 
+// Number of cars driven at the same time, the remote pairs with new cars until this many are paired
+// Range: 1 to 4
+// Default: 1
+#define MAX_CONNECTED_CARS 1
+
 // Attempt to establish a connection when signal strength is greater than this value
 // Unit: decibel-milliwatts - dBm
 // Range: 0 to -100
 // Default: -20
 #define MIN_RSSI_TO_INITIATE_CONNECTION -20
 
+/* ---> Serial Console Settings <--- */
+
+// Write motor status, RSSI, round trip and input event records as binary frames between the console text
+// Read by espGraphing.py, motor status is printed as text instead when disabled
+// Options: true, false
+// Default: true
+#define SERIAL_BINARY_RECORDS true
+
+/* ---> Log Settings <--- */
+
+// Highest level each module logs, calls above it are compiled out together with their strings
+// The connection modules keep their status lines while `SHOW_CONNECTION_STATUS` is enabled
+// Options: ESP_LOG_NONE, ESP_LOG_ERROR, ESP_LOG_WARN, ESP_LOG_INFO, ESP_LOG_DEBUG, ESP_LOG_VERBOSE
+// Default: ESP_LOG_WARN for the connection modules, ESP_LOG_INFO for the others
+#define LOG_LEVEL_CONNECTION (SHOW_CONNECTION_STATUS ? ESP_LOG_INFO : ESP_LOG_WARN)
+#define LOG_LEVEL_ESPNOW LOG_LEVEL_CONNECTION
+#define LOG_LEVEL_ESPNOW_CHANNEL LOG_LEVEL_CONNECTION
+#define LOG_LEVEL_ESPNOW_DISPATCH LOG_LEVEL_CONNECTION
+#define LOG_LEVEL_ESPNOW_FRAGMENT LOG_LEVEL_CONNECTION
+#define LOG_LEVEL_ESPNOW_RATE LOG_LEVEL_CONNECTION
+#define LOG_LEVEL_ESPNOW_RELIABLE LOG_LEVEL_CONNECTION
+#define LOG_LEVEL_FRAME_POOL LOG_LEVEL_CONNECTION
+#define LOG_LEVEL_RSSI LOG_LEVEL_CONNECTION
+#define LOG_LEVEL_APP_MAIN ESP_LOG_INFO
+#define LOG_LEVEL_BUTTON ESP_LOG_INFO
+#define LOG_LEVEL_CONTROLLER ESP_LOG_INFO
+#define LOG_LEVEL_DEVICE_SETTINGS ESP_LOG_INFO
+#define LOG_LEVEL_EEPROM ESP_LOG_INFO
+#define LOG_LEVEL_JOYSTICK ESP_LOG_INFO
+#define LOG_LEVEL_LOGGING ESP_LOG_INFO
+#define LOG_LEVEL_SERIAL_RECORD ESP_LOG_INFO
+#define LOG_LEVEL_TELEMETRY ESP_LOG_INFO
+
 /* ---> Built-in RGB LED Settings <--- */
 // https://www.selecolor.com/en/hsv-color-picker/
 
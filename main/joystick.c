@@ -1,6 +1,7 @@
 
 #include "joystick.h"
 
+#define LOG_MODULE JOYSTICK
 static const char *TAG = "joystick";
 
 typedef struct
@@ -49,10 +50,13 @@ static bool adc1_calibration_init(void)
 
 static void joystick_send_event(int pin, button_state_t state, const button_state_t prev_state)
 {
-        button_event_t new_state = {
-            .pin = pin,
-            .prev_state = prev_state,
-            .new_state = state,
+        button_queue_event_t new_state = {
+            .event = {
+                .pin = pin,
+                .prev_state = prev_state,
+                .new_state = state,
+            },
+            .time_us = esp_timer_get_time(),
         };
 
         if (xQueueSend(joystick_queue, &new_state, 0) != pdTRUE)
@@ -113,7 +117,7 @@ uint8_t count_num_joysticks(const uint64_t bitfield)
 void joystick_calibrate(void)
 {
         uint8_t num_joysticks = count_num_joysticks(joystick_pinmask);
-        LOG_INFO("joystick calibration info : ")
+        LOG_INFO("joystick calibration info : ");
         for (int idx = 0; idx < num_joysticks; idx++)
         {
                 joystick_data_t *joystick = &joystick_data[idx];
@@ -148,7 +152,7 @@ QueueHandle_t joystick_init(void)
         }
 
         // Initialize queue
-        joystick_queue = xQueueCreate(BUTTON_QUEUE_DEPTH, sizeof(button_event_t)); // TODO: statically allow memory
+        joystick_queue = xQueueCreate(BUTTON_QUEUE_DEPTH, sizeof(button_queue_event_t)); // TODO: statically allow memory
         if (joystick_queue == NULL)
         {
                 LOG_ERROR("Create queue failed");
@@ -172,6 +176,28 @@ void print_joystick_stat(void)
         }
 }
 
+int8_t joystick_get_position(const gpio_num_t adc_pin)
+{
+        uint8_t num_joysticks = count_num_joysticks(joystick_pinmask);
+        for (int idx = 0; idx < num_joysticks; idx++)
+        {
+                joystick_data_t *joystick = &joystick_data[idx];
+                if (joystick->_channel != adc_pin - 1)
+                        continue;
+
+                int voltage = joystick->_voltage;
+                float position = 0;
+                if (voltage == joystick->_center || joystick->_low == joystick->_center || joystick->_high == joystick->_center)
+                        return 0;
+                if (voltage > joystick->_center)
+                        position = map(voltage, joystick->_center, joystick->_high, 0, INT8_MAX);
+                else
+                        position = map(voltage, joystick->_low, joystick->_center, -INT8_MAX, 0);
+                return constrain(position, -INT8_MAX, INT8_MAX);
+        }
+        return 0;
+}
+
 void joystick_register(const gpio_num_t high_pin, const gpio_num_t low_pin, const gpio_num_t adc_pin, const float sensitivity)
 {
         adc_channel_t _channel = adc_pin - 1;
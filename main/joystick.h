@@ -24,4 +24,5 @@ QueueHandle_t joystick_init(void);
 void joystick_register(const gpio_num_t high_pin, const gpio_num_t low_pin, const gpio_num_t adc_pin, const float sensitivity);
 void joystick_deinit(void);
 void joystick_calibrate(void);
-void print_joystick_stat(void);
\ No newline at end of file
+void print_joystick_stat(void);
+int8_t joystick_get_position(const gpio_num_t adc_pin);
\ No newline at end of file
@@ -0,0 +1,625 @@
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/task.h"
+
+#include "esp_cpu.h"
+#include "esp_memory_utils.h"
+#include "esp_timer.h"
+
+#include "logging.h"
+
+#define LOG_MODULE LOGGING
+static const char *TAG = "logging";
+
+const char *const LOG_FILE_STRING[] = {
+    "main.c",
+    "button.c",
+    "controller.c",
+    "device_settings.c",
+    "eeprom.c",
+    "espnow.c",
+    "espnow_channel.c",
+    "espnow_dispatch.c",
+    "espnow_fragment.c",
+    "espnow_rate.c",
+    "espnow_reliable.c",
+    "frame_pool.c",
+    "joystick.c",
+    "logging.c",
+    "rssi.c",
+    "serial_record.c",
+    "telemetry.c",
+    "MAX"};
+
+_Static_assert(sizeof(LOG_FILE_STRING) / sizeof(LOG_FILE_STRING[0]) == LOG_FILE_MAX + 1, "Every log file needs a name");
+
+_Static_assert((LOGGING_DEFERRED_RING_SIZE & (LOGGING_DEFERRED_RING_SIZE - 1)) == 0, "Logging ring size must be a power of two");
+
+// Kind of value a conversion reads from the argument list
+typedef enum
+{
+        LOGGING_ARG_NONE,    // `%%`, or a conversion that is not captured
+        LOGGING_ARG_INT,     // `%d`, `%x`, `%c`... and their `h`, `hh` forms
+        LOGGING_ARG_LONG,    // `l` integers
+        LOGGING_ARG_LLONG,   // `ll` and `j` integers
+        LOGGING_ARG_SIZE,    // `z` and `t` integers
+        LOGGING_ARG_DOUBLE,  // `%f`, `%e`, `%g`, `%a`
+        LOGGING_ARG_POINTER, // `%p`
+        LOGGING_ARG_STRING,  // `%s`, kept as a pointer when it lives in flash, copied otherwise
+} logging_arg_t;
+
+// One conversion of a format string
+typedef struct
+{
+        const char *start;   // The `%` starting the conversion
+        size_t len;          // Length of the conversion, up to and including its letter
+        bool star_width;     // Width is read from the arguments
+        bool star_precision; // Precision is read from the arguments
+        logging_arg_t arg;   // Kind of the value
+} logging_conversion_t;
+
+// Raw log call, the arguments are stored back to back in the order of the format string
+typedef struct
+{
+        const logging_site_t *site;              // Call site, holds the format string
+        const char *tag;                         // Tag of the calling module
+        int64_t time_us;                         // Timestamp of the call
+        uint8_t len;                             // Bytes used in `args`
+        bool truncated;                          // Some arguments did not fit in `args`
+        uint8_t args[LOGGING_DEFERRED_ARGS_LEN]; // Raw arguments
+} logging_record_t;
+
+// Records of the calls made on one core, the caller side of the statistics is kept with them
+typedef struct
+{
+        logging_record_t records[LOGGING_DEFERRED_RING_SIZE]; // Queued records
+        uint32_t head;                                        // Next slot written
+        uint32_t tail;                                        // Next slot formatted
+        portMUX_TYPE lock;                                    // Guards the ring and its statistics
+        logging_stats_t stats;                                // Caller side statistics
+} logging_ring_t;
+
+static logging_ring_t logging_rings[portNUM_PROCESSORS] = {[0 ... portNUM_PROCESSORS - 1] = {.lock = portMUX_INITIALIZER_UNLOCKED}};
+static _Atomic bool logging_running;
+static _Atomic uint32_t logging_immediate;
+
+// Task side of the statistics
+static logging_stats_t logging_task_stats;
+static portMUX_TYPE logging_task_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static const char LOGGING_LETTER[] = {
+    [ESP_LOG_NONE] = 'N',
+    [ESP_LOG_ERROR] = 'E',
+    [ESP_LOG_WARN] = 'W',
+    [ESP_LOG_INFO] = 'I',
+    [ESP_LOG_DEBUG] = 'D',
+    [ESP_LOG_VERBOSE] = 'V'};
+
+static const char *LOGGING_COLOR[] = {
+    [ESP_LOG_NONE] = "",
+    [ESP_LOG_ERROR] = LOG_COLOR_E,
+    [ESP_LOG_WARN] = LOG_COLOR_W,
+    [ESP_LOG_INFO] = LOG_COLOR_I,
+    [ESP_LOG_DEBUG] = LOG_COLOR_D,
+    [ESP_LOG_VERBOSE] = LOG_COLOR_V};
+
+// Find the next conversion at or after `format`, returns the text following it or NULL at the end of the string
+static const char *logging_next_conversion(const char *format, logging_conversion_t *conversion)
+{
+        const char *pos = strchr(format, '%');
+        if (pos == NULL)
+                return NULL;
+
+        conversion->start = pos++;
+        conversion->star_width = false;
+        conversion->star_precision = false;
+        while (*pos != '\0' && strchr("-+ #0", *pos) != NULL)
+                pos++;
+        if (*pos == '*')
+        {
+                conversion->star_width = true;
+                pos++;
+        }
+        while (isdigit((unsigned char)*pos))
+                pos++;
+        if (*pos == '.')
+        {
+                pos++;
+                if (*pos == '*')
+                {
+                        conversion->star_precision = true;
+                        pos++;
+                }
+                while (isdigit((unsigned char)*pos))
+                        pos++;
+        }
+
+        uint8_t longs = 0;
+        char length = '\0';
+        while (*pos != '\0' && strchr("hlLjzt", *pos) != NULL)
+        {
+                if (*pos == 'l')
+                        longs++;
+                else
+                        length = *pos;
+                pos++;
+        }
+
+        switch (*pos)
+        {
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+        case 'c':
+                if (length == 'z' || length == 't')
+                        conversion->arg = LOGGING_ARG_SIZE;
+                else if (length == 'j' || longs >= 2)
+                        conversion->arg = LOGGING_ARG_LLONG;
+                else if (longs == 1)
+                        conversion->arg = LOGGING_ARG_LONG;
+                else
+                        conversion->arg = LOGGING_ARG_INT;
+                break;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+                conversion->arg = LOGGING_ARG_DOUBLE;
+                break;
+        case 'p':
+                conversion->arg = LOGGING_ARG_POINTER;
+                break;
+        case 's':
+                conversion->arg = LOGGING_ARG_STRING;
+                break;
+        default:
+                conversion->arg = LOGGING_ARG_NONE;
+                break;
+        }
+        if (*pos != '\0')
+                pos++;
+        conversion->len = pos - conversion->start;
+        return pos;
+}
+
+static bool logging_put(logging_record_t *record, const void *value, size_t len)
+{
+        if (record->len + len > LOGGING_DEFERRED_ARGS_LEN)
+        {
+                record->truncated = true;
+                return false;
+        }
+        memcpy(record->args + record->len, value, len);
+        record->len += len;
+        return true;
+}
+
+// Store a string argument, a length of 0xFF marks a pointer to a string in flash
+static bool logging_put_string(logging_record_t *record, const char *string)
+{
+        if (string == NULL)
+                string = "(null)";
+        if (esp_ptr_in_drom(string))
+        {
+                uint8_t marker = UINT8_MAX;
+                return logging_put(record, &marker, sizeof(marker)) && logging_put(record, &string, sizeof(string));
+        }
+
+        uint8_t len = strnlen(string, LOGGING_DEFERRED_STRING_LEN);
+        return logging_put(record, &len, sizeof(len)) && logging_put(record, string, len);
+}
+
+// Copy the arguments of `format` into the record, without formatting them
+static void logging_capture(logging_record_t *record, const char *format, va_list args)
+{
+        record->len = 0;
+        record->truncated = false;
+
+        logging_conversion_t conversion;
+        const char *pos = format;
+        bool fits = true;
+        while (fits && (pos = logging_next_conversion(pos, &conversion)) != NULL)
+        {
+                if (conversion.star_width)
+                {
+                        int width = va_arg(args, int);
+                        fits = logging_put(record, &width, sizeof(width));
+                }
+                if (fits && conversion.star_precision)
+                {
+                        int precision = va_arg(args, int);
+                        fits = logging_put(record, &precision, sizeof(precision));
+                }
+                if (!fits)
+                        break;
+
+                switch (conversion.arg)
+                {
+                case LOGGING_ARG_INT:
+                {
+                        int value = va_arg(args, int);
+                        fits = logging_put(record, &value, sizeof(value));
+                        break;
+                }
+                case LOGGING_ARG_LONG:
+                {
+                        long value = va_arg(args, long);
+                        fits = logging_put(record, &value, sizeof(value));
+                        break;
+                }
+                case LOGGING_ARG_LLONG:
+                {
+                        long long value = va_arg(args, long long);
+                        fits = logging_put(record, &value, sizeof(value));
+                        break;
+                }
+                case LOGGING_ARG_SIZE:
+                {
+                        size_t value = va_arg(args, size_t);
+                        fits = logging_put(record, &value, sizeof(value));
+                        break;
+                }
+                case LOGGING_ARG_DOUBLE:
+                {
+                        double value = va_arg(args, double);
+                        fits = logging_put(record, &value, sizeof(value));
+                        break;
+                }
+                case LOGGING_ARG_POINTER:
+                {
+                        void *value = va_arg(args, void *);
+                        fits = logging_put(record, &value, sizeof(value));
+                        break;
+                }
+                case LOGGING_ARG_STRING:
+                        fits = logging_put_string(record, va_arg(args, const char *));
+                        break;
+                case LOGGING_ARG_NONE:
+                        break;
+                }
+        }
+}
+
+// Read the next raw argument, returns false once the stored arguments run out
+static bool logging_get(const logging_record_t *record, size_t *offset, void *value, size_t len)
+{
+        if (*offset + len > record->len)
+                return false;
+        memcpy(value, record->args + *offset, len);
+        *offset += len;
+        return true;
+}
+
+static void logging_append(char *message, size_t size, size_t *pos, const char *text, size_t len)
+{
+        if (*pos + len >= size)
+                len = size - 1 - *pos;
+        memcpy(message + *pos, text, len);
+        *pos += len;
+        message[*pos] = '\0';
+}
+
+// Format one conversion, `spec` has its `*` replaced with the stored width and precision
+static bool logging_format_conversion(const logging_record_t *record, size_t *offset, const logging_conversion_t *conversion, char *out, size_t size)
+{
+        char spec[32];
+        size_t spec_len = 0;
+        for (size_t i = 0; i < conversion->len && spec_len < sizeof(spec) - 12; i++)
+        {
+                if (conversion->start[i] != '*')
+                {
+                        spec[spec_len++] = conversion->start[i];
+                        continue;
+                }
+                int star;
+                if (!logging_get(record, offset, &star, sizeof(star)))
+                        return false;
+                spec_len += snprintf(spec + spec_len, sizeof(spec) - spec_len, "%d", star);
+        }
+        spec[spec_len] = '\0';
+
+        switch (conversion->arg)
+        {
+        case LOGGING_ARG_INT:
+        {
+                int value;
+                if (!logging_get(record, offset, &value, sizeof(value)))
+                        return false;
+                snprintf(out, size, spec, value);
+                return true;
+        }
+        case LOGGING_ARG_LONG:
+        {
+                long value;
+                if (!logging_get(record, offset, &value, sizeof(value)))
+                        return false;
+                snprintf(out, size, spec, value);
+                return true;
+        }
+        case LOGGING_ARG_LLONG:
+        {
+                long long value;
+                if (!logging_get(record, offset, &value, sizeof(value)))
+                        return false;
+                snprintf(out, size, spec, value);
+                return true;
+        }
+        case LOGGING_ARG_SIZE:
+        {
+                size_t value;
+                if (!logging_get(record, offset, &value, sizeof(value)))
+                        return false;
+                snprintf(out, size, spec, value);
+                return true;
+        }
+        case LOGGING_ARG_DOUBLE:
+        {
+                double value;
+                if (!logging_get(record, offset, &value, sizeof(value)))
+                        return false;
+                snprintf(out, size, spec, value);
+                return true;
+        }
+        case LOGGING_ARG_POINTER:
+        {
+                void *value;
+                if (!logging_get(record, offset, &value, sizeof(value)))
+                        return false;
+                snprintf(out, size, spec, value);
+                return true;
+        }
+        case LOGGING_ARG_STRING:
+        {
+                uint8_t len;
+                if (!logging_get(record, offset, &len, sizeof(len)))
+                        return false;
+                if (len == UINT8_MAX)
+                {
+                        const char *string;
+                        if (!logging_get(record, offset, &string, sizeof(string)))
+                                return false;
+                        snprintf(out, size, spec, string);
+                        return true;
+                }
+                char string[LOGGING_DEFERRED_STRING_LEN + 1];
+                if (!logging_get(record, offset, string, len))
+                        return false;
+                string[len] = '\0';
+                snprintf(out, size, spec, string);
+                return true;
+        }
+        case LOGGING_ARG_NONE:
+                break;
+        }
+
+        // `%%` prints a percent sign, anything else is printed as written
+        if (conversion->len == 2 && conversion->start[1] == '%')
+                snprintf(out, size, "%%");
+        else
+                snprintf(out, size, "%.*s", (int)conversion->len, conversion->start);
+        return true;
+}
+
+// Rebuild the message of a record, one conversion at a time
+static void logging_format(const logging_record_t *record, char *message, size_t size)
+{
+        size_t pos = 0;
+        size_t offset = 0;
+        message[0] = '\0';
+
+        logging_conversion_t conversion;
+        const char *format = record->site->format;
+        const char *next;
+        while ((next = logging_next_conversion(format, &conversion)) != NULL)
+        {
+                logging_append(message, size, &pos, format, conversion.start - format);
+                char value[64];
+                if (!logging_format_conversion(record, &offset, &conversion, value, sizeof(value)))
+                {
+                        logging_append(message, size, &pos, "<truncated>", strlen("<truncated>"));
+                        return;
+                }
+                logging_append(message, size, &pos, value, strlen(value));
+                format = next;
+        }
+        logging_append(message, size, &pos, format, strlen(format));
+}
+
+// Write a record the way `ESP_LOGx` would have written the original call
+static void logging_write_record(const logging_record_t *record)
+{
+        char message[192];
+        logging_format(record, message, sizeof(message));
+
+        const logging_site_t *site = record->site;
+        esp_log_write(site->level, record->tag, "%s%c (%lu) %s: %s | \x1b[100m%s:%d\x1b[0m" LOG_RESET_COLOR "\n",
+                      LOGGING_COLOR[site->level], LOGGING_LETTER[site->level], (uint32_t)(record->time_us / 1000), record->tag, message, LOG_FILE_STRING[site->file], site->line);
+}
+
+void logging_deferred_write(const logging_site_t *site, const char *tag, const char *format, ...)
+{
+        uint32_t start_cycles = esp_cpu_get_cycle_count();
+        logging_record_t record;
+        record.site = site;
+        record.tag = tag;
+        record.time_us = esp_timer_get_time();
+
+        va_list args;
+        va_start(args, format);
+        logging_capture(&record, format, args);
+        va_end(args);
+
+        // Nothing drains the rings yet, pay for the formatting here
+        if (!atomic_load_explicit(&logging_running, memory_order_acquire))
+        {
+                atomic_fetch_add_explicit(&logging_immediate, 1, memory_order_relaxed);
+                logging_write_record(&record);
+                return;
+        }
+
+        logging_ring_t *ring = &logging_rings[xPortGetCoreID()];
+        portENTER_CRITICAL_SAFE(&ring->lock);
+        if (ring->head - ring->tail >= LOGGING_DEFERRED_RING_SIZE)
+                ring->stats.dropped++;
+        else
+        {
+                memcpy(&ring->records[ring->head & (LOGGING_DEFERRED_RING_SIZE - 1)], &record, offsetof(logging_record_t, args) + record.len);
+                ring->head++;
+                ring->stats.records++;
+                if (record.truncated)
+                        ring->stats.truncated++;
+        }
+        uint32_t cycles = esp_cpu_get_cycle_count() - start_cycles;
+        ring->stats.enqueue_cycles += cycles;
+        if (cycles > ring->stats.enqueue_max)
+                ring->stats.enqueue_max = cycles;
+        portEXIT_CRITICAL_SAFE(&ring->lock);
+}
+
+// Take the oldest record of all rings, returns false if every ring is empty
+static bool logging_take_oldest(logging_record_t *record)
+{
+        logging_ring_t *oldest = NULL;
+        int64_t oldest_us = 0;
+        for (size_t i = 0; i < portNUM_PROCESSORS; i++)
+        {
+                logging_ring_t *ring = &logging_rings[i];
+                portENTER_CRITICAL(&ring->lock);
+                if (ring->head != ring->tail)
+                {
+                        int64_t time_us = ring->records[ring->tail & (LOGGING_DEFERRED_RING_SIZE - 1)].time_us;
+                        if (oldest == NULL || time_us < oldest_us)
+                        {
+                                oldest = ring;
+                                oldest_us = time_us;
+                        }
+                }
+                portEXIT_CRITICAL(&ring->lock);
+        }
+        if (oldest == NULL)
+                return false;
+
+        // Only this task moves the tail, the record found above is still the first one
+        portENTER_CRITICAL(&oldest->lock);
+        logging_record_t *slot = &oldest->records[oldest->tail & (LOGGING_DEFERRED_RING_SIZE - 1)];
+        memcpy(record, slot, offsetof(logging_record_t, args) + slot->len);
+        oldest->tail++;
+        portEXIT_CRITICAL(&oldest->lock);
+        return true;
+}
+
+static void logging_task(void *arg)
+{
+        uint32_t reported_dropped = 0;
+        for (;;)
+        {
+                logging_record_t record;
+                while (logging_take_oldest(&record))
+                {
+                        uint32_t start_cycles = esp_cpu_get_cycle_count();
+                        logging_write_record(&record);
+                        uint32_t cycles = esp_cpu_get_cycle_count() - start_cycles;
+
+                        portENTER_CRITICAL(&logging_task_lock);
+                        logging_task_stats.written++;
+                        logging_task_stats.format_cycles += cycles;
+                        if (cycles > logging_task_stats.format_max)
+                                logging_task_stats.format_max = cycles;
+                        portEXIT_CRITICAL(&logging_task_lock);
+                }
+
+                // Dropped lines are reported once the rings have room again
+                logging_stats_t stats;
+                logging_get_stats(&stats);
+                if (stats.dropped != reported_dropped)
+                {
+                        esp_log_write(ESP_LOG_WARN, TAG, LOG_COLOR_W "W (%lu) %s: %lu log lines dropped" LOG_RESET_COLOR "\n",
+                                      esp_log_timestamp(), TAG, stats.dropped - reported_dropped);
+                        reported_dropped = stats.dropped;
+                }
+                vTaskDelay(pdMS_TO_TICKS(LOGGING_DEFERRED_DRAIN_MS));
+        }
+}
+
+logging_config_t *logging_default_config(logging_config_t *config)
+{
+        if (config == NULL)
+        {
+                LOG_ERROR("NULL pointer, config=0x%X", (uintptr_t)config);
+                return NULL;
+        }
+        config->stack_size = 4096;
+        config->priority = 1;
+        config->core = 0;
+        return config;
+}
+
+esp_err_t logging_deferred_start(const logging_config_t *config)
+{
+        if (config == NULL)
+        {
+                LOG_ERROR("NULL pointer, config=0x%X", (uintptr_t)config);
+                return ESP_ERR_INVALID_ARG;
+        }
+
+        if (xTaskCreatePinnedToCore(logging_task, "logging", config->stack_size, NULL, config->priority, NULL, config->core) != pdPASS)
+        {
+                LOG_ERROR("Create logging task failed");
+                return ESP_ERR_NO_MEM;
+        }
+        atomic_store_explicit(&logging_running, true, memory_order_release);
+        return ESP_OK;
+}
+
+logging_stats_t *logging_get_stats(logging_stats_t *stats)
+{
+        if (stats == NULL)
+        {
+                LOG_ERROR("NULL pointer, stats=0x%X", (uintptr_t)stats);
+                return NULL;
+        }
+
+        portENTER_CRITICAL(&logging_task_lock);
+        *stats = logging_task_stats;
+        portEXIT_CRITICAL(&logging_task_lock);
+        stats->immediate = atomic_load_explicit(&logging_immediate, memory_order_relaxed);
+
+        for (size_t i = 0; i < portNUM_PROCESSORS; i++)
+        {
+                logging_ring_t *ring = &logging_rings[i];
+                portENTER_CRITICAL(&ring->lock);
+                stats->records += ring->stats.records;
+                stats->dropped += ring->stats.dropped;
+                stats->truncated += ring->stats.truncated;
+                stats->enqueue_cycles += ring->stats.enqueue_cycles;
+                if (ring->stats.enqueue_max > stats->enqueue_max)
+                        stats->enqueue_max = ring->stats.enqueue_max;
+                portEXIT_CRITICAL(&ring->lock);
+        }
+        return stats;
+}
+
+void logging_show_stats(void)
+{
+        logging_stats_t stats;
+        logging_get_stats(&stats);
+        uint32_t calls = stats.records + stats.dropped;
+        LOG_INFO("Logging, records: %lu, dropped: %lu, truncated: %lu, immediate: %lu, written: %lu",
+                 stats.records, stats.dropped, stats.truncated, stats.immediate, stats.written);
+        LOG_INFO("Logging cycles per call, deferred avg: %llu, max: %lu | synchronous avg: %llu, max: %lu",
+                 calls ? stats.enqueue_cycles / calls : 0, stats.enqueue_max,
+                 stats.written ? stats.format_cycles / stats.written : 0, stats.format_max);
+}
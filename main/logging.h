@@ -1,8 +1,134 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
 
 #include "esp_log.h"
 
-#define LOG_ERROR(format, ...) ESP_LOGE(TAG, format " | [100m%s:%d[0m", ##__VA_ARGS__, __FILE__, __LINE__);
-#define LOG_WARNING(format, ...) ESP_LOGW(TAG, format " | [100m%s:%d[0m", ##__VA_ARGS__, __FILE__, __LINE__);
-#define LOG_INFO(format, ...) ESP_LOGI(TAG, format " | [100m%s:%d[0m", ##__VA_ARGS__, __FILE__, __LINE__);
-#define LOG_VERBOSE(format, ...) ESP_LOGV(TAG, format " | [100m%s:%d[0m", ##__VA_ARGS__, __FILE__, __LINE__);
-#define LOG_DEBUG(format, ...) ESP_LOGD(TAG, format " | [100m%s:%d[0m", ##__VA_ARGS__, __FILE__, __LINE__);
+#include "info.h"
+
+// Queue log lines as raw records formatted by a background task instead of formatting and writing them in the caller
+// Lines logged before `logging_deferred_start` are still written right away
+// Options: true, false
+// Default: true
+#define LOG_DEFERRED true
+
+#define LOGGING_DEFERRED_RING_SIZE (32)  // Records buffered per core, power of two
+#define LOGGING_DEFERRED_ARGS_LEN (96)   // Bytes of raw arguments kept per record, strings included
+#define LOGGING_DEFERRED_STRING_LEN (24) // Longest `%s` argument kept, longer ones are cut
+#define LOGGING_DEFERRED_DRAIN_MS (10)   // Time between two drains of the rings
+
+// Source files that log, each one names its module with `#define LOG_MODULE <NAME>` next to its `TAG`
+// The name selects the file ID below and the `LOG_LEVEL_<NAME>` ceiling in `info.h`
+typedef enum
+{
+        LOG_FILE_APP_MAIN,
+        LOG_FILE_BUTTON,
+        LOG_FILE_CONTROLLER,
+        LOG_FILE_DEVICE_SETTINGS,
+        LOG_FILE_EEPROM,
+        LOG_FILE_ESPNOW,
+        LOG_FILE_ESPNOW_CHANNEL,
+        LOG_FILE_ESPNOW_DISPATCH,
+        LOG_FILE_ESPNOW_FRAGMENT,
+        LOG_FILE_ESPNOW_RATE,
+        LOG_FILE_ESPNOW_RELIABLE,
+        LOG_FILE_FRAME_POOL,
+        LOG_FILE_JOYSTICK,
+        LOG_FILE_LOGGING,
+        LOG_FILE_RSSI,
+        LOG_FILE_SERIAL_RECORD,
+        LOG_FILE_TELEMETRY,
+        LOG_FILE_MAX,
+} log_file_t;
+
+// Name of every `log_file_t`, stored once instead of a path per call site
+extern const char *const LOG_FILE_STRING[];
+
+// Fixed part of a log call, one per call site, its address identifies the format string
+typedef struct
+{
+        const char *format; // printf format of the message
+        uint16_t line;      // Source line of the call
+        uint8_t level;      // `esp_log_level_t` of the call
+        uint8_t file;       // `log_file_t` of the call
+} logging_site_t;
+
+// Logging statistics, cycles are counted on the calling core
+typedef struct
+{
+        uint32_t records;        // Records queued
+        uint32_t dropped;        // Records lost because the ring of their core was full
+        uint32_t truncated;      // Records whose arguments did not fit
+        uint32_t immediate;      // Lines written by the caller, before the task started or from an interrupt
+        uint32_t written;        // Records formatted and written by the task
+        uint64_t enqueue_cycles; // Cycles spent by callers queueing records
+        uint32_t enqueue_max;    // Longest time to queue one record
+        uint64_t format_cycles;  // Cycles spent formatting and writing records, what callers used to pay
+        uint32_t format_max;     // Longest time to format and write one record
+} logging_stats_t;
+
+// Configuration of the formatting task
+typedef struct
+{
+        uint32_t stack_size;  // Stack size of the task, in bytes
+        UBaseType_t priority; // Priority of the task
+        BaseType_t core;      // Core the task is pinned to
+} logging_config_t;
+
+// Loads default settings of the formatting task
+logging_config_t *logging_default_config(logging_config_t *config);
+
+// Creates the formatting task, log calls are deferred from then on
+esp_err_t logging_deferred_start(const logging_config_t *config);
+
+// Capture the arguments of a log call into the ring of the current core, never formats nor blocks
+void logging_deferred_write(const logging_site_t *site, const char *tag, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+// Copy the logging statistics
+logging_stats_t *logging_get_stats(logging_stats_t *stats);
+
+// Print the logging statistics
+void logging_show_stats(void);
+
+#define LOG_CONCAT_(a, b) a##b
+#define LOG_CONCAT(a, b) LOG_CONCAT_(a, b)
+
+// Ceiling and file ID of the module of the calling file
+#define LOG_MODULE_LEVEL LOG_CONCAT(LOG_LEVEL_, LOG_MODULE)
+#define LOG_MODULE_FILE LOG_CONCAT(LOG_FILE_, LOG_MODULE)
+
+// Constant for every call, calls above the ceiling are removed with their format strings
+#define LOG_ENABLED(esp_level) (LOG_LOCAL_LEVEL >= (esp_level) && LOG_MODULE_LEVEL >= (esp_level))
+
+#if LOG_DEFERRED
+
+#define LOG_AT(esp_level, format, ...)                                                                          \
+        do                                                                                                      \
+        {                                                                                                       \
+                if (LOG_ENABLED(esp_level))                                                                     \
+                {                                                                                               \
+                        static const logging_site_t _log_site = {format, __LINE__, esp_level, LOG_MODULE_FILE}; \
+                        logging_deferred_write(&_log_site, TAG, format, ##__VA_ARGS__);                         \
+                }                                                                                               \
+        } while (0)
+
+#else
+
+#define LOG_AT(esp_level, format, ...)                                                                          \
+        do                                                                                                      \
+        {                                                                                                       \
+                if (LOG_ENABLED(esp_level))                                                                     \
+                        ESP_LOG_LEVEL(esp_level, TAG, format " | \x1b[100m%s:%d\x1b[0m", ##__VA_ARGS__,         \
+                                      LOG_FILE_STRING[LOG_MODULE_FILE], __LINE__);                              \
+        } while (0)
+
+#endif
+
+#define LOG_ERROR(format, ...) LOG_AT(ESP_LOG_ERROR, format, ##__VA_ARGS__)
+#define LOG_WARNING(format, ...) LOG_AT(ESP_LOG_WARN, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) LOG_AT(ESP_LOG_INFO, format, ##__VA_ARGS__)
+#define LOG_VERBOSE(format, ...) LOG_AT(ESP_LOG_VERBOSE, format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) LOG_AT(ESP_LOG_DEBUG, format, ##__VA_ARGS__)
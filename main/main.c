@@ -8,6 +8,9 @@
 
 #include "button.h"
 #include "espnow.h"
+#include "espnow_dispatch.h"
+#include "espnow_channel.h"
+#include "espnow_fragment.h"
 #include "pindef.h"
 #include "rssi.h"
 #include "ws2812.h"
@@ -19,12 +22,37 @@
 #include "eeprom.h"
 #include "device_settings.h"
 #include "dictionary.h"
+#include "controller.h"
+#include "telemetry.h"
+#include "serial_record.h"
 
+#define LOG_MODULE APP_MAIN
 static const char __attribute__((unused)) *TAG = "app_main";
 
 static espnow_send_param_t espnow_send_param;
 static esp_connection_handle_t esp_connection_handle;
 static device_settings_t device_settings;
+static controller_handle_t controller;
+
+// Latency from an input state change to handing its packet to ESP-NOW
+typedef struct
+{
+	uint32_t count;   // Number of input events sent
+	int64_t total_us; // Sum of all latencies
+	int64_t max_us;   // Largest latency
+} input_latency_t;
+
+// Peer close enough to pair, shown on the LED
+// Kept by address, its entry may be evicted and reused while the LED task still shows it
+typedef struct
+{
+	uint8_t mac[ESP_NOW_ETH_ALEN]; // Address of the peer
+	bool valid;                    // A peer is above the pairing threshold
+} nearby_peer_t;
+
+static input_latency_t input_latency;
+static nearby_peer_t nearby_peer;                                    // Moved by the dispatcher task, read by the LED task
+static portMUX_TYPE nearby_peer_lock = portMUX_INITIALIZER_UNLOCKED; // Guards `nearby_peer`
 
 void motor_controller_print_stat(motor_group_stat_pkt_t *motor_stat)
 {
@@ -37,6 +65,70 @@ void motor_controller_print_stat(motor_group_stat_pkt_t *motor_stat)
 			 motor_stat->delta_velocity);
 }
 
+void print_telemetry_sample(const telemetry_sample_t *sample)
+{
+	if (SERIAL_BINARY_RECORDS)
+	{
+		serial_record_write_motor_stat(sample->mac, &sample->stat, sample->time_us);
+		return;
+	}
+	motor_group_stat_pkt_t motor_stat = sample->stat;
+	motor_controller_print_stat(&motor_stat);
+}
+
+void nearby_peer_changed(esp_peer_handle_t *peer, int rssi, bool above, void *arg)
+{
+	portENTER_CRITICAL(&nearby_peer_lock);
+	if (above)
+	{
+		memcpy(nearby_peer.mac, peer->mac, ESP_NOW_ETH_ALEN);
+		nearby_peer.valid = true;
+	}
+	else if (nearby_peer.valid && memcmp(nearby_peer.mac, peer->mac, ESP_NOW_ETH_ALEN) == 0)
+	{
+		nearby_peer.valid = false;
+	}
+	portEXIT_CRITICAL(&nearby_peer_lock);
+}
+
+// RSSI heard from each transmitter since its last record, rssi_task only
+// Snapshots come every 10 ms, one record per transmitter each would take most of the console
+static rssi_stat_t rssi_records[RSSI_TABLE_SIZE];
+static size_t rssi_records_count;
+
+// Fold a snapshot into the record of its transmitter
+static void rssi_record_add(const rssi_stat_t *stat)
+{
+	size_t i = 0;
+	while (i < rssi_records_count && memcmp(rssi_records[i].recv_mac, stat->recv_mac, ESP_NOW_ETH_ALEN) != 0)
+		i++;
+	if (i == RSSI_TABLE_SIZE)
+		return;
+	if (i == rssi_records_count)
+	{
+		rssi_records[rssi_records_count++] = *stat;
+		return;
+	}
+
+	rssi_stat_t *record = &rssi_records[i];
+	record->mean = ((int32_t)record->mean * (int32_t)record->count + (int32_t)stat->mean * (int32_t)stat->count) / (int32_t)(record->count + stat->count);
+	record->count += stat->count;
+	if (stat->min < record->min)
+		record->min = stat->min;
+	if (stat->max > record->max)
+		record->max = stat->max;
+	record->last = stat->last;
+	record->time_us = stat->time_us;
+}
+
+static void rssi_record_flush(void)
+{
+	for (size_t i = 0; i < rssi_records_count; i++)
+		serial_record_write_rssi(rssi_records[i].recv_mac, rssi_records[i].count, rssi_records[i].min, rssi_records[i].max,
+								 rssi_records[i].mean, rssi_records[i].last, rssi_records[i].time_us);
+	rssi_records_count = 0;
+}
+
 void rssi_task()
 {
 	ws2812_hsv_t hsv = {.h = RGB_LED_HUE, .s = RGB_LED_SATURATION, .v = 0};
@@ -46,46 +138,74 @@ void rssi_task()
 	ws2812_set_hsv(&ws2812_handle, &hsv);
 	ws2812_update(&ws2812_handle);
 
-	QueueHandle_t rssi_event_queue = rssi_init();
 	uint8_t countdown = 0;
-	uint8_t ping_count = 0;
-	const uint8_t ping_reset = 30;
+	const uint8_t countdown_reset = 90;
+	int nearby_rssi = 0; // Last RSSI heard from the nearby peer
+	int64_t next_rssi_record_us = esp_timer_get_time() + SERIAL_RECORD_RSSI_INTERVAL_MS * 1000;
+	uint32_t rtt_reported[MAX_CONNECTED_CARS] = {0};
+	esp_peer_handle_t *rtt_peers[MAX_CONNECTED_CARS] = {NULL};
 	for (;;)
 	{
-		if (ping_count)
-			ping_count--;
-		else
+		rssi_stat_t rssi_stats[RSSI_TABLE_SIZE];
+		size_t num_rssi_stats = rssi_snapshot(rssi_stats, RSSI_TABLE_SIZE);
+		nearby_peer_t nearby;
+		portENTER_CRITICAL(&nearby_peer_lock);
+		nearby = nearby_peer;
+		portEXIT_CRITICAL(&nearby_peer_lock);
+		for (size_t i = 0; i < num_rssi_stats; i++)
 		{
-			ping_count = ping_reset;
-			esp_connection_send_heartbeat(&esp_connection_handle);
-			// espnow_send_text(&espnow_send_param, "ping");
-			// esp_connection_show_entries(&esp_connection_handle);
+			// print_rssi_stat(&rssi_stats[i]);
+			if (SERIAL_BINARY_RECORDS && rssi_stats[i].count)
+				rssi_record_add(&rssi_stats[i]);
+			esp_connection_post_rssi(&esp_connection_handle, &rssi_stats[i]);
+			// A nearby peer that goes quiet, evicted or not, fades out with the countdown
+			if (nearby.valid && memcmp(nearby.mac, rssi_stats[i].recv_mac, ESP_NOW_ETH_ALEN) == 0)
+			{
+				countdown = countdown_reset;
+				nearby_rssi = rssi_stats[i].mean;
+			}
 		}
-		rssi_event_t rssi_event;
-		while (xQueueReceive(rssi_event_queue, &rssi_event, 0))
+
+		if (SERIAL_BINARY_RECORDS && esp_timer_get_time() >= next_rssi_record_us)
 		{
-			// print_rssi_event(&rssi_event);
-			esp_connection_update_rssi(&esp_connection_handle, &rssi_event);
+			rssi_record_flush();
+			next_rssi_record_us += SERIAL_RECORD_RSSI_INTERVAL_MS * 1000;
+		}
 
-			const int rssi_min = MIN_RSSI_TO_INITIATE_CONNECTION;
-			if (rssi_event.rssi > rssi_min)
+		// Report every new round trip of the connected cars
+		if (SERIAL_BINARY_RECORDS)
+		{
+			esp_peer_handle_t *fleet[MAX_CONNECTED_CARS];
+			size_t fleet_size = esp_connection_get_fleet(&esp_connection_handle, fleet, MAX_CONNECTED_CARS);
+			for (size_t i = 0; i < fleet_size; i++)
 			{
-				countdown = ping_reset * 3;
-				float led_volume = map(rssi_event.rssi, 0, rssi_min, 50, 0);
-				led_volume = constrain(led_volume, 0, 100);
-				hsv.v = led_volume;
-				ws2812_set_hsv(&ws2812_handle, &hsv);
-				ws2812_update(&ws2812_handle);
+				if (rtt_peers[i] != fleet[i])
+				{
+					rtt_peers[i] = fleet[i];
+					rtt_reported[i] = fleet[i]->rtt.count;
+				}
+				if (fleet[i]->rtt.count != rtt_reported[i])
+				{
+					rtt_reported[i] = fleet[i]->rtt.count;
+					serial_record_write_rtt(fleet[i]->mac, fleet[i]->rtt.last_us, esp_timer_get_time());
+				}
 			}
 		}
-		if (countdown)
+
+		uint8_t led_value;
+		if (nearby.valid && countdown)
+		{
 			countdown--;
+			const int rssi_min = MIN_RSSI_TO_INITIATE_CONNECTION;
+			led_value = constrain(map(nearby_rssi, 0, rssi_min, 50, 0), 0, 100);
+		}
 		else
+			led_value = RGB_LED_VALUE * esp_connection_handle.remote_connected;
+
+		// The LED strip is only written when the brightness moves
+		if (led_value != hsv.v)
 		{
-			if (esp_connection_handle.remote_connected)
-				hsv.v = RGB_LED_VALUE * esp_connection_handle.remote_connected;
-			else
-				hsv.v = 0;
+			hsv.v = led_value;
 			ws2812_set_hsv(&ws2812_handle, &hsv);
 			ws2812_update(&ws2812_handle);
 		}
@@ -93,15 +213,6 @@ void rssi_task()
 	}
 }
 
-void ping_task()
-{
-	for (;;)
-	{
-		esp_connection_send_heartbeat(&esp_connection_handle);
-		vTaskDelay(pdMS_TO_TICKS(300));
-	}
-}
-
 void power_switch_task()
 {
 	// int32_t elapsed_time = 0;
@@ -112,14 +223,89 @@ void power_switch_task()
 		if (SHOW_CONNECTION_STATUS)
 		{
 			esp_connection_show_entries(&esp_connection_handle);
+			espnow_show_stats();
+			espnow_dispatch_show_stats();
+			telemetry_show_stats();
+			serial_record_show_stats();
+			logging_show_stats();
+			LOG_INFO("Input latency, events: %lu, avg: %lld us, max: %lld us",
+					 input_latency.count, input_latency.count ? input_latency.total_us / input_latency.count : 0, input_latency.max_us);
 			print_joystick_stat();
 		}
 		vTaskDelay(pdMS_TO_TICKS(3000));
 	}
 }
 
+void handle_input_event(button_queue_event_t *queue_event, const char *source)
+{
+	button_event_t *button_event = &queue_event->event;
+	LOG_INFO("%s event: %-24s is now %-16s",
+			 source,
+			 get_from_dictionary(button_event->pin),
+			 BUTTON_STATE_STRING[button_event->new_state]);
+	if (SERIAL_BINARY_RECORDS)
+		serial_record_write_input_event(button_event->pin, button_event->new_state, esp_timer_get_time() - queue_event->time_us, queue_event->time_us);
+
+	controller_update(&controller, queue_event);
+}
+
+void send_controller_state(void)
+{
+	bool changed = controller.changed;
+	int64_t changed_time_us = controller.changed_time_us;
+	remote_controller_state_pkt_t snapshot;
+	controller_take_snapshot(&controller, &snapshot);
+
+	esp_err_t ret;
+	esp_peer_handle_t *fleet[MAX_CONNECTED_CARS];
+	size_t fleet_size = esp_connection_get_fleet(&esp_connection_handle, fleet, MAX_CONNECTED_CARS);
+	if (fleet_size)
+	{
+		ret = espnow_send_controller_state_fanout(fleet, fleet_size, &snapshot);
+	}
+	else
+	{
+		espnow_dispatch_get_reply_param(&espnow_send_param);
+		ret = espnow_send_controller_state(&espnow_send_param, &snapshot);
+	}
+	ESP_ERROR_CHECK_WITHOUT_ABORT(ret);
+
+	if (!changed)
+		return;
+
+	int64_t latency_us = esp_timer_get_time() - changed_time_us;
+	input_latency.count++;
+	input_latency.total_us += latency_us;
+	if (latency_us > input_latency.max_us)
+		input_latency.max_us = latency_us;
+}
+
+void handle_motor_stat(esp_peer_handle_t *peer, espnow_packet_type_t type, const uint8_t *payload, size_t len)
+{
+	if (len == sizeof(motor_group_stat_pkt_t))
+	{
+		// Formatting is left to the telemetry task, the dispatcher only stamps and stores the sample
+		motor_group_stat_pkt_t motor_stat;
+		memcpy(&motor_stat, payload, sizeof(motor_group_stat_pkt_t));
+		telemetry_push(peer->mac, &motor_stat, esp_timer_get_time());
+	}
+	// print_mem(payload, len);
+}
+
+void handle_config(esp_peer_handle_t *peer, espnow_packet_type_t type, const uint8_t *payload, size_t len)
+{
+	LOG_INFO("Config from peer " MACSTR ", len: %d", MAC2STR(peer->mac), len);
+}
+
 void app_main(void)
 {
+	if (LOG_DEFERRED)
+	{
+		logging_config_t logging_config;
+		logging_default_config(&logging_config);
+		ESP_ERROR_CHECK(logging_deferred_start(&logging_config));
+	}
+
 	// Initialize NVS
 	esp_err_t ret = nvs_flash_init();
 	if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND)
@@ -137,14 +323,17 @@ void app_main(void)
 	espnow_wifi_config_t espnow_config;
 	espnow_wifi_default_config(&espnow_config);
 	espnow_wifi_init(&espnow_config);
+	rssi_init(MIN_RSSI_TO_INITIATE_CONNECTION);
 	espnow_get_default_send_param(&espnow_send_param);
 	esp_connection_handle_init(&esp_connection_handle);
 	esp_connection_handle_connect_to_device_settings(&esp_connection_handle, &device_settings);
-	esp_connection_set_peer_limit(&esp_connection_handle, 1);
+	esp_connection_set_peer_limit(&esp_connection_handle, MAX_CONNECTED_CARS);
+	QueueSetHandle_t main_queue_set = xQueueCreateSet(2 * BUTTON_QUEUE_DEPTH);
 	QueueHandle_t espnow_event_queue = espnow_init(&espnow_config, &esp_connection_handle);
 	esp_connection_enable_broadcast(&esp_connection_handle);
 
-	esp_connection_mac_add_to_entry(&esp_connection_handle, device_settings.remote_conn_mac);
+	for (size_t i = 0; i < DEVICE_SETTINGS_MAX_PEERS; i++)
+		esp_connection_mac_add_to_entry(&esp_connection_handle, device_settings.remote_conn_mac[i]);
 	espnow_get_default_send_param(&espnow_send_param);
 
 	ret = espnow_send_text(&espnow_send_param, "device init");
@@ -157,6 +346,8 @@ void app_main(void)
 	}
 
 	QueueHandle_t button_event_queue = button_init();
+	if (xQueueAddToSet(button_event_queue, main_queue_set) != pdPASS)
+		LOG_ERROR("Failed to add button queue to queue set");
 	button_register(JOYSTICK_SHIELD_BUTTON_A, BUTTON_CONFIG_ACTIVE_LOW);
 	button_register(JOYSTICK_SHIELD_BUTTON_B, BUTTON_CONFIG_ACTIVE_LOW);
 	button_register(JOYSTICK_SHIELD_BUTTON_C, BUTTON_CONFIG_ACTIVE_LOW);
@@ -172,103 +363,85 @@ void app_main(void)
 	SET_DICTIONARY_BY_NAME(JOYSTICK_SHIELD_BUTTON_F);
 	SET_DICTIONARY_BY_NAME(JOYSTICK_SHIELD_BUTTON_K);
 
+	controller_init(&controller);
+	controller_register_button(&controller, JOYSTICK_SHIELD_BUTTON_A);
+	controller_register_button(&controller, JOYSTICK_SHIELD_BUTTON_B);
+	controller_register_button(&controller, JOYSTICK_SHIELD_BUTTON_C);
+	controller_register_button(&controller, JOYSTICK_SHIELD_BUTTON_D);
+	controller_register_button(&controller, JOYSTICK_SHIELD_BUTTON_E);
+	controller_register_button(&controller, JOYSTICK_SHIELD_BUTTON_F);
+	controller_register_button(&controller, JOYSTICK_SHIELD_BUTTON_K);
+
 	QueueHandle_t joystick_event_queue = joystick_init();
+	if (xQueueAddToSet(joystick_event_queue, main_queue_set) != pdPASS)
+		LOG_ERROR("Failed to add joystick queue to queue set");
 	joystick_register(GPIO_BUTTON_UP, GPIO_BUTTON_DOWN, JOYSTICK_SHIELD_JOYSTICK_Y, 0.5);
 	joystick_register(GPIO_BUTTON_RIGHT, GPIO_BUTTON_LEFT, JOYSTICK_SHIELD_JOYSTICK_X, 0.02);
 	joystick_calibrate();
+	controller_register_axes(&controller, JOYSTICK_SHIELD_JOYSTICK_X, JOYSTICK_SHIELD_JOYSTICK_Y);
 	SET_DICTIONARY_BY_NAME(GPIO_BUTTON_RIGHT);
 	SET_DICTIONARY_BY_NAME(GPIO_BUTTON_LEFT);
 	SET_DICTIONARY_BY_NAME(GPIO_BUTTON_UP);
 	SET_DICTIONARY_BY_NAME(GPIO_BUTTON_DOWN);
 
+	esp_connection_subscribe_rssi(&esp_connection_handle, MIN_RSSI_TO_INITIATE_CONNECTION, 3, nearby_peer_changed, NULL);
 	xTaskCreate(rssi_task, "rssi_task", 4096, NULL, 4, NULL);
-	xTaskCreate(ping_task, "ping_task", 4096, NULL, 4, NULL);
 	xTaskCreate(power_switch_task, "power_switch_task", 4096, NULL, 4, NULL);
 
-	esp_connection_set_unique_peer_mac(&esp_connection_handle, device_settings.remote_conn_mac);
+	for (size_t i = 0; i < device_settings_count_macs(&device_settings); i++)
+		esp_connection_set_unique_peer_mac(&esp_connection_handle, device_settings.remote_conn_mac[i]);
+
+	espnow_dispatch_register(ESPNOW_PACKET_TYPE_MOTOR_STAT, handle_motor_stat);
+	espnow_dispatch_register(ESPNOW_PACKET_TYPE_CONFIG, handle_config);
+	espnow_channel_init(&esp_connection_handle);
+	espnow_fragment_init();
+	espnow_channel_request_scan();
+	telemetry_config_t telemetry_config;
+	telemetry_default_config(&telemetry_config);
+	telemetry_config.sink = print_telemetry_sample;
+	ESP_ERROR_CHECK(telemetry_start(&telemetry_config));
+	if (SERIAL_BINARY_RECORDS)
+	{
+		// Records are queued from here on, the input path never waits for the console
+		serial_record_config_t serial_record_config;
+		serial_record_default_config(&serial_record_config);
+		ESP_ERROR_CHECK(serial_record_start(&serial_record_config));
+	}
+	espnow_dispatch_config_t dispatch_config;
+	espnow_dispatch_default_config(&dispatch_config);
+	ESP_ERROR_CHECK(espnow_dispatch_start(&dispatch_config, espnow_event_queue, &esp_connection_handle));
 
+	int64_t next_state_us = esp_timer_get_time();
 	while (true)
 	{
-		button_event_t button_event;
+		int64_t now_us = esp_timer_get_time();
 
-		while (xQueueReceive(joystick_event_queue, &button_event, 0))
+		// Refresh the controller state while connected, so a lost snapshot is repaired without retransmission
+		if (now_us >= next_state_us)
 		{
-			LOG_INFO("Joystick event: %-17s is now %-16s",
-					 get_from_dictionary(button_event.pin),
-					 BUTTON_STATE_STRING[button_event.new_state]);
-
-			esp_err_t ret;
-			ret = espnow_send_data(&espnow_send_param, ESPNOW_PACKET_TYPE_TEXT, &button_event, sizeof(button_event));
-			ESP_ERROR_CHECK_WITHOUT_ABORT(ret);
+			if (esp_connection_handle.remote_connected)
+				send_controller_state();
+			next_state_us = now_us + CONTROLLER_STATE_INTERVAL_MS * 1000;
 		}
 
-		while (xQueueReceive(button_event_queue, &button_event, 0))
-		{
-			LOG_INFO("Button event: %-24s is now %-16s",
-					 get_from_dictionary(button_event.pin),
-					 BUTTON_STATE_STRING[button_event.new_state]);
-
-			esp_err_t ret;
-			ret = espnow_send_data(&espnow_send_param, ESPNOW_PACKET_TYPE_TEXT, &button_event, sizeof(button_event));
-			ESP_ERROR_CHECK_WITHOUT_ABORT(ret);
-		}
+		// Sleep until any input queue has work or the next snapshot is due
+		TickType_t wait_ticks = pdMS_TO_TICKS((next_state_us - now_us + 999) / 1000);
+		QueueSetMemberHandle_t member = xQueueSelectFromSet(main_queue_set, wait_ticks);
+		if (member == NULL)
+			continue;
 
-		espnow_event_t espnow_evt;
-		while (xQueueReceive(espnow_event_queue, &espnow_evt, 0))
+		if (member == joystick_event_queue || member == button_event_queue)
 		{
-			espnow_packet_t *recv_data = NULL;
-			switch (espnow_evt.id)
-			{
-			case ESPNOW_SEND_CB:
-				espnow_event_send_cb_t *send_cb = &espnow_evt.info.send_cb;
-				if (send_cb->status != ESP_NOW_SEND_SUCCESS)
-				{
-					LOG_WARNING("Send data to peer " MACSTR " failed", MAC2STR(send_cb->mac_addr));
-				}
-				else
-				{
-					LOG_VERBOSE("Send data to peer " MACSTR " success", MAC2STR(send_cb->mac_addr));
-				}
-				break;
-			case ESPNOW_RECV_CB:
-				espnow_event_recv_cb_t *recv_cb = &espnow_evt.info.recv_cb;
-				if (!(recv_data = espnow_data_parse(recv_data, recv_cb)))
-				{
-					LOG_WARNING("bad data packet from peer " MACSTR, MAC2STR(recv_cb->mac_addr));
-					free(recv_cb->data);
-					break;
-				}
-
-				esp_peer_handle_t *peer = esp_connection_mac_add_to_entry(&esp_connection_handle, recv_cb->mac_addr);
-				espnow_get_send_param(&espnow_send_param, peer);
-				esp_peer_process_received(peer, recv_data);
-
-				// LOG_WARNING("peer " MACSTR " is %s", MAC2STR(recv_cb->mac_addr), recv_data->broadcast ? "BROADCAST": "UNICAST");
-
-				if (recv_data->type == ESPNOW_PACKET_TYPE_MOTOR_STAT)
-				{
-					if (recv_data->len == sizeof(motor_group_stat_pkt_t))
-					{
-						static motor_group_stat_pkt_t motor_stat;
-						memccpy(&motor_stat, recv_data->payload, sizeof(motor_group_stat_pkt_t), recv_data->len);
-						motor_controller_print_stat(&motor_stat);
-					}
-
-					// print_mem(recv_data->payload, recv_data->len);
-				}
-
-				// if (recv_data->type != ESPNOW_PARAM_TYPE_ACK)
-				// espnow_reply(&espnow_send_param);
+			button_queue_event_t queue_event;
+			if (xQueueReceive(member, &queue_event, 0))
+				handle_input_event(&queue_event, member == joystick_event_queue ? "Joystick" : "Button");
 
-				free(recv_cb->data);
-				break;
-			default:
-				LOG_ERROR("Callback type error: %d", espnow_evt.id);
-				break;
+			// Coalesce every pending input event, a chord is sent as one snapshot
+			if (uxQueueMessagesWaiting(joystick_event_queue) == 0 && uxQueueMessagesWaiting(button_event_queue) == 0)
+			{
+				send_controller_state();
+				next_state_us = esp_timer_get_time() + CONTROLLER_STATE_INTERVAL_MS * 1000;
 			}
 		}
-
-		esp_connection_handle_update(&esp_connection_handle);
-		vTaskDelay(1);
 	}
-}
\ No newline at end of file
+}
@@ -24,12 +24,31 @@ typedef struct
         float delta_velocity;                 // Difference in speed
 } motor_group_stat_pkt_t;
 
-// `NOT IMPLEMENTED`
+#define REMOTE_CONTROLLER_MAX_BUTTONS (8) // Number of buttons that fit in one controller state packet
+
+// Full controller state, every packet is a self-contained snapshot
+// Button id `n` is stored at bits [2n+1:2n] of `buttons` and `press_count`
+typedef struct
+{
+        uint16_t seq_num;      // Sequence number of the snapshot
+        uint16_t buttons;      // `button_state_t` of each button, 2 bits per button
+        uint16_t press_count;  // Number of presses of each button modulo 4, 2 bits per button
+        int8_t axis_x, axis_y; // Joystick position, from -127 (left, down) to 127 (right, up)
+} __packed remote_controller_state_pkt_t;
+
+#define REMOTE_CONTROLLER_FIELD_BUTTONS (1 << 0)     // `buttons` changed
+#define REMOTE_CONTROLLER_FIELD_PRESS_COUNT (1 << 1) // `press_count` changed
+#define REMOTE_CONTROLLER_FIELD_AXIS_X (1 << 2)      // `axis_x` changed
+#define REMOTE_CONTROLLER_FIELD_AXIS_Y (1 << 3)      // `axis_y` changed
+
+// Controller state as the changes against an earlier snapshot acknowledged by the peer
 typedef struct
 {
-        voltage_mv_t pot_x, pot_y;                                      // `NOT IMPLEMENTED`
-        button_state_t a : 2, b : 2, c : 2, d : 2, e : 2, f : 2, g : 2; // `NOT IMPLEMENTED`
-} __packed remote_button_data_t;
+        uint16_t seq_num;    // Sequence number of the snapshot
+        uint8_t base_offset; // `seq_num` minus the sequence number of the base snapshot
+        uint8_t changed;     // `REMOTE_CONTROLLER_FIELD_*` bits of the fields that follow
+        uint8_t fields[0];   // Changed fields, in the order of their bits
+} __packed remote_controller_delta_pkt_t;
 
 // `NOT IMPLEMENTED`
 typedef struct
@@ -1,12 +1,67 @@
-
 #include "rssi.h"
 
+#define LOG_MODULE RSSI
 static const char *TAG = "rssi";
 
-QueueHandle_t rssi_queue;
+enum
+{
+        RSSI_SLOT_FREE,     // Slot holds no transmitter
+        RSSI_SLOT_CLAIMING, // MAC address is being written
+        RSSI_SLOT_ACTIVE,   // Slot tracks `mac`
+};
+
+static rssi_slot_t rssi_table[RSSI_TABLE_SIZE];
+static int rssi_admit;
+static _Atomic uint32_t rssi_accepted, rssi_filtered, rssi_table_full;
+static _Atomic uint32_t rssi_load_frames, rssi_load_bytes;
+static _Atomic int32_t rssi_load_rssi_sum;
+
+// Reader side copy of the totals at the previous snapshot, owned by the snapshot task
+static uint32_t rssi_snapshot_generation[RSSI_TABLE_SIZE];
+static uint32_t rssi_snapshot_count[RSSI_TABLE_SIZE];
+static int64_t rssi_snapshot_sum[RSSI_TABLE_SIZE];
+
+static rssi_slot_t *rssi_table_find(const uint8_t *mac)
+{
+        for (size_t i = 0; i < RSSI_TABLE_SIZE; i++)
+        {
+                rssi_slot_t *slot = &rssi_table[i];
+                if (atomic_load_explicit(&slot->state, memory_order_acquire) == RSSI_SLOT_ACTIVE && memcmp(slot->mac, mac, ESP_NOW_ETH_ALEN) == 0)
+                        return slot;
+        }
+        return NULL;
+}
+
+static rssi_slot_t *rssi_table_claim(const uint8_t *mac, bool watched)
+{
+        for (size_t i = 0; i < RSSI_TABLE_SIZE; i++)
+        {
+                rssi_slot_t *slot = &rssi_table[i];
+                uint8_t expected = RSSI_SLOT_FREE;
+                if (!atomic_compare_exchange_strong(&slot->state, &expected, RSSI_SLOT_CLAIMING))
+                        continue;
+
+                memcpy(slot->mac, mac, ESP_NOW_ETH_ALEN);
+                slot->watched = watched;
+                slot->total_count = 0;
+                slot->total_sum = 0;
+                slot->time_us = esp_timer_get_time();
+                atomic_store(&slot->reset, true);
+                slot->generation++;
+                atomic_store_explicit(&slot->state, RSSI_SLOT_ACTIVE, memory_order_release);
+                return slot;
+        }
+        return NULL;
+}
 
 static void wifi_promiscuous_rx_cb(void *buf, wifi_promiscuous_pkt_type_t type)
 {
+        const wifi_promiscuous_pkt_t *promiscuous_packet = (wifi_promiscuous_pkt_t *)buf;
+
+        // Every frame heard takes airtime from ESP-NOW, whoever sent it
+        atomic_fetch_add_explicit(&rssi_load_frames, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&rssi_load_bytes, promiscuous_packet->rx_ctrl.sig_len, memory_order_relaxed);
+        atomic_fetch_add_explicit(&rssi_load_rssi_sum, promiscuous_packet->rx_ctrl.rssi, memory_order_relaxed);
 
         // All espnow traffic uses action frames which are a subtype of the management frames so filter out everything else.
         if (type != WIFI_PKT_MGMT)
@@ -15,41 +70,254 @@ static void wifi_promiscuous_rx_cb(void *buf, wifi_promiscuous_pkt_type_t type)
         static const uint8_t ACTION_SUBTYPE = 0xd0;
         // static const uint8_t ESPRESSIF_OUI[] = {0x18, 0xfe, 0x34};
 
-        const wifi_promiscuous_pkt_t *promiscuous_packet = (wifi_promiscuous_pkt_t *)buf;
         const wifi_ieee80211_packet_t *ieee80211_packet = (wifi_ieee80211_packet_t *)promiscuous_packet->payload;
         const wifi_ieee80211_mac_hdr_t *hdr = &ieee80211_packet->hdr;
 
         // Only continue processing if this is an action frame containing the Espressif OUI.
-        if ((ACTION_SUBTYPE == (hdr->frame_ctrl & 0xFF)))
-        {
-                // print_mem(hdr, sizeof(wifi_ieee80211_mac_hdr_t));
-                rssi_event_t event = {
-                    .rssi = promiscuous_packet->rx_ctrl.rssi,
-                    .time_us = esp_timer_get_time()};
-                memcpy(event.recv_mac, hdr->addr2, ESP_NOW_ETH_ALEN);
+        if ((ACTION_SUBTYPE != (hdr->frame_ctrl & 0xFF)))
+                return;
 
-                if (xQueueSend(rssi_queue, &event, 0) != pdTRUE)
+        // print_mem(hdr, sizeof(wifi_ieee80211_mac_hdr_t));
+        int rssi = promiscuous_packet->rx_ctrl.rssi;
+        rssi_slot_t *slot = rssi_table_find(hdr->addr2);
+        if (slot == NULL)
+        {
+                // Strangers are only worth a slot when they are close enough to pair
+                if (rssi <= rssi_admit)
+                {
+                        atomic_fetch_add_explicit(&rssi_filtered, 1, memory_order_relaxed);
+                        return;
+                }
+                slot = rssi_table_claim(hdr->addr2, false);
+                if (slot == NULL)
                 {
-                        LOG_WARNING("Wi-Fi callback failed to send queue");
+                        atomic_fetch_add_explicit(&rssi_table_full, 1, memory_order_relaxed);
+                        return;
                 }
         }
+
+        uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+        atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        if (atomic_exchange_explicit(&slot->reset, false, memory_order_relaxed))
+        {
+                slot->min = rssi;
+                slot->max = rssi;
+        }
+        if (rssi < slot->min)
+                slot->min = rssi;
+        if (rssi > slot->max)
+                slot->max = rssi;
+        slot->last = rssi;
+        slot->total_count++;
+        slot->total_sum += rssi;
+        slot->time_us = esp_timer_get_time();
+        atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+        atomic_fetch_add_explicit(&rssi_accepted, 1, memory_order_relaxed);
 }
 
 // call after `esp_wifi_init`
-QueueHandle_t rssi_init(void)
+esp_err_t rssi_init(int admit_rssi)
 {
+        rssi_admit = admit_rssi;
         ESP_ERROR_CHECK(esp_wifi_set_promiscuous(true));
         ESP_ERROR_CHECK(esp_wifi_set_promiscuous_rx_cb(&wifi_promiscuous_rx_cb));
-        rssi_queue = xQueueCreate(RSSI_QUEUE_SIZE, sizeof(rssi_event_t));
-        if (rssi_queue == NULL)
+        return ESP_OK;
+}
+
+esp_err_t rssi_watch(const uint8_t *mac)
+{
+        if (mac == NULL)
+        {
+                LOG_ERROR("NULL pointer, mac=0x%X", (uintptr_t)mac);
+                return ESP_ERR_INVALID_ARG;
+        }
+
+        rssi_slot_t *slot = rssi_table_find(mac);
+        if (slot != NULL)
+        {
+                slot->watched = true;
+                return ESP_OK;
+        }
+        if (rssi_table_claim(mac, true) == NULL)
+        {
+                LOG_WARNING("RSSI table full, cannot watch " MACSTR, MAC2STR(mac));
+                return ESP_ERR_NO_MEM;
+        }
+        return ESP_OK;
+}
+
+size_t rssi_snapshot(rssi_stat_t *stats, size_t max_stats)
+{
+        if (stats == NULL)
+        {
+                LOG_ERROR("NULL pointer, stats=0x%X", (uintptr_t)stats);
+                return 0;
+        }
+
+        size_t num_stats = 0;
+        int64_t now_us = esp_timer_get_time();
+        for (size_t i = 0; i < RSSI_TABLE_SIZE && num_stats < max_stats; i++)
         {
-                LOG_ERROR("Failed to create queue");
+                rssi_slot_t *slot = &rssi_table[i];
+                if (atomic_load_explicit(&slot->state, memory_order_acquire) != RSSI_SLOT_ACTIVE)
+                        continue;
+
+                rssi_slot_t copy;
+                uint32_t seq_begin, seq_end;
+                do
+                {
+                        seq_begin = atomic_load_explicit(&slot->seq, memory_order_acquire);
+                        memcpy(copy.mac, slot->mac, ESP_NOW_ETH_ALEN);
+                        copy.generation = slot->generation;
+                        copy.total_count = slot->total_count;
+                        copy.total_sum = slot->total_sum;
+                        copy.min = slot->min;
+                        copy.max = slot->max;
+                        copy.last = slot->last;
+                        copy.time_us = slot->time_us;
+                        atomic_thread_fence(memory_order_acquire);
+                        seq_end = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+                } while ((seq_begin & 1) || seq_begin != seq_end);
+
+                // The slot went to another transmitter since the previous snapshot
+                if (copy.generation != rssi_snapshot_generation[i])
+                {
+                        rssi_snapshot_generation[i] = copy.generation;
+                        rssi_snapshot_count[i] = 0;
+                        rssi_snapshot_sum[i] = 0;
+                }
+
+                uint32_t count = copy.total_count - rssi_snapshot_count[i];
+                if (count == 0)
+                {
+                        // A silent stranger gives its slot back, the callback does not touch it any more
+                        if (!slot->watched && now_us - copy.time_us > RSSI_STALE_US)
+                                atomic_store_explicit(&slot->state, RSSI_SLOT_FREE, memory_order_release);
+                        continue;
+                }
+
+                rssi_stat_t *stat = &stats[num_stats++];
+                memcpy(stat->recv_mac, copy.mac, ESP_NOW_ETH_ALEN);
+                stat->count = count;
+                stat->min = copy.min;
+                stat->max = copy.max;
+                stat->last = copy.last;
+                stat->mean = (copy.total_sum - rssi_snapshot_sum[i]) / count;
+                stat->time_us = copy.time_us;
+                rssi_snapshot_count[i] = copy.total_count;
+                rssi_snapshot_sum[i] = copy.total_sum;
+                atomic_store_explicit(&slot->reset, true, memory_order_relaxed);
+        }
+        return num_stats;
+}
+
+rssi_capture_stats_t *rssi_get_capture_stats(rssi_capture_stats_t *stats)
+{
+        if (stats == NULL)
+        {
+                LOG_ERROR("NULL pointer, stats=0x%X", (uintptr_t)stats);
+                return NULL;
+        }
+        stats->accepted = atomic_load(&rssi_accepted);
+        stats->filtered = atomic_load(&rssi_filtered);
+        stats->table_full = atomic_load(&rssi_table_full);
+        return stats;
+}
+
+rssi_channel_load_t *rssi_take_channel_load(rssi_channel_load_t *load)
+{
+        if (load == NULL)
+        {
+                LOG_ERROR("NULL pointer, load=0x%X", (uintptr_t)load);
                 return NULL;
         }
-        return rssi_queue;
+        load->frames = atomic_exchange(&rssi_load_frames, 0);
+        load->bytes = atomic_exchange(&rssi_load_bytes, 0);
+        load->rssi_sum = atomic_exchange(&rssi_load_rssi_sum, 0);
+        return load;
+}
+
+void print_rssi_stat(rssi_stat_t *stat)
+{
+        LOG_INFO("RSSI stat: addr = " MACSTR ", frames: %lu, RSSI mean: %d, min: %d, max: %d", MAC2STR(stat->recv_mac), stat->count, stat->mean, stat->min, stat->max);
+}
+
+void rssi_filter_reset(rssi_filter_t *filter)
+{
+        if (filter == NULL)
+        {
+                LOG_ERROR("NULL pointer, filter=0x%X", (uintptr_t)filter);
+                return;
+        }
+        memset(filter, 0, sizeof(rssi_filter_t));
+}
+
+int rssi_filter_update(rssi_filter_t *filter, int rssi)
+{
+        if (filter == NULL)
+        {
+                LOG_ERROR("NULL pointer, filter=0x%X", (uintptr_t)filter);
+                return rssi;
+        }
+
+        filter->window[filter->next] = rssi;
+        filter->next = (filter->next + 1) % RSSI_FILTER_MEDIAN_SIZE;
+        if (filter->count < RSSI_FILTER_MEDIAN_SIZE)
+                filter->count++;
+
+        // Insertion sort, the window is only a few samples
+        int8_t sorted[RSSI_FILTER_MEDIAN_SIZE];
+        for (size_t i = 0; i < filter->count; i++)
+        {
+                size_t j = i;
+                for (; j > 0 && sorted[j - 1] > filter->window[i]; j--)
+                        sorted[j] = sorted[j - 1];
+                sorted[j] = filter->window[i];
+        }
+        int32_t median = (int32_t)sorted[filter->count / 2] << RSSI_FILTER_FRAC_BITS;
+
+        // Until the window is full the median of the few samples is all there is, the average starts from it
+        if (filter->count < RSSI_FILTER_MEDIAN_SIZE)
+        {
+                filter->mean = median;
+                filter->variance = 0;
+                return rssi_filter_get(filter);
+        }
+
+        int32_t error = median - filter->mean;
+        filter->mean += error >> RSSI_FILTER_EWMA_SHIFT;
+        int32_t square = ((int64_t)error * error) >> RSSI_FILTER_FRAC_BITS;
+        filter->variance += (square - filter->variance) >> RSSI_FILTER_EWMA_SHIFT;
+        return rssi_filter_get(filter);
+}
+
+bool rssi_filter_is_ready(const rssi_filter_t *filter)
+{
+        if (filter == NULL)
+        {
+                LOG_ERROR("NULL pointer, filter=0x%X", (uintptr_t)filter);
+                return false;
+        }
+        return filter->count >= RSSI_FILTER_MEDIAN_SIZE;
+}
+
+int rssi_filter_get(const rssi_filter_t *filter)
+{
+        if (filter == NULL)
+        {
+                LOG_ERROR("NULL pointer, filter=0x%X", (uintptr_t)filter);
+                return 0;
+        }
+        return (filter->mean + (1 << (RSSI_FILTER_FRAC_BITS - 1))) >> RSSI_FILTER_FRAC_BITS;
 }
 
-void print_rssi_event(rssi_event_t *event)
+int rssi_filter_get_variance(const rssi_filter_t *filter)
 {
-        LOG_INFO("RSSI event: addr = " MACSTR ", RSSI: %d", MAC2STR(event->recv_mac), event->rssi);
-}
\ No newline at end of file
+        if (filter == NULL)
+        {
+                LOG_ERROR("NULL pointer, filter=0x%X", (uintptr_t)filter);
+                return 0;
+        }
+        return (filter->variance + (1 << (RSSI_FILTER_FRAC_BITS - 1))) >> RSSI_FILTER_FRAC_BITS;
+}
@@ -1,10 +1,10 @@
-
 #pragma once
 
 #include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 
 #include "freertos/FreeRTOS.h"
-#include "freertos/queue.h"
 
 #include "esp_wifi.h"
 #include "esp_wifi_types.h"
@@ -15,7 +15,11 @@
 
 #include "logging.h"
 
-#define RSSI_QUEUE_SIZE (64)
+#define RSSI_TABLE_SIZE (16)             // Transmitters tracked at the same time
+#define RSSI_STALE_US (5 * 1000 * 1000) // Unwatched transmitters not heard for this long give up their slot
+#define RSSI_FILTER_MEDIAN_SIZE (5)      // Samples in the median filter, rejects single outliers
+#define RSSI_FILTER_EWMA_SHIFT (3)       // EWMA weight of a new sample is 1 / 2^shift
+#define RSSI_FILTER_FRAC_BITS (8)        // Fractional bits of the fixed-point mean and variance
 
 typedef struct
 {
@@ -34,12 +38,89 @@ typedef struct
         uint8_t payload[0]; /* network data ended with 4 bytes csum (CRC32) */
 } wifi_ieee80211_packet_t;
 
+// RSSI of one transmitter, aggregated over the frames received since the previous snapshot
+typedef struct
+{
+        uint8_t recv_mac[6]; // Transmitter MAC address
+        uint32_t count;      // Number of frames
+        int8_t min;          // Weakest RSSI
+        int8_t max;          // Strongest RSSI
+        int8_t mean;         // Mean RSSI
+        int8_t last;         // RSSI of the last frame
+        int64_t time_us;     // Timestamp of the last frame
+} rssi_stat_t;
+
+// Slot of the aggregation table, written by the Wi-Fi callback only and read through its sequence counter
+typedef struct
+{
+        _Atomic uint8_t state; // `RSSI_SLOT_*`, slots are claimed with compare-and-swap
+        bool watched;          // Slot was claimed by `rssi_watch`, never recycled
+        uint8_t mac[6];        // Transmitter MAC address
+        uint32_t generation;   // Incremented every time the slot is claimed
+        _Atomic uint32_t seq;  // Odd while the callback is updating the slot
+        _Atomic bool reset;    // Set by the reader, the next frame starts a new min/max window
+        uint32_t total_count;  // Frames since the slot was claimed
+        int64_t total_sum;     // Sum of the RSSI of those frames
+        int8_t min, max, last; // RSSI since the last reset, and of the last frame
+        int64_t time_us;       // Timestamp of the last frame
+} rssi_slot_t;
+
+// Capture statistics
+typedef struct
+{
+        uint32_t accepted;   // Frames aggregated into the table
+        uint32_t filtered;   // Frames from uninteresting transmitters, dropped in the callback
+        uint32_t table_full; // Frames from interesting transmitters with no free slot
+} rssi_capture_stats_t;
+
+// Traffic heard on the current channel, every frame type and transmitter included
 typedef struct
 {
-        uint8_t recv_mac[6];
-        int rssi;
-        int64_t time_us;
-} __packed rssi_event_t;
+        uint32_t frames;  // Number of frames
+        uint32_t bytes;   // Sum of the frame lengths
+        int32_t rssi_sum; // Sum of the RSSI of those frames
+} rssi_channel_load_t;
+
+// RSSI estimator of one transmitter, median of the last samples followed by an EWMA
+typedef struct
+{
+        int8_t window[RSSI_FILTER_MEDIAN_SIZE]; // Last raw samples, oldest overwritten first
+        uint8_t count;                          // Number of samples in the window
+        uint8_t next;                           // Position of the next sample in the window
+        int32_t mean;                           // Smoothed RSSI, fixed-point with `RSSI_FILTER_FRAC_BITS`
+        int32_t variance;                       // Smoothed squared deviation from the mean, same fixed-point
+} rssi_filter_t;
+
+// Start capturing the RSSI of ESP-NOW frames, call after `esp_wifi_init`
+// Frames are kept from watched transmitters, and from others only when stronger than `admit_rssi`
+esp_err_t rssi_init(int admit_rssi);
+
+// Always keep the RSSI of `mac`, may be called before `rssi_init`
+esp_err_t rssi_watch(const uint8_t *mac);
+
+// Copy the transmitters heard since the previous snapshot into `stats`, returns the number copied
+// Only one task may take snapshots
+size_t rssi_snapshot(rssi_stat_t *stats, size_t max_stats);
+
+// Copy the traffic heard since the previous call and start counting again
+rssi_channel_load_t *rssi_take_channel_load(rssi_channel_load_t *load);
+
+// Copy the capture statistics
+rssi_capture_stats_t *rssi_get_capture_stats(rssi_capture_stats_t *stats);
+
+void print_rssi_stat(rssi_stat_t *stat);
+
+// Forget all samples
+void rssi_filter_reset(rssi_filter_t *filter);
+
+// Add a raw sample, returns the smoothed RSSI
+int rssi_filter_update(rssi_filter_t *filter, int rssi);
+
+// The median window is full, a single stray sample can no longer move the smoothed RSSI
+bool rssi_filter_is_ready(const rssi_filter_t *filter);
+
+// Smoothed RSSI, rounded to the nearest dBm
+int rssi_filter_get(const rssi_filter_t *filter);
 
-QueueHandle_t rssi_init(void);
-void print_rssi_event(rssi_event_t *event);
\ No newline at end of file
+// Variance of the samples around the smoothed RSSI, in dB squared
+int rssi_filter_get_variance(const rssi_filter_t *filter);
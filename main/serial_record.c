@@ -0,0 +1,259 @@
+
+#include "serial_record.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define LOG_MODULE SERIAL_RECORD
+static const char *TAG = "serial_record";
+
+// Record waiting for the writer task, encoded only when it is written
+typedef struct
+{
+        int64_t time_us;                            // Timestamp of the recorded event
+        uint8_t type;                               // `serial_record_type_t`
+        uint8_t len;                                // Length of `payload`, in bytes
+        uint8_t payload[SERIAL_RECORD_MAX_PAYLOAD]; // Record payload
+} serial_record_entry_t;
+
+// Queue shared by every task that records, only the writer task moves the tail
+static serial_record_entry_t serial_record_queue[SERIAL_RECORD_QUEUE_SIZE];
+static uint32_t serial_record_head; // Next slot written
+static uint32_t serial_record_tail; // Next slot taken by the writer task
+static uint32_t serial_record_queued;
+static uint32_t serial_record_dropped;
+static uint32_t serial_record_high_water;
+static portMUX_TYPE serial_record_lock = portMUX_INITIALIZER_UNLOCKED; // Guards the queue and its statistics
+static _Atomic bool serial_record_running;
+
+static _Atomic uint32_t serial_record_written;
+static _Atomic uint32_t serial_record_bytes;
+static _Atomic uint32_t serial_record_failed;
+
+// Consistent overhead byte stuffing, removes every zero byte from `src`
+// Each zero is replaced by the distance to the next one, `src` must be shorter than 254 bytes
+static size_t serial_record_cobs_encode(uint8_t *dst, const uint8_t *src, size_t len)
+{
+        size_t code_pos = 0;
+        size_t out = 1;
+        uint8_t code = 1;
+        for (size_t i = 0; i < len; i++)
+        {
+                if (src[i] == 0)
+                {
+                        dst[code_pos] = code;
+                        code_pos = out++;
+                        code = 1;
+                        continue;
+                }
+                dst[out++] = src[i];
+                code++;
+        }
+        dst[code_pos] = code;
+        return out;
+}
+
+size_t serial_record_encode(uint8_t *frame, serial_record_type_t type, int64_t time_us, const void *payload, size_t len)
+{
+        if (frame == NULL || (payload == NULL && len))
+        {
+                LOG_ERROR("NULL pointer, frame=0x%X, payload=0x%X", (uintptr_t)frame, (uintptr_t)payload);
+                return 0;
+        }
+        if (len > SERIAL_RECORD_MAX_PAYLOAD)
+        {
+                LOG_ERROR("Record too large, type: %s, len: %d", SERIAL_RECORD_TYPE_STRING[type], len);
+                return 0;
+        }
+
+        uint8_t raw[sizeof(serial_record_header_t) + SERIAL_RECORD_MAX_PAYLOAD + sizeof(uint16_t)];
+        serial_record_header_t *header = (serial_record_header_t *)raw;
+        header->type = type;
+        header->len = len;
+        header->time_us = time_us;
+        memcpy(raw + sizeof(serial_record_header_t), payload, len);
+        size_t raw_len = sizeof(serial_record_header_t) + len;
+        uint16_t crc = esp_crc16_le(UINT16_MAX, raw, raw_len);
+        raw[raw_len++] = crc & 0xFF;
+        raw[raw_len++] = crc >> 8;
+
+        size_t frame_len = 0;
+        frame[frame_len++] = SERIAL_RECORD_DELIMITER;
+        frame_len += serial_record_cobs_encode(frame + frame_len, raw, raw_len);
+        frame[frame_len++] = SERIAL_RECORD_DELIMITER;
+        return frame_len;
+}
+
+// Encode a record and write it to the console, returns the number of bytes written, 0 on failure
+static size_t serial_record_output(const serial_record_entry_t *entry)
+{
+        uint8_t frame[SERIAL_RECORD_MAX_FRAME];
+        size_t frame_len = serial_record_encode(frame, entry->type, entry->time_us, entry->payload, entry->len);
+        if (frame_len == 0)
+                return 0;
+
+        // One call holds the stdout lock for the whole frame, log lines of other tasks land before or after it
+        if (fwrite(frame, 1, frame_len, stdout) != frame_len)
+        {
+                atomic_fetch_add_explicit(&serial_record_failed, 1, memory_order_relaxed);
+                return 0;
+        }
+        fflush(stdout);
+        atomic_fetch_add_explicit(&serial_record_written, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&serial_record_bytes, frame_len, memory_order_relaxed);
+        return frame_len;
+}
+
+esp_err_t serial_record_write(serial_record_type_t type, int64_t time_us, const void *payload, size_t len)
+{
+        if (payload == NULL && len)
+        {
+                LOG_ERROR("NULL pointer, payload=0x%X", (uintptr_t)payload);
+                return ESP_ERR_INVALID_ARG;
+        }
+        if (len > SERIAL_RECORD_MAX_PAYLOAD)
+        {
+                LOG_ERROR("Record too large, type: %s, len: %d", SERIAL_RECORD_TYPE_STRING[type], len);
+                return ESP_ERR_INVALID_ARG;
+        }
+
+        serial_record_entry_t entry = {.time_us = time_us, .type = type, .len = len};
+        memcpy(entry.payload, payload, len);
+
+        // Nothing drains the queue yet, pay for the console here
+        if (!atomic_load_explicit(&serial_record_running, memory_order_acquire))
+                return serial_record_output(&entry) ? ESP_OK : ESP_FAIL;
+
+        esp_err_t ret = ESP_OK;
+        portENTER_CRITICAL_SAFE(&serial_record_lock);
+        uint32_t waiting = serial_record_head - serial_record_tail;
+        if (waiting >= SERIAL_RECORD_QUEUE_SIZE)
+        {
+                serial_record_dropped++;
+                ret = ESP_ERR_NO_MEM;
+        }
+        else
+        {
+                memcpy(&serial_record_queue[serial_record_head & (SERIAL_RECORD_QUEUE_SIZE - 1)], &entry, offsetof(serial_record_entry_t, payload) + len);
+                serial_record_head++;
+                serial_record_queued++;
+                if (waiting + 1 > serial_record_high_water)
+                        serial_record_high_water = waiting + 1;
+        }
+        portEXIT_CRITICAL_SAFE(&serial_record_lock);
+        return ret;
+}
+
+// Take the oldest queued record, returns false if the queue is empty
+static bool serial_record_take(serial_record_entry_t *entry)
+{
+        bool taken = false;
+        portENTER_CRITICAL(&serial_record_lock);
+        if (serial_record_head != serial_record_tail)
+        {
+                const serial_record_entry_t *slot = &serial_record_queue[serial_record_tail & (SERIAL_RECORD_QUEUE_SIZE - 1)];
+                memcpy(entry, slot, offsetof(serial_record_entry_t, payload) + slot->len);
+                serial_record_tail++;
+                taken = true;
+        }
+        portEXIT_CRITICAL(&serial_record_lock);
+        return taken;
+}
+
+static void serial_record_task(void *arg)
+{
+        for (;;)
+        {
+                // The console is shared with the log lines, records wait for the next drain once their share is used
+                size_t budget = 0;
+                serial_record_entry_t entry;
+                while (budget < SERIAL_RECORD_DRAIN_BYTES && serial_record_take(&entry))
+                        budget += serial_record_output(&entry);
+                vTaskDelay(pdMS_TO_TICKS(SERIAL_RECORD_DRAIN_MS));
+        }
+}
+
+serial_record_config_t *serial_record_default_config(serial_record_config_t *config)
+{
+        if (config == NULL)
+        {
+                LOG_ERROR("NULL pointer, config=0x%X", (uintptr_t)config);
+                return NULL;
+        }
+        config->stack_size = 4096;
+        config->priority = 1;
+        config->core = 0;
+        return config;
+}
+
+esp_err_t serial_record_start(const serial_record_config_t *config)
+{
+        if (config == NULL)
+        {
+                LOG_ERROR("NULL pointer, config=0x%X", (uintptr_t)config);
+                return ESP_ERR_INVALID_ARG;
+        }
+
+        if (xTaskCreatePinnedToCore(serial_record_task, "serial_record", config->stack_size, NULL, config->priority, NULL, config->core) != pdPASS)
+        {
+                LOG_ERROR("Create serial record task failed");
+                return ESP_ERR_NO_MEM;
+        }
+        atomic_store_explicit(&serial_record_running, true, memory_order_release);
+        return ESP_OK;
+}
+
+esp_err_t serial_record_write_motor_stat(const uint8_t *mac, const motor_group_stat_pkt_t *stat, int64_t time_us)
+{
+        serial_record_motor_stat_t record;
+        memcpy(record.mac, mac, ESP_NOW_ETH_ALEN);
+        record.stat = *stat;
+        return serial_record_write(SERIAL_RECORD_TYPE_MOTOR_STAT, time_us, &record, sizeof(record));
+}
+
+esp_err_t serial_record_write_rssi(const uint8_t *mac, uint32_t count, int8_t min, int8_t max, int8_t mean, int8_t last, int64_t time_us)
+{
+        serial_record_rssi_t record = {.count = count, .min = min, .max = max, .mean = mean, .last = last};
+        memcpy(record.mac, mac, ESP_NOW_ETH_ALEN);
+        return serial_record_write(SERIAL_RECORD_TYPE_RSSI, time_us, &record, sizeof(record));
+}
+
+esp_err_t serial_record_write_rtt(const uint8_t *mac, uint32_t rtt_us, int64_t time_us)
+{
+        serial_record_rtt_t record = {.rtt_us = rtt_us};
+        memcpy(record.mac, mac, ESP_NOW_ETH_ALEN);
+        return serial_record_write(SERIAL_RECORD_TYPE_RTT, time_us, &record, sizeof(record));
+}
+
+esp_err_t serial_record_write_input_event(uint8_t pin, uint8_t state, uint32_t latency_us, int64_t time_us)
+{
+        serial_record_input_event_t record = {.pin = pin, .state = state, .latency_us = latency_us};
+        return serial_record_write(SERIAL_RECORD_TYPE_INPUT_EVENT, time_us, &record, sizeof(record));
+}
+
+serial_record_stats_t *serial_record_get_stats(serial_record_stats_t *stats)
+{
+        if (stats == NULL)
+        {
+                LOG_ERROR("NULL pointer, stats=0x%X", (uintptr_t)stats);
+                return NULL;
+        }
+
+        portENTER_CRITICAL(&serial_record_lock);
+        stats->queued = serial_record_queued;
+        stats->dropped = serial_record_dropped;
+        stats->high_water = serial_record_high_water;
+        portEXIT_CRITICAL(&serial_record_lock);
+        stats->written = atomic_load_explicit(&serial_record_written, memory_order_relaxed);
+        stats->bytes = atomic_load_explicit(&serial_record_bytes, memory_order_relaxed);
+        stats->failed = atomic_load_explicit(&serial_record_failed, memory_order_relaxed);
+        return stats;
+}
+
+void serial_record_show_stats(void)
+{
+        serial_record_stats_t stats;
+        serial_record_get_stats(&stats);
+        LOG_INFO("Serial records, queued: %lu, dropped: %lu, high water: %lu of %d, written: %lu, bytes: %lu, failed: %lu",
+                 stats.queued, stats.dropped, stats.high_water, SERIAL_RECORD_QUEUE_SIZE, stats.written, stats.bytes, stats.failed);
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_crc.h"
+#include "esp_now.h"
+#include "esp_timer.h"
+
+#include "logging.h"
+#include "packets.h"
+
+// Frames are COBS encoded between two `SERIAL_RECORD_DELIMITER` bytes, which never appear in the text console
+#define SERIAL_RECORD_DELIMITER (0x00)
+// Largest record payload, in bytes
+#define SERIAL_RECORD_MAX_PAYLOAD (64)
+#define SERIAL_RECORD_QUEUE_SIZE (32)        // Records waiting for the writer task, power of two
+#define SERIAL_RECORD_DRAIN_MS (20)          // Time between two drains of the queue
+#define SERIAL_RECORD_CONSOLE_SHARE (50)     // Percent of the console bandwidth records may take, log lines keep the rest
+#define SERIAL_RECORD_RSSI_INTERVAL_MS (100) // Time between two RSSI records of the same transmitter
+// Encoded bytes the writer task may write per drain, a byte takes 10 bits on the UART
+#define SERIAL_RECORD_DRAIN_BYTES (CONFIG_ESP_CONSOLE_UART_BAUDRATE / 10 * SERIAL_RECORD_CONSOLE_SHARE / 100 * SERIAL_RECORD_DRAIN_MS / 1000)
+
+// Type of a record, the host parses the payload by this value
+typedef enum
+{
+        SERIAL_RECORD_TYPE_MOTOR_STAT,  // `serial_record_motor_stat_t`
+        SERIAL_RECORD_TYPE_RSSI,        // `serial_record_rssi_t`
+        SERIAL_RECORD_TYPE_RTT,         // `serial_record_rtt_t`
+        SERIAL_RECORD_TYPE_INPUT_EVENT, // `serial_record_input_event_t`
+        SERIAL_RECORD_TYPE_MAX,
+} serial_record_type_t;
+
+static const char __attribute__((unused)) * SERIAL_RECORD_TYPE_STRING[] = {
+    "SERIAL_RECORD_TYPE_MOTOR_STAT",
+    "SERIAL_RECORD_TYPE_RSSI",
+    "SERIAL_RECORD_TYPE_RTT",
+    "SERIAL_RECORD_TYPE_INPUT_EVENT",
+    "SERIAL_RECORD_TYPE_MAX"};
+
+// Header in front of every record, followed by the payload and a CRC16 over both, all little endian
+typedef struct
+{
+        uint8_t type;    // `SERIAL_RECORD_TYPE_*`
+        uint8_t len;     // Length of the payload, in bytes
+        int64_t time_us; // Timestamp of the recorded event
+} __packed serial_record_header_t;
+
+// Motor status received from a car
+typedef struct
+{
+        uint8_t mac[ESP_NOW_ETH_ALEN]; // MAC address of the car
+        motor_group_stat_pkt_t stat;   // Motor status as received
+} __packed serial_record_motor_stat_t;
+
+// RSSI of one transmitter since the previous record
+typedef struct
+{
+        uint8_t mac[ESP_NOW_ETH_ALEN]; // Transmitter MAC address
+        uint32_t count;                // Number of frames
+        int8_t min;                    // Weakest RSSI
+        int8_t max;                    // Strongest RSSI
+        int8_t mean;                   // Mean RSSI
+        int8_t last;                   // RSSI of the last frame
+} __packed serial_record_rssi_t;
+
+// Round trip time of one ping
+typedef struct
+{
+        uint8_t mac[ESP_NOW_ETH_ALEN]; // Peer MAC address
+        uint32_t rtt_us;               // Round trip time
+} __packed serial_record_rtt_t;
+
+// Button or joystick state change
+typedef struct
+{
+        uint8_t pin;         // GPIO pin of the button
+        uint8_t state;       // New `button_state_t`
+        uint32_t latency_us; // Time from the state change to handling it
+} __packed serial_record_input_event_t;
+
+// Largest encoded frame: delimiters, COBS overhead, header, payload and CRC
+#define SERIAL_RECORD_MAX_FRAME (2 + 1 + sizeof(serial_record_header_t) + SERIAL_RECORD_MAX_PAYLOAD + sizeof(uint16_t))
+
+_Static_assert(sizeof(serial_record_motor_stat_t) <= SERIAL_RECORD_MAX_PAYLOAD, "Motor status record too large");
+_Static_assert(sizeof(serial_record_header_t) + SERIAL_RECORD_MAX_PAYLOAD + sizeof(uint16_t) < 254, "Frames must fit one COBS block");
+_Static_assert((SERIAL_RECORD_QUEUE_SIZE & (SERIAL_RECORD_QUEUE_SIZE - 1)) == 0, "Serial record queue size must be a power of two");
+
+// Serial record statistics
+typedef struct
+{
+        uint32_t queued;     // Records queued for the writer task
+        uint32_t dropped;    // Records lost because the queue was full
+        uint32_t high_water; // Most records waiting in the queue at once
+        uint32_t written;    // Records written to the console
+        uint32_t bytes;      // Encoded bytes written, delimiters included
+        uint32_t failed;     // Records not fully written
+} serial_record_stats_t;
+
+// Configuration of the writer task
+typedef struct
+{
+        uint32_t stack_size;  // Stack size of the task, in bytes
+        UBaseType_t priority; // Priority of the task, below every task on the input path
+        BaseType_t core;      // Core the task is pinned to
+} serial_record_config_t;
+
+// Loads default settings of the writer task
+serial_record_config_t *serial_record_default_config(serial_record_config_t *config);
+
+// Creates the writer task, records are queued from then on
+esp_err_t serial_record_start(const serial_record_config_t *config);
+
+// Encode a record into `frame`, which holds at least `SERIAL_RECORD_MAX_FRAME` bytes
+// Returns the length of the frame, 0 if the payload is too large
+size_t serial_record_encode(uint8_t *frame, serial_record_type_t type, int64_t time_us, const void *payload, size_t len);
+
+// Queue a record for the writer task, never blocks nor touches the console
+// Records written before `serial_record_start` go to the console right away
+// Returns `ESP_ERR_NO_MEM` if the queue is full and the record is lost
+esp_err_t serial_record_write(serial_record_type_t type, int64_t time_us, const void *payload, size_t len);
+
+// Queue a motor status record
+esp_err_t serial_record_write_motor_stat(const uint8_t *mac, const motor_group_stat_pkt_t *stat, int64_t time_us);
+
+// Queue an RSSI record
+esp_err_t serial_record_write_rssi(const uint8_t *mac, uint32_t count, int8_t min, int8_t max, int8_t mean, int8_t last, int64_t time_us);
+
+// Queue a round trip time record
+esp_err_t serial_record_write_rtt(const uint8_t *mac, uint32_t rtt_us, int64_t time_us);
+
+// Queue an input event record
+esp_err_t serial_record_write_input_event(uint8_t pin, uint8_t state, uint32_t latency_us, int64_t time_us);
+
+// Copy the serial record statistics
+serial_record_stats_t *serial_record_get_stats(serial_record_stats_t *stats);
+
+// Print the serial record statistics
+void serial_record_show_stats(void);
@@ -0,0 +1,263 @@
+
+#include "telemetry.h"
+
+#define LOG_MODULE TELEMETRY
+static const char *TAG = "telemetry";
+
+// Single producer, single consumer ring, each index is only written by its own side
+static telemetry_sample_t telemetry_ring[TELEMETRY_RING_SIZE];
+static _Atomic uint32_t telemetry_head; // Next slot written by the producer
+static _Atomic uint32_t telemetry_tail; // Next slot read by the consumer
+static _Atomic uint32_t telemetry_dropped;
+static uint32_t telemetry_pushed;
+static uint32_t telemetry_high_water;
+
+// Aggregation of one car
+typedef struct
+{
+        telemetry_window_t current;   // Window being aggregated, drain task only
+        telemetry_window_t completed; // Last completed window
+        bool in_use;                  // Slot holds a car
+        bool valid;                   // `completed` holds a window
+} telemetry_peer_t;
+
+static telemetry_sink_t telemetry_sink;
+static telemetry_peer_t telemetry_peers[TELEMETRY_MAX_PEERS];
+static uint32_t telemetry_drained;
+static uint32_t telemetry_windows;
+static uint32_t telemetry_evicted;
+static portMUX_TYPE telemetry_lock = portMUX_INITIALIZER_UNLOCKED;
+
+telemetry_config_t *telemetry_default_config(telemetry_config_t *config)
+{
+        if (config == NULL)
+        {
+                LOG_ERROR("NULL pointer, config=0x%X", (uintptr_t)config);
+                return NULL;
+        }
+        config->stack_size = 4096;
+        config->priority = 1;
+        config->core = 0;
+        config->sink = NULL;
+        return config;
+}
+
+bool telemetry_push(const uint8_t *mac, const motor_group_stat_pkt_t *stat, int64_t time_us)
+{
+        uint32_t head = atomic_load_explicit(&telemetry_head, memory_order_relaxed);
+        uint32_t tail = atomic_load_explicit(&telemetry_tail, memory_order_acquire);
+        if (head - tail >= TELEMETRY_RING_SIZE)
+        {
+                atomic_fetch_add_explicit(&telemetry_dropped, 1, memory_order_relaxed);
+                return false;
+        }
+
+        telemetry_sample_t *sample = &telemetry_ring[head & (TELEMETRY_RING_SIZE - 1)];
+        sample->time_us = time_us;
+        memcpy(sample->mac, mac, ESP_NOW_ETH_ALEN);
+        sample->stat = *stat;
+        atomic_store_explicit(&telemetry_head, head + 1, memory_order_release);
+
+        telemetry_pushed++;
+        if (head + 1 - tail > telemetry_high_water)
+                telemetry_high_water = head + 1 - tail;
+        return true;
+}
+
+static void telemetry_fields(const motor_group_stat_pkt_t *stat, float *fields)
+{
+        const motor_stat_t *motors[2] = {&stat->left_motor, &stat->right_motor};
+        for (size_t i = 0; i < 2; i++)
+        {
+                float *motor_fields = fields + i * (TELEMETRY_FIELD_RIGHT_COUNTER - TELEMETRY_FIELD_LEFT_COUNTER);
+                motor_fields[TELEMETRY_FIELD_LEFT_COUNTER] = motors[i]->counter;
+                motor_fields[TELEMETRY_FIELD_LEFT_SET_VELOCITY] = motors[i]->set_velocity;
+                motor_fields[TELEMETRY_FIELD_LEFT_VELOCITY] = motors[i]->velocity;
+                motor_fields[TELEMETRY_FIELD_LEFT_ACCELERATION] = motors[i]->acceleration;
+                motor_fields[TELEMETRY_FIELD_LEFT_DUTY_CYCLE] = motors[i]->duty_cycle;
+        }
+        fields[TELEMETRY_FIELD_DELTA_DISTANCE] = stat->delta_distance;
+        fields[TELEMETRY_FIELD_DELTA_VELOCITY] = stat->delta_velocity;
+}
+
+// Aggregation of the car `mac`, a free slot or the one heard from least recently if none, drain task only
+static telemetry_peer_t *telemetry_peer_get(const uint8_t *mac)
+{
+        telemetry_peer_t *slot = NULL;
+        for (size_t i = 0; i < TELEMETRY_MAX_PEERS; i++)
+        {
+                telemetry_peer_t *peer = &telemetry_peers[i];
+                if (peer->in_use && memcmp(peer->current.mac, mac, ESP_NOW_ETH_ALEN) == 0)
+                        return peer;
+                if (slot == NULL || (slot->in_use && (!peer->in_use || peer->current.end_us < slot->current.end_us)))
+                        slot = peer;
+        }
+
+        if (slot->in_use)
+        {
+                LOG_WARNING("Dropping telemetry of " MACSTR " for " MACSTR, MAC2STR(slot->current.mac), MAC2STR(mac));
+                telemetry_evicted++;
+        }
+        portENTER_CRITICAL(&telemetry_lock);
+        slot->in_use = true;
+        slot->valid = false;
+        portEXIT_CRITICAL(&telemetry_lock);
+        memcpy(slot->current.mac, mac, ESP_NOW_ETH_ALEN);
+        slot->current.count = 0;
+        return slot;
+}
+
+// Publish the current window of the car once it spans `TELEMETRY_WINDOW_MS`, `mean` holds the sums until then
+static void telemetry_aggregate(const telemetry_sample_t *sample)
+{
+        telemetry_peer_t *peer = telemetry_peer_get(sample->mac);
+        telemetry_window_t *window = &peer->current;
+        if (window->count && sample->time_us - window->start_us >= TELEMETRY_WINDOW_MS * 1000)
+        {
+                for (size_t i = 0; i < TELEMETRY_FIELD_MAX; i++)
+                        window->mean[i] /= window->count;
+                portENTER_CRITICAL(&telemetry_lock);
+                peer->completed = *window;
+                peer->valid = true;
+                telemetry_windows++;
+                portEXIT_CRITICAL(&telemetry_lock);
+                window->count = 0;
+        }
+
+        float fields[TELEMETRY_FIELD_MAX];
+        telemetry_fields(&sample->stat, fields);
+        if (window->count == 0)
+        {
+                window->start_us = sample->time_us;
+                memcpy(window->min, fields, sizeof(fields));
+                memcpy(window->max, fields, sizeof(fields));
+                memset(window->mean, 0, sizeof(window->mean));
+        }
+        for (size_t i = 0; i < TELEMETRY_FIELD_MAX; i++)
+        {
+                if (fields[i] < window->min[i])
+                        window->min[i] = fields[i];
+                if (fields[i] > window->max[i])
+                        window->max[i] = fields[i];
+                window->mean[i] += fields[i];
+        }
+        window->end_us = sample->time_us;
+        window->count++;
+}
+
+static void telemetry_task(void *arg)
+{
+        for (;;)
+        {
+                uint32_t tail = atomic_load_explicit(&telemetry_tail, memory_order_relaxed);
+                uint32_t head = atomic_load_explicit(&telemetry_head, memory_order_acquire);
+                while (tail != head)
+                {
+                        // The slot stays ours until the tail moves past it, no copy needed
+                        const telemetry_sample_t *sample = &telemetry_ring[tail & (TELEMETRY_RING_SIZE - 1)];
+                        telemetry_aggregate(sample);
+                        if (telemetry_sink != NULL)
+                                telemetry_sink(sample);
+                        tail++;
+                        atomic_store_explicit(&telemetry_tail, tail, memory_order_release);
+                        telemetry_drained++;
+                }
+                vTaskDelay(pdMS_TO_TICKS(TELEMETRY_DRAIN_INTERVAL_MS));
+        }
+}
+
+esp_err_t telemetry_start(const telemetry_config_t *config)
+{
+        if (config == NULL)
+        {
+                LOG_ERROR("NULL pointer, config=0x%X", (uintptr_t)config);
+                return ESP_ERR_INVALID_ARG;
+        }
+
+        telemetry_sink = config->sink;
+        if (xTaskCreatePinnedToCore(telemetry_task, "telemetry", config->stack_size, NULL, config->priority, NULL, config->core) != pdPASS)
+        {
+                LOG_ERROR("Create telemetry task failed");
+                return ESP_ERR_NO_MEM;
+        }
+        return ESP_OK;
+}
+
+telemetry_window_t *telemetry_get_window(const uint8_t *mac, telemetry_window_t *window)
+{
+        if ((mac == NULL) || (window == NULL))
+        {
+                LOG_ERROR("NULL pointer, mac=0x%X, window=0x%X", (uintptr_t)mac, (uintptr_t)window);
+                return NULL;
+        }
+
+        bool valid = false;
+        portENTER_CRITICAL(&telemetry_lock);
+        for (size_t i = 0; i < TELEMETRY_MAX_PEERS && !valid; i++)
+        {
+                telemetry_peer_t *peer = &telemetry_peers[i];
+                if (!peer->valid || memcmp(peer->completed.mac, mac, ESP_NOW_ETH_ALEN) != 0)
+                        continue;
+                *window = peer->completed;
+                valid = true;
+        }
+        portEXIT_CRITICAL(&telemetry_lock);
+        return valid ? window : NULL;
+}
+
+size_t telemetry_get_windows(telemetry_window_t *windows, size_t max_windows)
+{
+        if (windows == NULL)
+        {
+                LOG_ERROR("NULL pointer, windows=0x%X", (uintptr_t)windows);
+                return 0;
+        }
+
+        size_t count = 0;
+        portENTER_CRITICAL(&telemetry_lock);
+        for (size_t i = 0; i < TELEMETRY_MAX_PEERS && count < max_windows; i++)
+                if (telemetry_peers[i].valid)
+                        windows[count++] = telemetry_peers[i].completed;
+        portEXIT_CRITICAL(&telemetry_lock);
+        return count;
+}
+
+telemetry_stats_t *telemetry_get_stats(telemetry_stats_t *stats)
+{
+        if (stats == NULL)
+        {
+                LOG_ERROR("NULL pointer, stats=0x%X", (uintptr_t)stats);
+                return NULL;
+        }
+
+        stats->pushed = telemetry_pushed;
+        stats->dropped = atomic_load_explicit(&telemetry_dropped, memory_order_relaxed);
+        stats->drained = telemetry_drained;
+        stats->high_water = telemetry_high_water;
+        portENTER_CRITICAL(&telemetry_lock);
+        stats->windows = telemetry_windows;
+        portEXIT_CRITICAL(&telemetry_lock);
+        stats->evicted = telemetry_evicted;
+        return stats;
+}
+
+void telemetry_show_stats(void)
+{
+        telemetry_stats_t stats;
+        telemetry_get_stats(&stats);
+        LOG_INFO("Telemetry ring, pushed: %lu, dropped: %lu, drained: %lu, high water: %lu of %d",
+                 stats.pushed, stats.dropped, stats.drained, stats.high_water, TELEMETRY_RING_SIZE);
+
+        LOG_INFO("Telemetry windows: %lu, cars dropped: %lu", stats.windows, stats.evicted);
+
+        // Copied at once, the drain task may complete windows while they are printed
+        static telemetry_window_t windows[TELEMETRY_MAX_PEERS];
+        size_t count = telemetry_get_windows(windows, TELEMETRY_MAX_PEERS);
+        for (size_t n = 0; n < count; n++)
+        {
+                telemetry_window_t *window = &windows[n];
+                LOG_INFO("Telemetry window of " MACSTR ", samples: %lu over %lld ms", MAC2STR(window->mac), window->count, (window->end_us - window->start_us) / 1000);
+                for (size_t i = 0; i < TELEMETRY_FIELD_MAX; i++)
+                        LOG_INFO("    %-4s min: %9.3f, max: %9.3f, mean: %9.3f", TELEMETRY_FIELD_STRING[i], window->min[i], window->max[i], window->mean[i]);
+        }
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_timer.h"
+#include "esp_now.h"
+
+#include "logging.h"
+#include "packets.h"
+
+#define TELEMETRY_RING_SIZE (64)          // Samples buffered between the receiver and the drain task, power of two
+#define TELEMETRY_DRAIN_INTERVAL_MS (20)  // Time between two drains of the ring
+#define TELEMETRY_WINDOW_MS (1000)        // Length of an aggregation window
+#define TELEMETRY_MAX_PEERS (8)           // Cars aggregated apart, the one heard from least recently makes room for a new one
+
+_Static_assert((TELEMETRY_RING_SIZE & (TELEMETRY_RING_SIZE - 1)) == 0, "Telemetry ring size must be a power of two");
+
+// Received motor status with its receive time
+typedef struct
+{
+        int64_t time_us;                // Timestamp of receiving the sample
+        uint8_t mac[ESP_NOW_ETH_ALEN];  // MAC address of the car that sent it
+        motor_group_stat_pkt_t stat;    // Motor status as received
+} telemetry_sample_t;
+
+// Aggregated fields of the motor status
+typedef enum
+{
+        TELEMETRY_FIELD_LEFT_COUNTER,
+        TELEMETRY_FIELD_LEFT_SET_VELOCITY,
+        TELEMETRY_FIELD_LEFT_VELOCITY,
+        TELEMETRY_FIELD_LEFT_ACCELERATION,
+        TELEMETRY_FIELD_LEFT_DUTY_CYCLE,
+        TELEMETRY_FIELD_RIGHT_COUNTER,
+        TELEMETRY_FIELD_RIGHT_SET_VELOCITY,
+        TELEMETRY_FIELD_RIGHT_VELOCITY,
+        TELEMETRY_FIELD_RIGHT_ACCELERATION,
+        TELEMETRY_FIELD_RIGHT_DUTY_CYCLE,
+        TELEMETRY_FIELD_DELTA_DISTANCE,
+        TELEMETRY_FIELD_DELTA_VELOCITY,
+        TELEMETRY_FIELD_MAX,
+} telemetry_field_t;
+
+static const char __attribute__((unused)) * TELEMETRY_FIELD_STRING[] = {
+    "Lcnt",
+    "Lset",
+    "Lspd",
+    "Lacc",
+    "Lpwm",
+    "Rcnt",
+    "Rset",
+    "Rspd",
+    "Racc",
+    "Rpwm",
+    "Δd",
+    "Δs",
+    "MAX"};
+
+// Minimum, maximum and mean of every field of one car over one window
+typedef struct
+{
+        uint8_t mac[ESP_NOW_ETH_ALEN];   // MAC address of the car
+        int64_t start_us;                // Timestamp of the first sample of the window
+        int64_t end_us;                  // Timestamp of the last sample of the window
+        uint32_t count;                  // Number of samples
+        float min[TELEMETRY_FIELD_MAX];  // Smallest value of each field
+        float max[TELEMETRY_FIELD_MAX];  // Largest value of each field
+        float mean[TELEMETRY_FIELD_MAX]; // Mean value of each field
+} telemetry_window_t;
+
+// Telemetry statistics
+typedef struct
+{
+        uint32_t pushed;     // Samples pushed into the ring
+        uint32_t dropped;    // Samples lost because the ring was full
+        uint32_t drained;    // Samples taken out of the ring
+        uint32_t high_water; // Most samples waiting in the ring at once
+        uint32_t windows;    // Aggregation windows completed, all cars together
+        uint32_t evicted;    // Cars whose aggregation was dropped to make room for another
+} telemetry_stats_t;
+
+// Called by the drain task for every sample, in receive order
+typedef void (*telemetry_sink_t)(const telemetry_sample_t *sample);
+
+// Configuration of the drain task
+typedef struct
+{
+        uint32_t stack_size;   // Stack size of the task, in bytes
+        UBaseType_t priority;  // Priority of the task, below every task on the input path
+        BaseType_t core;       // Core the task is pinned to
+        telemetry_sink_t sink; // Receives every sample, NULL to only aggregate
+} telemetry_config_t;
+
+// Loads default settings of the drain task
+telemetry_config_t *telemetry_default_config(telemetry_config_t *config);
+
+// Creates the drain task
+esp_err_t telemetry_start(const telemetry_config_t *config);
+
+// Store a received sample, never blocks nor formats
+// Only one task may push, returns false if the ring is full and the sample is lost
+bool telemetry_push(const uint8_t *mac, const motor_group_stat_pkt_t *stat, int64_t time_us);
+
+// Copy the last completed aggregation window of the car `mac`, returns NULL if none completed yet
+telemetry_window_t *telemetry_get_window(const uint8_t *mac, telemetry_window_t *window);
+
+// Copy the last completed aggregation window of up to `max_windows` cars, returns the number copied
+size_t telemetry_get_windows(telemetry_window_t *windows, size_t max_windows);
+
+// Copy the telemetry statistics
+telemetry_stats_t *telemetry_get_stats(telemetry_stats_t *stats);
+
+// Print the ring statistics and the last completed window of every car
+void telemetry_show_stats(void);
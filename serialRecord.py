@@ -0,0 +1,184 @@
+import codecs
+
+import numpy as np
+
+# Mirrors main/serial_record.h, every field is little endian
+DELIMITER = 0x00
+MAX_FRAME = 254
+
+RECORD_TYPE_MOTOR_STAT = 0
+RECORD_TYPE_RSSI = 1
+RECORD_TYPE_RTT = 2
+RECORD_TYPE_INPUT_EVENT = 3
+
+HEADER_DTYPE = np.dtype([("type", "u1"), ("len", "u1"), ("time_us", "<i8")])
+
+MOTOR_DTYPE = [
+    ("counter", "<i4"),
+    ("set_velocity", "<f4"),
+    ("velocity", "<f4"),
+    ("acceleration", "<f4"),
+    ("duty_cycle", "<f4"),
+]
+
+RECORD_DTYPES = {
+    RECORD_TYPE_MOTOR_STAT: np.dtype(
+        [
+            ("time_us", "<i8"),
+            ("mac", "u1", 6),
+            ("left_motor", MOTOR_DTYPE),
+            ("right_motor", MOTOR_DTYPE),
+            ("delta_distance", "<f4"),
+            ("delta_velocity", "<f4"),
+        ]
+    ),
+    RECORD_TYPE_RSSI: np.dtype(
+        [
+            ("time_us", "<i8"),
+            ("mac", "u1", 6),
+            ("count", "<u4"),
+            ("min", "i1"),
+            ("max", "i1"),
+            ("mean", "i1"),
+            ("last", "i1"),
+        ]
+    ),
+    RECORD_TYPE_RTT: np.dtype(
+        [
+            ("time_us", "<i8"),
+            ("mac", "u1", 6),
+            ("rtt_us", "<u4"),
+        ]
+    ),
+    RECORD_TYPE_INPUT_EVENT: np.dtype(
+        [
+            ("time_us", "<i8"),
+            ("pin", "u1"),
+            ("state", "u1"),
+            ("latency_us", "<u4"),
+        ]
+    ),
+}
+
+
+def _crc16_table() -> list[int]:
+    table = []
+    for byte in range(256):
+        crc = byte
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0x8408 if crc & 1 else crc >> 1
+        table.append(crc)
+    return table
+
+
+CRC16_TABLE = _crc16_table()
+
+
+# Same result as esp_crc16_le(), the ROM inverts the value on the way in and out
+def crc16_le(data: bytes, crc: int = 0xFFFF) -> int:
+    crc = ~crc & 0xFFFF
+    for byte in data:
+        crc = (crc >> 8) ^ CRC16_TABLE[(crc ^ byte) & 0xFF]
+    return ~crc & 0xFFFF
+
+
+# Undoes consistent overhead byte stuffing, returns None for a malformed frame
+def cobs_decode(data: bytes) -> bytes | None:
+    out = bytearray()
+    pos = 0
+    while pos < len(data):
+        code = data[pos]
+        if code == 0 or pos + code > len(data):
+            return None
+        out += data[pos + 1 : pos + code]
+        pos += code
+        if code < 0xFF and pos < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+# Checks the CRC of a decoded frame, returns the record without it, or None
+def check_record(frame: bytes) -> bytes | None:
+    if len(frame) < HEADER_DTYPE.itemsize + 2:
+        return None
+    body, crc = frame[:-2], int.from_bytes(frame[-2:], "little")
+    if crc16_le(body) != crc or body[1] != len(body) - HEADER_DTYPE.itemsize:
+        return None
+    return body
+
+
+# Parses records into one structured array per type, with `time_us` taken from the header
+def parse_records(records: list[bytes]) -> dict[int, np.ndarray]:
+    grouped: dict[int, list[bytes]] = {}
+    for record in records:
+        grouped.setdefault(record[0], []).append(record)
+
+    parsed = {}
+    for record_type, group in grouped.items():
+        dtype = RECORD_DTYPES.get(record_type)
+        if dtype is None:
+            continue
+
+        # Dropping `type` and `len` lines the header up with the record dtype
+        size = dtype.itemsize + 2
+        group = [record for record in group if len(record) == size]
+        if group:
+            joined = b"".join(record[2:] for record in group)
+            parsed[record_type] = np.frombuffer(joined, dtype=dtype)
+    return parsed
+
+
+# Splits the serial stream into console text and binary records
+class SerialDemux:
+    def __init__(self) -> None:
+        self.in_frame = False
+        self.frame = bytearray()
+        self.text = bytearray()
+        self.decoder = codecs.getincrementaldecoder("utf-8")(errors="replace")
+        self.good_frames = 0
+        self.bad_frames = 0
+
+    # Feeds raw bytes, returns the completed text lines and the valid records
+    def feed(self, data: bytes) -> tuple[str, list[bytes]]:
+        records = []
+        for chunk_index, chunk in enumerate(data.split(bytes([DELIMITER]))):
+            # Every chunk but the first one starts right after a delimiter
+            if chunk_index:
+                if not self.in_frame:
+                    self.in_frame = True
+                elif self.frame:
+                    decoded = cobs_decode(bytes(self.frame))
+                    record = check_record(decoded) if decoded is not None else None
+                    if record is not None:
+                        records.append(record)
+                        self.good_frames += 1
+                        self.in_frame = False
+                    else:
+                        # Joined mid-frame, the delimiter opens the next frame
+                        self.bad_frames += 1
+                        self.text += self.frame
+                    self.frame.clear()
+
+            if self.in_frame:
+                self.frame += chunk
+
+                # Longer than any record, the delimiter was not the start of a frame
+                if len(self.frame) > MAX_FRAME:
+                    self.bad_frames += 1
+                    self.text += self.frame
+                    self.frame.clear()
+                    self.in_frame = False
+            else:
+                self.text += chunk
+
+        # Only complete lines are handed out, an escape sequence is never split
+        end = self.text.rfind(b"\n") + 1
+        lines = self.decoder.decode(bytes(self.text[:end]))
+        del self.text[:end]
+        return lines, records
+
+    def reset(self) -> None:
+        self.in_frame = False
+        self.frame.clear()
+        self.text.clear()
+        self.decoder.reset()
@@ -1,8 +1,10 @@
-import queue
+import threading
+from time import perf_counter
 from tkinter import Misc
 
 import matplotlib
 import matplotlib.pyplot as plt
+import numpy as np
 from matplotlib.backends.backend_tkagg import FigureCanvasTkAgg
 
 matplotlib.use("Agg")
@@ -16,6 +18,8 @@ class tkPlotGraph:
         dpi: int = 80,
         timespan: int = 5000,
         title: str = "Graph",
+        capacity: int = 16384,
+        fps: int = 20,
     ) -> None:
 
         # Create a figure and a canvas to draw on
@@ -24,23 +28,35 @@ class tkPlotGraph:
         self.canvas = FigureCanvasTkAgg(self.figure, master=self.root)
         self.timespan = timespan
         self.title = title
+        self.fps = fps
+        self.killed = True
 
-        # Graph data
-        self.data = []
-        self.times = []
-        self.data_hash = hash(tuple(self.data))
+        # Graph data, a preallocated ring written by the reader thread and read by the UI thread
+        self.capacity = capacity
+        self.times = np.zeros(capacity)
+        self.data = np.zeros(capacity)
+        self.head = 0
+        self.count = 0
+        self.dirty = False
+        self.lock = threading.Lock()
         self.do_ylim = False
 
-        # Holding the draw command for main loop to update the UI
-        self.draw_queue: queue.Queue[FigureCanvasTkAgg] = queue.Queue()
+        # Frame statistics
+        self.frames = 0
+        self.full_draws = 0
+        self.draw_time = 0.0
 
-        # Configure Axes object
+        # Configure Axes object, time is shown relative to the newest sample so the axes stay still between frames
         self.ax = self.figure.add_subplot(111)
         self.ax.set_title(self.title)
-        if self.do_ylim:
-            self.ax.set_ylim(self.low_ylim, self.high_ylim)
+        self.ax.set_xlim(-self.timespan, 0)
+        self.ax.set_xlabel("ms")
         self.ax.grid()
-        (self.line,) = self.ax.plot(self.times, self.data)
+        (self.line,) = self.ax.plot([], [], animated=True)
+
+        # Everything but the line is cached after each full draw and restored before each frame
+        self.background = None
+        self.canvas.mpl_connect("draw_event", self.on_draw)
 
     # Partial function of tk.grid()
     def grid(self, row: int = 2, column: int = 0) -> None:
@@ -48,62 +64,133 @@ class tkPlotGraph:
 
     # Clears graph data
     def reset(self) -> None:
-        self.data.clear()
-        self.times.clear()
+        with self.lock:
+            self.head = 0
+            self.count = 0
+            self.dirty = True
 
-    # Appends timestamp and data to the list, also clears old data
+    # Appends timestamp and data to the ring, the oldest samples are overwritten
     def append(self, time, data) -> None:
-        self.data.append(data)
-        self.times.append(time)
+        with self.lock:
+            self.times[self.head] = time
+            self.data[self.head] = data
+            self.head = (self.head + 1) % self.capacity
+            self.count = min(self.count + 1, self.capacity)
+            self.dirty = True
+
+    # Appends a batch of timestamps and data, the oldest samples are overwritten
+    def extend(self, times, data) -> None:
+        times = np.asarray(times, dtype=float)[-self.capacity :]
+        data = np.asarray(data, dtype=float)[-self.capacity :]
+        n = len(times)
+        if n == 0:
+            return
 
-        # Remove data older than x milliseconds
-        while self.times and self.times[0] < time - self.timespan:
-            self.times.pop(0)
-            self.data.pop(0)
+        with self.lock:
+            first = min(n, self.capacity - self.head)
+            self.times[self.head : self.head + first] = times[:first]
+            self.data[self.head : self.head + first] = data[:first]
+            self.times[: n - first] = times[first:]
+            self.data[: n - first] = data[first:]
+            self.head = (self.head + n) % self.capacity
+            self.count = min(self.count + n, self.capacity)
+            self.dirty = True
+
+    # Copies the samples of the last `timespan` milliseconds, oldest first
+    def window(self) -> tuple[np.ndarray, np.ndarray]:
+        with self.lock:
+            start = (self.head - self.count) % self.capacity
+            if start + self.count <= self.capacity:
+                times = self.times[start : start + self.count].copy()
+                data = self.data[start : start + self.count].copy()
+            else:
+                times = np.concatenate((self.times[start:], self.times[: self.head]))
+                data = np.concatenate((self.data[start:], self.data[: self.head]))
+            self.dirty = False
+
+        if len(times):
+            first = np.searchsorted(times, times[-1] - self.timespan)
+            times, data = times[first:], data[first:]
+        return times, data
 
     # Set graph y-axis limit, default is automatic
     def set_ylim(self, low: float, high: float):
         self.do_ylim = True
         self.low_ylim = low
         self.high_ylim = high
-
-    # Draw graph on canvas
+        self.ax.set_ylim(low, high)
+
+    # Reduces the samples to the minimum and maximum of each pixel column, in time order
+    @staticmethod
+    def decimate(times: np.ndarray, data: np.ndarray, width: int):
+        n = len(times)
+        if width <= 0 or n <= 2 * width:
+            return times, data
+
+        # Whole buckets only, the oldest few samples are left out
+        size = n // width
+        times = times[n - size * width :].reshape(width, size)
+        data = data[n - size * width :].reshape(width, size)
+        rows = np.arange(width)
+        low, high = data.argmin(axis=1), data.argmax(axis=1)
+        first, second = np.minimum(low, high), np.maximum(low, high)
+        times = np.stack((times[rows, first], times[rows, second]), axis=1).ravel()
+        data = np.stack((data[rows, first], data[rows, second]), axis=1).ravel()
+        return times, data
+
+    # Fits the y-axis to the data, returns True if the limits moved
+    def autoscale(self, data: np.ndarray) -> bool:
+        if self.do_ylim or len(data) == 0:
+            return False
+
+        low, high = float(data.min()), float(data.max())
+        current_low, current_high = self.ax.get_ylim()
+        span = max(high - low, 1e-6)
+
+        # Grow as soon as the data leaves the axes, shrink only once it uses a small part of them
+        if low >= current_low and high <= current_high and span * 4 > current_high - current_low:
+            return False
+        margin = span * 0.1
+        self.ax.set_ylim(low - margin, high + margin)
+        return True
+
+    # Caches the background after every full redraw, including the ones caused by resizing
+    def on_draw(self, event) -> None:
+        self.background = self.canvas.copy_from_bbox(self.figure.bbox)
+        self.ax.draw_artist(self.line)
+
+    # Draw graph on canvas, only the line is redrawn unless the axes changed
     def draw(self) -> None:
 
         # Skips if no updates
-        new_hash = hash(tuple(self.data))
-        if self.data_hash is new_hash:
+        if not self.dirty and self.background is not None:
             return
-        self.data_hash = new_hash
-
-        # Update the graph
-        self.line.set_data(self.times, self.data)
 
-        # Rescale the x-axis to fit the new data
-        if len(self.times) >= 2:
-            self.ax.set_xlim(self.times[0], self.times[-1])
+        start = perf_counter()
+        times, data = self.window()
+        if len(times):
+            times = times - times[-1]
+        times, data = self.decimate(times, data, int(self.ax.bbox.width))
+        self.line.set_data(times, data)
 
-        # Rescale the y-axis to fit the new data
-        if self.do_ylim:
-            self.ax.set_ylim(self.low_ylim, self.high_ylim)
+        if self.autoscale(data) or self.background is None:
+            self.canvas.draw()
+            self.full_draws += 1
         else:
-            self.ax.relim()
-            self.ax.autoscale_view(scalex=False)
+            self.canvas.restore_region(self.background)
+            self.ax.draw_artist(self.line)
+            self.canvas.blit(self.ax.bbox)
 
-        self.canvas.draw()
-        # self.draw_queue.put(self.canvas)
+        self.frames += 1
+        self.draw_time += perf_counter() - start
 
-    # Take data from the queue and update the UI
+    # Draws at a fixed rate on the UI thread, independent of how fast data arrives
     def update_ui(self) -> None:
         if self.killed:
             return
 
-        while not self.draw_queue.empty():
-            canvas = self.draw_queue.get()
-            canvas.draw()
-
-        # Schedule the next update, roughly 100 ms
-        self.root.after(100, self.update_ui)
+        self.draw()
+        self.root.after(max(1, 1000 // self.fps), self.update_ui)
 
     # This function should only be called on main loop, once
     def start(self) -> None:
@@ -0,0 +1,76 @@
+import argparse
+import threading
+import tkinter as tk
+from time import perf_counter, sleep
+
+import numpy as np
+
+from tkPlotGraph import tkPlotGraph
+
+# Feeds three graphs with synthetic telemetry, as espGraphing.py does, and reports the frame rate reached
+
+
+def feed(graphs: list[tkPlotGraph], rate: int, batch_ms: int, stop: threading.Event) -> None:
+    rng = np.random.default_rng()
+    period_ms = 1000.0 / rate
+    per_batch = max(1, rate * batch_ms // 1000)
+    time = 0.0
+    next_batch = perf_counter()
+    while not stop.is_set():
+        times = time + np.arange(per_batch) * period_ms
+        time += per_batch * period_ms
+        for index, graph in enumerate(graphs):
+            data = 5 * np.sin(times / (300.0 * (index + 1))) + rng.normal(0, 0.3, per_batch)
+            graph.extend(times, data)
+
+        # Keep the average rate even when a batch runs late
+        next_batch += batch_ms / 1000.0
+        sleep(max(0.0, next_batch - perf_counter()))
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Measure the frame rate of tkPlotGraph")
+    parser.add_argument("--rate", type=int, default=1000, help="samples per second per graph")
+    parser.add_argument("--seconds", type=float, default=10.0, help="length of the run")
+    parser.add_argument("--fps", type=int, default=30, help="frame rate asked for")
+    parser.add_argument("--batch-ms", type=int, default=10, help="time between two batches of samples")
+    args = parser.parse_args()
+
+    root = tk.Tk()
+    root.title("tkPlotGraph Benchmark")
+    graphs = []
+    for column, title in enumerate(("Left Motor Velocity", "Right Motor Velocity", "Delta Error")):
+        graph = tkPlotGraph(root=root, title=title, fps=args.fps)
+        graph.grid(row=0, column=column)
+        graphs.append(graph)
+    graphs[0].set_ylim(-6, 6)
+    graphs[1].set_ylim(-6, 6)
+
+    stop = threading.Event()
+    feeder = threading.Thread(target=feed, args=(graphs, args.rate, args.batch_ms, stop))
+
+    def finish() -> None:
+        elapsed = perf_counter() - started
+        stop.set()
+        for graph in graphs:
+            graph.stop()
+        feeder.join()
+
+        print(f"{args.rate} Hz per graph for {elapsed:.1f} s, asked for {args.fps} FPS")
+        for graph in graphs:
+            mean_ms = 1000 * graph.draw_time / graph.frames if graph.frames else 0
+            print(
+                f"  {graph.title:<22} fps: {graph.frames / elapsed:6.1f}, full redraws: {graph.full_draws:4d}, draw: {mean_ms:6.2f} ms"
+            )
+        root.destroy()
+
+    for graph in graphs:
+        graph.start()
+    feeder.start()
+    started = perf_counter()
+    root.after(int(args.seconds * 1000), finish)
+    root.mainloop()
+
+
+if __name__ == "__main__":
+    main()